@@ -5,7 +5,9 @@
 #include "driver/usbmsc.h"
 #include "lesi/lesi.h"
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "hardware/pio.h"
+#include "hardware/sync.h"
 #include "mscp/mscp.h"
 
 #define AIRCR_Register (*((volatile uint32_t*)(PPB_BASE + 0x0ED0C)))
@@ -41,10 +43,26 @@ int lesi_selftest() {
 mscpa_t *hostif;
 mscps_t *server;
 
+#if MSCP_DUAL_CORE
+/**
+ * Core 1 owns the LESI bus. It runs the host interface, which also moves
+ * host buffer data and responses for the server on core 0.
+ */
+static void core1_main() {
+    while (true)
+        hostif_loop( hostif );
+}
+#endif
+
 int main()
    {
     stdio_init_all();
 
+#ifdef LESI_PIO_ENA
+    lesi_set_transport( &lesi_pio_transport );
+#else
+    lesi_set_transport( &lesi_gpio_transport );
+#endif
     lesi_lowlevel_setup();
     lesi_lowlevel_set_pwrgood(0);
     lesi_lowlevel_set_pwrgood(1);
@@ -55,7 +73,9 @@ int main()
     mscps_attach( server, hostif );
     usbmsc_init(server, 0);
 
-    /* Attempt to get the USB drive mounted */
+    /* Give a USB drive that is already plugged in the chance to come up
+       before the host looks for units. Drives plugged in later make their
+       units available with an attention message. */
     for ( int i = 0; i < 1000; i++ )
     {
         usbmsc_process();
@@ -64,20 +84,31 @@ int main()
             break;
     }
 
-    /* If it failed, pull our reset line */
-    if ( server->c_unit->u_state != MUS_AVAIL) {
+#if MSCP_DUAL_CORE
+    if ( !mscps_split( server ) ) {
+        printf("Could not set up the core link\n");
         sleep_ms(10);
         AIRCR_Register = 0x5FA0004;
     }
+    multicore_launch_core1( core1_main );
 
+    /* Main loop, the server and USB */
+    while (true) {
+        mscps_loop( server );
+        usbmsc_process();
+    }
+#else
     /* Main loop */
     while (true) {
         hostif_loop( hostif );
         mscps_loop( server );
         usbmsc_process();
     }
+#endif
 }
 
 void app_idle() {
-    usbmsc_process();
+    /* The LESI core waits for the bus without touching USB */
+    if ( get_core_num() == 0 )
+        usbmsc_process();
 }
\ No newline at end of file
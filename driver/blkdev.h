@@ -0,0 +1,79 @@
+/**
+ * Block device backend interface.
+ *
+ * The block unit driver in driver/blkdrv.c turns MSCP commands into
+ * block reads and writes. It splits them in segments and runs the block
+ * cache, read-ahead and write-back, and leaves moving the blocks to a
+ * backend:
+ *
+ *  driver/usbmsc.c  USB mass storage device through TinyUSB
+ *  driver/fatvol.c  Disk image file on a FAT32 volume on another device
+ *  driver/mirror.c  Mirror of two other devices
+ *  driver/stripe.c  Stripe set over other devices
+ *  host/imgdev.c    Disk image file, host builds only
+ *
+ * The driver hands requests to the backend with submit and never has
+ * more than qdepth of them outstanding. The backend moves them along
+ * from poll, or from its own interrupt or callback context, and gives
+ * every finished request back through blkdev_complete(). It must not
+ * complete a request from within submit.
+ */
+#ifndef __blkdev__
+#define __blkdev__
+
+#include <stdint.h>
+
+typedef struct blkdev    blkdev_t;
+typedef struct blkdev_io blkdev_io_t;
+
+/**
+ * A block transfer between the device and a buffer.
+ */
+struct blkdev_io {
+    /** Free for use by the backend while it owns the request */
+    blkdev_io_t *next;
+    /** Set to move the buffer to the device */
+    int          write;
+    uint32_t     lba;
+    /** Number of blocks */
+    uint32_t     count;
+    void        *buf;
+    /** ERR_OK or an ERR_ code, set by the backend on completion */
+    int          status;
+};
+
+typedef struct blkdev_ops {
+    const char *name;
+    /** Start a request. Returns ERR_OK if it was taken, or ERR_BUSY to
+        have the driver submit it again later */
+    int  (*submit)  ( blkdev_t *dev, blkdev_io_t *io );
+    /** Move outstanding requests along. Optional */
+    void (*poll)    ( blkdev_t *dev );
+    /** Returns the number of blocks and the block size */
+    void (*geometry)( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize );
+} blkdev_ops_t;
+
+struct blkdev {
+    const blkdev_ops_t *ops;
+    /** Requests the backend can have outstanding at once */
+    int    qdepth;
+    /** Backend state */
+    void  *priv;
+
+    /** Set by the driver the device is attached to */
+    void (*complete)( blkdev_t *dev, blkdev_io_t *io );
+    void  *owner;
+};
+
+/**
+ * Give a finished request back to the driver.
+ * @param dev    The device
+ * @param io     The request
+ * @param status ERR_OK or an ERR_ code
+ */
+static inline void blkdev_complete( blkdev_t *dev, blkdev_io_t *io, int status ) {
+    io->status = status;
+    dev->complete( dev, io );
+}
+
+#endif
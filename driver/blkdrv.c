@@ -0,0 +1,987 @@
+#include "mscp/server/server.h"
+#include "mscp/pool.h"
+#include "mscp/server/bcache.h"
+#include "driver/blkdrv.h"
+#include "projconfig.h"
+#include "error.h"
+#include "pico/time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Transfer segment states */
+#define BDS_IDLE    (0)
+#define BDS_QUEUED  (1) /* Queued for the device or submitted to it */
+#define BDS_DONE    (2)
+#define BDS_REISSUE (3) /* The backend refused the segment, submit it again */
+
+typedef struct blkdrv_cmd blkdrv_cmd_t;
+typedef struct blkdrv_seg blkdrv_seg_t;
+
+typedef struct blkdrv_ctx blkdrv_ctx_t;
+
+/**
+ * One device transfer. A command owns BLKDRV_SEGS of these so that the
+ * device transfer of one segment overlaps the LESI DMA of another; the
+ * unit has one more for read-ahead into the block cache and one for
+ * write-back. The data buffer is taken from the shared buffer pool while
+ * the segment is in use.
+ */
+struct blkdrv_seg {
+    /* Request handed to the backend, first so it converts back */
+    blkdev_io_t   io;
+    blkdrv_seg_t *snext;
+    blkdrv_ctx_t *ctx;
+    /* Owning command, NULL for read-ahead and write-back */
+    blkdrv_cmd_t *dcmd;
+    uint8_t  *buf;
+    /* M_OP_READ or M_OP_WRITE, the direction on the device */
+    int       op;
+    /* Offset of the segment in the host buffer */
+    int       buf_pos;
+    uint32_t  lba;
+    int       turnsz;
+    int       state;
+    /* Served from the block cache, the device was not used */
+    int       cached;
+    /* Value of the write generation when the data was read */
+    unsigned  wgen;
+};
+
+struct blkdrv_ctx {
+    mscpu_t *unit;
+
+    /* Backing device */
+    blkdev_t *dev;
+
+    /* Next attached unit */
+    blkdrv_ctx_t *next;
+
+    /* Segments waiting for the device, across all commands on the unit */
+    blkdrv_seg_t *sq_head;
+    blkdrv_seg_t *sq_tail;
+    int           sq_count;
+
+    /* Segments submitted to the device, at most dev->qdepth */
+    int           inflight;
+
+    /* Commands holding a driver context */
+    int           ncmds;
+
+    /* Transfer segment size per opcode, in bytes */
+    int           seg_read;
+    int           seg_write;
+    int           seg_comp;
+
+    /* Block cache, only used if the device has 512 byte blocks */
+    mscp_bcache_t cache;
+    int           cache_ena;
+
+    /* Bumped when a WRITE segment is started. Data read from the device */
+    /* before that may be stale and is not put in the cache.              */
+    unsigned      wgen;
+
+    /* Sequential READ stream detection: LBA following the last READ and */
+    /* the number of READs in a row that started there                    */
+    uint32_t      seq_next;
+    int           seq_count;
+
+    /* Read-ahead segment and the first LBA it has not covered yet */
+    blkdrv_seg_t  ra_seg;
+    uint32_t      ra_next;
+
+    /* Write-back: destage segment and the LBA its sweep continues at */
+    blkdrv_seg_t  wb_seg;
+    uint32_t      wb_cursor;
+    /* When the cache last went from clean to dirty */
+    uint64_t      dirty_since;
+    /* Set when the dirty data deadline passed, cleared once all data   */
+    /* dirty up to wb_epoch has been destaged                           */
+    int           wb_force;
+    uint16_t      wb_epoch;
+    /* Set while a command that bypasses the cache waits for dirty data */
+    int           wb_urgent;
+    /* FLUSH commands in progress, and those with M_MD_FLENU */
+    int           nflush;
+    int           nflush_all;
+
+    uint64_t      busy_since;
+    uint64_t      idle_since;
+    int           idle_counted;
+
+    blkdrv_stats_t stats;
+
+};
+
+struct blkdrv_cmd {
+    mscpu_t  *unit;
+    mscpc_t  *cmd;
+    blkdrv_seg_t seg[BLKDRV_SEGS];
+    /* Bytes to move, including those of commands merged into this one */
+    int       bytecnt;
+    /* Host buffer offset and LBA of the next segment to start */
+    int       buf_pos;
+    uint32_t  cur_lba;
+    /* Bytes whose segment has been fully handled */
+    int       done;
+    /* Set to the end status once a segment fails, stops new segments */
+    int       status;
+    /* FLUSH: waits for the data dirty up to this epoch, or all of it */
+    int       flushing;
+    uint16_t  flush_epoch;
+    int       flush_all;
+};
+
+static mscp_pool_t blkdrv_cmd_pool;
+MSCP_POOL_STORAGE( blkdrv_cmd_storage, sizeof(blkdrv_cmd_t), BLKDRV_CMD_POOL );
+
+/* Segment data buffers, shared by all commands and units */
+static mscp_pool_t blkdrv_buf_pool;
+MSCP_POOL_STORAGE( blkdrv_buf_storage, BLKDRV_SEG_MAX, BLKDRV_BUF_POOL );
+
+static int           blkdrv_pools_ready;
+static blkdrv_ctx_t *blkdrv_units;
+
+static int  blkdrv_proc( mscpu_t *unit, mscpc_t *cmd );
+static void blkdrv_io_cmpl( blkdev_t *dev, blkdev_io_t *io );
+
+/**
+ * Put queued segments on the device until it has qdepth of them. This is
+ * called from the main loop and from the completion callback, so a new
+ * transfer goes out as soon as the previous one finished.
+ */
+static void blkdrv_issue_next( blkdrv_ctx_t *ctx ) {
+    blkdrv_seg_t *seg;
+    uint64_t now;
+
+    while ( ctx->inflight < ctx->dev->qdepth && ctx->sq_head != NULL ) {
+        seg = ctx->sq_head;
+        ctx->sq_head = seg->snext;
+        if ( ctx->sq_head == NULL )
+            ctx->sq_tail = NULL;
+        ctx->sq_count--;
+
+        seg->io.write  = seg->op == M_OP_WRITE;
+        seg->io.lba    = seg->lba;
+        seg->io.count  = seg->turnsz / ctx->unit->u_blksize;
+        seg->io.buf    = seg->buf;
+        seg->io.status = ERR_OK;
+
+        now = time_us_64();
+        if ( ctx->inflight++ == 0 ) {
+            ctx->busy_since = now;
+            if ( ctx->idle_counted ) {
+                ctx->stats.idle_us += now - ctx->idle_since;
+                ctx->stats.idle_gaps++;
+                ctx->idle_counted = 0;
+            }
+        }
+
+        if ( ctx->dev->ops->submit( ctx->dev, &seg->io ) != ERR_OK ) {
+            if ( --ctx->inflight == 0 )
+                ctx->stats.busy_us += now - ctx->busy_since;
+            seg->state = BDS_REISSUE;
+            return;
+        }
+    }
+}
+
+/**
+ * Queue a prepared segment for the device. Without a device, i.e. after
+ * it went away, the segment fails right away.
+ */
+static void blkdrv_submit( blkdrv_ctx_t *ctx, blkdrv_seg_t *seg ) {
+    if ( ctx->dev == NULL ) {
+        seg->io.status = ERR_MEDIA;
+        seg->state     = BDS_DONE;
+        return;
+    }
+    seg->state = BDS_QUEUED;
+    seg->snext = NULL;
+    if ( ctx->sq_tail )
+        ctx->sq_tail->snext = seg;
+    else
+        ctx->sq_head = seg;
+    ctx->sq_tail = seg;
+    if ( ++ctx->sq_count > ctx->stats.max_queue )
+        ctx->stats.max_queue = ctx->sq_count;
+    blkdrv_issue_next( ctx );
+}
+
+/**
+ * Set the transfer segment size used for an opcode on a unit.
+ * @param unit   The unit, which must be driven by this driver
+ * @param opcode M_OP_READ, M_OP_WRITE or M_OP_COMP
+ * @param bytes  Bytes per device transfer, clamped to what a pool buffer
+ *               holds. COMPARE keeps the host data in the second half of
+ *               the buffer, so it gets at most half of that.
+ * @return The size that will be used
+ */
+int blkdrv_set_segsize( mscpu_t *unit, int opcode, int bytes ) {
+    blkdrv_ctx_t *ctx = unit->u_drvctx;
+    int max = opcode == M_OP_COMP ? BLKDRV_SEG_MAX / 2 : BLKDRV_SEG_MAX;
+
+    if ( bytes > max )
+        bytes = max;
+    if ( bytes < 512 )
+        bytes = 512;
+    bytes &= ~511;
+
+    switch( opcode ) {
+        case M_OP_READ:  ctx->seg_read  = bytes; break;
+        case M_OP_WRITE: ctx->seg_write = bytes; break;
+        case M_OP_COMP:  ctx->seg_comp  = bytes; break;
+    }
+    return bytes;
+}
+
+/**
+ * Return the buffer of an idle segment to the pool.
+ */
+static void blkdrv_seg_release( blkdrv_seg_t *seg ) {
+    mscp_pool_free( &blkdrv_buf_pool, seg->buf );
+    seg->buf = NULL;
+}
+
+/**
+ * Check whether a command may use the block cache. COMPARE always goes
+ * to the media, as does everything while the host suppresses caching.
+ */
+static int blkdrv_cacheable( blkdrv_ctx_t *ctx, mscpc_t *cmd ) {
+    return ctx->cache_ena &&
+        cmd->pkt->m_opcode != M_OP_COMP &&
+        !(ctx->unit->u_flags & M_UF_SCCHH) &&
+        !(cmd->pkt->m_modifier & (M_MD_SCCHH | M_MD_SCCHL));
+}
+
+static int blkdrv_is_write( mscpc_t *cmd ) {
+    return cmd->pkt->m_opcode == M_OP_WRITE || cmd->pkt->m_opcode == M_OP_ERASE;
+}
+
+/**
+ * Check whether a WRITE segment may complete into the cache. This needs
+ * the host to have enabled write-back with M_UF_WBKNV, whole blocks and
+ * room below the dirty data limit. No new data is held back while a
+ * FLUSH of the entire unit is waiting for the cache to drain.
+ */
+static int blkdrv_writeback( blkdrv_ctx_t *ctx, mscpc_t *cmd, blkdrv_seg_t *seg ) {
+#if MSCP_BCACHE_WBACK
+    int nblk = seg->turnsz / MSCP_BCACHE_BLKSZ;
+
+    return blkdrv_cacheable( ctx, cmd ) &&
+        (ctx->unit->u_flags & M_UF_WBKNV) &&
+        ctx->nflush_all == 0 &&
+        nblk * MSCP_BCACHE_BLKSZ == seg->turnsz &&
+        ctx->cache.ndirty + nblk <= MSCP_BCACHE_DIRTY_MAX;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Read the blocks following a sequential READ stream into the cache,
+ * up to MSCP_BCACHE_RA_BLOCKS past the end of the last READ. This only
+ * uses the device while no other segment is waiting for it.
+ */
+static void blkdrv_readahead( blkdrv_ctx_t *ctx ) {
+    blkdrv_seg_t *seg = &ctx->ra_seg;
+    mscpu_t *unit = ctx->unit;
+    uint32_t lba, end;
+    int n;
+
+    if ( seg->state != BDS_IDLE || ctx->sq_head != NULL )
+        return;
+
+    end = ctx->seq_next + MSCP_BCACHE_RA_BLOCKS;
+    if ( end > unit->u_blkcount )
+        end = unit->u_blkcount;
+    lba = ctx->ra_next > ctx->seq_next ? ctx->ra_next : ctx->seq_next;
+    while ( lba < end && mscp_bcache_contains( &ctx->cache, lba ) )
+        lba++;
+    for ( n = 0; lba + n < end && n < BLKDRV_SEG_MAX / MSCP_BCACHE_BLKSZ; n++ )
+        if ( mscp_bcache_contains( &ctx->cache, lba + n ) )
+            break;
+    if ( n == 0 )
+        return;
+
+    seg->buf = mscp_pool_alloc( &blkdrv_buf_pool );
+    if ( seg->buf == NULL )
+        return;
+    seg->ctx    = ctx;
+    seg->dcmd   = NULL;
+    seg->op     = M_OP_READ;
+    seg->lba    = lba;
+    seg->turnsz = n * MSCP_BCACHE_BLKSZ;
+    seg->wgen   = ctx->wgen;
+    ctx->ra_next = lba + n;
+    blkdrv_submit( ctx, seg );
+}
+
+/**
+ * Put the blocks of a finished read-ahead in the cache.
+ */
+static void blkdrv_ra_poll( blkdrv_ctx_t *ctx ) {
+    blkdrv_seg_t *seg = &ctx->ra_seg;
+
+    if ( seg->state == BDS_REISSUE ) {
+        seg->state = BDS_IDLE;
+        blkdrv_seg_release( seg );
+        ctx->ra_next = seg->lba;
+    } else if ( seg->state == BDS_DONE ) {
+        seg->state = BDS_IDLE;
+        if ( seg->wgen == ctx->wgen && seg->io.status == ERR_OK )
+            mscp_bcache_fill( &ctx->cache, seg->lba, seg->turnsz / MSCP_BCACHE_BLKSZ,
+                seg->buf, MSCP_BC_RA );
+        else
+            ctx->ra_next = seg->lba;
+        blkdrv_seg_release( seg );
+    }
+}
+
+/**
+ * Write dirty blocks back to the device, one run of consecutive blocks
+ * at a time in ascending LBA order. Destaging starts when the dirty data
+ * passes MSCP_BCACHE_DIRTY_HIGH blocks, while a FLUSH is waiting, or once
+ * data has been dirty for MSCP_BCACHE_WB_DEADLINE_US. The deadline then
+ * forces out everything that was dirty at that moment. Everything goes
+ * out as well once the host turns write-back off or suppresses caching,
+ * and a command that bypasses the cache has its dirty blocks destaged
+ * first, see blkdrv_destage_first().
+ */
+static void blkdrv_wb_poll( blkdrv_ctx_t *ctx ) {
+    blkdrv_seg_t *seg = &ctx->wb_seg;
+    mscp_bcache_t *c  = &ctx->cache;
+    uint64_t now;
+    int n;
+
+    if ( seg->state == BDS_REISSUE ) {
+        blkdrv_submit( ctx, seg );
+        return;
+    } else if ( seg->state == BDS_DONE ) {
+        if ( seg->io.status != ERR_OK )
+            printf("BLKDRV: write-back of LBA %u failed: %i\n",
+                (unsigned) seg->lba, seg->io.status);
+        seg->state = BDS_IDLE;
+        blkdrv_seg_release( seg );
+    }
+    if ( seg->state != BDS_IDLE )
+        return;
+    if ( c->ndirty == 0 ) {
+        ctx->wb_force = 0;
+        return;
+    }
+
+    now = time_us_64();
+    if ( !ctx->wb_force && now - ctx->dirty_since >= MSCP_BCACHE_WB_DEADLINE_US ) {
+        ctx->wb_force = 1;
+        ctx->wb_epoch = mscp_bcache_new_epoch( c );
+    }
+    if ( ctx->wb_force && mscp_bcache_dirty_before( c, ctx->wb_epoch ) == 0 ) {
+        /* What is left was written after the deadline passed */
+        ctx->wb_force    = 0;
+        ctx->dirty_since = now;
+    }
+    if ( !ctx->wb_force && ctx->nflush == 0 && !ctx->wb_urgent &&
+         c->ndirty < MSCP_BCACHE_DIRTY_HIGH &&
+         (ctx->unit->u_flags & (M_UF_WBKNV | M_UF_SCCHH)) == M_UF_WBKNV )
+        return;
+
+    seg->buf = mscp_pool_alloc( &blkdrv_buf_pool );
+    if ( seg->buf == NULL )
+        return;
+    n = mscp_bcache_destage( c, ctx->wb_cursor, &seg->lba,
+        BLKDRV_SEG_MAX / MSCP_BCACHE_BLKSZ, seg->buf );
+    seg->ctx    = ctx;
+    seg->dcmd   = NULL;
+    seg->op     = M_OP_WRITE;
+    seg->turnsz = n * MSCP_BCACHE_BLKSZ;
+    ctx->wb_cursor = seg->lba + n;
+    ctx->wb_urgent = 0;
+    blkdrv_submit( ctx, seg );
+}
+
+/**
+ * Check whether a command that bypasses the cache has to wait before it
+ * goes to the device for a range of blocks. In write-back operation the
+ * only copy of the newest data may be dirty in the cache, so the dirty
+ * blocks in the range are destaged first, and a destage of the range
+ * that is under way has to land before the command.
+ * @return 1 if the command has to wait
+ */
+static int blkdrv_destage_first( blkdrv_ctx_t *ctx, uint32_t lba, uint32_t count ) {
+    blkdrv_seg_t *wb = &ctx->wb_seg;
+    uint32_t first;
+
+    if ( wb->state != BDS_IDLE && wb->lba < lba + count &&
+         lba < wb->lba + wb->turnsz / MSCP_BCACHE_BLKSZ )
+        return 1;
+    if ( mscp_bcache_dirty_in( &ctx->cache, lba, count, &first ) == 0 )
+        return 0;
+    ctx->wb_urgent = 1;
+    if ( wb->state == BDS_IDLE )
+        ctx->wb_cursor = first;
+    return 1;
+}
+
+/**
+ * Check whether the read-ahead in flight covers a block.
+ */
+static int blkdrv_ra_covers( blkdrv_ctx_t *ctx, uint32_t lba ) {
+    blkdrv_seg_t *seg = &ctx->ra_seg;
+
+    return seg->state != BDS_IDLE && lba >= seg->lba &&
+        lba < seg->lba + seg->turnsz / MSCP_BCACHE_BLKSZ;
+}
+
+/**
+ * Prepare the next segment of a command in a free segment and queue it.
+ * For a WRITE the host data is fetched first; the device keeps moving
+ * the other segments of the command meanwhile. A READ that starts on
+ * cached blocks is served from the cache without using the device. The
+ * segment stays idle if no pool buffer is free, while a read-ahead is
+ * fetching its first block, or while a command that bypasses the cache
+ * waits for dirty blocks to be destaged.
+ */
+static int blkdrv_start( mscpu_t *unit, mscpc_t *cmd, blkdrv_seg_t *seg ) {
+    int status = 0;
+    blkdrv_ctx_t *ctx  = unit->u_drvctx;
+    blkdrv_cmd_t *dcmd = cmd->dctx;
+    int cacheable = blkdrv_cacheable( ctx, cmd );
+    int nblk, n;
+
+    if ( cacheable && cmd->pkt->m_opcode == M_OP_READ ) {
+        blkdrv_ra_poll( ctx );
+        if ( blkdrv_ra_covers( ctx, dcmd->cur_lba ) )
+            return 0;
+    } else if ( !cacheable && ctx->cache_ena &&
+                blkdrv_destage_first( ctx, dcmd->cur_lba,
+                    (dcmd->bytecnt - dcmd->buf_pos + unit->u_blksize - 1) / unit->u_blksize ) )
+        return 0;
+
+    seg->buf = mscp_pool_alloc( &blkdrv_buf_pool );
+    if ( seg->buf == NULL )
+        return 0;
+
+    switch( cmd->pkt->m_opcode ) {
+        case M_OP_READ:  seg->turnsz = ctx->seg_read;  break;
+        case M_OP_COMP:  seg->turnsz = ctx->seg_comp;  break;
+        default:         seg->turnsz = ctx->seg_write; break;
+    }
+    seg->turnsz -= seg->turnsz % unit->u_blksize;
+    if ( seg->turnsz == 0 )
+        seg->turnsz = unit->u_blksize;
+
+    seg->buf_pos = dcmd->buf_pos;
+    seg->lba     = dcmd->cur_lba;
+    seg->op      = blkdrv_is_write( cmd ) ? M_OP_WRITE : M_OP_READ;
+    seg->cached  = 0;
+    seg->wgen    = ctx->wgen;
+    if ( (dcmd->bytecnt - seg->buf_pos) < seg->turnsz )
+        seg->turnsz = dcmd->bytecnt - seg->buf_pos;
+
+    if ( cacheable && cmd->pkt->m_opcode == M_OP_READ ) {
+        /* Serve the cached blocks at the start, or read up to the first one */
+        nblk = (seg->turnsz + MSCP_BCACHE_BLKSZ - 1) / MSCP_BCACHE_BLKSZ;
+        n = mscp_bcache_read( &ctx->cache, seg->lba, nblk, seg->buf );
+        if ( n == 0 )
+            n = mscp_bcache_misses( &ctx->cache, seg->lba, nblk );
+        else
+            seg->cached = 1;
+        if ( n * MSCP_BCACHE_BLKSZ < seg->turnsz )
+            seg->turnsz = n * MSCP_BCACHE_BLKSZ;
+    }
+
+    switch( cmd->pkt->m_opcode ) {
+        case M_OP_COMP:
+            /* The second half of the buffer holds the host data */
+            status = mscps_read_buf( unit->u_server, seg->buf + BLKDRV_SEG_MAX / 2,
+                &cmd->pkt->m_un.m_generic.Ms_buf, seg->buf_pos, seg->turnsz );
+            break;
+        case M_OP_WRITE:
+            status = mscpu_read_data( unit, cmd, seg->buf, seg->buf_pos, seg->turnsz );
+            break;
+        case M_OP_ERASE:
+            memset( seg->buf, 0, seg->turnsz );
+            break;
+    }
+    if ( status )
+        printf("BLKDRV: error reading host buffer: %i\n", status);
+
+    if ( blkdrv_is_write( cmd ) && ctx->cache_ena ) {
+        /* Reads started before this one may return the old data */
+        ctx->wgen++;
+        nblk = seg->turnsz / MSCP_BCACHE_BLKSZ;
+        if ( blkdrv_writeback( ctx, cmd, seg ) ) {
+            /* Done once the data is in the cache, it is destaged later */
+            if ( ctx->cache.ndirty == 0 )
+                ctx->dirty_since = time_us_64();
+            mscp_bcache_fill( &ctx->cache, seg->lba, nblk, seg->buf, MSCP_BC_DIRTY );
+            seg->cached = 1;
+        } else if ( cacheable )
+            mscp_bcache_write( &ctx->cache, seg->lba, nblk, seg->buf );
+        else
+            mscp_bcache_inval( &ctx->cache, seg->lba, nblk );
+    }
+
+    dcmd->cur_lba += seg->turnsz / unit->u_blksize;
+    dcmd->buf_pos += seg->turnsz;
+
+    if ( seg->cached ) {
+        seg->io.status = ERR_OK;
+        seg->state = BDS_DONE;
+    } else
+        blkdrv_submit( ctx, seg );
+    return 0;
+}
+
+static int blkdrv_issue( mscpu_t *unit, mscpc_t *cmd ) {
+    blkdrv_ctx_t *ctx  = unit->u_drvctx;
+    blkdrv_cmd_t *dcmd = cmd->dctx;
+    uint32_t lba = cmd->pkt->m_un.m_generic.Ms_lba;
+    int i;
+
+    if ( !mscpu_verify_access( unit, cmd ) ) {
+        cmd->state = CMD_REPLY;
+        return 0;
+    }
+
+    if ( cmd->pkt->m_opcode == M_OP_ACCES ) {
+        cmd->state = CMD_REPLY;
+        cmd->resp->m_status = M_ST_SUCC;
+        return 0;
+    }
+
+    dcmd->bytecnt = mscpu_xfer_len( cmd );
+    dcmd->buf_pos = 0;
+    dcmd->cur_lba = cmd->pkt->m_un.m_generic.Ms_lba;
+    dcmd->status  = M_ST_SUCC;
+
+    if ( cmd->pkt->m_opcode == M_OP_FLUSH ) {
+        /* All cached data is volatile, so M_MD_VOLTL flushes the same */
+        /* data as a plain FLUSH. M_MD_FLENU also waits for data the   */
+        /* host writes while the flush runs.                            */
+        dcmd->flush_epoch = mscp_bcache_new_epoch( &ctx->cache );
+        dcmd->flush_all   = (cmd->pkt->m_modifier & M_MD_FLENU) != 0;
+        dcmd->flushing    = 1;
+        ctx->nflush++;
+        ctx->nflush_all += dcmd->flush_all;
+        return 0;
+    }
+
+    /* Follow sequential READ streams for read-ahead */
+    if ( cmd->pkt->m_opcode == M_OP_READ ) {
+        if ( lba == ctx->seq_next )
+            ctx->seq_count++;
+        else {
+            ctx->seq_count = 0;
+            ctx->ra_next   = 0;
+        }
+        ctx->seq_next = lba +
+            (cmd->pkt->m_un.m_generic.Ms_bytecnt + unit->u_blksize - 1) / unit->u_blksize;
+    }
+
+    for ( i = 0; i < BLKDRV_SEGS; i++ ) {
+        dcmd->seg[i].ctx   = ctx;
+        dcmd->seg[i].dcmd  = dcmd;
+        dcmd->seg[i].buf   = NULL;
+        dcmd->seg[i].state = BDS_IDLE;
+    }
+    return 0;
+}
+
+static int blkdrv_abort( mscpu_t *unit, mscpc_t *cmd ) {
+    return 0;//TODO: Actually abort
+}
+
+/**
+ * Complete a FLUSH once the data it covers has been written to the device.
+ */
+static void blkdrv_flush_run( blkdrv_ctx_t *ctx, mscpc_t *cmd ) {
+    blkdrv_cmd_t *dcmd = cmd->dctx;
+    int dirty;
+
+    if ( cmd->state == CMD_ACTIVE ) {
+        if ( dcmd->status == M_ST_SUCC ) {
+            if ( dcmd->flush_all )
+                dirty = ctx->cache.ndirty;
+            else
+                dirty = mscp_bcache_dirty_before( &ctx->cache, dcmd->flush_epoch );
+            if ( dirty || ctx->wb_seg.state != BDS_IDLE )
+                return;
+        }
+        cmd->resp->m_status = dcmd->status;
+    }
+    cmd->state = CMD_REPLY;
+}
+
+/**
+ * Handle the data of a segment that came back from the device.
+ */
+static void blkdrv_segdone( mscpu_t *unit, mscpc_t *cmd, blkdrv_seg_t *seg ) {
+    int status;
+    blkdrv_ctx_t *ctx  = unit->u_drvctx;
+    blkdrv_cmd_t *dcmd = cmd->dctx;
+
+    seg->state = BDS_IDLE;
+
+    if ( seg->io.status != ERR_OK ) {
+        printf("BLKDRV: %s error at LBA %u: %i\n", seg->op == M_OP_READ ?
+            "read" : "write", (unsigned) seg->lba, seg->io.status);
+        if ( dcmd->status == M_ST_SUCC )
+            dcmd->status = M_ST_DRIVE;
+    }
+
+    if ( cmd->state != CMD_ACTIVE || dcmd->status != M_ST_SUCC ) {
+        blkdrv_seg_release( seg );
+        return;
+    }
+
+    /* Handle data from disk */
+    if ( cmd->pkt->m_opcode == M_OP_READ ) {
+        if ( !seg->cached && seg->wgen == ctx->wgen && blkdrv_cacheable( ctx, cmd ) )
+            mscp_bcache_fill( &ctx->cache, seg->lba, seg->turnsz / MSCP_BCACHE_BLKSZ, seg->buf, 0 );
+        status = mscps_write_buf( unit->u_server, seg->buf,
+            &cmd->pkt->m_un.m_generic.Ms_buf, seg->buf_pos, seg->turnsz );
+        if ( status )
+            printf("error dumping read io into mem: %i\n", status);
+    } else if ( cmd->pkt->m_opcode == M_OP_COMP ) {
+        if ( memcmp( seg->buf, seg->buf + BLKDRV_SEG_MAX / 2, seg->turnsz ) != 0 )
+            dcmd->status = M_ST_COMP;
+    }
+
+    if ( dcmd->status == M_ST_SUCC )
+        dcmd->done += seg->turnsz;
+    blkdrv_seg_release( seg );
+}
+
+/**
+ * Move an active command along: hand finished segments to the host, keep
+ * every free segment buffer busy with the next part of the transfer and
+ * reply once no segment is left on the device.
+ */
+static void blkdrv_run( mscpu_t *unit, mscpc_t *cmd ) {
+    blkdrv_ctx_t *ctx  = unit->u_drvctx;
+    blkdrv_cmd_t *dcmd = cmd->dctx;
+    int bytecnt = dcmd->bytecnt;
+    int nsegs   = BLKDRV_SEGS;
+    int running = cmd->state == CMD_ACTIVE;
+    int busy = 0;
+    int i;
+    blkdrv_seg_t *seg;
+
+    if ( cmd->pkt->m_opcode == M_OP_FLUSH ) {
+        blkdrv_flush_run( ctx, cmd );
+        return;
+    }
+
+    for ( i = 0; i < nsegs; i++ ) {
+        seg = dcmd->seg + i;
+        if ( seg->state == BDS_DONE ) {
+            blkdrv_segdone( unit, cmd, seg );
+        } else if ( seg->state == BDS_REISSUE ) {
+            if ( running )
+                blkdrv_submit( ctx, seg );
+            else {
+                seg->state = BDS_IDLE;
+                blkdrv_seg_release( seg );
+            }
+        }
+    }
+
+    for ( i = 0; i < nsegs; i++ ) {
+        seg = dcmd->seg + i;
+        if ( seg->state == BDS_IDLE && running && dcmd->status == M_ST_SUCC &&
+             dcmd->buf_pos < bytecnt )
+            blkdrv_start( unit, cmd, seg );
+        if ( seg->state != BDS_IDLE )
+            busy++;
+    }
+
+    /* Once a streaming READ has all of its data on the way, fetch ahead */
+    if ( running && dcmd->buf_pos == bytecnt && cmd->pkt->m_opcode == M_OP_READ &&
+         ctx->seq_count >= MSCP_BCACHE_SEQ_MIN && blkdrv_cacheable( ctx, cmd ) )
+        blkdrv_readahead( ctx );
+
+    if ( busy )
+        return;
+
+    if ( cmd->state == CMD_ABORTING ) {
+        cmd->state = CMD_REPLY;
+    } else if ( dcmd->status != M_ST_SUCC || dcmd->done == bytecnt ) {
+        cmd->resp->m_status = dcmd->status;
+        cmd->state = CMD_REPLY;
+    }
+}
+
+static int blkdrv_proc( mscpu_t *unit, mscpc_t *cmd ) {
+    int status = 0;
+    blkdrv_ctx_t *ctx  = unit->u_drvctx;
+    blkdrv_cmd_t *dcmd = cmd->dctx;
+
+    /* Ignore commands that are owned by the unit driver */
+    if ( cmd->state == CMD_COMPLETE || cmd->state == CMD_DELETE || cmd->state == CMD_REPLY )
+        return 0;
+
+    if ( cmd->state == CMD_QUEUED ) {
+        cmd->dctx = mscp_pool_alloc( &blkdrv_cmd_pool );
+
+        if ( cmd->dctx == NULL )
+            return 0; /* stays queued until a command completes */
+
+        memset( cmd->dctx, 0, sizeof(blkdrv_cmd_t) );
+
+        dcmd = cmd->dctx;
+        cmd->state = CMD_ACTIVE;
+        dcmd->unit = unit;
+        dcmd->cmd  = cmd;
+        ctx->ncmds++;
+        status = blkdrv_issue( unit, cmd );
+    } else if ( cmd->state == CMD_ABORTED ) {
+        /* Aborted while still queued, there is no transfer to stop */
+        if ( cmd->dctx == NULL ) {
+            cmd->resp->m_status = M_ST_ABRTD;
+            cmd->state = CMD_REPLY;
+            return 0;
+        }
+        cmd->state = CMD_ABORTING;
+        status = blkdrv_abort( unit, cmd );
+    }
+    if ( cmd->state == CMD_ACTIVE || cmd->state == CMD_ABORTING )
+        blkdrv_run( unit, cmd );
+    if ( cmd->state == CMD_REPLY || cmd->state == CMD_DELETE ) {
+        if ( cmd->dctx ) {
+            if ( dcmd->flushing ) {
+                ctx->nflush--;
+                ctx->nflush_all -= dcmd->flush_all;
+            }
+            mscp_pool_free( &blkdrv_cmd_pool, cmd->dctx );
+            cmd->dctx = NULL;
+            ctx->ncmds--;
+        }
+    }
+    return status;
+}
+
+/**
+ * Completion callback of the backend. May run outside the main loop, so
+ * it only updates the accounting, marks the segment and keeps the device
+ * busy; the data is handled from the main loop.
+ */
+static void blkdrv_io_cmpl( blkdev_t *dev, blkdev_io_t *io ) {
+    blkdrv_seg_t *seg  = (blkdrv_seg_t *) io;
+    blkdrv_cmd_t *dcmd = seg->dcmd;
+    blkdrv_ctx_t *ctx  = seg->ctx;
+    uint64_t now;
+
+    /* The unit was detached from the device meanwhile */
+    if ( ctx->dev != dev )
+        return;
+
+    now = time_us_64();
+    ctx->stats.transfers++;
+    ctx->stats.bytes += seg->turnsz;
+    if ( --ctx->inflight == 0 )
+        ctx->stats.busy_us += now - ctx->busy_since;
+
+    seg->state = BDS_DONE;
+
+    /* Keep the device busy with the next queued segment */
+    blkdrv_issue_next( ctx );
+
+    /* If nothing was queued the device is idle until the main loop      */
+    /* starts a segment. This only counts as lost time if some command   */
+    /* still has data to move.                                           */
+    if ( ctx->inflight == 0 ) {
+        ctx->idle_since   = now;
+        ctx->idle_counted = ctx->ncmds > 1 || ( dcmd &&
+            dcmd->buf_pos < dcmd->bytecnt );
+    }
+}
+
+/**
+ * Make a unit available on a block device. The unit identifier is left to
+ * the caller. A unit that was detached keeps its driver context and is
+ * switched to the new device; the host is told with an available
+ * attention message.
+ * @param server The MSCP server
+ * @param idx    Index of the unit
+ * @param dev    The backing device
+ * @return 1 on success, 0 if out of memory
+ */
+int blkdrv_attach( mscps_t *server, int idx, blkdev_t *dev ) {
+    mscpu_t *unit = server->c_unit + idx;
+    blkdrv_ctx_t *ctx = unit->u_drvctx;
+
+    if ( !blkdrv_pools_ready ) {
+        mscp_pool_init( &blkdrv_cmd_pool, "blkdrv", blkdrv_cmd_storage,
+            sizeof(blkdrv_cmd_t), BLKDRV_CMD_POOL );
+        mscp_pool_init( &blkdrv_buf_pool, "blkbuf", blkdrv_buf_storage,
+            BLKDRV_SEG_MAX, BLKDRV_BUF_POOL );
+        blkdrv_pools_ready = 1;
+    }
+
+    if ( ctx != NULL && ctx->dev != NULL )
+        blkdrv_detach( server, idx );
+
+    if ( ctx == NULL ) {
+        ctx = calloc( 1, sizeof(blkdrv_ctx_t) );
+        if ( ctx == NULL )
+            return 0;
+        ctx->unit = unit;
+        unit->u_drvctx = ctx;
+        blkdrv_set_segsize( unit, M_OP_READ,  BLKDRV_SEG_READ );
+        blkdrv_set_segsize( unit, M_OP_WRITE, BLKDRV_SEG_WRITE );
+        blkdrv_set_segsize( unit, M_OP_COMP,  BLKDRV_SEG_COMP );
+        ctx->next = blkdrv_units;
+        blkdrv_units = ctx;
+    }
+
+    ctx->dev      = dev;
+    dev->complete = blkdrv_io_cmpl;
+    dev->owner    = ctx;
+    if ( dev->qdepth < 1 )
+        dev->qdepth = 1;
+
+    unit->u_id.i_class = M_CC_DISK144;
+    unit->u_id.i_model = M_CM_UDA50;
+    unit->u_spindles = 1;
+    unit->u_mediaid  = 0x254B3294;
+    dev->ops->geometry( dev, &unit->u_blkcount, &unit->u_blksize );
+
+    /* The host may turn the block cache off with M_UF_SCCHH, and */
+    /* enable write-back with M_UF_WBKNV                           */
+    if ( unit->u_blksize == MSCP_BCACHE_BLKSZ && !ctx->cache_ena &&
+         mscp_bcache_init( &ctx->cache, MSCP_BCACHE_BLOCKS ) ) {
+        ctx->cache_ena = 1;
+        unit->u_flags    |= M_UF_CACH;
+        unit->u_flagmask |= M_UF_SCCHH;
+#if MSCP_BCACHE_WBACK
+        unit->u_flagmask |= M_UF_WBKNV;
+#endif
+    }
+
+    /* Contiguous WRITEs are moved in one transfer */
+    unit->u_merge_max = MSCP_MERGE_MAX;
+
+    printf("BLKDRV: unit %i on %s, %u blocks of %u bytes, queue depth %i\n",
+        idx, dev->ops->name, (unsigned) unit->u_blkcount,
+        (unsigned) unit->u_blksize, dev->qdepth);
+
+    mscpu_set_avail( server, idx, blkdrv_proc );
+    return 1;
+}
+
+/**
+ * Fail a segment that was waiting for or held by a device that is gone.
+ */
+static void blkdrv_seg_fail( blkdrv_seg_t *seg ) {
+    if ( seg->state == BDS_QUEUED || seg->state == BDS_REISSUE ) {
+        seg->io.status = ERR_MEDIA;
+        seg->state     = BDS_DONE;
+    }
+}
+
+/**
+ * Take a unit offline because its device went away, e.g. a USB stick
+ * was pulled. Segments the device held fail with a drive error and the
+ * block cache is dropped; if that loses dirty data, the FLUSH commands
+ * in progress fail as well. Late completions of the old device are
+ * ignored.
+ * @param server The MSCP server
+ * @param idx    Index of the unit
+ */
+void blkdrv_detach( mscps_t *server, int idx ) {
+    mscpu_t *unit = server->c_unit + idx;
+    blkdrv_ctx_t *ctx = unit->u_drvctx;
+    blkdrv_cmd_t *dcmd;
+    mscpc_t *cmd;
+    int i, lost;
+
+    if ( ctx == NULL || ctx->dev == NULL )
+        return;
+
+    if ( ctx->inflight )
+        ctx->stats.busy_us += time_us_64() - ctx->busy_since;
+    ctx->dev          = NULL;
+    ctx->inflight     = 0;
+    ctx->sq_head      = NULL;
+    ctx->sq_tail      = NULL;
+    ctx->sq_count     = 0;
+    ctx->idle_counted = 0;
+
+    lost = ctx->cache.ndirty;
+    if ( lost )
+        printf("BLKDRV: unit %i lost %i dirty blocks\n", idx, lost);
+    mscp_bcache_clear( &ctx->cache );
+    ctx->wb_force  = 0;
+    ctx->seq_count = 0;
+    ctx->ra_next   = 0;
+
+    for ( cmd = unit->cq_head; cmd != NULL; cmd = cmd->next ) {
+        dcmd = cmd->dctx;
+        if ( cmd->state == CMD_MERGED || dcmd == NULL )
+            continue;
+        for ( i = 0; i < BLKDRV_SEGS; i++ )
+            blkdrv_seg_fail( dcmd->seg + i );
+        if ( dcmd->flushing && lost && dcmd->status == M_ST_SUCC )
+            dcmd->status = M_ST_DRIVE;
+    }
+
+    /* Return the buffers of read-ahead and write-back */
+    blkdrv_seg_fail( &ctx->ra_seg );
+    blkdrv_seg_fail( &ctx->wb_seg );
+    blkdrv_ra_poll( ctx );
+    blkdrv_wb_poll( ctx );
+
+    printf("BLKDRV: unit %i detached\n", idx);
+    mscpu_set_offline( server, idx );
+}
+
+/**
+ * Background work of all attached units: let the backends move their
+ * requests along, then run read-ahead and write-back.
+ */
+void blkdrv_process( void ) {
+    blkdrv_ctx_t *ctx;
+
+    for ( ctx = blkdrv_units; ctx != NULL; ctx = ctx->next ) {
+        if ( ctx->dev == NULL )
+            continue;
+        if ( ctx->dev->ops->poll )
+            ctx->dev->ops->poll( ctx->dev );
+        if ( ctx->cache_ena ) {
+            blkdrv_ra_poll( ctx );
+            blkdrv_wb_poll( ctx );
+        }
+    }
+}
+
+/**
+ * Returns the device transfer statistics of a unit.
+ */
+const blkdrv_stats_t *blkdrv_stats( mscpu_t *unit ) {
+    blkdrv_ctx_t *ctx = unit->u_drvctx;
+    return &ctx->stats;
+}
+
+void blkdrv_stats_reset( mscpu_t *unit ) {
+    blkdrv_ctx_t *ctx = unit->u_drvctx;
+    memset( &ctx->stats, 0, sizeof(blkdrv_stats_t) );
+    memset( &ctx->cache.stats, 0, sizeof(mscp_bcache_stats_t) );
+}
+
+/**
+ * Returns the block cache of a unit.
+ */
+mscp_bcache_t *blkdrv_cache( mscpu_t *unit ) {
+    blkdrv_ctx_t *ctx = unit->u_drvctx;
+    return &ctx->cache;
+}
+
+/**
+ * Print the usage of the command context and segment buffer pools.
+ */
+void blkdrv_pools_dump( void ) {
+    mscp_pool_dump( &blkdrv_cmd_pool );
+    mscp_pool_dump( &blkdrv_buf_pool );
+}
@@ -0,0 +1,30 @@
+#include "mscp/mscp.h"
+#include "mscp/server/bcache.h"
+#include "driver/blkdev.h"
+
+/**
+ * Per unit block device transfer statistics.
+ */
+typedef struct blkdrv_stats {
+    /** Device transfers completed */
+    unsigned long transfers;
+    /** Bytes moved by them */
+    unsigned long bytes;
+    /** Time the device had a transfer outstanding, in microseconds */
+    uint64_t      busy_us;
+    /** Time the device sat idle while a command still had data to move */
+    uint64_t      idle_us;
+    /** Number of such idle periods */
+    unsigned long idle_gaps;
+    /** Most transfer segments waiting for the device at once */
+    int           max_queue;
+} blkdrv_stats_t;
+
+int  blkdrv_attach( mscps_t *server, int idx, blkdev_t *dev );
+void blkdrv_detach( mscps_t *server, int idx );
+void blkdrv_process( void );
+const blkdrv_stats_t *blkdrv_stats( mscpu_t *unit );
+void blkdrv_stats_reset( mscpu_t *unit );
+int  blkdrv_set_segsize( mscpu_t *unit, int opcode, int bytes );
+void blkdrv_pools_dump( void );
+mscp_bcache_t *blkdrv_cache( mscpu_t *unit );
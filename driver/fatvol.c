@@ -0,0 +1,486 @@
+#include "driver/fatvol.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Mount states */
+#define FV_IDLE   (0)
+#define FV_BOOT   (1) /* Reading the boot sector, or the MBR before it */
+#define FV_DIR    (2) /* Scanning the root directory for images */
+#define FV_CHAIN  (3) /* Following the cluster chains of the images */
+#define FV_READY  (4)
+#define FV_FAILED (5)
+
+#define FV_NOSEC  (0xFFFFFFFF)
+
+static int  fatvol_img_submit  ( blkdev_t *dev, blkdev_io_t *io );
+static void fatvol_img_poll    ( blkdev_t *dev );
+static void fatvol_img_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize );
+
+static const blkdev_ops_t fatvol_img_ops = {
+    .name     = "FAT image",
+    .submit   = fatvol_img_submit,
+    .poll     = fatvol_img_poll,
+    .geometry = fatvol_img_geometry,
+};
+
+static uint16_t fatvol_rd16( const uint8_t *p ) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t fatvol_rd32( const uint8_t *p ) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/**
+ * Put requests on the device while it has room for them.
+ */
+static void fatvol_kick( fatvol_t *vol ) {
+    blkdev_io_t *io;
+
+    while ( vol->inflight < vol->dev->qdepth && vol->pq_head != NULL ) {
+        io = vol->pq_head;
+        if ( vol->dev->ops->submit( vol->dev, io ) != ERR_OK )
+            return;
+        vol->pq_head = io->next;
+        if ( vol->pq_head == NULL )
+            vol->pq_tail = NULL;
+        vol->inflight++;
+    }
+}
+
+static void fatvol_queue( fatvol_t *vol, blkdev_io_t *io ) {
+    io->next = NULL;
+    if ( vol->pq_tail )
+        vol->pq_tail->next = io;
+    else
+        vol->pq_head = io;
+    vol->pq_tail = io;
+    fatvol_kick( vol );
+}
+
+/**
+ * Returns a volume block for the mount, or NULL after starting to read
+ * it. Mounting goes on once the read completes.
+ */
+static const uint8_t *fatvol_sector( fatvol_t *vol, uint32_t lba ) {
+    if ( vol->mbusy )
+        return NULL;
+    if ( vol->sec_lba == lba )
+        return vol->sec;
+    vol->sec_lba   = FV_NOSEC;
+    vol->mbusy     = 1;
+    vol->mio.write = 0;
+    vol->mio.lba   = lba;
+    vol->mio.count = 1;
+    vol->mio.buf   = vol->sec;
+    fatvol_queue( vol, &vol->mio );
+    return NULL;
+}
+
+/**
+ * Look up the cluster following another in the FAT.
+ * @return 1 if next was set, 0 if the FAT block is being read
+ */
+static int fatvol_fat( fatvol_t *vol, uint32_t clus, uint32_t *next ) {
+    const uint8_t *s = fatvol_sector( vol, vol->fat_lba + clus / 128 );
+
+    if ( s == NULL )
+        return 0;
+    *next = fatvol_rd32( s + (clus % 128) * 4 ) & 0x0FFFFFFF;
+    return 1;
+}
+
+/**
+ * Check whether a cluster number refers to a data cluster. End of chain
+ * and bad cluster markers do not.
+ */
+static int fatvol_clus_ok( fatvol_t *vol, uint32_t clus ) {
+    return clus >= 2 && clus < vol->nclus + 2;
+}
+
+static uint32_t fatvol_clus_lba( fatvol_t *vol, uint32_t clus ) {
+    return vol->data_lba + (clus - 2) * vol->spc;
+}
+
+static void fatvol_done( fatvol_t *vol, int status ) {
+    vol->state = status == ERR_OK ? FV_READY : FV_FAILED;
+    if ( vol->cb )
+        vol->cb( vol, status );
+}
+
+/**
+ * Take the geometry from a FAT32 boot sector.
+ * @return 1 on success, 0 if this is not a FAT32 file system we can use
+ */
+static int fatvol_bpb( fatvol_t *vol, const uint8_t *s ) {
+    uint32_t rsvd, nfats, fatsz, totsec;
+
+    if ( fatvol_rd16( s + 510 ) != 0xAA55 || (s[0] != 0xEB && s[0] != 0xE9) )
+        return 0;
+    if ( fatvol_rd16( s + 11 ) != 512 || s[13] == 0 || (s[13] & (s[13] - 1)) )
+        return 0;
+    rsvd   = fatvol_rd16( s + 14 );
+    nfats  = s[16];
+    fatsz  = fatvol_rd16( s + 22 ) ? fatvol_rd16( s + 22 ) : fatvol_rd32( s + 36 );
+    totsec = fatvol_rd16( s + 19 ) ? fatvol_rd16( s + 19 ) : fatvol_rd32( s + 32 );
+    if ( nfats == 0 || fatvol_rd16( s + 17 ) != 0 || totsec <= rsvd + nfats * fatsz )
+        return 0;
+
+    vol->spc       = s[13];
+    vol->fat_lba   = vol->part_lba + rsvd;
+    vol->data_lba  = vol->fat_lba + nfats * fatsz;
+    vol->nclus     = (totsec - rsvd - nfats * fatsz) / vol->spc;
+    vol->root_clus = fatvol_rd32( s + 44 );
+
+    /* The cluster count is what makes a volume FAT32 */
+    return vol->nclus >= 65525 && vol->nclus + 2 <= fatsz * 128;
+}
+
+/**
+ * Check for an MBR whose first partition holds a FAT32 file system.
+ */
+static int fatvol_mbr( const uint8_t *s ) {
+    return fatvol_rd16( s + 510 ) == 0xAA55 &&
+        (s[450] == 0x0B || s[450] == 0x0C) && fatvol_rd32( s + 454 ) != 0;
+}
+
+/**
+ * Note a root directory entry if it is an image file.
+ */
+static void fatvol_dirent( fatvol_t *vol, const uint8_t *d ) {
+    fatvol_img_t *img;
+    char *p;
+    int i;
+
+    if ( d[0] == 0xE5 || d[11] == 0x0F || (d[11] & 0x18) ||
+         memcmp( d + 8, FATVOL_EXT, 3 ) != 0 || fatvol_rd32( d + 28 ) < 512 )
+        return;
+    if ( vol->nimages == FATVOL_IMAGES ) {
+        printf("FATVOL: no room for %.8s.%.3s\n", d, d + 8);
+        return;
+    }
+
+    img = vol->img + vol->nimages++;
+    memset( img, 0, sizeof(fatvol_img_t) );
+    for ( p = img->name, i = 0; i < 8 && d[i] != ' '; i++ )
+        *p++ = d[i];
+    *p++ = '.';
+    memcpy( p, d + 8, 3 );
+    img->clus       = ((uint32_t) fatvol_rd16( d + 20 ) << 16) | fatvol_rd16( d + 26 );
+    img->blkcount   = fatvol_rd32( d + 28 ) / 512;
+    img->vol        = vol;
+    img->dev.ops    = &fatvol_img_ops;
+    img->dev.qdepth = FATVOL_QDEPTH;
+    img->dev.priv   = img;
+}
+
+/**
+ * Map the next blocks of an image to the volume. Runs of consecutive
+ * clusters become one extent.
+ * @return 1 on success, 0 if out of memory
+ */
+static int fatvol_extend( fatvol_img_t *img, uint32_t lba, uint32_t vlba, uint32_t count ) {
+    fatvol_ext_t *e;
+
+    if ( img->next ) {
+        e = img->ext + img->next - 1;
+        if ( e->vlba + e->count == vlba ) {
+            e->count += count;
+            return 1;
+        }
+    }
+    if ( img->next == img->ext_alloc ) {
+        e = realloc( img->ext, 2 * (img->ext_alloc + 2) * sizeof(fatvol_ext_t) );
+        if ( e == NULL )
+            return 0;
+        img->ext       = e;
+        img->ext_alloc = 2 * (img->ext_alloc + 2);
+    }
+    e = img->ext + img->next++;
+    e->lba   = lba;
+    e->vlba  = vlba;
+    e->count = count;
+    return 1;
+}
+
+/**
+ * Move the mount along until it needs a block from the device, or is
+ * done. Every state can be entered again after the block arrives.
+ */
+static void fatvol_step( fatvol_t *vol ) {
+    const uint8_t *s;
+    fatvol_img_t *img;
+    uint32_t next, n;
+
+    for (;;) switch( vol->state ) {
+        case FV_BOOT:
+            s = fatvol_sector( vol, vol->part_lba );
+            if ( s == NULL )
+                return;
+            if ( fatvol_bpb( vol, s ) ) {
+                vol->dir_clus = vol->root_clus;
+                vol->dir_ent  = 0;
+                vol->state    = FV_DIR;
+            } else if ( vol->part_lba == 0 && fatvol_mbr( s ) ) {
+                vol->part_lba = fatvol_rd32( s + 454 );
+            } else {
+                printf("FATVOL: no FAT32 file system\n");
+                fatvol_done( vol, ERR_MEDIA );
+                return;
+            }
+            break;
+
+        case FV_DIR:
+            if ( vol->dir_ent == vol->spc * 16 ) {
+                if ( !fatvol_fat( vol, vol->dir_clus, &next ) )
+                    return;
+                vol->dir_clus = next;
+                vol->dir_ent  = 0;
+            }
+            s = NULL;
+            if ( fatvol_clus_ok( vol, vol->dir_clus ) ) {
+                s = fatvol_sector( vol,
+                    fatvol_clus_lba( vol, vol->dir_clus ) + vol->dir_ent / 16 );
+                if ( s == NULL && vol->mbusy )
+                    return;
+            }
+            if ( s == NULL || s[(vol->dir_ent % 16) * 32] == 0 ) {
+                /* End of the directory */
+                vol->cur_img  = -1;
+                vol->cur_lba  = 0;
+                vol->state    = FV_CHAIN;
+                break;
+            }
+            fatvol_dirent( vol, s + (vol->dir_ent % 16) * 32 );
+            vol->dir_ent++;
+            break;
+
+        case FV_CHAIN:
+            if ( vol->cur_img < 0 || vol->cur_lba >= vol->img[vol->cur_img].blkcount ) {
+                if ( ++vol->cur_img == vol->nimages ) {
+                    fatvol_done( vol, ERR_OK );
+                    return;
+                }
+                vol->cur_clus = vol->img[vol->cur_img].clus;
+                vol->cur_lba  = 0;
+            }
+            img = vol->img + vol->cur_img;
+            if ( !fatvol_clus_ok( vol, vol->cur_clus ) ) {
+                printf("FATVOL: %s is cut short at block %u\n",
+                    img->name, (unsigned) vol->cur_lba);
+                img->blkcount = vol->cur_lba;
+                break;
+            }
+            n = img->blkcount - vol->cur_lba;
+            if ( n > vol->spc ) {
+                n = vol->spc;
+                if ( !fatvol_fat( vol, vol->cur_clus, &next ) )
+                    return;
+            } else
+                next = 0;
+            if ( !fatvol_extend( img, vol->cur_lba,
+                    fatvol_clus_lba( vol, vol->cur_clus ), n ) ) {
+                printf("FATVOL: out of memory mapping %s\n", img->name);
+                img->blkcount = vol->cur_lba;
+                break;
+            }
+            vol->cur_lba += n;
+            vol->cur_clus = next;
+            break;
+
+        default:
+            return;
+    }
+}
+
+/**
+ * Completion callback of the device.
+ */
+static void fatvol_cmpl( blkdev_t *dev, blkdev_io_t *io ) {
+    fatvol_t *vol = dev->owner;
+    fatvol_io_t *fio;
+    blkdev_io_t *req;
+
+    vol->inflight--;
+    if ( io == &vol->mio ) {
+        vol->mbusy = 0;
+        if ( io->status == ERR_OK )
+            vol->sec_lba = io->lba;
+        fatvol_kick( vol );
+        if ( io->status != ERR_OK ) {
+            printf("FATVOL: read error at block %u\n", (unsigned) io->lba);
+            fatvol_done( vol, io->status );
+        } else
+            fatvol_step( vol );
+        return;
+    }
+
+    fio = (fatvol_io_t *) io;
+    req = fio->req;
+    fio->done += io->count;
+    if ( io->status != ERR_OK || fio->done == req->count ) {
+        fio->fnext   = vol->io_free;
+        vol->io_free = fio;
+        fatvol_kick( vol );
+        blkdev_complete( &fio->img->dev, req, io->status );
+        return;
+    }
+
+    /* The request continues in the next extent */
+    io->lba = fatvol_lookup( &fio->img->dev, req->lba + fio->done, &io->count );
+    io->buf = (uint8_t *) req->buf + fio->done * 512;
+    if ( io->count > req->count - fio->done )
+        io->count = req->count - fio->done;
+    fatvol_queue( vol, io );
+}
+
+/**
+ * Start mounting the FAT32 file system on a device. Any images of an
+ * earlier mount go away.
+ * @param vol The volume
+ * @param dev The device, which must have 512 byte blocks
+ * @param cb  Called when the images are ready or the mount failed
+ */
+void fatvol_mount( fatvol_t *vol, blkdev_t *dev, fatvol_cb_t cb ) {
+    uint32_t blkcount;
+    uint16_t blksize;
+    int i;
+
+    fatvol_unmount( vol );
+    vol->dev      = dev;
+    vol->cb       = cb;
+    vol->sec_lba  = FV_NOSEC;
+    dev->complete = fatvol_cmpl;
+    dev->owner    = vol;
+    for ( i = FATVOL_QDEPTH - 1; i >= 0; i-- ) {
+        vol->io[i].fnext = vol->io_free;
+        vol->io_free = vol->io + i;
+    }
+
+    dev->ops->geometry( dev, &blkcount, &blksize );
+    if ( blksize != 512 ) {
+        fatvol_done( vol, ERR_MEDIA );
+        return;
+    }
+    vol->state = FV_BOOT;
+    fatvol_step( vol );
+}
+
+/**
+ * Forget a volume, e.g. because its device went away. Requests still on
+ * the volume are dropped without completing, so the units on its images
+ * have to be detached first.
+ */
+void fatvol_unmount( fatvol_t *vol ) {
+    int i;
+
+    for ( i = 0; i < vol->nimages; i++ )
+        free( vol->img[i].ext );
+    memset( vol, 0, sizeof(fatvol_t) );
+}
+
+/**
+ * Let the device move its requests along, and hand it those waiting.
+ */
+void fatvol_poll( fatvol_t *vol ) {
+    if ( vol->dev->ops->poll )
+        vol->dev->ops->poll( vol->dev );
+    fatvol_kick( vol );
+}
+
+/**
+ * Check whether mounting finished successfully.
+ */
+int fatvol_ready( fatvol_t *vol ) {
+    return vol->state == FV_READY;
+}
+
+/**
+ * Returns an image of a mounted volume as a block device, or NULL if
+ * there are not that many.
+ */
+blkdev_t *fatvol_image( fatvol_t *vol, int idx ) {
+    if ( vol->state != FV_READY || idx >= vol->nimages || vol->img[idx].blkcount == 0 )
+        return NULL;
+    return &vol->img[idx].dev;
+}
+
+/**
+ * Map an image block to the volume.
+ * @param dev The image
+ * @param lba Image block, within the image
+ * @param run Set to the number of blocks from there that follow it on
+ *            the volume
+ * @return The volume block
+ */
+uint32_t fatvol_lookup( blkdev_t *dev, uint32_t lba, uint32_t *run ) {
+    fatvol_img_t *img = dev->priv;
+    const fatvol_ext_t *e;
+    int lo = 0, hi = img->next - 1, mid;
+
+    /* Last extent that starts at or before the block */
+    while ( lo < hi ) {
+        mid = (lo + hi + 1) / 2;
+        img->probes++;
+        if ( img->ext[mid].lba <= lba )
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    img->lookups++;
+    e = img->ext + lo;
+    *run = e->lba + e->count - lba;
+    return e->vlba + lba - e->lba;
+}
+
+static int fatvol_img_submit( blkdev_t *dev, blkdev_io_t *req ) {
+    fatvol_img_t *img = dev->priv;
+    fatvol_t *vol = img->vol;
+    fatvol_io_t *fio = vol->io_free;
+
+    if ( fio == NULL )
+        return ERR_BUSY;
+    vol->io_free = fio->fnext;
+
+    fio->req  = req;
+    fio->img  = img;
+    fio->done = 0;
+    fio->io.write = req->write;
+    fio->io.buf   = req->buf;
+    fio->io.lba   = fatvol_lookup( dev, req->lba, &fio->io.count );
+    if ( fio->io.count > req->count )
+        fio->io.count = req->count;
+    fatvol_queue( vol, &fio->io );
+    return ERR_OK;
+}
+
+static void fatvol_img_poll( blkdev_t *dev ) {
+    fatvol_img_t *img = dev->priv;
+
+    fatvol_poll( img->vol );
+}
+
+static void fatvol_img_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize ) {
+    fatvol_img_t *img = dev->priv;
+
+    *blkcount = img->blkcount;
+    *blksize  = 512;
+}
+
+/**
+ * Print the images with their extent count and the average number of
+ * binary search steps a block lookup took.
+ */
+void fatvol_dump( fatvol_t *vol ) {
+    fatvol_img_t *img;
+    int i;
+
+    for ( i = 0; i < vol->nimages; i++ ) {
+        img = vol->img + i;
+        printf("FATVOL: %-12s %8u blocks %6i extents %8lu lookups %5.2f probes/lookup\n",
+            img->name, (unsigned) img->blkcount, img->next, img->lookups,
+            img->lookups ? (double) img->probes / img->lookups : 0.0 );
+    }
+}
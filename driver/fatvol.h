@@ -0,0 +1,119 @@
+/**
+ * Disk images on a FAT32 volume.
+ *
+ * Mounts a FAT32 file system on a block device, e.g. a USB stick, and
+ * offers every image file in its root directory as a block device of its
+ * own, so each image can be an MSCP unit. The volume may be a whole
+ * device or the first partition of one.
+ *
+ * The FAT is only read while mounting. The cluster chain of each image
+ * is turned into a sorted list of extents, runs of image blocks that are
+ * consecutive on the volume, so mapping an image block to a volume block
+ * is a binary search over that list. A contiguous image has one extent.
+ *
+ * Mounting runs in the background like any other transfer: it starts
+ * with fatvol_mount() and calls back when done. The images share the
+ * FATVOL_QDEPTH transfer contexts of the volume and a request that spans
+ * several extents moves one extent at a time.
+ */
+#ifndef __fatvol__
+#define __fatvol__
+
+#include <stdint.h>
+#include "driver/blkdev.h"
+#include "projconfig.h"
+
+typedef struct fatvol fatvol_t;
+
+/** Called once mounting finished with ERR_OK or failed */
+typedef void (*fatvol_cb_t)( fatvol_t *vol, int status );
+
+/**
+ * Run of image blocks that are consecutive on the volume.
+ */
+typedef struct fatvol_ext {
+    /** First image block */
+    uint32_t lba;
+    /** Volume block it is stored in */
+    uint32_t vlba;
+    uint32_t count;
+} fatvol_ext_t;
+
+typedef struct fatvol_img {
+    /** The image as a block device */
+    blkdev_t      dev;
+    fatvol_t     *vol;
+    /** 8.3 file name */
+    char          name[13];
+    /** First cluster of the file, unique on the volume */
+    uint32_t      clus;
+    uint32_t      blkcount;
+    fatvol_ext_t *ext;
+    int           next;
+    int           ext_alloc;
+
+    /** Block lookups done and the binary search steps they took */
+    unsigned long lookups;
+    unsigned long probes;
+} fatvol_img_t;
+
+/**
+ * Transfer of one image request, moved one extent at a time.
+ */
+typedef struct fatvol_io {
+    /** Request to the volume, first so it converts back */
+    blkdev_io_t       io;
+    /** Image request and the blocks of it that were moved */
+    blkdev_io_t      *req;
+    fatvol_img_t     *img;
+    uint32_t          done;
+    struct fatvol_io *fnext;
+} fatvol_io_t;
+
+struct fatvol {
+    blkdev_t     *dev;
+    fatvol_cb_t   cb;
+    int           state;
+
+    /* Geometry, in volume blocks */
+    uint32_t      part_lba;
+    uint32_t      fat_lba;
+    uint32_t      data_lba;
+    uint32_t      nclus;
+    uint32_t      root_clus;
+    int           spc;
+
+    /* Sector buffer of the mount and the block it holds */
+    blkdev_io_t   mio;
+    uint8_t       sec[512];
+    uint32_t      sec_lba;
+    int           mbusy;
+
+    /* Mount progress: directory position, and the chain being followed */
+    uint32_t      dir_clus;
+    int           dir_ent;
+    int           cur_img;
+    uint32_t      cur_clus;
+    uint32_t      cur_lba;
+
+    fatvol_img_t  img[FATVOL_IMAGES];
+    int           nimages;
+
+    /* Requests waiting for the device, and the number it holds */
+    blkdev_io_t  *pq_head;
+    blkdev_io_t  *pq_tail;
+    int           inflight;
+
+    fatvol_io_t   io[FATVOL_QDEPTH];
+    fatvol_io_t  *io_free;
+};
+
+void      fatvol_mount  ( fatvol_t *vol, blkdev_t *dev, fatvol_cb_t cb );
+void      fatvol_unmount( fatvol_t *vol );
+void      fatvol_poll   ( fatvol_t *vol );
+int       fatvol_ready  ( fatvol_t *vol );
+blkdev_t *fatvol_image  ( fatvol_t *vol, int idx );
+uint32_t  fatvol_lookup ( blkdev_t *dev, uint32_t lba, uint32_t *run );
+void      fatvol_dump   ( fatvol_t *vol );
+
+#endif
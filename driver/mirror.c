@@ -0,0 +1,531 @@
+#include "driver/mirror.h"
+#include "error.h"
+#include "pico/time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Resync states */
+#define MS_IDLE  (0)
+#define MS_READ  (1) /* Reading a chunk from the member in sync */
+#define MS_WRITE (2) /* Writing it to the member being synced */
+
+static int  mirror_submit  ( blkdev_t *dev, blkdev_io_t *io );
+static void mirror_poll    ( blkdev_t *dev );
+static void mirror_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize );
+static void mirror_xfer_end( mirror_t *m, mirror_xfer_t *x );
+
+static const blkdev_ops_t mirror_ops = {
+    .name     = "mirror",
+    .submit   = mirror_submit,
+    .poll     = mirror_poll,
+    .geometry = mirror_geometry,
+};
+
+static const char *mirror_state_names[] = { "absent", "syncing", "active", "failed" };
+
+/**
+ * Put requests on a member while it has room for them.
+ */
+static void mirror_kick( mirror_member_t *mm ) {
+    blkdev_io_t *io;
+
+    while ( mm->inflight < mm->dev->qdepth && mm->pq_head != NULL ) {
+        io = mm->pq_head;
+        if ( mm->dev->ops->submit( mm->dev, io ) != ERR_OK )
+            return;
+        mm->pq_head = io->next;
+        if ( mm->pq_head == NULL )
+            mm->pq_tail = NULL;
+        mm->inflight++;
+    }
+}
+
+/**
+ * Queue the part of a transfer that goes to one member.
+ */
+static void mirror_child_start( mirror_t *m, mirror_xfer_t *x, int idx, int write,
+                                uint32_t lba, uint32_t count, void *buf ) {
+    mirror_member_t *mm = m->mem + idx;
+    mirror_child_t *c = x->child + idx;
+
+    c->io.next   = NULL;
+    c->io.write  = write;
+    c->io.lba    = lba;
+    c->io.count  = count;
+    c->io.buf    = buf;
+    c->io.status = ERR_OK;
+    c->x         = x;
+    c->member    = idx;
+    c->gen       = mm->gen;
+    c->busy      = 1;
+    c->t_queued  = time_us_64();
+    x->pending++;
+    mm->load++;
+    mm->head = lba + count;
+
+    if ( mm->pq_tail )
+        mm->pq_tail->next = &c->io;
+    else
+        mm->pq_head = &c->io;
+    mm->pq_tail = &c->io;
+    mirror_kick( mm );
+}
+
+/**
+ * Mark the regions holding a range of blocks dirty.
+ */
+static void mirror_mark( mirror_t *m, uint32_t lba, uint32_t count ) {
+    uint32_t r, last = (lba + count - 1) >> m->rshift;
+
+    for ( r = lba >> m->rshift; r <= last && r < m->nregions; r++ ) {
+        if ( m->dirty[r / 32] & (1u << (r % 32)) )
+            continue;
+        m->dirty[r / 32] |= 1u << (r % 32);
+        m->ndirty++;
+    }
+}
+
+/**
+ * Send a READ to the member that is least busy, or nearest to it if
+ * both are equally busy, and that was not tried for it yet.
+ * @return 1 if a member took it
+ */
+static int mirror_read( mirror_t *m, mirror_xfer_t *x ) {
+    blkdev_io_t *req = x->req;
+    mirror_member_t *mm;
+    uint32_t dist, best_dist = 0;
+    int i, best = -1;
+
+    for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+        mm = m->mem + i;
+        if ( mm->state != MM_ACTIVE || (x->tried & (1u << i)) )
+            continue;
+        dist = mm->head > req->lba ? mm->head - req->lba : req->lba - mm->head;
+        if ( best < 0 || mm->load < m->mem[best].load ||
+             (mm->load == m->mem[best].load && dist < best_dist) ) {
+            best      = i;
+            best_dist = dist;
+        }
+    }
+    if ( best < 0 )
+        return 0;
+    x->tried |= 1u << best;
+    mirror_child_start( m, x, best, 0, req->lba, req->count, req->buf );
+    return 1;
+}
+
+/**
+ * Drop the child requests of a transfer that a member no longer moves.
+ * @return The number dropped
+ */
+static int mirror_abandon( mirror_xfer_t *x, int idx ) {
+    mirror_child_t *c = x->child + idx;
+
+    if ( !c->busy || c->member != idx )
+        return 0;
+    c->busy = 0;
+    x->pending--;
+    return 1;
+}
+
+/**
+ * Stop using a member that failed a transfer. Requests still queued for
+ * it are taken back; those it holds complete as usual.
+ */
+static void mirror_fail( mirror_t *m, int idx ) {
+    mirror_member_t *mm = m->mem + idx;
+    mirror_child_t *c;
+    blkdev_io_t *io;
+
+    if ( mm->state == MM_FAILED )
+        return;
+    printf("MIRROR: member %i failed, dropped\n", idx);
+    mm->state = MM_FAILED;
+    while ( (io = mm->pq_head) != NULL ) {
+        mm->pq_head = io->next;
+        if ( mm->pq_head == NULL )
+            mm->pq_tail = NULL;
+        c = (mirror_child_t *) io;
+        mm->load--;
+        if ( mirror_abandon( c->x, idx ) && c->x->pending == 0 )
+            mirror_xfer_end( m, c->x );
+    }
+}
+
+/**
+ * Start copying the next chunk of the region being synced.
+ */
+static void mirror_sync_chunk( mirror_t *m ) {
+    uint32_t count = m->sync_end - m->sync_lba;
+
+    if ( count > MIRROR_SYNC_BLOCKS )
+        count = MIRROR_SYNC_BLOCKS;
+    m->sync.ok    = 0;
+    m->sync_state = MS_READ;
+    mirror_child_start( m, &m->sync, m->sync_src, 0, m->sync_lba, count, m->sync_buf );
+}
+
+/**
+ * Move the resync along. Copies the dirty regions from a member in sync
+ * to one that is not, one chunk at a time, and lets the member take
+ * requests once no dirty region is left. The bit of a region is cleared
+ * before its copy starts, so a WRITE to it meanwhile has it copied again.
+ */
+static void mirror_sync_step( mirror_t *m ) {
+    mirror_xfer_t *x = &m->sync;
+    int i, done;
+    uint32_t n, r;
+
+    if ( m->sync_state != MS_IDLE ) {
+        if ( x->pending )
+            return;
+        done = m->sync_state == MS_READ ? m->sync_src : m->sync_dst;
+        m->sync_state = MS_IDLE;
+        if ( !(x->ok & (1u << done)) ) {
+            /* A member went away or failed, copy the region again later */
+            mirror_mark( m, m->sync_lba, m->sync_end - m->sync_lba );
+            return;
+        }
+        if ( done == m->sync_src ) {
+            m->sync_state = MS_WRITE;
+            x->ok = 0;
+            mirror_child_start( m, x, m->sync_dst, 1, m->sync_lba,
+                x->child[m->sync_src].io.count, m->sync_buf );
+            return;
+        }
+        m->sync_lba += x->child[m->sync_dst].io.count;
+        m->synced   += x->child[m->sync_dst].io.count;
+        if ( m->sync_lba < m->sync_end ) {
+            mirror_sync_chunk( m );
+            return;
+        }
+    }
+
+    m->sync_src = m->sync_dst = -1;
+    for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+        if ( m->mem[i].state == MM_ACTIVE && m->sync_src < 0 )
+            m->sync_src = i;
+        if ( m->mem[i].state == MM_SYNCING && m->sync_dst < 0 )
+            m->sync_dst = i;
+    }
+    if ( m->sync_src < 0 || m->sync_dst < 0 )
+        return;
+
+    if ( m->ndirty == 0 ) {
+        for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+            if ( m->mem[i].state != MM_SYNCING )
+                continue;
+            printf("MIRROR: member %i in sync, %lu blocks copied\n", i, m->synced);
+            m->mem[i].state = MM_ACTIVE;
+            m->mem[i].stale = 0;
+        }
+        return;
+    }
+
+    for ( n = 0; n < m->nregions; n++ ) {
+        r = (m->sync_next + n) % m->nregions;
+        if ( m->dirty[r / 32] & (1u << (r % 32)) )
+            break;
+    }
+    m->dirty[r / 32] &= ~(1u << (r % 32));
+    m->ndirty--;
+    m->sync_next = r + 1;
+    m->sync_lba  = r << m->rshift;
+    m->sync_end  = (r + 1) << m->rshift;
+    if ( m->sync_end > m->blkcount )
+        m->sync_end = m->blkcount;
+    x->req   = NULL;
+    x->tried = 0;
+    mirror_sync_chunk( m );
+}
+
+/**
+ * Finish a transfer once none of its child requests is outstanding. A
+ * READ that failed is tried on the other member. A WRITE succeeds if any
+ * member stored it; the others missed it and its regions become dirty.
+ * A member that came in sync, or was attached, while the WRITE was under
+ * way goes back to syncing, as it would serve READs of those regions
+ * from its old data.
+ */
+static void mirror_xfer_end( mirror_t *m, mirror_xfer_t *x ) {
+    blkdev_io_t *req = x->req;
+    int i;
+
+    if ( x == &m->sync ) {
+        mirror_sync_step( m );
+        return;
+    }
+    if ( !req->write && x->ok == 0 && mirror_read( m, x ) )
+        return;
+    if ( req->write && x->ok != 0 && x->ok != (1u << MIRROR_MEMBERS) - 1 ) {
+        mirror_mark( m, req->lba, req->count );
+        for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+            if ( x->ok & (1u << i) )
+                continue;
+            m->mem[i].stale = 1;
+            if ( m->mem[i].state == MM_ACTIVE ) {
+                printf("MIRROR: member %i missed a write, syncing again\n", i);
+                m->mem[i].state = MM_SYNCING;
+            }
+        }
+    }
+    x->fnext = m->xfer_free;
+    m->xfer_free = x;
+    blkdev_complete( &m->dev, req, x->ok ? ERR_OK : ERR_MEDIA );
+}
+
+/**
+ * Completion callback of the members.
+ */
+static void mirror_cmpl( blkdev_t *dev, blkdev_io_t *io ) {
+    mirror_t *m = dev->owner;
+    mirror_child_t *c = (mirror_child_t *) io;
+    mirror_member_t *mm = m->mem + c->member;
+    mirror_xfer_t *x = c->x;
+    uint32_t lat;
+
+    /* The member was detached meanwhile */
+    if ( !c->busy || c->gen != mm->gen )
+        return;
+    c->busy = 0;
+    mm->inflight--;
+    mm->load--;
+
+    if ( x->req ) {
+        lat = time_us_64() - c->t_queued;
+        if ( io->write )
+            mm->stats.writes++;
+        else
+            mm->stats.reads++;
+        mm->stats.blocks += io->count;
+        mm->stats.lat_us += lat;
+        if ( lat > mm->stats.lat_max_us )
+            mm->stats.lat_max_us = lat;
+    }
+
+    if ( io->status != ERR_OK ) {
+        mm->stats.errors++;
+        printf("MIRROR: member %i %s error at LBA %u: %i\n", c->member,
+            io->write ? "write" : "read", (unsigned) io->lba, io->status);
+        mirror_fail( m, c->member );
+    } else {
+        x->ok |= 1u << c->member;
+        mirror_kick( mm );
+    }
+
+    if ( --x->pending == 0 )
+        mirror_xfer_end( m, x );
+}
+
+static int mirror_submit( blkdev_t *dev, blkdev_io_t *req ) {
+    mirror_t *m = dev->priv;
+    mirror_xfer_t *x = m->xfer_free;
+    int i;
+
+    if ( x == NULL )
+        return ERR_BUSY;
+    m->xfer_free = x->fnext;
+
+    x->req     = req;
+    x->pending = 0;
+    x->ok      = 0;
+    x->tried   = 0;
+    if ( req->write ) {
+        for ( i = 0; i < MIRROR_MEMBERS; i++ )
+            if ( m->mem[i].state == MM_ACTIVE )
+                mirror_child_start( m, x, i, 1, req->lba, req->count, req->buf );
+    } else
+        mirror_read( m, x );
+
+    /* No member took it, it fails from poll */
+    if ( x->pending == 0 ) {
+        x->fnext  = m->failed;
+        m->failed = x;
+    }
+    return ERR_OK;
+}
+
+static void mirror_poll( blkdev_t *dev ) {
+    mirror_t *m = dev->priv;
+    mirror_member_t *mm;
+    mirror_xfer_t *x;
+    int i;
+
+    for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+        mm = m->mem + i;
+        if ( mm->dev == NULL )
+            continue;
+        if ( mm->dev->ops->poll )
+            mm->dev->ops->poll( mm->dev );
+        if ( mm->state == MM_ACTIVE || mm->state == MM_SYNCING )
+            mirror_kick( mm );
+    }
+    while ( (x = m->failed) != NULL ) {
+        m->failed = x->fnext;
+        mirror_xfer_end( m, x );
+    }
+    if ( m->sync_state == MS_IDLE )
+        mirror_sync_step( m );
+}
+
+static void mirror_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize ) {
+    mirror_t *m = dev->priv;
+
+    *blkcount = m->blkcount;
+    *blksize  = m->blksize;
+}
+
+/**
+ * Set up a mirror without members.
+ * @param m        The mirror
+ * @param blkcount Size of the mirror, members must have at least this
+ *                 many blocks
+ * @param blksize  Block size of the members
+ * @return 1 on success, 0 if out of memory
+ */
+int mirror_init( mirror_t *m, uint32_t blkcount, uint16_t blksize ) {
+    int i;
+
+    memset( m, 0, sizeof(mirror_t) );
+    m->blkcount = blkcount;
+    m->blksize  = blksize;
+    /* Regions are at least a resync chunk */
+    while ( ((uint64_t) MIRROR_REGIONS << m->rshift) < blkcount ||
+            (1u << m->rshift) < MIRROR_SYNC_BLOCKS )
+        m->rshift++;
+    m->nregions = blkcount ? ((blkcount - 1) >> m->rshift) + 1 : 0;
+    m->dirty    = calloc( (m->nregions + 31) / 32 + 1, sizeof(uint32_t) );
+    m->sync_buf = malloc( MIRROR_SYNC_BLOCKS * blksize );
+    if ( m->dirty == NULL || m->sync_buf == NULL ) {
+        free( m->dirty );
+        free( m->sync_buf );
+        memset( m, 0, sizeof(mirror_t) );
+        return 0;
+    }
+
+    m->dev.ops    = &mirror_ops;
+    m->dev.qdepth = MIRROR_QDEPTH;
+    m->dev.priv   = m;
+    for ( i = MIRROR_QDEPTH - 1; i >= 0; i-- ) {
+        m->xfer[i].fnext = m->xfer_free;
+        m->xfer_free = m->xfer + i;
+    }
+    return 1;
+}
+
+/**
+ * Make a device a member. A member that missed no writes takes requests
+ * right away, one that did waits for its dirty regions to be copied.
+ * @param m    The mirror
+ * @param idx  Index of the member
+ * @param dev  The device
+ * @param full Set if the device does not hold the data the member had,
+ *             it gets a copy of everything
+ * @return 1 on success, 0 if the device is too small
+ */
+int mirror_attach( mirror_t *m, int idx, blkdev_t *dev, int full ) {
+    mirror_member_t *mm = m->mem + idx;
+    uint32_t blkcount;
+    uint16_t blksize;
+
+    dev->ops->geometry( dev, &blkcount, &blksize );
+    if ( blksize != m->blksize || blkcount < m->blkcount ) {
+        printf("MIRROR: device of %u blocks of %u bytes does not fit\n",
+            (unsigned) blkcount, blksize);
+        return 0;
+    }
+    mirror_detach( m, idx );
+
+    mm->dev       = dev;
+    mm->head      = 0;
+    dev->complete = mirror_cmpl;
+    dev->owner    = m;
+    if ( full ) {
+        mirror_mark( m, 0, m->blkcount );
+        mm->stale = 1;
+    }
+    mm->state = mm->stale ? MM_SYNCING : MM_ACTIVE;
+    printf("MIRROR: member %i on %s, %s, %u dirty regions\n", idx, dev->ops->name,
+        mirror_state_names[mm->state], (unsigned) m->ndirty);
+    return 1;
+}
+
+/**
+ * Remove a member whose device went away. The requests the device held
+ * are given up, so it must not complete them later on.
+ */
+void mirror_detach( mirror_t *m, int idx ) {
+    mirror_member_t *mm = m->mem + idx;
+    mirror_xfer_t *x;
+    int i, n;
+
+    if ( mm->dev == NULL )
+        return;
+    printf("MIRROR: member %i detached\n", idx);
+    mm->gen++;
+    mm->dev      = NULL;
+    mm->state    = MM_ABSENT;
+    mm->pq_head  = NULL;
+    mm->pq_tail  = NULL;
+    mm->inflight = 0;
+    mm->load     = 0;
+
+    for ( i = 0; i <= MIRROR_QDEPTH; i++ ) {
+        x = i < MIRROR_QDEPTH ? m->xfer + i : &m->sync;
+        n = mirror_abandon( x, idx );
+        if ( n && x->pending == 0 )
+            mirror_xfer_end( m, x );
+    }
+}
+
+/**
+ * Check whether some member is in sync, so the mirror can be used.
+ */
+int mirror_ready( mirror_t *m ) {
+    int i;
+
+    for ( i = 0; i < MIRROR_MEMBERS; i++ )
+        if ( m->mem[i].state == MM_ACTIVE )
+            return 1;
+    return 0;
+}
+
+/**
+ * Check whether all members are present and in sync.
+ */
+int mirror_synced( mirror_t *m ) {
+    int i;
+
+    for ( i = 0; i < MIRROR_MEMBERS; i++ )
+        if ( m->mem[i].state != MM_ACTIVE )
+            return 0;
+    return m->ndirty == 0 && m->sync_state == MS_IDLE;
+}
+
+void mirror_stats_reset( mirror_t *m ) {
+    int i;
+
+    for ( i = 0; i < MIRROR_MEMBERS; i++ )
+        memset( &m->mem[i].stats, 0, sizeof(mirror_stats_t) );
+}
+
+/**
+ * Print the state and transfer statistics of the members.
+ */
+void mirror_dump( mirror_t *m ) {
+    mirror_member_t *mm;
+    int i;
+
+    printf("MIRROR: %u regions of %u blocks, %u dirty, %lu blocks copied\n",
+        (unsigned) m->nregions, 1u << m->rshift, (unsigned) m->ndirty, m->synced);
+    for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+        mm = m->mem + i;
+        printf("MIRROR: member %i %-7s %7lu reads %7lu writes %9lu blocks, latency avg %8.1f us max %7u us, %lu errors\n",
+            i, mirror_state_names[mm->state], mm->stats.reads, mm->stats.writes,
+            mm->stats.blocks,
+            mm->stats.reads + mm->stats.writes ?
+                (double) mm->stats.lat_us / (mm->stats.reads + mm->stats.writes) : 0.0,
+            (unsigned) mm->stats.lat_max_us, mm->stats.errors);
+    }
+}
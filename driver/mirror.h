@@ -0,0 +1,137 @@
+/**
+ * Mirrored block device.
+ *
+ * Keeps the same data on two member devices, e.g. two USB sticks, and
+ * offers it as one block device, so a unit survives losing either of
+ * them. Writes go to every member that is in sync. A read goes to the
+ * member with the fewest requests outstanding, and if both are equally
+ * busy, to the one whose last request ended nearest to it.
+ *
+ * Writes that did not reach every member mark their regions in a dirty
+ * region bitmap of MIRROR_REGIONS bits. When a member that dropped out
+ * comes back, only those regions are copied to it from the other one, in
+ * the background and one region at a time; it takes no requests until
+ * the copy is done. A write that was under way when it came in sync and
+ * missed it sends it back to syncing. A member that fails a transfer is
+ * dropped until it is attached again.
+ *
+ * The mirror keeps no metadata on the devices, so members that show up
+ * for the first time are taken to hold the same data. A device that
+ * replaces a member gets a full copy when it is attached that way.
+ */
+#ifndef __mirror__
+#define __mirror__
+
+#include <stdint.h>
+#include "driver/blkdev.h"
+#include "projconfig.h"
+
+#define MIRROR_MEMBERS (2)
+
+/* Member states */
+#define MM_ABSENT  (0)
+#define MM_SYNCING (1) /* Waiting for the dirty regions to be copied to it */
+#define MM_ACTIVE  (2)
+#define MM_FAILED  (3) /* Failed a transfer, unused until attached again */
+
+typedef struct mirror mirror_t;
+typedef struct mirror_xfer mirror_xfer_t;
+
+/**
+ * Per member transfer statistics.
+ */
+typedef struct mirror_stats {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long blocks;
+    /** Sum and maximum of the time from queueing to completion */
+    uint64_t      lat_us;
+    uint32_t      lat_max_us;
+    unsigned long errors;
+} mirror_stats_t;
+
+typedef struct mirror_member {
+    blkdev_t     *dev;
+    int           state;
+    /** Missed writes, its dirty regions have to be copied to it */
+    int           stale;
+    /** Bumped when the device goes away, to ignore late completions */
+    unsigned      gen;
+    /* Requests waiting for the device, the number it holds, and both */
+    blkdev_io_t  *pq_head;
+    blkdev_io_t  *pq_tail;
+    int           inflight;
+    int           load;
+    /** Block following the last request, to find the nearest member */
+    uint32_t      head;
+    mirror_stats_t stats;
+} mirror_member_t;
+
+/**
+ * Request of a transfer to one member.
+ */
+typedef struct mirror_child {
+    /* Request to the member, first so it converts back */
+    blkdev_io_t    io;
+    mirror_xfer_t *x;
+    int            member;
+    unsigned       gen;
+    int            busy;
+    uint64_t       t_queued;
+} mirror_child_t;
+
+/**
+ * Transfer of one request to the mirror, or of one resync chunk.
+ */
+struct mirror_xfer {
+    /** Request to the mirror, NULL for the resync */
+    blkdev_io_t    *req;
+    mirror_child_t  child[MIRROR_MEMBERS];
+    /** Child requests outstanding */
+    int             pending;
+    /** Members that moved the data, and those a READ was tried on */
+    unsigned        ok;
+    unsigned        tried;
+    mirror_xfer_t  *fnext;
+};
+
+struct mirror {
+    /** The mirror as a block device */
+    blkdev_t         dev;
+    mirror_member_t  mem[MIRROR_MEMBERS];
+    uint32_t         blkcount;
+    uint16_t         blksize;
+
+    /* Dirty region bitmap, regions of 1 << rshift blocks */
+    uint32_t        *dirty;
+    int              rshift;
+    uint32_t         nregions;
+    uint32_t         ndirty;
+
+    /* Resync: chunk in progress, the region it belongs to and where the */
+    /* search for the next dirty region goes on                          */
+    mirror_xfer_t    sync;
+    uint8_t         *sync_buf;
+    int              sync_state;
+    int              sync_src;
+    int              sync_dst;
+    uint32_t         sync_lba;
+    uint32_t         sync_end;
+    uint32_t         sync_next;
+    unsigned long    synced;
+
+    mirror_xfer_t    xfer[MIRROR_QDEPTH];
+    mirror_xfer_t   *xfer_free;
+    /* Requests no member could take, completed from poll */
+    mirror_xfer_t   *failed;
+};
+
+int  mirror_init  ( mirror_t *m, uint32_t blkcount, uint16_t blksize );
+int  mirror_attach( mirror_t *m, int idx, blkdev_t *dev, int full );
+void mirror_detach( mirror_t *m, int idx );
+int  mirror_ready ( mirror_t *m );
+int  mirror_synced( mirror_t *m );
+void mirror_stats_reset( mirror_t *m );
+void mirror_dump  ( mirror_t *m );
+
+#endif
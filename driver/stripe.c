@@ -0,0 +1,221 @@
+#include "driver/stripe.h"
+#include "error.h"
+#include <stdio.h>
+#include <string.h>
+
+static int  stripe_submit  ( blkdev_t *dev, blkdev_io_t *io );
+static void stripe_poll    ( blkdev_t *dev );
+static void stripe_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize );
+
+static const blkdev_ops_t stripe_ops = {
+    .name     = "stripe",
+    .submit   = stripe_submit,
+    .poll     = stripe_poll,
+    .geometry = stripe_geometry,
+};
+
+/**
+ * Put pieces on a member while it has room for them.
+ */
+static void stripe_kick( stripe_member_t *sm ) {
+    blkdev_io_t *io;
+
+    while ( sm->inflight < sm->dev->qdepth && sm->pq_head != NULL ) {
+        io = sm->pq_head;
+        if ( sm->dev->ops->submit( sm->dev, io ) != ERR_OK )
+            return;
+        sm->pq_head = io->next;
+        if ( sm->pq_head == NULL )
+            sm->pq_tail = NULL;
+        sm->inflight++;
+    }
+}
+
+/**
+ * Map a block of the stripe set to a member.
+ * @param s      The stripe set
+ * @param lba    Block of the stripe set
+ * @param member Set to the member holding it
+ * @param run    Set to the number of blocks from there that follow it on
+ *               the member
+ * @return The member block
+ */
+uint32_t stripe_lookup( stripe_t *s, uint32_t lba, int *member, uint32_t *run ) {
+    uint32_t u = lba / s->ssize;
+
+    *member = u % s->nmembers;
+    *run    = (u + 1) * s->ssize - lba;
+    return (u / s->nmembers) * s->ssize + lba % s->ssize;
+}
+
+/**
+ * Hand the next stripe of a request to its member.
+ */
+static void stripe_piece_start( stripe_t *s, stripe_xfer_t *x, stripe_piece_t *p ) {
+    blkdev_io_t *req = x->req;
+    stripe_member_t *sm;
+    uint32_t lba, run;
+
+    lba = (x->first + x->next) * s->ssize;
+    if ( lba < req->lba )
+        lba = req->lba;
+    x->next++;
+
+    p->x         = x;
+    p->io.next   = NULL;
+    p->io.write  = req->write;
+    p->io.lba    = stripe_lookup( s, lba, &p->member, &run );
+    p->io.count  = run < req->lba + req->count - lba ? run : req->lba + req->count - lba;
+    p->io.buf    = (uint8_t *) req->buf + (size_t) (lba - req->lba) * s->blksize;
+    p->io.status = ERR_OK;
+    x->pending++;
+
+    sm = s->mem + p->member;
+    if ( sm->pq_tail )
+        sm->pq_tail->next = &p->io;
+    else
+        sm->pq_head = &p->io;
+    sm->pq_tail = &p->io;
+    stripe_kick( sm );
+}
+
+/**
+ * Completion callback of the members. The piece goes on with the next
+ * stripe of its request, and the request completes with the last one.
+ */
+static void stripe_cmpl( blkdev_t *dev, blkdev_io_t *io ) {
+    stripe_t *s = dev->owner;
+    stripe_piece_t *p = (stripe_piece_t *) io;
+    stripe_member_t *sm = s->mem + p->member;
+    stripe_xfer_t *x = p->x;
+
+    sm->inflight--;
+    sm->pieces++;
+    sm->blocks += io->count;
+    if ( io->status != ERR_OK ) {
+        printf("STRIPE: member %i %s error at LBA %u: %i\n", p->member,
+            io->write ? "write" : "read", (unsigned) io->lba, io->status);
+        x->status = ERR_MEDIA;
+        x->next   = x->nstripes;
+    }
+    stripe_kick( sm );
+
+    x->pending--;
+    if ( x->next < x->nstripes ) {
+        stripe_piece_start( s, x, p );
+        return;
+    }
+    if ( x->pending )
+        return;
+    x->fnext = s->xfer_free;
+    s->xfer_free = x;
+    blkdev_complete( &s->dev, x->req, x->status );
+}
+
+static int stripe_submit( blkdev_t *dev, blkdev_io_t *req ) {
+    stripe_t *s = dev->priv;
+    stripe_xfer_t *x = s->xfer_free;
+    int i;
+
+    if ( x == NULL )
+        return ERR_BUSY;
+    s->xfer_free = x->fnext;
+
+    x->req      = req;
+    x->first    = req->lba / s->ssize;
+    x->nstripes = (req->lba + req->count - 1) / s->ssize - x->first + 1;
+    x->next     = 0;
+    x->pending  = 0;
+    x->status   = ERR_OK;
+    for ( i = 0; i < STRIPE_PIECES && x->next < x->nstripes; i++ )
+        stripe_piece_start( s, x, x->piece + i );
+    return ERR_OK;
+}
+
+static void stripe_poll( blkdev_t *dev ) {
+    stripe_t *s = dev->priv;
+    stripe_member_t *sm;
+    int i;
+
+    for ( i = 0; i < s->nmembers; i++ ) {
+        sm = s->mem + i;
+        if ( sm->dev->ops->poll )
+            sm->dev->ops->poll( sm->dev );
+        stripe_kick( sm );
+    }
+}
+
+static void stripe_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize ) {
+    stripe_t *s = dev->priv;
+
+    *blkcount = s->blkcount;
+    *blksize  = s->blksize;
+}
+
+/**
+ * Set up a stripe set.
+ * @param s     The stripe set
+ * @param devs  The members, in the order of their stripes
+ * @param n     Number of members, at most STRIPE_MEMBERS
+ * @param ssize Blocks per stripe
+ * @return 1 on success, 0 if the members do not fit together
+ */
+int stripe_init( stripe_t *s, blkdev_t **devs, int n, uint32_t ssize ) {
+    uint32_t blkcount, stripes = 0;
+    uint16_t blksize;
+    int i;
+
+    memset( s, 0, sizeof(stripe_t) );
+    if ( n < 1 || n > STRIPE_MEMBERS || ssize == 0 )
+        return 0;
+    for ( i = 0; i < n; i++ ) {
+        devs[i]->ops->geometry( devs[i], &blkcount, &blksize );
+        if ( i == 0 )
+            s->blksize = blksize;
+        if ( blksize != s->blksize ) {
+            printf("STRIPE: member %i has %u byte blocks, not %u\n", i, blksize, s->blksize);
+            return 0;
+        }
+        if ( i == 0 || blkcount / ssize < stripes )
+            stripes = blkcount / ssize;
+    }
+    if ( stripes == 0 )
+        return 0;
+
+    s->nmembers = n;
+    s->ssize    = ssize;
+    s->blkcount = stripes * ssize * n;
+    for ( i = 0; i < n; i++ ) {
+        s->mem[i].dev    = devs[i];
+        devs[i]->complete = stripe_cmpl;
+        devs[i]->owner    = s;
+    }
+    s->dev.ops    = &stripe_ops;
+    s->dev.qdepth = STRIPE_QDEPTH;
+    s->dev.priv   = s;
+    for ( i = STRIPE_QDEPTH - 1; i >= 0; i-- ) {
+        s->xfer[i].fnext = s->xfer_free;
+        s->xfer_free = s->xfer + i;
+    }
+    printf("STRIPE: %i members, stripes of %u blocks, %u blocks\n", n,
+        (unsigned) ssize, (unsigned) s->blkcount);
+    return 1;
+}
+
+void stripe_stats_reset( stripe_t *s ) {
+    int i;
+
+    for ( i = 0; i < s->nmembers; i++ )
+        s->mem[i].pieces = s->mem[i].blocks = 0;
+}
+
+/**
+ * Print the transfers of the members.
+ */
+void stripe_dump( stripe_t *s ) {
+    int i;
+
+    for ( i = 0; i < s->nmembers; i++ )
+        printf("STRIPE: member %i on %-6s %7lu pieces %9lu blocks\n", i,
+            s->mem[i].dev->ops->name, s->mem[i].pieces, s->mem[i].blocks);
+}
@@ -0,0 +1,84 @@
+/**
+ * Striped block device.
+ *
+ * Spreads one block device over up to STRIPE_MEMBERS member devices in
+ * stripes of a fixed number of blocks, RAID-0 style: stripe s is stripe
+ * s / n of member s % n. A request is split in one piece per stripe it
+ * touches and the members move their pieces at the same time, so large
+ * transfers run at the sum of their speeds. The request completes when
+ * all its pieces have. There is no redundancy, a piece that fails fails
+ * the request.
+ *
+ * Every member holds as many stripes as the smallest one, so the device
+ * is that many stripes times the number of members. The layout depends
+ * on the stripe size and the order of the members, which must stay the
+ * same for the data to be found again.
+ */
+#ifndef __stripe__
+#define __stripe__
+
+#include <stdint.h>
+#include "driver/blkdev.h"
+#include "projconfig.h"
+
+#define STRIPE_MEMBERS (4)
+
+typedef struct stripe stripe_t;
+typedef struct stripe_xfer stripe_xfer_t;
+
+/**
+ * Request of one stripe to a member.
+ */
+typedef struct stripe_piece {
+    /* Request to the member, first so it converts back */
+    blkdev_io_t    io;
+    stripe_xfer_t *x;
+    int            member;
+} stripe_piece_t;
+
+/**
+ * Transfer of one request to the stripe set.
+ */
+struct stripe_xfer {
+    blkdev_io_t    *req;
+    stripe_piece_t  piece[STRIPE_PIECES];
+    /* First stripe of the request, the number of them and the next one */
+    /* to hand to a member                                              */
+    uint32_t        first;
+    uint32_t        nstripes;
+    uint32_t        next;
+    int             pending;
+    int             status;
+    stripe_xfer_t  *fnext;
+};
+
+typedef struct stripe_member {
+    blkdev_t      *dev;
+    /* Pieces waiting for the device, and the number it holds */
+    blkdev_io_t   *pq_head;
+    blkdev_io_t   *pq_tail;
+    int            inflight;
+    unsigned long  pieces;
+    unsigned long  blocks;
+} stripe_member_t;
+
+struct stripe {
+    /** The stripe set as a block device */
+    blkdev_t         dev;
+    stripe_member_t  mem[STRIPE_MEMBERS];
+    int              nmembers;
+    /** Blocks per stripe */
+    uint32_t         ssize;
+    uint32_t         blkcount;
+    uint16_t         blksize;
+
+    stripe_xfer_t    xfer[STRIPE_QDEPTH];
+    stripe_xfer_t   *xfer_free;
+};
+
+int      stripe_init  ( stripe_t *s, blkdev_t **devs, int n, uint32_t ssize );
+uint32_t stripe_lookup( stripe_t *s, uint32_t lba, int *member, uint32_t *run );
+void     stripe_stats_reset( stripe_t *s );
+void     stripe_dump  ( stripe_t *s );
+
+#endif
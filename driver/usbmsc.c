@@ -1,59 +1,171 @@
 #include "mscp/server/server.h"
-#include <ctype.h>
+#include "driver/usbmsc.h"
+#include "driver/blkdrv.h"
+#include "driver/fatvol.h"
+#include "driver/mirror.h"
+#include "error.h"
 #include "bsp/board.h"
 #include "tusb.h"
 #include "class/msc/msc.h"
 #include "class/msc/msc_host.h"
-#include <stdlib.h>
-
-#define USBDRV_BUF_SZ 1024
-
-static mscps_t *usbdrv_server;
-static mscpu_t *usbdrv_unit;
-
-#define UMS_IDLE    (0)
-#define UMS_REQUSB  (1)
-#define UMS_USBDONE (2)
-#define UMS_REISSUE (3)
-
-typedef struct usbdrv_ctx {
-    /* USB Bus address of backing device */
-    uint8_t bus_addr; 
-
-    /* SCSI LUN of backing device */
-    uint8_t lun;
 
+/**
+ * USB mass storage backend of the block unit driver. Every LUN of every
+ * device is a block device of its own with its own units, so transfers
+ * on different devices run at the same time. TinyUSB runs one SCSI
+ * command at a time per device, so the queue depth is one and LUNs of
+ * one device take turns. With FATVOL_ENA a stick holding disk images on
+ * FAT32 is served one image per unit instead.
+ *
+ * LUNs are brought up one after the other when their device is plugged
+ * in, and their units go offline when it is pulled.
+ *
+ * With mirroring on, the first LUNs of two devices are the members of a
+ * mirror served as one unit instead, which stays online as long as one
+ * of them is in sync. Their other LUNs are served as usual.
+ */
+
+typedef struct usbmsc_lun {
+    /* The LUN as a block device, first so it converts back */
+    blkdev_t     dev;
+    /* USB bus address of the device, 0 if the slot is free */
+    uint8_t      addr;
+    uint8_t      lun;
+    /* Request in progress */
+    blkdev_io_t *io;
+    /* Mirror member it is, or -1 */
+    int          member;
     /* Inquiry response */
     scsi_inquiry_resp_t inq;
+#if FATVOL_ENA
+    fatvol_t     vol;
+#endif
+} usbmsc_lun_t;
+
+static mscps_t *usbmsc_server;
+static int      usbmsc_idx;
+
+static usbmsc_lun_t  usbmsc_luns[USBMSC_LUNS];
+/* LUN or mirror serving each unit, NULL while the unit is free */
+static const void   *usbmsc_owner[MSCP_CUNITS];
+
+/**
+ * Device last attached as a mirror member, to tell whether the one that
+ * takes its place later is the same.
+ */
+typedef struct usbmsc_mid {
+    int          used;
+    /* Vendor, product and revision */
+    char         id[28];
+    uint32_t     blkcount;
+} usbmsc_mid_t;
+
+static int          usbmsc_mirror_ena = USBMSC_MIRROR;
+static mirror_t     usbmsc_mir;
+static usbmsc_mid_t usbmsc_mids[MIRROR_MEMBERS];
+
+static int  usbmsc_submit  ( blkdev_t *dev, blkdev_io_t *io );
+static void usbmsc_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize );
+
+static const blkdev_ops_t usbmsc_ops = {
+    .name     = "USB",
+    .submit   = usbmsc_submit,
+    .poll     = NULL,
+    .geometry = usbmsc_geometry,
+};
+
+static bool usbmsc_inq_cb( uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data );
+static void usbmsc_probe ( uint8_t addr, uint8_t lun );
+
+/**
+ * Turn mirroring on or off, before usbmsc_init().
+ */
+void usbmsc_set_mirror( int ena ) {
+    usbmsc_mirror_ena = ena;
+}
 
-    int busy;
-
-} usbdrv_ctx_t;
-
-typedef struct usbdrv_cmd {
-    mscpu_t  *unit;
-    uint8_t   buf [USBDRV_BUF_SZ / 2];
-    uint8_t   hbuf[USBDRV_BUF_SZ / 2];
-    int       buf_pos;
-    uint32_t  cur_lba;
-    int       turnsz;
-    int       state;
-} usbdrv_cmd_t;
-
-bool usbdrv_inq_cb(uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data);
+/**
+ * Get the mirror, NULL if mirroring is off.
+ */
+mirror_t *usbmsc_mirror( void ) {
+    return usbmsc_mirror_ena ? &usbmsc_mir : NULL;
+}
 
 void usbmsc_init( mscps_t *server, int idx ) {
-    mscpu_t *unit = server->c_unit + idx;
-
     board_init();
     tuh_init(0);
 
-    unit->u_drvctx = malloc( sizeof(usbdrv_ctx_t) );  
-    memset( unit->u_drvctx, 0, sizeof(usbdrv_ctx_t));
-    usbdrv_unit = unit;
-    usbdrv_server = server;
-    //TODO: Check OOM
+    usbmsc_idx    = idx;
+    usbmsc_server = server;
+}
 
+/**
+ * Run the USB host stack and the block unit driver.
+ */
+void usbmsc_process() {
+    tuh_task();
+#if FATVOL_ENA
+    for ( int i = 0; i < USBMSC_LUNS; i++ )
+        if ( usbmsc_luns[i].addr && usbmsc_luns[i].vol.dev )
+            fatvol_poll( &usbmsc_luns[i].vol );
+#endif
+    blkdrv_process();
+}
+
+/**
+ * Put a unit online on a block device of a LUN or of the mirror.
+ * @param owner The LUN or the mirror
+ * @return The unit index, or -1 if all units are in use
+ */
+static int usbmsc_attach( const void *owner, blkdev_t *dev, uint32_t uid_l, uint16_t uid_h ) {
+    mscpu_t *unit;
+    int idx;
+
+    for ( idx = usbmsc_idx; idx < MSCP_CUNITS && usbmsc_owner[idx]; idx++ )
+        ;
+    if ( idx == MSCP_CUNITS ) {
+        printf("USBDRV: no unit free\n");
+        return -1;
+    }
+    unit = usbmsc_server->c_unit + idx;
+    unit->u_id.i_uid_l = uid_l;
+    unit->u_id.i_uid_h = uid_h;
+    usbmsc_owner[idx] = owner;
+    blkdrv_attach( usbmsc_server, idx, dev );
+    return idx;
+}
+
+/**
+ * Take the units of a LUN or of the mirror offline.
+ */
+static void usbmsc_detach( const void *owner ) {
+    int idx;
+
+    for ( idx = usbmsc_idx; idx < MSCP_CUNITS; idx++ ) {
+        if ( usbmsc_owner[idx] != owner )
+            continue;
+        blkdrv_detach( usbmsc_server, idx );
+        usbmsc_owner[idx] = NULL;
+    }
+}
+
+/**
+ * Release a LUN and take its units offline. The mirror unit goes offline
+ * when no member in sync is left.
+ */
+static void usbmsc_lun_free( usbmsc_lun_t *l ) {
+    if ( l->member >= 0 ) {
+        mirror_detach( &usbmsc_mir, l->member );
+        l->member = -1;
+        if ( !mirror_ready( &usbmsc_mir ) )
+            usbmsc_detach( &usbmsc_mir );
+    }
+    usbmsc_detach( l );
+#if FATVOL_ENA
+    fatvol_unmount( &l->vol );
+#endif
+    l->addr = 0;
+    l->io   = NULL;
 }
 
 //--------------------------------------------------------------------+
@@ -69,239 +181,234 @@ void tuh_umount_cb(uint8_t dev_addr) {
   (void) dev_addr;
 }
 
-
-void usbmsc_process() {
-    tuh_task();
-}
-
 void tuh_msc_mount_cb(uint8_t dev_addr) {
-    usbdrv_ctx_t *ctx = usbdrv_unit->u_drvctx;
-    //TODO: Handle multiple devices
-    printf("USBDRV: Got mass storage mount!\n");
+    printf("USBDRV: Got mass storage mount of device %i, %i LUNs\n",
+        dev_addr, tuh_msc_get_maxlun(dev_addr));
 
-    ctx->lun = 0;
-    ctx->bus_addr = dev_addr;
-
-    tuh_msc_inquiry(ctx->bus_addr, ctx->lun, &ctx->inq, usbdrv_inq_cb, (uintptr_t) usbdrv_unit);
+    usbmsc_probe( dev_addr, 0 );
 }
 
 void tuh_msc_umount_cb(uint8_t dev_addr) {
-    usbdrv_ctx_t *ctx = usbdrv_unit->u_drvctx;
-    printf("USBDRV: Got mass storage unmount!\n\n");
-
-    uint8_t const drive_num = dev_addr-1;
-    //TODO: Handle unmount
-}
+    int i;
 
-static bool usbdrv_io_cmpl(uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data );
-
-int usbdrv_start( mscpu_t *unit, mscpc_t *cmd ) {
-    int status;
-    usbdrv_ctx_t *ctx  = unit->u_drvctx;
-    usbdrv_cmd_t *dcmd = cmd->dctx;
-    
-    if ( ctx->busy )
-        return 0;
-
-
-    dcmd->turnsz = USBDRV_BUF_SZ;
-    //if ( cmd->pkt->m_opcode == M_OP_COMP )
-        dcmd->turnsz /= 2; /* half the buffer is used for comparison */
-    if ( (cmd->pkt->m_un.m_generic.Ms_bytecnt - dcmd->buf_pos) < dcmd->turnsz )
-        dcmd->turnsz = cmd->pkt->m_un.m_generic.Ms_bytecnt - dcmd->buf_pos;
-
-    dcmd->state = UMS_REQUSB;
-
-    switch( cmd->pkt->m_opcode ) {
-        case M_OP_ACCES:
-            cmd->state = CMD_REPLY;
-            cmd->resp->m_status = M_ST_SUCC;
-            return 0;
-        case M_OP_COMP:
-            status = mscps_read_buf( unit->u_server, dcmd->hbuf,
-                &cmd->pkt->m_un.m_generic.Ms_buf, dcmd->buf_pos, dcmd->turnsz );
-        case M_OP_READ:
-            ctx->busy = 1;
-            //printf("USBDRV: Issuing read for %p: LBA=%i Count=%i\n", cmd, dcmd->cur_lba, dcmd->turnsz);
-            status = tuh_msc_read10( ctx->bus_addr, ctx->lun, dcmd->buf, 
-                dcmd->cur_lba, dcmd->turnsz / unit->u_blksize
-                , usbdrv_io_cmpl, (uintptr_t) cmd);
-            //printf("result: %i\n", status);
-            return 0;
-        case M_OP_WRITE:
-            status = mscps_read_buf( unit->u_server, dcmd->buf,
-                &cmd->pkt->m_un.m_generic.Ms_buf, dcmd->buf_pos, dcmd->turnsz );
-        case M_OP_ERASE:
-            ctx->busy = 1;
-            //printf("USBDRV: Issuing write for %p LBA=%i Count=%i\n", cmd, dcmd->cur_lba, dcmd->turnsz);
-            status = tuh_msc_write10( ctx->bus_addr, ctx->lun, dcmd->buf, 
-                dcmd->cur_lba,
-                dcmd->turnsz / unit->u_blksize, usbdrv_io_cmpl, (uintptr_t) cmd);
-            //printf("result: %i\n", status);
-            return 0;
-    }
+    printf("USBDRV: Got mass storage unmount of device %i\n", dev_addr);
 
+    for ( i = 0; i < USBMSC_LUNS; i++ )
+        if ( usbmsc_luns[i].addr == dev_addr )
+            usbmsc_lun_free( usbmsc_luns + i );
 }
 
-int usbdrv_issue( mscpu_t *unit, mscpc_t *cmd ) {
-    int status;
-    usbdrv_ctx_t *ctx  = unit->u_drvctx;
-    usbdrv_cmd_t *dcmd = cmd->dctx;
+static bool usbmsc_io_cmpl(uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data ) {
+    usbmsc_lun_t *l = (void *) cb_data->user_arg;
+    blkdev_io_t *io = l->io;
 
-    if ( !mscpu_verify_access( unit, cmd ) ) {
-        cmd->state = CMD_REPLY;
-        return 0;
-    }
-
-    dcmd->buf_pos = 0;
-    dcmd->cur_lba = cmd->pkt->m_un.m_generic.Ms_lba;
-
-    return usbdrv_start( unit, cmd );
+    /* The device was unplugged and the LUN given up meanwhile */
+    if ( l->addr != dev_addr || io == NULL )
+        return true;
+    l->io = NULL;
+    blkdev_complete( &l->dev, io,
+        cb_data->csw->status == MSC_CSW_STATUS_PASSED ? ERR_OK : ERR_MEDIA );
+    return true;
 }
 
-int usbdrv_abort( mscpu_t *unit, mscpc_t *cmd ) {
-    return 0;//TODO: Actually abort
+/**
+ * Send a READ10 or WRITE10 for a request. TinyUSB refuses it while the
+ * previous command on the device is still running, which may be one for
+ * another LUN.
+ */
+static int usbmsc_submit( blkdev_t *dev, blkdev_io_t *io ) {
+    usbmsc_lun_t *l = (usbmsc_lun_t *) dev;
+    bool ok;
+
+    l->io = io;
+    if ( io->write )
+        ok = tuh_msc_write10( l->addr, l->lun, io->buf,
+            io->lba, io->count, usbmsc_io_cmpl, (uintptr_t) l );
+    else
+        ok = tuh_msc_read10( l->addr, l->lun, io->buf,
+            io->lba, io->count, usbmsc_io_cmpl, (uintptr_t) l );
+    if ( !ok )
+        l->io = NULL;
+    return ok ? ERR_OK : ERR_BUSY;
 }
 
+static void usbmsc_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize ) {
+    usbmsc_lun_t *l = (usbmsc_lun_t *) dev;
 
-int usbdrv_usbdone( mscpu_t *unit, mscpc_t *cmd ) {
-    int status;
-    usbdrv_cmd_t *dcmd = cmd->dctx;
-    usbdrv_ctx_t *ctx  = unit->u_drvctx;
+    *blkcount = tuh_msc_get_block_count( l->addr, l->lun );
+    *blksize  = tuh_msc_get_block_size( l->addr, l->lun );
+}
 
-    //printf("USBDRV: Got USB done for %p\n", cmd);
-    if ( cmd->state == CMD_ABORTING ) {
-        cmd->state = CMD_REPLY;
-        return true;
-    }
+/**
+ * Put a LUN online as a whole. The unit identifier is made of the
+ * product name and the place of the LUN.
+ */
+static void usbmsc_attach_lun( usbmsc_lun_t *l ) {
+    uint32_t uid_l;
 
-    if ( cmd->state != CMD_ACTIVE ) {
-        //TODO: what to do if we get here?
-        return true;
-    }
+    memcpy( &uid_l, l->inq.product_id, 4 );
+    usbmsc_attach( l, &l->dev, uid_l, (l->addr << 8) | l->lun );
+}
 
-    dcmd->state = UMS_IDLE;
-
-    /* Handle data from disk */
-    if ( cmd->pkt->m_opcode == M_OP_READ ) {
-        status = mscps_write_buf( unit->u_server, dcmd->buf,
-            &cmd->pkt->m_un.m_generic.Ms_buf, dcmd->buf_pos, dcmd->turnsz );
-        if ( status )
-            printf("error dumping read io into mem: %i\n", status);
-    } else if ( cmd->pkt->m_opcode == M_OP_COMP ) {
-        if ( memcmp( dcmd->buf, dcmd->hbuf, dcmd->turnsz ) != 0 ) {
-            cmd->resp->m_status = M_ST_COMP;
-            cmd->state = CMD_REPLY;
-            return true;
+/**
+ * Make the first LUN of a device a mirror member, and put the mirror
+ * online once a member is in sync. A device that was a member before
+ * takes its place again and gets the writes it missed. A device that
+ * was never seen takes a place that was never used as it is, and
+ * otherwise the place of one that is gone, with a full copy.
+ * @return 1 if the LUN became a member
+ */
+static int usbmsc_mirror_add( usbmsc_lun_t *l ) {
+    usbmsc_mid_t *mid;
+    uint32_t blkcount, uid_l;
+    uint16_t blksize;
+    char id[28];
+    int i, idx = -1, full;
+
+    memcpy( id,      l->inq.vendor_id,   8 );
+    memcpy( id + 8,  l->inq.product_id,  16 );
+    memcpy( id + 24, l->inq.product_rev, 4 );
+    usbmsc_geometry( &l->dev, &blkcount, &blksize );
+
+    for ( i = 0; i < MIRROR_MEMBERS; i++ ) {
+        mid = usbmsc_mids + i;
+        if ( usbmsc_mir.mem[i].dev )
+            continue;
+        if ( mid->used && mid->blkcount == blkcount && !memcmp( mid->id, id, 28 ) ) {
+            idx = i;
+            break;
         }
+        if ( idx < 0 || (usbmsc_mids[idx].used && !mid->used) )
+            idx = i;
     }
+    if ( idx < 0 )
+        return 0;
+    mid  = usbmsc_mids + idx;
+    full = mid->used && (mid->blkcount != blkcount || memcmp( mid->id, id, 28 ));
 
-    /* Move to next sector */
-    dcmd->cur_lba += dcmd->turnsz / unit->u_blksize;
-    dcmd->buf_pos += dcmd->turnsz;
-
-    if ( dcmd->buf_pos == cmd->pkt->m_un.m_generic.Ms_bytecnt ) {
-        /* We're done */
-        cmd->resp->m_status = M_ST_SUCC;
-        cmd->state = CMD_REPLY;
-        return true;
+    if ( usbmsc_mir.blkcount == 0 && !mirror_init( &usbmsc_mir, blkcount, blksize ) ) {
+        printf("USBDRV: could not set up the mirror\n");
+        return 0;
     }
-
-    status = usbdrv_start( unit, cmd );
-    if ( status ) {
-        printf( "USBDRV: Transfer restart error: %i\n", status );
+    if ( !mirror_attach( &usbmsc_mir, idx, &l->dev, full ) )
+        return 0;
+    l->member     = idx;
+    mid->used     = 1;
+    mid->blkcount = blkcount;
+    memcpy( mid->id, id, 28 );
+
+    for ( i = usbmsc_idx; i < MSCP_CUNITS && usbmsc_owner[i] != &usbmsc_mir; i++ )
+        ;
+    if ( i == MSCP_CUNITS && mirror_ready( &usbmsc_mir ) ) {
+        memcpy( &uid_l, l->inq.product_id, 4 );
+        i = usbmsc_attach( &usbmsc_mir, &usbmsc_mir.dev, uid_l, (l->addr << 8) | l->lun );
+        if ( i >= 0 )
+            printf("USBDRV: unit %i is the mirror\n", i);
     }
-    return true;
+    return 1;
 }
 
-int usbdrv_proc( mscpu_t *unit, mscpc_t *cmd ) {
-    int status;
-    usbdrv_ctx_t *ctx  = unit->u_drvctx;
-    usbdrv_cmd_t *dcmd = cmd->dctx;
-
-    /* Ignore commands that are owned by the unit driver */
-    if ( cmd->state == CMD_COMPLETE || cmd->state == CMD_DELETE || cmd->state == CMD_REPLY )
-        return 0;
-
-    if ( cmd->state == CMD_QUEUED ) {
-        cmd->dctx = malloc( sizeof(usbdrv_cmd_t) );
-
-        if ( cmd->dctx == NULL )
-            return 0; /* try again on next spin */
-
-        memset( cmd->dctx, 0, sizeof(usbdrv_cmd_t) );
-
-        dcmd = cmd->dctx;
-        cmd->state = CMD_ACTIVE;
-        dcmd->state = UMS_REISSUE;
-        dcmd->unit = unit;
-        status = usbdrv_issue( unit, cmd );
-    } else if ( cmd->state == CMD_ABORTED ) {
-        cmd->state = CMD_ABORTING;
-        status = usbdrv_abort( unit, cmd );
-    } else if ( dcmd->state == UMS_USBDONE ) {
-        status = usbdrv_usbdone( unit, cmd );
-    } else if ( dcmd->state == UMS_REISSUE ) {
-        status = usbdrv_issue( unit, cmd );
-    }
-    if ( cmd->state == CMD_REPLY || cmd->state == CMD_DELETE ) {
-        if ( cmd->dctx ) {
-            free( cmd->dctx );
-            cmd->dctx = NULL;
-        }
+#if FATVOL_ENA
+/**
+ * Put the images on a stick online, or the stick itself if it holds
+ * none, then bring up the next LUN of the device.
+ */
+static void usbmsc_mounted( fatvol_t *vol, int status ) {
+    usbmsc_lun_t *l;
+    blkdev_t *dev;
+    int i, idx, n = 0;
+
+    for ( l = usbmsc_luns; &l->vol != vol; l++ )
+        ;
+    for ( i = 0; status == ERR_OK && i < vol->nimages; i++ ) {
+        dev = fatvol_image( vol, i );
+        if ( dev == NULL )
+            continue;
+        idx = usbmsc_attach( l, dev, vol->img[i].clus, ((l - usbmsc_luns) << 8) | i );
+        if ( idx < 0 )
+            break;
+        printf("USBDRV: unit %i is %s\n", idx, vol->img[i].name);
+        n++;
     }
-    return status;
+    fatvol_dump( vol );
+    if ( n == 0 )
+        usbmsc_attach_lun( l );
+    usbmsc_probe( l->addr, l->lun + 1 );
 }
-
-static bool usbdrv_io_cmpl(uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data ) {
-    int bufpos;
-    int status;
-    mscpc_t *cmd       = (void *) cb_data->user_arg;
-    usbdrv_cmd_t *dcmd = cmd->dctx;
-    mscpu_t *unit      = dcmd->unit;
-    usbdrv_ctx_t *ctx  = unit->u_drvctx;
-    
-    ctx->busy = 0;
-
-    //printf("USBDRV: Got IO completion for %p\n", cmd);
-
-    if ( cmd->state == CMD_ABORTING ) {
-        cmd->state = CMD_REPLY;
-        return true;
+#endif
+
+/**
+ * Find a free slot for a LUN.
+ */
+static usbmsc_lun_t *usbmsc_lun_alloc( uint8_t addr, uint8_t lun ) {
+    usbmsc_lun_t *l;
+    int i;
+
+    for ( i = 0; i < USBMSC_LUNS; i++ ) {
+        l = usbmsc_luns + i;
+        if ( l->addr )
+            continue;
+        memset( &l->dev, 0, sizeof(blkdev_t) );
+        l->dev.ops    = &usbmsc_ops;
+        l->dev.qdepth = 1;
+        l->addr   = addr;
+        l->lun    = lun;
+        l->io     = NULL;
+        l->member = -1;
+        return l;
     }
+    return NULL;
+}
 
-    if ( cmd->state != CMD_ACTIVE ) {
-        //TODO: what to do if we get here?
-        return true;
+/**
+ * Bring up the LUNs of a device from a given one on. Each LUN is asked
+ * for its identity and mounted before the next one, as the device runs
+ * one command at a time.
+ */
+static void usbmsc_probe( uint8_t addr, uint8_t lun ) {
+    usbmsc_lun_t *l;
+
+    for ( ; lun < tuh_msc_get_maxlun( addr ); lun++ ) {
+        l = usbmsc_lun_alloc( addr, lun );
+        if ( l == NULL ) {
+            printf("USBDRV: no room for device %i LUN %i\n", addr, lun);
+            return;
+        }
+        if ( tuh_msc_inquiry( addr, lun, &l->inq, usbmsc_inq_cb, (uintptr_t) l ) )
+            return;
+        printf("USBDRV: inquiry of device %i LUN %i refused\n", addr, lun);
+        l->addr = 0;
     }
-
-    dcmd->state = UMS_USBDONE;
-    return true;
 }
 
-bool usbdrv_inq_cb(uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data) {
-    mscpu_t *unit        = (void *) cb_data->user_arg;
-    usbdrv_ctx_t *ctx    = unit->u_drvctx;
-    msc_cbw_t const* cbw = cb_data->cbw;
+static bool usbmsc_inq_cb( uint8_t dev_addr, tuh_msc_complete_data_t const * cb_data ) {
+    usbmsc_lun_t *l      = (void *) cb_data->user_arg;
     msc_csw_t const* csw = cb_data->csw;
 
+    if ( l->addr != dev_addr )
+        return true;
+
     if (csw->status != 0) {
-        printf("USBDEV: Inquiry failed\n");
+        printf("USBDEV: Inquiry of device %i LUN %i failed\n", l->addr, l->lun);
+        l->addr = 0;
+        usbmsc_probe( dev_addr, l->lun + 1 );
         return false;
     }
 
-    printf("USBDRV: %.8s %.16s rev %.4s\n", 
-        ctx->inq.vendor_id, ctx->inq.product_id, ctx->inq.product_rev);
+    printf("USBDRV: device %i LUN %i: %.8s %.16s rev %.4s\n", l->addr, l->lun,
+        l->inq.vendor_id, l->inq.product_id, l->inq.product_rev);
 
-    memcpy( &unit->u_id.i_uid_h, ctx->inq.product_id, 6 );
-    unit->u_id.i_class = M_CC_DISK144;
-    unit->u_id.i_model = M_CM_UDA50;
-    unit->u_spindles = 1;
-    unit->u_mediaid  = 0x254B3294;
-    unit->u_blkcount = tuh_msc_get_block_count(dev_addr, cbw->lun);
-    unit->u_blksize  = tuh_msc_get_block_size(dev_addr, cbw->lun);
+    if ( usbmsc_mirror_ena && l->lun == 0 && usbmsc_mirror_add( l ) ) {
+        usbmsc_probe( l->addr, l->lun + 1 );
+        return true;
+    }
 
-    mscpu_set_avail( unit->u_server, unit->u_idx, usbdrv_proc );
+#if FATVOL_ENA
+    fatvol_mount( &l->vol, &l->dev, usbmsc_mounted );
+#else
+    usbmsc_attach_lun( l );
+    usbmsc_probe( l->addr, l->lun + 1 );
+#endif
 
     return true;
 }
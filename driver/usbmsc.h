@@ -1,4 +1,7 @@
 #include "mscp/mscp.h"
+#include "driver/mirror.h"
 
-void usbmsc_init( mscps_t *server, int idx );
-void usbmsc_process();
\ No newline at end of file
+void      usbmsc_init      ( mscps_t *server, int idx );
+void      usbmsc_process   ();
+void      usbmsc_set_mirror( int ena );
+mirror_t *usbmsc_mirror    ( void );
@@ -28,6 +28,9 @@
 /** Timeout during data transfer */
 #define ERR_DATA_TO   (-8&0x7F)
 
+/** The backing block device failed the transfer */
+#define ERR_MEDIA     (-9&0x7F)
+
 /** Error was fatal */
 #define ERR_FATAL     (0x80)
 
@@ -0,0 +1,11 @@
+/**
+ * @file host/compat/bsp/board.h
+ *
+ * Host build stand-in for the TinyUSB board support header.
+ */
+#ifndef _HOST_BSP_BOARD_H_
+#define _HOST_BSP_BOARD_H_
+
+void board_init( void );
+
+#endif
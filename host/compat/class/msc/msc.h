@@ -0,0 +1,52 @@
+/**
+ * @file host/compat/class/msc/msc.h
+ *
+ * Host build stand-in for the TinyUSB mass storage class definitions.
+ */
+#ifndef _HOST_CLASS_MSC_H_
+#define _HOST_CLASS_MSC_H_
+
+#include <stdint.h>
+
+/** Command Block Wrapper */
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t total_bytes;
+    uint8_t  dir;
+    uint8_t  lun;
+    uint8_t  cmd_len;
+    uint8_t  command[16];
+} msc_cbw_t;
+
+/** Command Status Wrapper */
+typedef struct __attribute__((packed)) {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t  status;
+} msc_csw_t;
+
+#define MSC_CSW_STATUS_PASSED      (0)
+#define MSC_CSW_STATUS_FAILED      (1)
+
+#define SCSI_CMD_INQUIRY           (0x12)
+#define SCSI_CMD_READ_10           (0x28)
+#define SCSI_CMD_WRITE_10          (0x2A)
+
+/** SCSI INQUIRY response */
+typedef struct __attribute__((packed)) {
+    uint8_t peripheral_device_type;
+    uint8_t flags1;
+    uint8_t version;
+    uint8_t response_data_format;
+    uint8_t additional_length;
+    uint8_t flags5;
+    uint8_t flags6;
+    uint8_t flags7;
+    uint8_t vendor_id[8];
+    uint8_t product_id[16];
+    uint8_t product_rev[4];
+} scsi_inquiry_resp_t;
+
+#endif
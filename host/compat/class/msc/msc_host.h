@@ -0,0 +1,39 @@
+/**
+ * @file host/compat/class/msc/msc_host.h
+ *
+ * Host build stand-in for the TinyUSB mass storage host API.
+ */
+#ifndef _HOST_CLASS_MSC_HOST_H_
+#define _HOST_CLASS_MSC_HOST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "class/msc/msc.h"
+
+typedef struct {
+    msc_cbw_t const *cbw;
+    msc_csw_t const *csw;
+    void            *scsi_data;
+    uintptr_t        user_arg;
+} tuh_msc_complete_data_t;
+
+typedef bool (*tuh_msc_complete_cb_t)( uint8_t dev_addr, tuh_msc_complete_data_t const *cb_data );
+
+bool     tuh_msc_mounted( uint8_t dev_addr );
+bool     tuh_msc_ready  ( uint8_t dev_addr );
+uint8_t  tuh_msc_get_maxlun( uint8_t dev_addr );
+uint32_t tuh_msc_get_block_count( uint8_t dev_addr, uint8_t lun );
+uint32_t tuh_msc_get_block_size ( uint8_t dev_addr, uint8_t lun );
+
+bool tuh_msc_inquiry( uint8_t dev_addr, uint8_t lun, scsi_inquiry_resp_t *response,
+                      tuh_msc_complete_cb_t complete_cb, uintptr_t arg );
+bool tuh_msc_read10 ( uint8_t dev_addr, uint8_t lun, void *buffer, uint32_t lba,
+                      uint16_t block_count, tuh_msc_complete_cb_t complete_cb, uintptr_t arg );
+bool tuh_msc_write10( uint8_t dev_addr, uint8_t lun, void const *buffer, uint32_t lba,
+                      uint16_t block_count, tuh_msc_complete_cb_t complete_cb, uintptr_t arg );
+
+/* Application callbacks */
+void tuh_msc_mount_cb ( uint8_t dev_addr );
+void tuh_msc_umount_cb( uint8_t dev_addr );
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * @file host/compat/hardware/sync.h
+ *
+ * Host build stand-in for the Pico SDK spin locks and core number, for
+ * running the port and the server on two threads. The thread started by
+ * multicore_launch_core1() is core 1, every other thread is core 0.
+ */
+#ifndef _HOST_HARDWARE_SYNC_H_
+#define _HOST_HARDWARE_SYNC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef volatile uint8_t spin_lock_t;
+
+spin_lock_t *spin_lock_instance( unsigned lock_num );
+spin_lock_t *spin_lock_init( unsigned lock_num );
+int          spin_lock_claim_unused( bool required );
+unsigned     get_core_num( void );
+
+static inline uint32_t spin_lock_blocking( spin_lock_t *lock ) {
+    while ( __atomic_test_and_set( lock, __ATOMIC_ACQUIRE ) )
+        ;
+    return 0;
+}
+
+static inline void spin_unlock( spin_lock_t *lock, uint32_t saved_irq ) {
+    (void) saved_irq;
+    __atomic_clear( lock, __ATOMIC_RELEASE );
+}
+
+#endif
@@ -0,0 +1,12 @@
+/**
+ * @file host/compat/pico/multicore.h
+ *
+ * Host build stand-in for launching the second core, which runs as a
+ * POSIX thread.
+ */
+#ifndef _HOST_PICO_MULTICORE_H_
+#define _HOST_PICO_MULTICORE_H_
+
+void multicore_launch_core1( void (*entry)( void ) );
+
+#endif
@@ -0,0 +1,11 @@
+/**
+ * @file host/compat/pico/stdlib.h
+ *
+ * Host build stand-in for the Pico SDK standard library header.
+ */
+#ifndef _HOST_PICO_STDLIB_H_
+#define _HOST_PICO_STDLIB_H_
+
+#include "pico/time.h"
+
+#endif
@@ -0,0 +1,43 @@
+/**
+ * @file host/compat/pico/time.h
+ *
+ * Host build stand-in for the Pico SDK timing functions used by the
+ * emulator, implemented on top of the POSIX monotonic clock.
+ */
+#ifndef _HOST_PICO_TIME_H_
+#define _HOST_PICO_TIME_H_
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t time_us_64( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static inline uint32_t time_us_32( void ) {
+    return (uint32_t) time_us_64();
+}
+
+static inline void busy_wait_us( uint64_t us ) {
+    uint64_t end = time_us_64() + us;
+    while ( time_us_64() < end );
+}
+
+static inline void busy_wait_us_32( uint32_t us ) {
+    busy_wait_us( us );
+}
+
+static inline void sleep_us( uint64_t us ) {
+    struct timespec ts;
+    ts.tv_sec  = us / 1000000u;
+    ts.tv_nsec = (us % 1000000u) * 1000u;
+    nanosleep( &ts, NULL );
+}
+
+static inline void sleep_ms( uint32_t ms ) {
+    sleep_us( (uint64_t) ms * 1000u );
+}
+
+#endif
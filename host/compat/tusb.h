@@ -0,0 +1,26 @@
+/**
+ * @file host/compat/tusb.h
+ *
+ * Host build stand-in for the parts of the TinyUSB host stack used by
+ * driver/usbmsc.c. The stack is replaced by host/usbsim.c, which
+ * simulates a single mass storage device.
+ */
+#ifndef _HOST_TUSB_H_
+#define _HOST_TUSB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "class/msc/msc.h"
+#include "class/msc/msc_host.h"
+
+bool tuh_init( uint8_t rhport );
+void tuh_task( void );
+
+/* Application callbacks */
+void tuh_mount_cb ( uint8_t dev_addr );
+void tuh_umount_cb( uint8_t dev_addr );
+
+#endif
@@ -0,0 +1,276 @@
+/**
+ * @file host/hostdrv.c
+ *
+ * This file implements a model of the MSCP port driver running on the
+ * host (PDP-11 or MicroVAX) side of the KLESI adapter. It drives the SA
+ * register init sequence, lays out the communication area, the rings
+ * and the packet buffers in the simulated host memory and exchanges
+ * messages with the port the same way a real host driver would: by
+ * handing ring descriptors back and forth and reading IP to make the
+ * port poll the command ring.
+ *
+ * Host memory layout:
+ *    HD_COMM_BASE   Communication area header, followed by the response
+ *                   ring and the command ring.
+ *    HD_PKT_BASE    One HD_PKT_SIZE buffer per command and response slot,
+ *                   each starting with the 4 byte envelope header.
+ *    HD_DATA_BASE   Data buffers handed out by hostdrv_alloc().
+ *
+ * Host memory is little endian, like the PDP-11.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mscp/hostif/hostif.h"
+#include "host/klesisim.h"
+#include "host/hostdrv.h"
+
+#define HD_COMM_BASE  (0x1000)
+#define HD_PKT_BASE   (0x4000)
+#define HD_PKT_SIZE   (0x50)
+#define HD_PKT_MSGLEN (64)
+#define HD_DATA_BASE  (0x10000)
+
+#define HD_STEP1      (1)
+#define HD_STEP2      (2)
+#define HD_STEP3      (3)
+#define HD_STEP4      (4)
+#define HD_RUN        (5)
+
+static struct {
+    int      state;
+    int      clog2;
+    int      rlog2;
+    int      csize;
+    int      rsize;
+    uint16_t vector;
+    uint16_t last_sa;
+
+    uint32_t ringbase;
+    uint32_t rring;
+    uint32_t cring;
+    uint32_t cpkt;
+    uint32_t rpkt;
+    uint32_t brk;
+
+    int      cidx;
+    int      ridx;
+
+    hostdrv_stats_t stats;
+} hd;
+
+static inline uint16_t hd_rd16( uint32_t a ) {
+    uint16_t v;
+    memcpy( &v, klesisim_host_mem() + a, 2 );
+    return v;
+}
+
+static inline void hd_wr16( uint32_t a, uint16_t v ) {
+    memcpy( klesisim_host_mem() + a, &v, 2 );
+}
+
+static inline uint32_t hd_rd32( uint32_t a ) {
+    uint32_t v;
+    memcpy( &v, klesisim_host_mem() + a, 4 );
+    return v;
+}
+
+static inline void hd_wr32( uint32_t a, uint32_t v ) {
+    memcpy( klesisim_host_mem() + a, &v, 4 );
+}
+
+/**
+ * Interrupt service routine: acknowledge the ring transition words.
+ */
+static void hd_intr( uint16_t vector ) {
+    hd.stats.interrupts++;
+    if ( hd.state == HD_RUN ) {
+        hd_wr16( hd.ringbase - 4, 0 );
+        hd_wr16( hd.ringbase - 2, 0 );
+    }
+}
+
+/**
+ * Set up the driver model.
+ * @param cring_log2 Log2 of the number of command ring slots.
+ * @param rring_log2 Log2 of the number of response ring slots.
+ * @param vector     Interrupt vector, 0 to run without interrupts.
+ */
+void hostdrv_setup( int cring_log2, int rring_log2, uint16_t vector ) {
+    memset( &hd, 0, sizeof hd );
+    hd.clog2    = cring_log2;
+    hd.rlog2    = rring_log2;
+    hd.csize    = 1 << cring_log2;
+    hd.rsize    = 1 << rring_log2;
+    hd.vector   = vector;
+    hd.ringbase = HD_COMM_BASE + sizeof(hostif_cahdr_t);
+    hd.rring    = hd.ringbase;
+    hd.cring    = hd.ringbase + 4 * hd.rsize;
+    hd.cpkt     = HD_PKT_BASE;
+    hd.rpkt     = HD_PKT_BASE + hd.csize * HD_PKT_SIZE;
+    hd.brk      = HD_DATA_BASE;
+    klesisim_host_intr_cb( hd_intr );
+}
+
+/**
+ * Initialize the port by writing IP.
+ */
+void hostdrv_start( void ) {
+    hd.state   = HD_STEP1;
+    hd.last_sa = 0;
+    hd.cidx    = 0;
+    hd.ridx    = 0;
+    klesisim_host_write_ip();
+}
+
+/**
+ * Returns non-zero once the port has been told to GO.
+ */
+int hostdrv_online( void ) {
+    return hd.state == HD_RUN;
+}
+
+/**
+ * Give a response slot to the port.
+ */
+static void hd_give_rsp( int idx ) {
+    uint32_t buf = hd.rpkt + idx * HD_PKT_SIZE;
+
+    memset( klesisim_host_mem() + buf, 0, HD_PKT_SIZE );
+    hd_wr16( buf, HD_PKT_MSGLEN );
+    hd_wr32( hd.rring + 4 * idx, MSCP_DESC_OWNER | MSCP_DESC_FLAG | (buf + 4) );
+}
+
+/**
+ * Run the host side of the init sequence. This is called from the main
+ * loop and from app_idle(), as the port waits for the host in the SA
+ * handshake.
+ */
+void hostdrv_poll( void ) {
+    uint16_t sa;
+    int i;
+
+    if ( hd.state == HD_RUN || hd.state == 0 )
+        return;
+
+    /* Until the port moves on, SA reads back what we wrote */
+    sa = klesisim_host_read_sa();
+    if ( sa == hd.last_sa )
+        return;
+
+    if ( sa & SA_ERROR ) {
+        fprintf( stderr, "hostdrv: port reported fatal error %06o\n", sa );
+        exit( 1 );
+    }
+
+    switch ( hd.state ) {
+        case HD_STEP1:
+            if ( (sa & SA_INIT_STEP_MASK) != SA_INIT1_STEP )
+                return;
+            sa  = 0x8000;
+            sa |= (hd.clog2 << SA_INIT1W_CRING_BIT) & SA_INIT1W_CRING_MASK;
+            sa |= (hd.rlog2 << SA_INIT1W_RRING_BIT) & SA_INIT1W_RRING_MASK;
+            sa |= (hd.vector / 4) & SA_INIT1W_VADR_MASK;
+            if ( hd.vector )
+                sa |= SA_INIT1W_IE;
+            break;
+        case HD_STEP2:
+            if ( (sa & SA_INIT_STEP_MASK) != SA_INIT2_STEP )
+                return;
+            sa = hd.ringbase & SA_INIT2W_RINGBASE_MASK;
+            break;
+        case HD_STEP3:
+            if ( (sa & SA_INIT_STEP_MASK) != SA_INIT3_STEP )
+                return;
+            sa = (hd.ringbase >> 16) & SA_INIT3W_HRBASE_MASK;
+            break;
+        case HD_STEP4:
+            if ( (sa & SA_INIT_STEP_MASK) != SA_INIT4_STEP )
+                return;
+            /* The port cleared the rings, fill the response ring */
+            for ( i = 0; i < hd.rsize; i++ )
+                hd_give_rsp( i );
+            sa = SA_INIT4W_GO;
+            break;
+    }
+
+    klesisim_host_write_sa( sa );
+    hd.last_sa = sa;
+    hd.state++;
+}
+
+/**
+ * Post a command message and make the port poll for it.
+ * @param msg Message text, without envelope.
+ * @param len Message length in bytes, at most HD_PKT_MSGLEN.
+ * @return 0 on success, -1 if the command ring is full.
+ */
+int hostdrv_submit( const void *msg, int len ) {
+    uint32_t desc = hd.cring + 4 * hd.cidx;
+    uint32_t buf  = hd.cpkt  + hd.cidx * HD_PKT_SIZE;
+
+    if ( hd_rd32( desc ) & MSCP_DESC_OWNER ) {
+        hd.stats.ring_full++;
+        return -1;
+    }
+
+    memset( klesisim_host_mem() + buf, 0, HD_PKT_SIZE );
+    hd_wr16( buf, len );
+    memcpy( klesisim_host_mem() + buf + 4, msg, len );
+    hd_wr32( desc, MSCP_DESC_OWNER | MSCP_DESC_FLAG | (buf + 4) );
+    hd.cidx = (hd.cidx + 1) & (hd.csize - 1);
+    hd.stats.commands++;
+
+    klesisim_host_read_ip();
+    return 0;
+}
+
+/**
+ * Collect the responses the port has placed in the response ring and
+ * hand their slots back to the port.
+ * @param cb  Called for every response.
+ * @param ctx Passed to cb.
+ * @return The number of responses collected.
+ */
+int hostdrv_reap( hostdrv_rsp_cb_t cb, void *ctx ) {
+    uint32_t buf;
+    int n = 0;
+
+    if ( hd.state != HD_RUN )
+        return 0;
+
+    while ( !(hd_rd32( hd.rring + 4 * hd.ridx ) & MSCP_DESC_OWNER) ) {
+        buf = hd.rpkt + hd.ridx * HD_PKT_SIZE;
+        if ( cb )
+            cb( klesisim_host_mem() + buf + 4, hd_rd16( buf ), ctx );
+        hd_give_rsp( hd.ridx );
+        hd.ridx = (hd.ridx + 1) & (hd.rsize - 1);
+        hd.stats.responses++;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Allocate a data buffer in host memory.
+ * @param size Size in bytes.
+ * @return The host bus address of the buffer.
+ */
+uint32_t hostdrv_alloc( uint32_t size ) {
+    uint32_t a = hd.brk;
+
+    hd.brk = (hd.brk + size + 15) & ~15u;
+    if ( hd.brk > klesisim_host_memsize() ) {
+        fprintf( stderr, "hostdrv: out of host memory\n" );
+        exit( 1 );
+    }
+    return a;
+}
+
+/**
+ * Returns the driver statistics.
+ */
+const hostdrv_stats_t *hostdrv_stats( void ) {
+    return &hd.stats;
+}
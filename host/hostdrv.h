@@ -0,0 +1,30 @@
+/**
+ * @file host/hostdrv.h
+ *
+ * Interface to the model of the host's MSCP port driver.
+ */
+#ifndef _HOSTDRV_H_
+#define _HOSTDRV_H_
+
+#include <stdint.h>
+
+typedef struct hostdrv_stats {
+    unsigned long commands;
+    unsigned long responses;
+    unsigned long interrupts;
+    unsigned long ring_full;
+} hostdrv_stats_t;
+
+/** Receives a response message, len is the envelope message length */
+typedef void (*hostdrv_rsp_cb_t)( const uint8_t *msg, int len, void *ctx );
+
+void     hostdrv_setup ( int cring_log2, int rring_log2, uint16_t vector );
+void     hostdrv_start ( void );
+int      hostdrv_online( void );
+void     hostdrv_poll  ( void );
+int      hostdrv_submit( const void *msg, int len );
+int      hostdrv_reap  ( hostdrv_rsp_cb_t cb, void *ctx );
+uint32_t hostdrv_alloc ( uint32_t size );
+const hostdrv_stats_t *hostdrv_stats( void );
+
+#endif
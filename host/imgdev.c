@@ -0,0 +1,257 @@
+/**
+ * @file host/imgdev.c
+ *
+ * This file implements a block device backend on a disk image file, so
+ * the block unit driver can serve a unit from a file on a Linux machine.
+ *
+ * Requests are queued by submit and run as one batch from poll, like the
+ * submission and completion rings of io_uring but with plain preadv and
+ * pwritev. Requests in a batch that continue each other in the same
+ * direction are joined into a single system call. Every request of the
+ * batch completes before poll returns; requests the driver submits from
+ * the completion callback go in the next batch.
+ *
+ * With imgdev_timing() a batch instead takes a fixed time per system
+ * call plus a time per byte, on the wall clock, before it runs, and the
+ * next one starts after it. This models a slow device such as a USB
+ * stick on a file, e.g. to see several of them striped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <pico/time.h>
+
+#include "error.h"
+#include "host/imgdev.h"
+
+typedef struct imgdev {
+    blkdev_t     dev;
+    int          fd;
+    uint16_t     blksize;
+    uint32_t     blkcount;
+
+    /* Requests waiting for the next batch */
+    blkdev_io_t *q_head;
+    blkdev_io_t *q_tail;
+    int          q_count;
+
+    /* Scratch for joining requests, qdepth entries */
+    struct iovec *iov;
+
+    /* Timing, and the batch waiting for its time to pass */
+    uint32_t     cmd_us;
+    uint32_t     ns_per_byte;
+    blkdev_io_t *b_head;
+    uint64_t     done_at;
+
+    const uint8_t *map;
+} imgdev_t;
+
+static int imgdev_submit( blkdev_t *dev, blkdev_io_t *io ) {
+    imgdev_t *img = dev->priv;
+
+    if ( img->q_count == dev->qdepth )
+        return ERR_BUSY;
+    io->next = NULL;
+    if ( img->q_tail )
+        img->q_tail->next = io;
+    else
+        img->q_head = io;
+    img->q_tail = io;
+    img->q_count++;
+    return ERR_OK;
+}
+
+/**
+ * Move a run of requests between the image and their buffers.
+ * @return ERR_OK, or ERR_MEDIA if the image could not be read or written
+ */
+static int imgdev_xfer( imgdev_t *img, int write, uint32_t lba, struct iovec *iov, int niov ) {
+    off_t pos = (off_t) lba * img->blksize;
+    ssize_t n;
+
+    while ( niov > 0 ) {
+        if ( write )
+            n = pwritev( img->fd, iov, niov, pos );
+        else
+            n = preadv( img->fd, iov, niov, pos );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return ERR_MEDIA;
+        pos += n;
+        while ( niov > 0 && (size_t) n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if ( niov > 0 ) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return ERR_OK;
+}
+
+/**
+ * Time a batch takes with the timing set: a system call for every run
+ * of requests that continue each other, plus the bytes.
+ */
+static uint64_t imgdev_cost( imgdev_t *img, blkdev_io_t *io ) {
+    uint64_t ns = 0;
+    blkdev_io_t *prev = NULL;
+
+    for ( ; io != NULL; prev = io, io = io->next ) {
+        if ( prev == NULL || io->write != prev->write || io->lba != prev->lba + prev->count )
+            ns += img->cmd_us * 1000ull;
+        ns += (uint64_t) io->count * img->blksize * img->ns_per_byte;
+    }
+    return ns / 1000;
+}
+
+/**
+ * Run the queued batch and complete its requests. With the timing set,
+ * the batch first waits for its time.
+ */
+static void imgdev_poll( blkdev_t *dev ) {
+    imgdev_t *img = dev->priv;
+    blkdev_io_t *io, *first, *next;
+    uint32_t end;
+    int niov, status;
+
+    if ( img->cmd_us || img->ns_per_byte ) {
+        if ( img->b_head == NULL ) {
+            if ( img->q_head == NULL )
+                return;
+            img->b_head  = img->q_head;
+            img->q_head  = img->q_tail = NULL;
+            img->q_count = 0;
+            img->done_at = time_us_64() + imgdev_cost( img, img->b_head );
+        }
+        if ( time_us_64() < img->done_at )
+            return;
+        io = img->b_head;
+        img->b_head = NULL;
+    } else {
+        io = img->q_head;
+        img->q_head  = img->q_tail = NULL;
+        img->q_count = 0;
+    }
+
+    while ( io != NULL ) {
+        first = io;
+        end   = io->lba;
+        niov  = 0;
+        do {
+            img->iov[niov].iov_base = io->buf;
+            img->iov[niov].iov_len  = (size_t) io->count * img->blksize;
+            niov++;
+            end += io->count;
+            io = io->next;
+        } while ( io != NULL && io->write == first->write && io->lba == end );
+
+        if ( end > img->blkcount )
+            status = ERR_MEDIA;
+        else
+            status = imgdev_xfer( img, first->write, first->lba, img->iov, niov );
+
+        for ( ; first != io; first = next ) {
+            next = first->next;
+            blkdev_complete( dev, first, status );
+        }
+    }
+}
+
+static void imgdev_geometry( blkdev_t *dev, uint32_t *blkcount, uint16_t *blksize ) {
+    imgdev_t *img = dev->priv;
+
+    *blkcount = img->blkcount;
+    *blksize  = img->blksize;
+}
+
+static const blkdev_ops_t imgdev_ops = {
+    .name     = "image",
+    .submit   = imgdev_submit,
+    .poll     = imgdev_poll,
+    .geometry = imgdev_geometry,
+};
+
+/**
+ * Open a disk image, creating it or growing it to hold blkcount blocks.
+ * @param path     The image file
+ * @param blksize  Block size in bytes
+ * @param blkcount Number of blocks, 0 to use the size of the file
+ * @param qdepth   Requests accepted per batch
+ * @return The device, or NULL on error
+ */
+blkdev_t *imgdev_open( const char *path, uint16_t blksize, uint32_t blkcount, int qdepth ) {
+    imgdev_t *img;
+    struct stat st;
+    int fd;
+
+    fd = open( path, O_RDWR | O_CREAT, 0644 );
+    if ( fd < 0 || fstat( fd, &st ) < 0 ) {
+        perror( path );
+        return NULL;
+    }
+    if ( blkcount == 0 )
+        blkcount = st.st_size / blksize;
+    else if ( st.st_size < (off_t) blkcount * blksize &&
+              ftruncate( fd, (off_t) blkcount * blksize ) < 0 ) {
+        perror( path );
+        close( fd );
+        return NULL;
+    }
+
+    img = calloc( 1, sizeof(imgdev_t) );
+    if ( img == NULL || (img->iov = calloc( qdepth, sizeof(struct iovec) )) == NULL ) {
+        free( img );
+        close( fd );
+        return NULL;
+    }
+    img->fd         = fd;
+    img->blksize    = blksize;
+    img->blkcount   = blkcount;
+    img->dev.ops    = &imgdev_ops;
+    img->dev.qdepth = qdepth;
+    img->dev.priv   = img;
+    return &img->dev;
+}
+
+/**
+ * Make the image as slow as a real device. Each batch takes a fixed time
+ * per system call it needs plus a time per byte.
+ * @param dev         The image
+ * @param cmd_us      Fixed time per system call, in microseconds
+ * @param ns_per_byte Transfer time per byte, in nanoseconds
+ */
+void imgdev_timing( blkdev_t *dev, uint32_t cmd_us, uint32_t ns_per_byte ) {
+    imgdev_t *img = dev->priv;
+
+    img->cmd_us      = cmd_us;
+    img->ns_per_byte = ns_per_byte;
+}
+
+/**
+ * Map the image read-only, to check what the unit stored in it.
+ * @return The contents of the image, or NULL on error
+ */
+const uint8_t *imgdev_map( blkdev_t *dev ) {
+    imgdev_t *img = dev->priv;
+    void *p;
+
+    if ( img->map == NULL ) {
+        p = mmap( NULL, (size_t) img->blkcount * img->blksize, PROT_READ,
+            MAP_SHARED, img->fd, 0 );
+        if ( p != MAP_FAILED )
+            img->map = p;
+    }
+    return img->map;
+}
@@ -0,0 +1,16 @@
+/**
+ * @file host/imgdev.h
+ *
+ * Interface to the disk image backend of the block unit driver.
+ */
+#ifndef _IMGDEV_H_
+#define _IMGDEV_H_
+
+#include <stdint.h>
+#include "driver/blkdev.h"
+
+blkdev_t      *imgdev_open  ( const char *path, uint16_t blksize, uint32_t blkcount, int qdepth );
+void           imgdev_timing( blkdev_t *dev, uint32_t cmd_us, uint32_t ns_per_byte );
+const uint8_t *imgdev_map   ( blkdev_t *dev );
+
+#endif
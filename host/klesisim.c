@@ -0,0 +1,408 @@
+/**
+ * @file host/klesisim.c
+ *
+ * This file implements a simulated KLESI adapter for host builds. It
+ * works at the level of LESI bus cycles: the bus front ends call in on
+ * every STROBE and sample the value the adapter drives onto C/D, so the
+ * unmodified lesi/klesi.c and lesi/npr.c code can run against it.
+ *
+ * The model covers the command register, the word counter, the 16 word
+ * scratchpad RAM, the host address registers and the status register,
+ * NPR transfers to and from a simulated host memory, interrupts and the
+ * SA register handshake. The host side entry points stand in for the
+ * host CPU accessing the IP and SA registers of the adapter.
+ *
+ * Simplifications:
+ *    * NPR transfers and interrupts complete instantly, T1 only
+ *      deasserts while the adapter waits for the host to write SA.
+ *    * Error bits in the status register stay set until it is read.
+ *    * After an interrupt with SA enabled the host write is stored in
+ *      both scratchpad location 0 and 1, as the controller code reads
+ *      either one depending on the init step.
+ *
+ * This file also provides the control signals that lesi/lowlevel.c
+ * drives on the board, and lesi_sim_transport, which connects the lesi_
+ * API straight to the model without going through a bus front end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lesi/lesi.h"
+#include "host/klesisim.h"
+
+void app_idle();
+
+static struct {
+    /* Adapter registers */
+    uint16_t cmd;
+    int      wc;
+    uint16_t ram[16];
+    uint32_t ua;
+    uint16_t sr;
+    int      ident;
+
+    /* SA handshake: 0 = disabled, 1 = enabled, 2 = enabled by interrupt */
+    int      sa_mode;
+    int      t1;
+    int      init;
+
+    /* Host side */
+    uint8_t *mem;
+    uint32_t memsize;
+    klesisim_intr_cb_t intr_cb;
+
+    klesisim_stats_t stats;
+} ks;
+
+volatile int saw_init = 0;
+
+/**
+ * Create the simulated adapter and its host memory.
+ * @param ident   The LESI_SR_IDENT_ value to report in the status register.
+ * @param memsize Size of the host memory in bytes.
+ */
+void klesisim_setup( int ident, uint32_t memsize ) {
+    free( ks.mem );
+    memset( &ks, 0, sizeof ks );
+    ks.ident   = ident & LESI_SR_IDENT_MASK;
+    ks.memsize = memsize;
+    ks.mem     = calloc( 1, memsize );
+    if ( ks.mem == NULL ) {
+        fprintf( stderr, "klesisim: could not allocate host memory\n" );
+        exit( 1 );
+    }
+    klesisim_reset();
+}
+
+/**
+ * AC CLEAR the simulated adapter. Host memory and statistics are kept.
+ */
+void klesisim_reset( void ) {
+    ks.cmd     = 0;
+    ks.wc      = 0;
+    ks.ua      = 0;
+    ks.sa_mode = 0;
+    ks.t1      = 1;
+    memset( ks.ram, 0, sizeof ks.ram );
+    ks.sr = ks.ident;
+    if ( ks.ident == LESI_SR_IDENT_QBUS )
+        ks.sr |= LESI_SR_PURGED;
+}
+
+/**
+ * Returns the adapter statistics.
+ */
+const klesisim_stats_t *klesisim_stats( void ) {
+    return &ks.stats;
+}
+
+/**
+ * Move words between host memory and the scratchpad, starting at the
+ * word counter and ending at the last scratchpad location.
+ * @param out Non-zero to move data from the scratchpad to host memory.
+ */
+static void klesisim_npr( int out ) {
+    int i;
+
+    ks.stats.nprs++;
+    for ( i = ks.wc; i < 16; i++ ) {
+        if ( ks.ua + 2 > ks.memsize ) {
+            ks.sr |= LESI_SR_NXM;
+        } else if ( out ) {
+            memcpy( ks.mem + ks.ua, &ks.ram[i], 2 );
+            ks.stats.npr_words_out++;
+        } else {
+            memcpy( &ks.ram[i], ks.mem + ks.ua, 2 );
+            ks.stats.npr_words_in++;
+        }
+        ks.ua = (ks.ua + 2) & 0x3FFFFF;
+    }
+}
+
+/**
+ * Execute a command cycle.
+ */
+static void klesisim_command( uint16_t data ) {
+    ks.cmd = data;
+    ks.wc  = LESI_CMD_WORDCNT( data );
+    if ( data & LESI_CMD_CLEAR_WC )
+        ks.wc = 0;
+
+    if ( data & LESI_CMD_SA ) {
+        ks.sa_mode = (data & LESI_CMD_DO_INTR) ? 2 : 1;
+        ks.t1 = 0;
+    } else {
+        ks.sa_mode = 0;
+        ks.t1 = 1;
+    }
+
+    if ( data & LESI_CMD_DO_NPR )
+        klesisim_npr( data & LESI_CMD_WRITE );
+
+    if ( data & LESI_CMD_DO_INTR ) {
+        ks.stats.interrupts++;
+        if ( ks.intr_cb )
+            ks.intr_cb( ks.ram[ks.sa_mode ? 1 : 0] );
+    }
+}
+
+/**
+ * A write cycle was strobed into the adapter.
+ * @param data  The value on C/D.
+ * @param cmd   Whether COMMAND was asserted.
+ * @param parok Whether the parity bits matched the data.
+ */
+void klesisim_write( uint16_t data, int cmd, int parok ) {
+    if ( !parok )
+        ks.sr |= LESI_SR_LESI_PE;
+
+    if ( cmd ) {
+        ks.stats.cmd_cycles++;
+        klesisim_command( data );
+        return;
+    }
+
+    ks.stats.data_cycles++;
+    if ( ~ks.cmd & LESI_CMD_WRITE )
+        return;
+
+    switch ( LESI_CMD_REGSEL_R( ks.cmd ) ) {
+        case LESI_REG_RAM:
+            ks.ram[ks.wc] = data;
+            ks.wc = (ks.wc + 1) & 15;
+            break;
+        case LESI_REG_UAL:
+            ks.stats.ua_writes++;
+            ks.ua = (ks.ua & 0x3F0000) | data;
+            break;
+        case LESI_REG_UAH:
+            ks.stats.ua_writes++;
+            ks.ua = (ks.ua & 0xFFFF) | ((uint32_t) (data & 0x3F) << 16);
+            break;
+    }
+}
+
+/**
+ * Returns the value the adapter currently drives onto C/D.
+ */
+uint16_t klesisim_read( void ) {
+    uint16_t v;
+
+    ks.stats.read_cycles++;
+    switch ( LESI_CMD_REGSEL_R( ks.cmd ) ) {
+        case LESI_REG_RAM:
+            return ks.ram[ks.wc];
+        case LESI_REG_STATUS:
+            v = ks.sr;
+            ks.sr &= ~(LESI_SR_BUS_PE | LESI_SR_LESI_PE | LESI_SR_NXM);
+            return v;
+        case LESI_REG_CLEAR_POLL:
+            v = ks.sr;
+            ks.sr &= ~LESI_SR_POLL;
+            return v;
+        case LESI_REG_CLEAR_PURGED:
+            v = ks.sr;
+            if ( ks.ident != LESI_SR_IDENT_QBUS )
+                ks.sr &= ~LESI_SR_PURGED;
+            return v;
+    }
+    return 0;
+}
+
+/**
+ * A read strobe was issued: advance to the next scratchpad word.
+ */
+void klesisim_strobe( void ) {
+    ks.stats.strobe_cycles++;
+    if ( LESI_CMD_REGSEL_R( ks.cmd ) == LESI_REG_RAM )
+        ks.wc = (ks.wc + 1) & 15;
+}
+
+/**
+ * Returns the level of T1, set when the adapter is ready.
+ */
+int klesisim_t1( void ) {
+    return ks.t1;
+}
+
+/**
+ * Returns non-zero once for every INIT the host requested.
+ */
+int klesisim_init( void ) {
+    int v = ks.init;
+    ks.init = 0;
+    return v;
+}
+
+/**
+ * Returns a pointer to the simulated host memory.
+ */
+uint8_t *klesisim_host_mem( void ) {
+    return ks.mem;
+}
+
+/**
+ * Returns the size of the simulated host memory.
+ */
+uint32_t klesisim_host_memsize( void ) {
+    return ks.memsize;
+}
+
+/**
+ * The host read the SA register.
+ */
+uint16_t klesisim_host_read_sa( void ) {
+    return ks.sa_mode ? ks.ram[0] : 0;
+}
+
+/**
+ * The host wrote the SA register. Outside of the SA handshake this is a
+ * purge on UNIBUS adapters.
+ */
+void klesisim_host_write_sa( uint16_t data ) {
+    if ( !ks.sa_mode ) {
+        ks.sr |= LESI_SR_PURGED;
+        return;
+    }
+    ks.ram[0] = data;
+    if ( ks.sa_mode == 2 )
+        ks.ram[1] = data;
+    ks.t1 = 1;
+}
+
+/**
+ * The host read the IP register, which starts polling.
+ */
+void klesisim_host_read_ip( void ) {
+    ks.sr |= LESI_SR_POLL;
+}
+
+/**
+ * The host wrote the IP register, which initializes the port.
+ */
+void klesisim_host_write_ip( void ) {
+    ks.init = 1;
+}
+
+/**
+ * Register the routine that receives interrupts from the adapter.
+ */
+void klesisim_host_intr_cb( klesisim_intr_cb_t cb ) {
+    ks.intr_cb = cb;
+}
+
+/* Control signals, these are plain GPIO in lesi/lowlevel.c */
+
+static int klesisim_poll_init( void ) {
+    if ( klesisim_init() )
+        saw_init = 1;
+    return saw_init;
+}
+
+void lesi_ctl_setup() {
+    saw_init = 0;
+}
+
+void lesi_ctl_set_pwrgood( int good ) {
+    (void) good;
+}
+
+void lesi_ctl_reset_klesi() {
+    klesisim_reset();
+}
+
+void lesi_ctl_clear_init() {
+    klesisim_init();
+    saw_init = 0;
+}
+
+int lesi_ctl_check_init() {
+    return klesisim_poll_init();
+}
+
+/* The model changes T1 as soon as a cycle is strobed, so there are no */
+/* edges to count and no settle time to wait out                       */
+
+void lesi_ctl_t1_arm( void ) {
+}
+
+int lesi_ctl_t1_ready( void ) {
+    return klesisim_t1();
+}
+
+int lesi_ctl_t1_busy( void ) {
+    return !klesisim_t1();
+}
+
+uint32_t lesi_ctl_t1_elapsed( void ) {
+    return 0;
+}
+
+/* Direct transport into the model */
+
+static int lesi_sim_write( uint16_t data, int cmd ) {
+    if ( klesisim_poll_init() )
+        return ERR_INIT;
+    klesisim_write( data, cmd, 1 );
+    return ERR_OK;
+}
+
+static int lesi_sim_read( uint16_t *data ) {
+    if ( klesisim_poll_init() )
+        return ERR_INIT;
+    *data = klesisim_read();
+    return ERR_OK;
+}
+
+static int lesi_sim_wait_ready() {
+    while ( !klesisim_t1() ) {
+        if ( klesisim_poll_init() )
+            return ERR_INIT;
+        app_idle();
+    }
+    return ERR_OK;
+}
+
+static int lesi_sim_wait_busy() {
+    while ( klesisim_t1() ) {
+        if ( klesisim_poll_init() )
+            return ERR_INIT;
+        app_idle();
+    }
+    return ERR_OK;
+}
+
+static int lesi_sim_ready_poll() {
+    if ( klesisim_poll_init() )
+        return ERR_INIT;
+    return klesisim_t1() ? ERR_OK : ERR_BUSY;
+}
+
+static int lesi_sim_read_strobe( int waitxfer ) {
+    int status;
+
+    if ( klesisim_poll_init() )
+        return ERR_INIT;
+    if ( waitxfer ) {
+        status = lesi_sim_wait_ready();
+        if ( status )
+            return status;
+    }
+    klesisim_strobe();
+    return ERR_OK;
+}
+
+const lesi_transport_t lesi_sim_transport = {
+    .name        = "sim",
+    .setup       = lesi_ctl_setup,
+    .write       = lesi_sim_write,
+    .read        = lesi_sim_read,
+    .read_strobe = lesi_sim_read_strobe,
+    .wait_ready  = lesi_sim_wait_ready,
+    .wait_busy   = lesi_sim_wait_busy,
+    .ready_poll  = lesi_sim_ready_poll,
+    .set_pwrgood = lesi_ctl_set_pwrgood,
+    .reset_klesi = lesi_ctl_reset_klesi,
+    .clear_init  = lesi_ctl_clear_init,
+    .check_init  = lesi_ctl_check_init,
+};
@@ -0,0 +1,49 @@
+/**
+ * @file host/klesisim.h
+ *
+ * Interface to the simulated KLESI adapter used by host builds.
+ */
+#ifndef _KLESISIM_H_
+#define _KLESISIM_H_
+
+#include <stdint.h>
+
+typedef struct klesisim_stats {
+    unsigned long cmd_cycles;
+    unsigned long data_cycles;
+    unsigned long read_cycles;
+    unsigned long strobe_cycles;
+    /** Writes to the UAL and UAH registers */
+    unsigned long ua_writes;
+    unsigned long nprs;
+    /** Words moved from host memory into the scratchpad */
+    unsigned long npr_words_in;
+    /** Words moved from the scratchpad into host memory */
+    unsigned long npr_words_out;
+    unsigned long interrupts;
+} klesisim_stats_t;
+
+/** Called when the adapter interrupts the host, must not write SA */
+typedef void (*klesisim_intr_cb_t)( uint16_t vector );
+
+void     klesisim_setup ( int ident, uint32_t memsize );
+void     klesisim_reset ( void );
+const klesisim_stats_t *klesisim_stats( void );
+
+/* Bus side, called by the LESI cycle front ends */
+void     klesisim_write ( uint16_t data, int cmd, int parok );
+uint16_t klesisim_read  ( void );
+void     klesisim_strobe( void );
+int      klesisim_t1    ( void );
+int      klesisim_init  ( void );
+
+/* Host side, called by the model of the host driver */
+uint8_t *klesisim_host_mem     ( void );
+uint32_t klesisim_host_memsize ( void );
+uint16_t klesisim_host_read_sa ( void );
+void     klesisim_host_write_sa( uint16_t data );
+void     klesisim_host_read_ip ( void );
+void     klesisim_host_write_ip( void );
+void     klesisim_host_intr_cb ( klesisim_intr_cb_t cb );
+
+#endif
@@ -0,0 +1,198 @@
+/**
+ * @file host/mkfatimg.c
+ *
+ * Creates a FAT32 volume holding disk image files, to try the FAT image
+ * backend (driver/fatvol.c) with simdrive -F on a machine without FAT
+ * tools. The volume sits in the first partition of an MBR, or fills the
+ * file with -n. Clusters are one block, so the volume is at least 32 MB;
+ * the file is sparse.
+ *
+ * Usage: mkfatimg [-n] [-f clusters] volume name.ext:blocks ...
+ *    -n   No partition table, the volume starts at block 0.
+ *    -f   Fragment the images: hand out clusters to them in turn, this
+ *         many at a time, instead of storing each one contiguously.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#define MKFAT_PART_LBA  (2048)
+#define MKFAT_RSVD      (32)
+#define MKFAT_MIN_CLUS  (66000)
+#define MKFAT_MAX_FILES (15)
+
+typedef struct mkfat_file {
+    char     name[11];
+    uint32_t blocks;
+    uint32_t first;
+    uint32_t last;
+    uint32_t left;
+} mkfat_file_t;
+
+static void wr16( uint8_t *p, uint16_t v ) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void wr32( uint8_t *p, uint32_t v ) {
+    wr16( p, v );
+    wr16( p + 2, v >> 16 );
+}
+
+static void wrblk( int fd, uint32_t lba, const void *buf, size_t len ) {
+    if ( pwrite( fd, buf, len, (off_t) lba * 512 ) != (ssize_t) len ) {
+        perror( "mkfatimg" );
+        exit( 1 );
+    }
+}
+
+/**
+ * Parse name.ext:blocks into an 8.3 directory name and a size.
+ */
+static int mkfat_parse( const char *arg, mkfat_file_t *f ) {
+    const char *dot = strchr( arg, '.' ), *colon = strchr( arg, ':' );
+    int i;
+
+    if ( dot == NULL || colon == NULL || dot > colon ||
+         dot - arg > 8 || colon - dot - 1 > 3 || dot == arg )
+        return 0;
+    memset( f, 0, sizeof *f );
+    memset( f->name, ' ', 11 );
+    for ( i = 0; arg + i < dot; i++ )
+        f->name[i] = toupper( (unsigned char) arg[i] );
+    for ( i = 0; dot + 1 + i < colon; i++ )
+        f->name[8 + i] = toupper( (unsigned char) dot[1 + i] );
+    f->blocks = strtoul( colon + 1, NULL, 0 );
+    f->left   = f->blocks;
+    return f->blocks > 0;
+}
+
+int main( int argc, char **argv ) {
+    mkfat_file_t files[MKFAT_MAX_FILES];
+    uint8_t sec[512], *dir;
+    uint32_t *fat, part, nclus, fatsz, total, need = 0, next, run;
+    int nfiles = 0, frag = 0, nopart = 0, fd, i, c, n;
+
+    while ( (c = getopt( argc, argv, "nf:" )) != -1 ) {
+        switch ( c ) {
+            case 'n': nopart = 1; break;
+            case 'f': frag = atoi( optarg ); break;
+            default:
+                fprintf( stderr, "Usage: %s [-n] [-f clusters] volume name.ext:blocks ...\n", argv[0] );
+                return 2;
+        }
+    }
+    if ( optind + 1 >= argc || argc - optind - 1 > MKFAT_MAX_FILES ) {
+        fprintf( stderr, "Usage: %s [-n] [-f clusters] volume name.ext:blocks ...\n", argv[0] );
+        return 2;
+    }
+    for ( i = optind + 1; i < argc; i++ ) {
+        if ( !mkfat_parse( argv[i], files + nfiles ) ) {
+            fprintf( stderr, "mkfatimg: bad file %s\n", argv[i] );
+            return 2;
+        }
+        need += files[nfiles++].blocks;
+    }
+
+    /* One cluster of root directory, then the files */
+    part  = nopart ? 0 : MKFAT_PART_LBA;
+    nclus = need + 1 < MKFAT_MIN_CLUS ? MKFAT_MIN_CLUS : need + 1 + 1024;
+    fatsz = ((nclus + 2) * 4 + 511) / 512;
+    total = MKFAT_RSVD + 2 * fatsz + nclus;
+
+    fat = calloc( fatsz * 128, 4 );
+    dir = calloc( 1, 512 );
+    if ( fat == NULL || dir == NULL )
+        return 1;
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = 0x0FFFFFFF;
+    fat[2] = 0x0FFFFFFF;
+
+    /* Hand out clusters from 3 on, to one file at a time or in turns */
+    next = 3;
+    for ( n = 0; n < nfiles; ) {
+        for ( i = 0, n = 0; i < nfiles; i++ ) {
+            if ( files[i].left == 0 ) {
+                n++;
+                continue;
+            }
+            run = frag ? (uint32_t) frag : files[i].left;
+            if ( run > files[i].left )
+                run = files[i].left;
+            for ( ; run; run--, files[i].left--, next++ ) {
+                if ( files[i].first == 0 )
+                    files[i].first = next;
+                else
+                    fat[files[i].last] = next;
+                files[i].last = next;
+                fat[next] = 0x0FFFFFFF;
+            }
+        }
+    }
+
+    fd = open( argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 || ftruncate( fd, (off_t) (part + total) * 512 ) < 0 ) {
+        perror( argv[optind] );
+        return 1;
+    }
+
+    if ( !nopart ) {
+        memset( sec, 0, 512 );
+        sec[446 + 4] = 0x0C;
+        wr32( sec + 446 + 8,  part );
+        wr32( sec + 446 + 12, total );
+        wr16( sec + 510, 0xAA55 );
+        wrblk( fd, 0, sec, 512 );
+    }
+
+    memset( sec, 0, 512 );
+    memcpy( sec, "\xEB\x58\x90" "LESIDRV ", 11 );
+    wr16( sec + 11, 512 );
+    sec[13] = 1;
+    wr16( sec + 14, MKFAT_RSVD );
+    sec[16] = 2;
+    sec[21] = 0xF8;
+    wr16( sec + 24, 32 );
+    wr16( sec + 26, 64 );
+    wr32( sec + 28, part );
+    wr32( sec + 32, total );
+    wr32( sec + 36, fatsz );
+    wr32( sec + 44, 2 );
+    wr16( sec + 48, 1 );
+    sec[64] = 0x80;
+    sec[66] = 0x29;
+    wr32( sec + 67, 0x4C455349 );
+    memcpy( sec + 71, "LESIDRIVE  FAT32   ", 19 );
+    wr16( sec + 510, 0xAA55 );
+    wrblk( fd, part, sec, 512 );
+
+    /* FSInfo, free cluster count unknown */
+    memset( sec, 0, 512 );
+    wr32( sec, 0x41615252 );
+    wr32( sec + 484, 0x61417272 );
+    wr32( sec + 488, 0xFFFFFFFF );
+    wr32( sec + 492, next );
+    wr16( sec + 510, 0xAA55 );
+    wrblk( fd, part + 1, sec, 512 );
+
+    wrblk( fd, part + MKFAT_RSVD, fat, (size_t) fatsz * 512 );
+    wrblk( fd, part + MKFAT_RSVD + fatsz, fat, (size_t) fatsz * 512 );
+
+    for ( i = 0; i < nfiles; i++ ) {
+        memcpy( dir + i * 32, files[i].name, 11 );
+        dir[i * 32 + 11] = 0x20;
+        wr16( dir + i * 32 + 20, files[i].first >> 16 );
+        wr16( dir + i * 32 + 26, files[i].first );
+        wr32( dir + i * 32 + 28, files[i].blocks * 512 );
+    }
+    wrblk( fd, part + MKFAT_RSVD + 2 * fatsz, dir, 512 );
+
+    close( fd );
+    printf("%s: %u clusters, %i files, %s\n", argv[optind], (unsigned) nclus, nfiles,
+        frag ? "fragmented" : "contiguous" );
+    return 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file host/multicore.c
+ *
+ * Spin locks and the second core of the RP2040 on POSIX threads, see
+ * host/compat/hardware/sync.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+
+#define HOST_SPIN_LOCKS (32)
+
+static spin_lock_t host_spin_locks[HOST_SPIN_LOCKS];
+static int host_spin_claimed;
+static _Thread_local unsigned host_core_num;
+
+spin_lock_t *spin_lock_instance( unsigned lock_num ) {
+    return host_spin_locks + lock_num;
+}
+
+spin_lock_t *spin_lock_init( unsigned lock_num ) {
+    spin_unlock( host_spin_locks + lock_num, 0 );
+    return host_spin_locks + lock_num;
+}
+
+int spin_lock_claim_unused( bool required ) {
+    if ( host_spin_claimed == HOST_SPIN_LOCKS ) {
+        if ( required ) {
+            fprintf( stderr, "multicore: no spin locks left\n" );
+            exit( 1 );
+        }
+        return -1;
+    }
+    return host_spin_claimed++;
+}
+
+unsigned get_core_num( void ) {
+    return host_core_num;
+}
+
+static void *host_core1( void *arg ) {
+    void (*entry)( void );
+
+    *(void **) &entry = arg;
+    host_core_num = 1;
+    entry();
+    return NULL;
+}
+
+void multicore_launch_core1( void (*entry)( void ) ) {
+    pthread_t thread;
+
+    if ( pthread_create( &thread, NULL, host_core1, *(void **) &entry ) ) {
+        fprintf( stderr, "multicore: could not start core 1\n" );
+        exit( 1 );
+    }
+    pthread_detach( thread );
+}
@@ -0,0 +1,246 @@
+/**
+ * @file host/piomodel.c
+ *
+ * This file implements a host-side model of the lesi_cycle PIO program
+ * in lesi/lesi.pio. It stands in for the state machine and its FIFOs, so
+ * the unmodified lesi/pio.c backend and everything built on top of it
+ * can be run under a Linux build against the simulated KLESI adapter.
+ *
+ * Each descriptor is executed by walking the same instruction sequence
+ * as the PIO program: side-set changes are applied to the modelled
+ * STROBE and COMMAND pins, and a rising STROBE edge is presented to the
+ * adapter as a write or read strobe depending on the bus direction. The
+ * model counts state machine clocks, including delay slots, so the bus
+ * time of a cycle sequence can be estimated, and it can optionally log
+ * every bus cycle.
+ *
+ * The control signals that lesi/lowlevel.c drives directly (INIT,
+ * AC CLEAR, CP OK) are modelled by host/klesisim.c.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lesi/hwconfig.h"
+#include "lesi/lesi.h"
+#include "lesi/pio.h"
+#include "host/klesisim.h"
+#include "host/piomodel.h"
+
+#define PM_TXQ_SIZE (64)
+
+static struct {
+    /* FIFOs */
+    uint32_t txq[PM_TXQ_SIZE];
+    int      tx_head;
+    int      tx_count;
+    uint32_t rxq[LESI_PIO_FIFO_DEPTH];
+    int      rx_head;
+    int      rx_count;
+
+    /* Pin state */
+    int      strobe;
+    int      cmd;
+    int      buf_write;
+    int      drive;
+    uint32_t out;
+
+    /* Statistics */
+    piomodel_stats_t stats;
+    FILE    *trace;
+} pm;
+
+extern volatile int saw_init;
+
+/**
+ * Account for state machine clocks spent on instructions and delays.
+ */
+static inline void pm_tick( int clocks ) {
+    pm.stats.clocks += clocks;
+}
+
+static void pm_trace_cycle( const char *what, uint16_t data ) {
+    if ( !pm.trace )
+        return;
+    fprintf( pm.trace, "%10llu  %-6s %06o", (unsigned long long) pm.stats.clocks, what, data );
+    if ( !strcmp( what, "CMD" ) ) {
+        fprintf( pm.trace, "  WC=%i REG=%i", LESI_CMD_WORDCNT(data), LESI_CMD_REGSEL_R(data) );
+        if ( data & LESI_CMD_WRITE    ) fprintf( pm.trace, " WRITE"  );
+        if ( data & LESI_CMD_BYTE     ) fprintf( pm.trace, " BYTE"   );
+        if ( data & LESI_CMD_CLEAR_WC ) fprintf( pm.trace, " CLR_WC" );
+        if ( data & LESI_CMD_DO_NPR   ) fprintf( pm.trace, " NPR"    );
+        if ( data & LESI_CMD_DO_INTR  ) fprintf( pm.trace, " INTR"   );
+        if ( data & LESI_CMD_SA       ) fprintf( pm.trace, " SA"     );
+    }
+    fprintf( pm.trace, "\n" );
+}
+
+/**
+ * Apply a side-set value. A rising edge on STROBE is where the adapter
+ * latches write data or advances on a read strobe.
+ */
+static void pm_side( int strobe, int cmd ) {
+    uint16_t data;
+    int parok;
+
+    if ( strobe && !pm.strobe ) {
+        if ( pm.drive && pm.buf_write ) {
+            data  = LESI_PIO_PINS_DATA( pm.out );
+            parok = LESI_PIO_PINS_PAR( pm.out ) == lesi_parity( data );
+            pm_trace_cycle( cmd ? "CMD" : "DATA", data );
+            klesisim_write( data, cmd, parok );
+            if ( cmd )
+                pm.stats.cmd_cycles++;
+            else
+                pm.stats.data_cycles++;
+        } else {
+            pm_trace_cycle( "STROBE", 0 );
+            klesisim_strobe();
+            pm.stats.strobe_cycles++;
+        }
+    }
+    pm.strobe = strobe;
+    pm.cmd    = cmd;
+}
+
+static void pm_push( uint32_t v ) {
+    assert( pm.rx_count < LESI_PIO_FIFO_DEPTH );
+    pm.rxq[(pm.rx_head + pm.rx_count++) % LESI_PIO_FIFO_DEPTH] = v;
+}
+
+/**
+ * bus_release: deassert COMMAND, float C/D and turn the transceivers.
+ */
+static void pm_bus_release( void ) {
+    pm_side( pm.strobe, 0 );
+    pm.drive     = 0;
+    pm.buf_write = 0;
+    pm_tick( 1 + 1 + 2 );
+}
+
+/**
+ * Execute one descriptor.
+ * @return 0 if the state machine stalls on a WAIT, 1 if it completed.
+ */
+static int pm_exec( uint32_t d ) {
+    int y = LESI_PIO_DESC_FLAG( d );
+    uint16_t data;
+
+    switch ( LESI_PIO_DESC_OP( d ) ) {
+        case LESI_PIO_OP_WRITE:
+            pm_tick( 1 );                   /* jmp !y data_cycle */
+            if ( y ) {
+                pm_side( 0, 1 );            /* nop side 2 [1] */
+                pm_tick( 2 );
+            }
+            pm.out       = LESI_PIO_DESC_PINS( d );
+            pm.buf_write = 1;
+            pm.drive     = 1;
+            pm_tick( 1 + 1 + 1 + 2 );       /* out, mov, set, out [1] */
+            pm_tick( 1 );                   /* jmp !y data_strobe */
+            if ( y ) {
+                pm_side( 1, 1 );            /* nop side 3 [1] */
+                pm_tick( 2 );
+                pm_side( 0, 1 );            /* jmp bus_release side 2 [1] */
+                pm_tick( 2 );
+                pm_bus_release();
+                pm_tick( 1 );               /* jmp y-- entry */
+            } else {
+                pm_side( 1, 0 );            /* nop side 1 [1] */
+                pm_tick( 2 );
+                pm_side( 0, 0 );            /* jmp entry side 0 */
+                pm_tick( 1 );
+            }
+            break;
+
+        case LESI_PIO_OP_READ:
+            pm_bus_release();
+            pm_tick( 1 );                   /* jmp y-- entry */
+            data = klesisim_read();
+            pm_trace_cycle( "READ", data );
+            pm.stats.read_cycles++;
+            pm_push( ((uint16_t) ~data) | ((uint32_t) lesi_parity( data ) << 16) );
+            pm_tick( 2 );                   /* in pins, push */
+            break;
+
+        case LESI_PIO_OP_STROBE:
+            pm_side( 1, 0 );                /* jmp y-- entry side 1 [1] */
+            pm_tick( 2 );
+            if ( !y ) {
+                pm_side( 0, 0 );            /* jmp entry side 0 */
+                pm_tick( 1 );
+            }
+            break;
+
+        case LESI_PIO_OP_WAIT:
+            if ( klesisim_t1() != y ) {
+                pm.stats.wait_stalls++;
+                pm_tick( 1 );
+                return 0;                   /* wait gpio T1_PIN */
+            }
+            pm_trace_cycle( y ? "T1" : "T1 L", 0 );
+            pm.stats.waits++;
+            pm_tick( 1 + 1 + 1 + 1 );       /* jmp !y, wait, jmp ack, push */
+            pm_push( 0 );
+            break;
+    }
+    pm_tick( 1 + 1 + 1 + 1 );               /* pull, out y, out pc, jmp op */
+    return 1;
+}
+
+/**
+ * Run the state machine until the TX FIFO is drained or it stalls.
+ */
+static void pm_run( void ) {
+    saw_init |= klesisim_init();
+    while ( pm.tx_count ) {
+        if ( !pm_exec( pm.txq[pm.tx_head] ) )
+            return;
+        pm.tx_head = (pm.tx_head + 1) % PM_TXQ_SIZE;
+        pm.tx_count--;
+    }
+}
+
+void lesi_pio_put( uint32_t desc ) {
+    assert( pm.tx_count < PM_TXQ_SIZE );
+    pm.txq[(pm.tx_head + pm.tx_count++) % PM_TXQ_SIZE] = desc;
+    pm_run();
+}
+
+int lesi_pio_rx_empty( void ) {
+    pm_run();
+    return pm.rx_count == 0;
+}
+
+uint32_t lesi_pio_get( void ) {
+    uint32_t v;
+    while ( lesi_pio_rx_empty() );
+    v = pm.rxq[pm.rx_head];
+    pm.rx_head = (pm.rx_head + 1) % LESI_PIO_FIFO_DEPTH;
+    pm.rx_count--;
+    return v;
+}
+
+void lesi_pio_restart( void ) {
+    pm.tx_count = pm.rx_count = 0;
+    pm_side( 0, 0 );
+    pm.drive = pm.buf_write = 0;
+}
+
+void lesi_pio_setup( void ) {
+    lesi_pio_restart();
+}
+
+/**
+ * Enable or disable the per-cycle log.
+ */
+void piomodel_trace( FILE *f ) {
+    pm.trace = f;
+}
+
+/**
+ * Returns the model statistics.
+ */
+const piomodel_stats_t *piomodel_stats( void ) {
+    return &pm.stats;
+}
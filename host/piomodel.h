@@ -0,0 +1,26 @@
+/**
+ * @file host/piomodel.h
+ *
+ * Interface to the host-side model of the lesi_cycle PIO program.
+ */
+#ifndef _PIOMODEL_H_
+#define _PIOMODEL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct piomodel_stats {
+    /** State machine clocks, including delay slots and T1 stalls */
+    uint64_t      clocks;
+    unsigned long cmd_cycles;
+    unsigned long data_cycles;
+    unsigned long read_cycles;
+    unsigned long strobe_cycles;
+    unsigned long waits;
+    unsigned long wait_stalls;
+} piomodel_stats_t;
+
+void piomodel_trace( FILE *f );
+const piomodel_stats_t *piomodel_stats( void );
+
+#endif
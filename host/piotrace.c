@@ -0,0 +1,121 @@
+/**
+ * @file host/piotrace.c
+ *
+ * Runs the lesi_* API through the PIO backend and the host-side model of
+ * the PIO program, logging every LESI bus cycle that results. This is
+ * used to check the cycle sequences generated by lesi/lesi.pio and
+ * lesi/pio.c without a board.
+ *
+ * Usage: piotrace [-q]
+ *    -q   Only print the summary, not the cycle log.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "lesi/hwconfig.h"
+#include "lesi/lesi.h"
+#include "host/klesisim.h"
+#include "host/piomodel.h"
+
+/* Nominal system clock the divider in hwconfig.h is relative to */
+#define PIOTRACE_SYS_MHZ (125.0)
+
+void app_idle() {
+}
+
+static int piotrace_loopback( void ) {
+    uint16_t test_vals[19] = {1,2,4,8,0x10,0x20,0x40,0x80,0x100,0x200,0x400,0x800,0x1000,0x2000,0x4000,0x8000,0xaaaa,0x8888,0x1337};
+    uint16_t rb;
+    int i, status, fails = 0;
+
+    printf("-- Scratchpad loopback\n");
+    for ( i = 0; i < 19; i++ ) {
+        status = lesi_write_ram_word( 0, test_vals[i] );
+        if ( status )
+            return status;
+        status = lesi_read_ram_word( 0, &rb );
+        if ( status )
+            return status;
+        if ( rb != test_vals[i] ) {
+            printf("Loopback failed: %04X != %04X\n", rb, test_vals[i]);
+            fails++;
+        }
+    }
+    return fails ? ERR_MISMATCH : ERR_OK;
+}
+
+static int piotrace_block( void ) {
+    uint16_t buf[16], rb;
+    int i, status;
+
+    printf("-- Scratchpad block write\n");
+    for ( i = 0; i < 16; i++ )
+        buf[i] = 0x1111 * i;
+    status = lesi_write_ram( 0, buf, 16 );
+    if ( status )
+        return status;
+
+    printf("-- Scratchpad word reads\n");
+    for ( i = 0; i < 16; i++ ) {
+        status = lesi_read_ram_word( i, &rb );
+        if ( status )
+            return status;
+        if ( rb != buf[i] ) {
+            printf("Block readback failed at %i: %04X != %04X\n", i, rb, buf[i]);
+            return ERR_MISMATCH;
+        }
+    }
+    return ERR_OK;
+}
+
+static int piotrace_regs( void ) {
+    uint16_t sr;
+    int status;
+
+    printf("-- Host address and status registers\n");
+    status = lesi_set_host_addr( 0x123456 );
+    if ( status )
+        return status;
+    status = lesi_read_sr( &sr );
+    if ( status )
+        return status;
+    if ( (sr & LESI_SR_IDENT_MASK) != LESI_SR_IDENT_QBUS ) {
+        printf("Unexpected adapter ident in status register: %06o\n", sr);
+        return ERR_MISMATCH;
+    }
+    return lesi_handle_status();
+}
+
+int main( int argc, char **argv ) {
+    const piomodel_stats_t *st;
+    int status;
+    unsigned long cycles;
+    double ns_per_clock;
+
+    if ( argc < 2 || strcmp( argv[1], "-q" ) )
+        piomodel_trace( stdout );
+
+    klesisim_setup( LESI_SR_IDENT_QBUS, 0x10000 );
+    lesi_set_transport( &lesi_pio_transport );
+    lesi_lowlevel_setup();
+    lesi_lowlevel_set_pwrgood(0);
+    lesi_lowlevel_set_pwrgood(1);
+    lesi_lowlevel_reset_klesi();
+
+    status = piotrace_loopback();
+    if ( !status )
+        status = piotrace_block();
+    if ( !status )
+        status = piotrace_regs();
+
+    st = piomodel_stats();
+    cycles = st->cmd_cycles + st->data_cycles + st->read_cycles + st->strobe_cycles;
+    ns_per_clock = 1000.0 * LESI_PIO_CLKDIV / PIOTRACE_SYS_MHZ;
+    printf("\nBus cycles: %lu (%lu command, %lu data, %lu read, %lu strobe), %lu T1 waits\n",
+        cycles, st->cmd_cycles, st->data_cycles, st->read_cycles, st->strobe_cycles, st->waits);
+    printf("State machine clocks: %llu, %.1f ns per cycle at %.0f MHz / %.1f\n",
+        (unsigned long long) st->clocks, cycles ? st->clocks * ns_per_clock / cycles : 0.0,
+        PIOTRACE_SYS_MHZ, LESI_PIO_CLKDIV);
+    printf("Result: %s (%i)\n", status ? "FAILED" : "OK", status);
+    return status ? 1 : 0;
+}
@@ -0,0 +1,1077 @@
+/**
+ * @file host/simdrive.c
+ *
+ * Host build of the complete emulator: the MSCP host interface and server
+ * run unmodified against the simulated KLESI adapter, with a RAM disk as
+ * unit 0 and a model of the host's port driver issuing commands. This is
+ * used to exercise and benchmark the ring and DMA paths on a Linux
+ * machine.
+ *
+ * Five phases are run: READ commands with a zero byte count, which only
+ * exercise the command and response rings, READ and WRITE commands of
+ * the configured size, which add the data transfer, a single FLUSH of
+ * the entire unit, which drains a write-back cache, and READs of the
+ * same two buffers over and over, which show the block cache on a USB
+ * or disk image unit. Before them, a few edge cases that take unusual
+ * paths through the unit are run and checked, see sim_edges().
+ *
+ * A recorded trace of commands can be replayed after the phases, to
+ * compare the unit command schedulers on a realistic mix of requests.
+ * Each line of a trace holds one command:
+ *
+ *    <op> <lba> <blocks> [x]
+ *
+ * where op is R (READ), W (WRITE), E (ERASE), C (COMPARE) or A (ACCESS),
+ * and a trailing x marks an express request. Empty lines and lines
+ * starting with # are ignored.
+ *
+ * Usage: simdrive [-2] [-p] [-u] [-D devices] [-L luns] [-M] [-H] [-f image] [-R members]
+ *                 [-z blocks] [-T] [-F volume] [-w] [-n commands] [-b bytes] [-q depth] [-s bytes] [-S] [-o policy] [-t trace]
+ *    -2   Run the port and the host model on a second thread, as core 1
+ *         does on the RP2040, with the server and unit driver on the
+ *         main thread.
+ *    -p   Use the PIO transport running on the model of the PIO program
+ *         instead of the direct transport.
+ *    -u   Use the block unit driver on a simulated USB mass storage
+ *         device instead of the RAM disk.
+ *    -D   Number of simulated USB devices (default 1), implies -u.
+ *    -L   LUNs per simulated USB device (default 1), implies -u. With
+ *         more than one unit, as many as MSCP_CUNITS are used and the
+ *         commands go to them in turn.
+ *    -M   Serve two simulated USB devices as a mirror, unit 0. After
+ *         the phases, wait for the members to be in sync and check that
+ *         they hold the same data.
+ *    -H   Before the phases, enable attention messages, pull the first
+ *         USB device and plug it in again, and check that its units go
+ *         offline and come back with an available attention message.
+ *         With -M, pull it for the WRITE phase instead, so the unit runs
+ *         on the other member and the first one is resynced. Not with -2.
+ *    -f   Use the block unit driver on a disk image file instead of the
+ *         RAM disk. The file is created or grown to the size of the unit.
+ *    -R   With -f, stripe the unit over this many image files instead,
+ *         named image.0, image.1 and so on.
+ *    -z   Blocks per stripe with -R (default STRIPE_BLOCKS).
+ *    -T   Make the image files as slow as the simulated USB device, to
+ *         see how striping scales.
+ *    -F   Use the block unit driver on the disk images of a FAT32 volume
+ *         file, see host/mkfatimg.c. The first image is unit 0 and must
+ *         hold at least 8192 blocks.
+ *    -w   Bring the unit online with write-back caching (M_UF_WBKNV).
+ *    -n   Commands per phase (default 2000).
+ *    -b   Byte count of the READ and WRITE phases (default 8192).
+ *    -q   Commands kept in flight (default 1).
+ *    -s   Block unit driver segment size for READ and WRITE (default
+ *         from projconfig.h).
+ *    -S   After the phases, repeat READ and WRITE for every segment size
+ *         from 512 bytes up to BLKDRV_SEG_MAX and print the MB/s.
+ *    -o   Unit command scheduler: fifo, elevator or deadline (default
+ *         from projconfig.h).
+ *    -t   Replay the commands in a trace file after the phases.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pico/stdlib.h>
+#include <pico/multicore.h>
+#include <hardware/sync.h>
+
+#include "mscp/server/server.h"
+#include "mscp/hostif/hostif.h"
+#include "mscp/pool.h"
+#include "lesi/lesi.h"
+#include "host/klesisim.h"
+#include "host/hostdrv.h"
+#include "host/usbsim.h"
+#include "host/imgdev.h"
+#include "driver/usbmsc.h"
+#include "driver/blkdrv.h"
+#include "driver/fatvol.h"
+#include "driver/stripe.h"
+#include "projconfig.h"
+
+#define SIM_MEMSIZE    (0x400000)
+#define SIM_BLKSIZE    (512)
+#define SIM_BLKCOUNT   (8192)
+#define SIM_VECTOR     (0154)
+#define SIM_RING_LOG2  (4)
+#define SIM_CMD_LEN    (48)
+#define SIM_MAX_SPINS  (100000000)
+#define SIM_TRACE_MAX  (65536)
+#define SIM_IMG_QDEPTH (8)
+#define SIM_EDGE_BYTES (4096)
+#define SIM_EDGE_CMDS  (32)
+#define SIM_EDGE_STEPS (200)
+#define SIM_SLOW_CMD_US  (250)
+#define SIM_SLOW_NS_BYTE (1000)
+
+static mscpa_t *hostif;
+static mscps_t *server;
+static uint8_t *ramdisk;
+static int use_usb;
+static const char *image;
+static const char *volume;
+static fatvol_t fatvol;
+/* Stripe set with -R, the stripe size, its members' images, and -T */
+static stripe_t stripe;
+static int stripe_n;
+static uint32_t stripe_ss = STRIPE_BLOCKS;
+static const uint8_t *stripe_media[STRIPE_MEMBERS];
+static int slow_images;
+static int fatvol_done;
+/* What the unit stored, for the data check */
+static const uint8_t *medium;
+/* Background work of the block unit driver, NULL for the RAM disk */
+static void (*blk_process)( void );
+/* Simulated USB devices and LUNs, the units the commands go to, and the */
+/* available attention messages received                                 */
+static int sim_devs = 1, sim_luns = 1, sim_units = 1, hotplug;
+static int sim_attns;
+/* The mirror with -M */
+static mirror_t *mirror;
+
+typedef struct sim_trace {
+    uint8_t  opcode;
+    uint16_t modifier;
+    uint32_t lba;
+    uint32_t bytecnt;
+} sim_trace_t;
+
+typedef struct sim_phase {
+    const char *name;
+    int      opcode;
+    uint32_t bytecnt;
+    uint32_t buf;
+    /* Commands before the LBA wraps back to 0, 0 to cover the disk */
+    int      span;
+    /* Commands in the phase, 0 for the count given on the command line */
+    int      count;
+    uint16_t modifier;
+    uint16_t unitflgs;
+    uint16_t cntflgs;
+    int      issued;
+    int      done;
+    int      errors;
+    /* Bytes requested by the commands issued */
+    uint64_t bytes;
+    /* Commands to replay instead of the generated ones, and the time each
+       was issued, for the response latency */
+    const sim_trace_t *trace;
+    uint64_t *t_issue;
+    uint64_t lat_sum;
+    uint64_t lat_max;
+} sim_phase_t;
+
+/* Options */
+static int count = 2000, bytes = 8192, depth = 1, sweep;
+static uint16_t unitflgs;
+static const char *trace;
+static uint32_t trace_bytes;
+static sim_phase_t replay = { .name = "trace" };
+
+/* Set by core 1 when the benchmark is over */
+static atomic_int sim_done;
+static int sim_result;
+
+/**
+ * Unit driver for the RAM disk. Commands complete on the first call.
+ */
+static int ramdisk_proc( mscpu_t *unit, mscpc_t *cmd ) {
+    mscp_pkt_t *pkt = cmd->pkt;
+    uint8_t *p;
+    int status = ERR_OK;
+
+    if ( cmd->state == CMD_COMPLETE || cmd->state == CMD_DELETE || cmd->state == CMD_REPLY )
+        return 0;
+
+    if ( cmd->state == CMD_ABORTED ) {
+        cmd->state = CMD_REPLY;
+        return 0;
+    }
+
+    cmd->state = CMD_REPLY;
+    if ( !mscpu_verify_access( unit, cmd ) )
+        return 0;
+
+    p = ramdisk + pkt->m_un.m_generic.Ms_lba * SIM_BLKSIZE;
+    switch ( pkt->m_opcode ) {
+        case M_OP_READ:
+            status = mscps_write_buf( unit->u_server, p,
+                &pkt->m_un.m_generic.Ms_buf, 0, pkt->m_un.m_generic.Ms_bytecnt );
+            break;
+        case M_OP_WRITE:
+            status = mscps_read_buf( unit->u_server, p,
+                &pkt->m_un.m_generic.Ms_buf, 0, pkt->m_un.m_generic.Ms_bytecnt );
+            break;
+        case M_OP_ERASE:
+            memset( p, 0, pkt->m_un.m_generic.Ms_bytecnt );
+            break;
+    }
+    cmd->resp->m_status = status ? M_ST_HSTBF : M_ST_SUCC;
+    return 0;
+}
+
+static void ramdisk_attach( void ) {
+    mscpu_t *unit = server->c_unit;
+
+    ramdisk = calloc( SIM_BLKCOUNT, SIM_BLKSIZE );
+    if ( ramdisk == NULL ) {
+        fprintf( stderr, "simdrive: could not allocate RAM disk\n" );
+        exit( 1 );
+    }
+    unit->u_id.i_class = M_CC_DISK144;
+    unit->u_id.i_model = M_CM_UDA50;
+    unit->u_spindles   = 1;
+    unit->u_mediaid    = 0x254B3294;
+    unit->u_blkcount   = SIM_BLKCOUNT;
+    unit->u_blksize    = SIM_BLKSIZE;
+    mscpu_set_avail( server, 0, ramdisk_proc );
+    medium = ramdisk;
+}
+
+/**
+ * Bring up the USB unit driver on the simulated mass storage device.
+ */
+/**
+ * Check whether the first n units are available.
+ */
+static int sim_units_avail( int n ) {
+    int i;
+
+    for ( i = 0; i < n; i++ )
+        if ( server->c_unit[i].u_state != MUS_AVAIL )
+            return 0;
+    return 1;
+}
+
+/**
+ * Bring up the USB unit driver on the simulated mass storage devices.
+ */
+static void usbdisk_attach( void ) {
+    uint16_t uid;
+    int i;
+
+    sim_units = sim_devs * sim_luns < MSCP_CUNITS ? sim_devs * sim_luns : MSCP_CUNITS;
+    if ( mirror )
+        sim_units = 1;
+    usbsim_setup( SIM_BLKCOUNT, SIM_BLKSIZE, sim_devs, sim_luns );
+    usbmsc_init( server, 0 );
+    for ( i = 0; i < SIM_MAX_SPINS && !sim_units_avail( sim_units ); i++ )
+        usbmsc_process();
+    if ( !sim_units_avail( sim_units ) ) {
+        fprintf( stderr, "simdrive: USB units did not come up\n" );
+        exit( 1 );
+    }
+    /* The unit identifier holds the bus address and LUN */
+    for ( i = 0; i < sim_units; i++ ) {
+        uid = server->c_unit[i].u_id.i_uid_h;
+        printf("Unit %i: USB device %i LUN %i\n", i, uid >> 8, uid & 0xFF );
+    }
+    uid = server->c_unit[0].u_id.i_uid_h;
+    medium = usbsim_image( (uid >> 8) - 1, uid & 0xFF );
+    blk_process = usbmsc_process;
+}
+
+/**
+ * Bring up the block unit driver on a disk image file.
+ */
+static void imgdisk_attach( void ) {
+    blkdev_t *dev = imgdev_open( image, SIM_BLKSIZE, SIM_BLKCOUNT, SIM_IMG_QDEPTH );
+
+    if ( dev == NULL || !blkdrv_attach( server, 0, dev ) ) {
+        fprintf( stderr, "simdrive: could not attach image %s\n", image );
+        exit( 1 );
+    }
+    if ( slow_images )
+        imgdev_timing( dev, SIM_SLOW_CMD_US, SIM_SLOW_NS_BYTE );
+    medium = imgdev_map( dev );
+    if ( medium == NULL ) {
+        fprintf( stderr, "simdrive: could not map image %s\n", image );
+        exit( 1 );
+    }
+    blk_process = blkdrv_process;
+}
+
+/**
+ * Bring up the block unit driver on a stripe set of disk image files,
+ * each big enough for the set to hold the unit.
+ */
+static void stripedisk_attach( void ) {
+    blkdev_t *devs[STRIPE_MEMBERS];
+    uint32_t blocks;
+    char path[256];
+    int i;
+
+    blocks = (SIM_BLKCOUNT + stripe_n * stripe_ss - 1) / (stripe_n * stripe_ss) * stripe_ss;
+    for ( i = 0; i < stripe_n; i++ ) {
+        snprintf( path, sizeof path, "%s.%i", image, i );
+        devs[i] = imgdev_open( path, SIM_BLKSIZE, blocks, SIM_IMG_QDEPTH );
+        if ( devs[i] == NULL || (stripe_media[i] = imgdev_map( devs[i] )) == NULL ) {
+            fprintf( stderr, "simdrive: could not open image %s\n", path );
+            exit( 1 );
+        }
+        if ( slow_images )
+            imgdev_timing( devs[i], SIM_SLOW_CMD_US, SIM_SLOW_NS_BYTE );
+    }
+    if ( !stripe_init( &stripe, devs, stripe_n, stripe_ss ) ||
+         !blkdrv_attach( server, 0, &stripe.dev ) ) {
+        fprintf( stderr, "simdrive: could not attach the stripe set\n" );
+        exit( 1 );
+    }
+    blk_process = blkdrv_process;
+}
+
+static void fatdisk_mounted( fatvol_t *vol, int status ) {
+    fatvol_done = 1;
+}
+
+/**
+ * Bring up the block unit driver on the images of a FAT32 volume file.
+ */
+static void fatdisk_attach( void ) {
+    blkdev_t *dev = imgdev_open( volume, SIM_BLKSIZE, 0, SIM_IMG_QDEPTH );
+    int i;
+
+    if ( dev == NULL ) {
+        fprintf( stderr, "simdrive: could not open volume %s\n", volume );
+        exit( 1 );
+    }
+    medium = imgdev_map( dev );
+    fatvol_mount( &fatvol, dev, fatdisk_mounted );
+    for ( i = 0; i < SIM_MAX_SPINS && !fatvol_done; i++ )
+        fatvol_poll( &fatvol );
+    if ( medium == NULL || !fatvol_ready( &fatvol ) ||
+         fatvol_image( &fatvol, 0 ) == NULL || fatvol.img[0].blkcount < SIM_BLKCOUNT ) {
+        fprintf( stderr, "simdrive: no image of %u blocks on %s\n", SIM_BLKCOUNT, volume );
+        exit( 1 );
+    }
+    for ( i = 0; i < fatvol.nimages && i < MSCP_CUNITS; i++ ) {
+        printf("Unit %i: %s\n", i, fatvol.img[i].name );
+        blkdrv_attach( server, i, fatvol_image( &fatvol, i ) );
+    }
+    fatvol_dump( &fatvol );
+    blk_process = blkdrv_process;
+}
+
+/**
+ * Check that the start of unit 0 holds a copy of a buffer.
+ * @return 1 if it does
+ */
+static int sim_check( const uint8_t *buf, uint32_t len ) {
+    uint32_t lba, vlba, run, n;
+    int member;
+
+    if ( stripe_n ) {
+        for ( lba = 0; len; lba += run, buf += n, len -= n ) {
+            vlba = stripe_lookup( &stripe, lba, &member, &run );
+            n = run * SIM_BLKSIZE < len ? run * SIM_BLKSIZE : len;
+            if ( memcmp( stripe_media[member] + (size_t) vlba * SIM_BLKSIZE, buf, n ) )
+                return 0;
+        }
+        return 1;
+    }
+    if ( !volume )
+        return memcmp( medium, buf, len ) == 0;
+    for ( lba = 0; len; lba += run, buf += n, len -= n ) {
+        vlba = fatvol_lookup( fatvol_image( &fatvol, 0 ), lba, &run );
+        n = run * SIM_BLKSIZE < len ? run * SIM_BLKSIZE : len;
+        if ( memcmp( medium + (size_t) vlba * SIM_BLKSIZE, buf, n ) )
+            return 0;
+    }
+    return 1;
+}
+
+void app_idle() {
+    /* The host model runs on the core that owns the LESI bus, USB on the
+       one that runs the server */
+    if ( server->link == NULL || get_core_num() == 1 )
+        hostdrv_poll();
+    if ( blk_process && get_core_num() == 0 )
+        blk_process();
+    if ( server->link != NULL )
+        sched_yield();
+}
+
+static void sim_step( void ) {
+    hostdrv_poll();
+    hostif_loop( hostif );
+    if ( server->link == NULL ) {
+        mscps_loop( server );
+        if ( blk_process )
+            blk_process();
+    } else
+        sched_yield(); /* the cores may share a CPU */
+}
+
+static void sim_rsp( const uint8_t *msg, int len, void *ctx ) {
+    const mscp_resp_t *rsp = (const void *) msg;
+    sim_phase_t *ph = ctx;
+
+    uint64_t lat;
+
+    if ( !(rsp->m_endcode & M_OP_END) ) {
+        if ( rsp->m_endcode == M_OP_AVATN )
+            sim_attns++;
+        return;
+    }
+    ph->done++;
+    if ( (rsp->m_status & M_ST_MASK) != M_ST_SUCC )
+        ph->errors++;
+    if ( ph->t_issue && rsp->m_cmdref >= 1 && rsp->m_cmdref <= ph->issued ) {
+        lat = time_us_64() - ph->t_issue[rsp->m_cmdref - 1];
+        ph->lat_sum += lat;
+        if ( lat > ph->lat_max )
+            ph->lat_max = lat;
+    }
+}
+
+static int sim_submit( sim_phase_t *ph ) {
+    mscp_pkt_t pkt;
+    uint32_t lba;
+
+    lba = ph->span ? ph->issued % ph->span : ph->issued;
+    lba = (lba * ((ph->bytecnt + SIM_BLKSIZE - 1) / SIM_BLKSIZE)) % SIM_BLKCOUNT;
+    if ( lba * SIM_BLKSIZE + ph->bytecnt > SIM_BLKCOUNT * SIM_BLKSIZE )
+        lba = 0;
+
+    memset( &pkt, 0, sizeof pkt );
+    pkt.m_cmdref  = ph->issued + 1;
+    pkt.m_unit    = ph->issued % sim_units;
+    pkt.m_opcode  = ph->opcode;
+    pkt.m_modifier = ph->modifier;
+    pkt.m_un.m_generic.Ms_bytecnt = ph->bytecnt;
+    pkt.m_un.m_generic.Ms_buf     = ph->buf;
+    pkt.m_un.m_generic.Ms_lba     = lba;
+    if ( ph->opcode == M_OP_ONLIN )
+        pkt.m_un.m_online.Ms_unitflgs = ph->unitflgs;
+    if ( ph->opcode == M_OP_STCON )
+        pkt.m_un.m_setcntchar.Ms_cntflgs = ph->cntflgs;
+    if ( ph->trace ) {
+        pkt.m_opcode   = ph->trace[ph->issued].opcode;
+        pkt.m_modifier = ph->trace[ph->issued].modifier;
+        pkt.m_un.m_generic.Ms_lba     = ph->trace[ph->issued].lba;
+        pkt.m_un.m_generic.Ms_bytecnt = ph->trace[ph->issued].bytecnt;
+    }
+    if ( hostdrv_submit( &pkt, SIM_CMD_LEN ) )
+        return 0;
+    if ( ph->t_issue )
+        ph->t_issue[ph->issued] = time_us_64();
+    ph->bytes += pkt.m_un.m_generic.Ms_bytecnt;
+    ph->issued++;
+    return 1;
+}
+
+/**
+ * Run commands until count of them completed, keeping depth in flight.
+ */
+static int sim_run( sim_phase_t *ph, int count, int depth ) {
+    long spins = 0;
+
+    while ( ph->done < count ) {
+        while ( ph->issued < count && ph->issued - ph->done < depth )
+            if ( !sim_submit( ph ) )
+                break;
+        sim_step();
+        hostdrv_reap( sim_rsp, ph );
+        if ( ++spins > SIM_MAX_SPINS ) {
+            fprintf( stderr, "simdrive: %s stalled after %i commands\n", ph->name, ph->done );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void sim_report( sim_phase_t *ph, uint64_t us, const klesisim_stats_t *s0,
+                        const lesi_ua_stats_t *u0 ) {
+    const klesisim_stats_t *s = klesisim_stats();
+    const lesi_ua_stats_t *u = lesi_ua_stats();
+    unsigned long cycles, cycles0;
+    double secs = us / 1e6;
+
+    cycles  = s->cmd_cycles + s->data_cycles + s->read_cycles + s->strobe_cycles;
+    cycles0 = s0->cmd_cycles + s0->data_cycles + s0->read_cycles + s0->strobe_cycles;
+    printf("%-6s %6i cmds %6i err %9.0f cmd/s %8.2f MB/s %8.1f cycles/cmd %6.1f NPRs/cmd %6.1f UA writes/cmd %6.1f saved/cmd %5.2f irq/cmd\n",
+        ph->name, ph->done, ph->errors, ph->done / secs,
+        ph->bytes / secs / 1e6,
+        (double) (cycles - cycles0) / ph->done,
+        (double) (s->nprs - s0->nprs) / ph->done,
+        (double) (s->ua_writes - s0->ua_writes) / ph->done,
+        (double) (u->cycles_saved - u0->cycles_saved) / ph->done,
+        (double) (s->interrupts - s0->interrupts) / ph->done );
+}
+
+static void sim_report_irq( void ) {
+    hostif_irq_stats_t is;
+
+    hostif_irq_interval( hostif, &is );
+    printf("       %6lu ring transitions %6lu interrupts: %lu by count, %lu by timer, %lu idle, max delay %u us\n",
+        is.transitions, is.interrupts, is.by_count, is.by_timer, is.by_idle, is.max_delay_us );
+    printf("       %6lu ownership checks read the ring, %lu answered from the shadow\n",
+        hostif->own_reads, hostif->own_reads_avoided );
+    hostif->own_reads = hostif->own_reads_avoided = 0;
+}
+
+static void sim_report_blk( uint64_t us ) {
+    const blkdrv_stats_t *st = blkdrv_stats( server->c_unit );
+
+    printf("       %6lu device transfers %8.2f MB/s, device busy %5.1f%%, idle with data left %8llu us in %lu gaps, max queue %i\n",
+        st->transfers, st->bytes / (double) us, 100.0 * st->busy_us / us,
+        (unsigned long long) st->idle_us, st->idle_gaps, st->max_queue );
+}
+
+/**
+ * Pull the first USB device and plug it in again. Its units have to go
+ * offline, then come back available with an attention message each; all
+ * units are brought online again.
+ * @return 0 on success
+ */
+static int sim_hotplug( void ) {
+    sim_phase_t stcon  = { .name = "stcon",  .opcode = M_OP_STCON, .cntflgs = M_CF_ATTN };
+    sim_phase_t online = { .name = "online", .opcode = M_OP_ONLIN, .unitflgs = unitflgs };
+    int i, n = 0;
+
+    if ( sim_run( &stcon, 1, 1 ) || stcon.errors ) {
+        fprintf( stderr, "simdrive: could not enable attention messages\n" );
+        return -1;
+    }
+    usbsim_plug( 0, 0 );
+    for ( i = 0; i < sim_units; i++ )
+        n += server->c_unit[i].u_state == MUS_OFFLINE;
+    printf("\nHot-plug: %i of %i units offline after pulling device 1\n", n, sim_units );
+    if ( n == 0 )
+        return -1;
+
+    sim_attns = 0;
+    usbsim_plug( 0, 1 );
+    for ( i = 0; i < SIM_MAX_SPINS && sim_attns < n; i++ ) {
+        sim_step();
+        hostdrv_reap( sim_rsp, &online );
+    }
+    printf("Hot-plug: %i available attention messages after plugging it in\n", sim_attns );
+    for ( i = 0; i < sim_units; i++ )
+        if ( server->c_unit[i].u_state == MUS_OFFLINE )
+            return -1;
+    if ( sim_attns < n )
+        return -1;
+    if ( sim_run( &online, sim_units, 1 ) || online.errors ) {
+        fprintf( stderr, "simdrive: units did not come back online\n" );
+        return -1;
+    }
+    return 0;
+}
+
+/* End packet status of the edge case commands, by command reference, */
+/* and the number of them received                                   */
+static uint16_t sim_edge_status[SIM_EDGE_CMDS];
+static int sim_edge_done;
+
+static void sim_edge_rsp( const uint8_t *msg, int len, void *ctx ) {
+    const mscp_resp_t *rsp = (const void *) msg;
+
+    if ( !(rsp->m_endcode & M_OP_END) )
+        return;
+    if ( rsp->m_cmdref < SIM_EDGE_CMDS )
+        sim_edge_status[rsp->m_cmdref] = rsp->m_status & M_ST_MASK;
+    sim_edge_done++;
+}
+
+/**
+ * Post one command to unit 0 for the edge cases.
+ * @param lba The LBA, or for an ABORT the reference of the command to
+ *            abort
+ */
+static void sim_edge_cmd( int cmdref, int opcode, uint32_t lba, uint32_t bytecnt, uint32_t buf ) {
+    mscp_pkt_t pkt;
+
+    memset( &pkt, 0, sizeof pkt );
+    pkt.m_cmdref  = cmdref;
+    pkt.m_opcode  = opcode;
+    pkt.m_un.m_generic.Ms_bytecnt = bytecnt;
+    pkt.m_un.m_generic.Ms_buf     = buf;
+    pkt.m_un.m_generic.Ms_lba     = lba;
+    if ( opcode == M_OP_ABORT )
+        pkt.m_un.m_abort.Ms_orn   = lba;
+    sim_edge_status[cmdref] = 0xFFFF;
+    while ( hostdrv_submit( &pkt, SIM_CMD_LEN ) )
+        sim_step();
+}
+
+/**
+ * Run until n end packets of the edge cases came back.
+ * @return 0 on success
+ */
+static int sim_edge_wait( int n ) {
+    long spins;
+
+    for ( spins = 0; sim_edge_done < n; spins++ ) {
+        sim_step();
+        hostdrv_reap( sim_edge_rsp, NULL );
+        if ( spins > SIM_MAX_SPINS ) {
+            fprintf( stderr, "simdrive: edge case stalled after %i commands\n", sim_edge_done );
+            return -1;
+        }
+    }
+    sim_edge_done = 0;
+    return 0;
+}
+
+/**
+ * Check that the blocks from an LBA on hold a host buffer, reading them
+ * back through the unit.
+ * @return 1 if they do
+ */
+static int sim_edge_check( uint32_t lba, uint32_t data, uint32_t scratch ) {
+    memset( klesisim_host_mem() + scratch, 0, SIM_EDGE_BYTES );
+    sim_edge_cmd( 1, M_OP_READ, lba, SIM_EDGE_BYTES, scratch );
+    if ( sim_edge_wait( 1 ) || sim_edge_status[1] != M_ST_SUCC )
+        return 0;
+    return memcmp( klesisim_host_mem() + data, klesisim_host_mem() + scratch, SIM_EDGE_BYTES ) == 0;
+}
+
+/**
+ * Run commands that take unusual paths through the unit and its driver,
+ * and check that each is answered correctly:
+ *  - A WRITE of 0 bytes followed by a WRITE to the same LBA, which must
+ *    not be merged into it.
+ *  - More READs than the unit driver takes at once, and an ABORT of the
+ *    last one, which is still queued on a slow unit.
+ *  - Three WRITEs to contiguous blocks queued behind such READs, which
+ *    are merged, and an ABORT of the first one and then, in a second
+ *    round, of the middle one. The others must end normally and store
+ *    their data.
+ *  - A WRITE that continues a queued one but overlaps a later chain of
+ *    merged WRITEs queued in between. It must not be merged ahead of
+ *    that chain, or the chain's older data ends up on the blocks.
+ *  - A COMPARE right after a WRITE of the same blocks. COMPARE bypasses
+ *    the block cache, so with -w it must see the data still dirty there.
+ * @return The number of cases that failed
+ */
+static int sim_edges( void ) {
+    uint32_t data = hostdrv_alloc( SIM_EDGE_BYTES );
+    uint32_t scratch = hostdrv_alloc( SIM_EDGE_BYTES );
+    uint32_t other = hostdrv_alloc( SIM_EDGE_BYTES );
+    int i, n, fails = 0;
+
+    for ( i = 0; i < SIM_EDGE_BYTES; i++ ) {
+        klesisim_host_mem()[data + i]  = i * 13 + 5;
+        klesisim_host_mem()[other + i] = i * 7 + 1;
+    }
+
+    sim_edge_cmd( 2, M_OP_WRITE, 64, 0, data );
+    sim_edge_cmd( 3, M_OP_WRITE, 64, SIM_EDGE_BYTES, data );
+    if ( sim_edge_wait( 2 ) || sim_edge_status[2] != M_ST_SUCC || sim_edge_status[3] != M_ST_SUCC ||
+         !sim_edge_check( 64, data, scratch ) ) {
+        printf("Edge case failed: WRITE after a 0 byte WRITE to the same LBA\n");
+        fails++;
+    }
+
+    for ( i = 4; i < 10; i++ )
+        sim_edge_cmd( i, M_OP_READ, i * 64, SIM_EDGE_BYTES, scratch );
+    sim_edge_cmd( 10, M_OP_ABORT, 9, 0, 0 );
+    if ( sim_edge_wait( 7 ) )
+        return fails + 1;
+    for ( i = 4; i < 9 && sim_edge_status[i] == M_ST_SUCC; i++ )
+        ;
+    if ( i < 9 || sim_edge_status[10] != M_ST_SUCC ||
+         (sim_edge_status[9] != M_ST_SUCC && sim_edge_status[9] != M_ST_ABRTD) ) {
+        printf("Edge case failed: ABORT of a queued READ\n");
+        fails++;
+    } else
+        printf("Edge case: ABORT of a queued READ, it ended %s\n",
+            sim_edge_status[9] == M_ST_ABRTD ? "aborted" : "normally");
+
+    for ( n = 0; n < 2; n++ ) {
+        for ( i = 11; i < 15; i++ )
+            sim_edge_cmd( i, M_OP_READ, i * 64, SIM_EDGE_BYTES, scratch );
+        for ( i = 15; i < 18; i++ )
+            sim_edge_cmd( i, M_OP_WRITE, 1024 + (i - 15) * SIM_EDGE_BYTES / SIM_BLKSIZE,
+                SIM_EDGE_BYTES, data );
+        sim_edge_cmd( 18, M_OP_ABORT, 15 + n, 0, 0 );
+        if ( sim_edge_wait( 8 ) )
+            return fails + 1;
+        for ( i = 11; i < 18; i++ ) {
+            if ( i == 15 + n ? sim_edge_status[i] == M_ST_SUCC || sim_edge_status[i] == M_ST_ABRTD :
+                               sim_edge_status[i] == M_ST_SUCC &&
+                               (i < 15 || sim_edge_check( 1024 + (i - 15) * SIM_EDGE_BYTES / SIM_BLKSIZE,
+                                                          data, scratch )) )
+                continue;
+            printf("Edge case failed: ABORT of the %s of three merged WRITEs, command %i\n",
+                n ? "middle" : "first", i );
+            fails++;
+            break;
+        }
+        if ( i == 18 )
+            printf("Edge case: ABORT of the %s of three merged WRITEs, it ended %s\n",
+                n ? "middle" : "first", sim_edge_status[15 + n] == M_ST_ABRTD ? "aborted" : "normally");
+    }
+
+    /* With the unit busy, queue L at 2048 (1 block), then X at 2040 and
+       Y at 2048, which merge, and let them be fetched and merged before C
+       arrives. C continues L but overlaps Y, so it has to go after it */
+    for ( i = 19; i < 23; i++ )
+        sim_edge_cmd( i, M_OP_READ, i * 64, SIM_EDGE_BYTES, scratch );
+    sim_edge_cmd( 23, M_OP_WRITE, 2048, SIM_BLKSIZE, data );
+    sim_edge_cmd( 24, M_OP_WRITE, 2040, SIM_EDGE_BYTES, data );
+    sim_edge_cmd( 25, M_OP_WRITE, 2048, SIM_EDGE_BYTES, data );
+    for ( i = 0; i < SIM_EDGE_STEPS; i++ )
+        sim_step();
+    sim_edge_cmd( 26, M_OP_WRITE, 2049, SIM_EDGE_BYTES, other );
+    if ( sim_edge_wait( 8 ) )
+        return fails + 1;
+    for ( i = 19; i < 27 && sim_edge_status[i] == M_ST_SUCC; i++ )
+        ;
+    if ( i < 27 || !sim_edge_check( 2049, other, scratch ) || !sim_edge_check( 2040, data, scratch ) ) {
+        printf("Edge case failed: WRITE continuing a queued one across a merged chain\n");
+        fails++;
+    }
+
+    sim_edge_cmd( 27, M_OP_WRITE, 3072, SIM_EDGE_BYTES, other );
+    sim_edge_cmd( 28, M_OP_COMP, 3072, SIM_EDGE_BYTES, other );
+    if ( sim_edge_wait( 2 ) || sim_edge_status[27] != M_ST_SUCC || sim_edge_status[28] != M_ST_SUCC ) {
+        printf("Edge case failed: COMPARE after a WRITE of the same blocks\n");
+        fails++;
+    }
+    return fails;
+}
+
+/**
+ * Load a trace of commands, see the top of this file for the format.
+ * @param path  The trace file
+ * @param count Set to the number of commands
+ * @param bytes Set to the largest byte count of a command
+ * @return The commands, exits on error
+ */
+static sim_trace_t *sim_trace_load( const char *path, int *count, uint32_t *bytes ) {
+    static const struct { char c; uint8_t opcode; } ops[] = {
+        { 'R', M_OP_READ }, { 'W', M_OP_WRITE }, { 'E', M_OP_ERASE },
+        { 'C', M_OP_COMP }, { 'A', M_OP_ACCES },
+    };
+    sim_trace_t *t;
+    char line[128], op, flag[8];
+    unsigned long lba, blocks;
+    int n = 0, lineno = 0, i, f;
+    FILE *fp;
+
+    fp = fopen( path, "r" );
+    t  = calloc( SIM_TRACE_MAX, sizeof(sim_trace_t) );
+    if ( fp == NULL || t == NULL ) {
+        fprintf( stderr, "simdrive: could not load trace %s\n", path );
+        exit( 1 );
+    }
+    *bytes = 0;
+    while ( fgets( line, sizeof line, fp ) ) {
+        lineno++;
+        f = sscanf( line, " %c %lu %lu %7s", &op, &lba, &blocks, flag );
+        if ( f <= 0 || op == '#' )
+            continue;
+        for ( i = 0; i < 5 && ops[i].c != op; i++ )
+            ;
+        if ( f < 3 || i == 5 || lba + blocks > SIM_BLKCOUNT || n == SIM_TRACE_MAX ) {
+            fprintf( stderr, "simdrive: %s:%i: bad command\n", path, lineno );
+            exit( 1 );
+        }
+        t[n].opcode   = ops[i].opcode;
+        t[n].modifier = f == 4 && flag[0] == 'x' ? M_MD_EXPRS : 0;
+        t[n].lba      = lba;
+        t[n].bytecnt  = blocks * SIM_BLKSIZE;
+        if ( t[n].bytecnt > *bytes )
+            *bytes = t[n].bytecnt;
+        n++;
+    }
+    fclose( fp );
+    *count = n;
+    return t;
+}
+
+/**
+ * Bring the port up and run the phases. With -2 this runs on core 1,
+ * which owns the LESI bus and the model of the host.
+ * @return The exit status
+ */
+static int sim_bench( void ) {
+    sim_phase_t phases[5] = {
+        { .name = "ring",   .opcode = M_OP_READ  },
+        { .name = "read",   .opcode = M_OP_READ  },
+        { .name = "write",  .opcode = M_OP_WRITE },
+        { .name = "flush",  .opcode = M_OP_FLUSH, .modifier = M_MD_FLENU, .count = 1 },
+        { .name = "reread", .opcode = M_OP_READ, .span = 2 },
+    };
+    sim_phase_t online = { .name = "online", .opcode = M_OP_ONLIN };
+    klesisim_stats_t s0;
+    lesi_ua_stats_t u0;
+    int i, segsz, fails = 0;
+    unsigned long w0, m0, r0, x0;
+    uint32_t buf;
+    uint64_t t0;
+
+    online.unitflgs = unitflgs;
+    hostdrv_setup( SIM_RING_LOG2, SIM_RING_LOG2, SIM_VECTOR );
+    buf = hostdrv_alloc( bytes );
+    for ( i = 0; i < bytes; i++ )
+        klesisim_host_mem()[buf + i] = i * 7;
+
+    /* Bring the port up and the unit online */
+    hostdrv_start();
+    for ( i = 0; i < SIM_MAX_SPINS && !hostdrv_online(); i++ )
+        sim_step();
+    if ( !hostdrv_online() ) {
+        fprintf( stderr, "simdrive: port did not come up\n" );
+        return 1;
+    }
+    if ( sim_run( &online, sim_units, 1 ) || online.errors ) {
+        fprintf( stderr, "simdrive: unit did not come online\n" );
+        return 1;
+    }
+    if ( hotplug && !mirror && sim_hotplug() ) {
+        fprintf( stderr, "simdrive: hot-plug failed\n" );
+        return 1;
+    }
+    fails += sim_edges();
+
+    printf("\nTransport: %s, unit: %s, %i commands per phase, %i bytes, depth %i, %i units\n",
+        lesi_transport->name, use_usb ? "USB" : stripe_n ? "striped images" : image ? "image" : volume ? "FAT image" : "RAM disk",
+        count, bytes, depth, sim_units );
+    phases[1].bytecnt = phases[2].bytecnt = phases[4].bytecnt = bytes;
+    phases[1].buf     = phases[2].buf     = phases[4].buf     = buf;
+    for ( i = 0; i < 5; i++ ) {
+        s0 = *klesisim_stats();
+        u0 = *lesi_ua_stats();
+        hostif_irq_interval( hostif, NULL );
+        hostif->own_reads = hostif->own_reads_avoided = 0;
+        if ( blk_process )
+            blkdrv_stats_reset( server->c_unit );
+        w0 = server->c_unit->u_writes;
+        m0 = server->c_unit->u_merged;
+        if ( stripe_n )
+            stripe_stats_reset( &stripe );
+        if ( mirror ) {
+            mirror_stats_reset( mirror );
+            if ( hotplug && phases[i].opcode == M_OP_WRITE ) {
+                printf("\nHot-plug: pulling device 1 for the write phase\n");
+                usbsim_plug( 0, 0 );
+            }
+        }
+        t0 = time_us_64();
+        if ( sim_run( phases + i, phases[i].count ? phases[i].count : count, depth ) )
+            return 1;
+        t0 = time_us_64() - t0;
+        if ( mirror && hotplug && phases[i].opcode == M_OP_WRITE )
+            usbsim_plug( 0, 1 );
+        sim_report( phases + i, t0, &s0, &u0 );
+        sim_report_irq();
+        w0 = server->c_unit->u_writes - w0;
+        m0 = server->c_unit->u_merged - m0;
+        if ( w0 )
+            printf("       %6lu writes, %lu merged into others, %.2f commands per transfer\n",
+                w0, m0, (double) w0 / (w0 - m0) );
+        if ( blk_process ) {
+            sim_report_blk( t0 );
+            printf("       ");
+            mscp_bcache_dump( blkdrv_cache( server->c_unit ) );
+            blkdrv_stats_reset( server->c_unit );
+        }
+        if ( mirror )
+            mirror_dump( mirror );
+        if ( stripe_n )
+            stripe_dump( &stripe );
+        fails += phases[i].errors;
+    }
+
+    /* Both members have to end up with the same data */
+    if ( mirror ) {
+        t0 = time_us_64();
+        for ( i = 0; i < SIM_MAX_SPINS && !mirror_synced( mirror ); i++ )
+            sim_step();
+        t0 = time_us_64() - t0;
+        printf("\nMirror: %s after %llu us\n", mirror_synced( mirror ) ? "in sync" : "NOT in sync",
+            (unsigned long long) t0 );
+        mirror_dump( mirror );
+        if ( !mirror_synced( mirror ) ||
+             memcmp( usbsim_image( 0, 0 ), usbsim_image( 1, 0 ), (size_t) SIM_BLKCOUNT * SIM_BLKSIZE ) ) {
+            printf("Data mismatch between the mirror members\n");
+            fails++;
+        }
+    }
+
+    /* The last WRITE phase stored the host buffer at LBA 0 */
+    if ( bytes && !sim_check( klesisim_host_mem() + buf, bytes ) ) {
+        printf("Data mismatch between host buffer and unit\n");
+        fails++;
+    }
+
+    if ( trace ) {
+        printf("\nTrace %s: %i commands, depth %i, scheduler %s\n", trace, replay.count, depth,
+            (const char *[]) { "fifo", "elevator", "deadline" }[server->c_unit->u_sched] );
+        replay.buf = hostdrv_alloc( trace_bytes );
+        s0 = *klesisim_stats();
+        u0 = *lesi_ua_stats();
+        hostif_irq_interval( hostif, NULL );
+        if ( blk_process )
+            blkdrv_stats_reset( server->c_unit );
+        w0 = server->c_unit->u_writes;
+        m0 = server->c_unit->u_merged;
+        r0 = server->c_unit->u_reordered;
+        x0 = server->c_unit->u_starved;
+        t0 = time_us_64();
+        if ( sim_run( &replay, replay.count, depth ) )
+            return 1;
+        t0 = time_us_64() - t0;
+        sim_report( &replay, t0, &s0, &u0 );
+        printf("       latency avg %8.1f us, max %8llu us, %lu issued ahead of earlier commands, %lu starved\n",
+            (double) replay.lat_sum / replay.done, (unsigned long long) replay.lat_max,
+            server->c_unit->u_reordered - r0, server->c_unit->u_starved - x0 );
+        w0 = server->c_unit->u_writes - w0;
+        m0 = server->c_unit->u_merged - m0;
+        if ( w0 )
+            printf("       %6lu writes, %lu merged into others, %.2f commands per transfer\n",
+                w0, m0, (double) w0 / (w0 - m0) );
+        if ( blk_process ) {
+            sim_report_blk( t0 );
+            printf("       ");
+            mscp_bcache_dump( blkdrv_cache( server->c_unit ) );
+            blkdrv_stats_reset( server->c_unit );
+        }
+        fails += replay.errors;
+    }
+
+    if ( blk_process && sweep ) {
+        printf("\nSegment size sweep, %i commands of %i bytes, depth %i\n", count, bytes, depth );
+        for ( segsz = 512; segsz <= BLKDRV_SEG_MAX; segsz *= 2 ) {
+            blkdrv_set_segsize( server->c_unit, M_OP_READ,  segsz );
+            blkdrv_set_segsize( server->c_unit, M_OP_WRITE, segsz );
+            printf("segment %6i bytes:", segsz );
+            for ( i = 1; i < 3; i++ ) {
+                phases[i].issued = phases[i].done = phases[i].errors = 0;
+                t0 = time_us_64();
+                if ( sim_run( phases + i, count, depth ) )
+                    return 1;
+                t0 = time_us_64() - t0;
+                printf(" %s %6.2f MB/s", phases[i].name,
+                    (double) phases[i].done * phases[i].bytecnt / t0 );
+                fails += phases[i].errors;
+            }
+            printf("\n");
+        }
+        blkdrv_stats_reset( server->c_unit );
+    }
+
+    mscp_pools_dump();
+    if ( blk_process )
+        blkdrv_pools_dump();
+    if ( volume )
+        fatvol_dump( &fatvol );
+    printf("Command ring stalls for lack of packets: %lu\n", hostif->cring_stalls);
+    printf("Result: %s\n", fails ? "FAILED" : "OK");
+    return fails ? 1 : 0;
+}
+
+static void sim_core1( void ) {
+    sim_result = sim_bench();
+    atomic_store( &sim_done, 1 );
+}
+
+int main( int argc, char **argv ) {
+    const char *policy = NULL;
+    int pio = 0, segsz = 0, split = 0;
+    int c;
+
+    while ( (c = getopt( argc, argv, "2puD:L:MHf:R:z:TF:wn:b:q:s:So:t:" )) != -1 ) {
+        switch ( c ) {
+            case '2': split = 1; break;
+            case 'p': pio   = 1; break;
+            case 'u': use_usb = 1; break;
+            case 'D': use_usb = 1; sim_devs = atoi( optarg ); break;
+            case 'L': use_usb = 1; sim_luns = atoi( optarg ); break;
+            case 'M': use_usb = 1; sim_devs = 2; usbmsc_set_mirror( 1 ); mirror = usbmsc_mirror(); break;
+            case 'H': use_usb = 1; hotplug  = 1; break;
+            case 'f': image = optarg; break;
+            case 'R': stripe_n = atoi( optarg ); break;
+            case 'z': stripe_ss = atoi( optarg ); break;
+            case 'T': slow_images = 1; break;
+            case 'F': volume = optarg; break;
+            case 'w': unitflgs = M_UF_WBKNV; break;
+            case 'n': count = atoi( optarg ); break;
+            case 'b': bytes = atoi( optarg ) & ~1; break;
+            case 'q': depth = atoi( optarg ); break;
+            case 's': segsz = atoi( optarg ); break;
+            case 'S': sweep = 1; break;
+            case 'o': policy = optarg; break;
+            case 't': trace = optarg; break;
+            default:
+                fprintf( stderr, "Usage: %s [-2] [-p] [-u] [-D devices] [-L luns] [-M] [-H] [-f image] [-R members]"
+                                 " [-z blocks] [-T] [-F volume] [-w] [-n commands] [-b bytes] [-q depth] [-s bytes] [-S] [-o policy]"
+                                 " [-t trace]\n", argv[0] );
+                return 2;
+        }
+    }
+    if ( sim_devs < 1 || sim_devs > USBSIM_DEVS || sim_luns < 1 || sim_luns > USBSIM_LUNS ||
+         (hotplug && split) || (mirror && (sim_devs != 2 || sim_luns != 1)) ||
+         stripe_n < 0 || stripe_n > STRIPE_MEMBERS || (stripe_n && !image) || stripe_ss < 1 ) {
+        fprintf( stderr, "simdrive: at most %i devices of %i LUNs, -H not with -2, -M only with 2 devices of 1 LUN,"
+                         " -R up to %i members with -f\n",
+            USBSIM_DEVS, USBSIM_LUNS, STRIPE_MEMBERS );
+        return 2;
+    }
+
+    klesisim_setup( LESI_SR_IDENT_QBUS, SIM_MEMSIZE );
+    lesi_set_transport( pio ? &lesi_pio_transport : &lesi_sim_transport );
+    lesi_lowlevel_setup();
+    lesi_lowlevel_set_pwrgood(0);
+    lesi_lowlevel_set_pwrgood(1);
+    lesi_lowlevel_reset_klesi();
+
+    hostif = hostif_setup();
+    server = mscps_setup();
+    mscps_attach( server, hostif );
+    if ( use_usb || image || volume ) {
+        if ( use_usb )
+            usbdisk_attach();
+        else if ( image && stripe_n )
+            stripedisk_attach();
+        else if ( image )
+            imgdisk_attach();
+        else
+            fatdisk_attach();
+        if ( segsz ) {
+            blkdrv_set_segsize( server->c_unit, M_OP_READ,  segsz );
+            blkdrv_set_segsize( server->c_unit, M_OP_WRITE, segsz );
+        }
+    } else
+        ramdisk_attach();
+    if ( policy ) {
+        if ( !strcmp( policy, "fifo" ) )
+            server->c_unit->u_sched = MSCP_SCHED_FIFO;
+        else if ( !strcmp( policy, "elevator" ) )
+            server->c_unit->u_sched = MSCP_SCHED_ELEVATOR;
+        else if ( !strcmp( policy, "deadline" ) )
+            server->c_unit->u_sched = MSCP_SCHED_DEADLINE;
+        else {
+            fprintf( stderr, "simdrive: unknown scheduler %s\n", policy );
+            return 2;
+        }
+    }
+    if ( trace ) {
+        replay.trace   = sim_trace_load( trace, &replay.count, &trace_bytes );
+        replay.t_issue = calloc( replay.count + 1, sizeof(uint64_t) );
+    }
+
+    if ( split ) {
+        if ( !mscps_split( server ) ) {
+            fprintf( stderr, "simdrive: could not split the server from the port\n" );
+            return 1;
+        }
+        multicore_launch_core1( sim_core1 );
+
+        /* Core 0 runs the server until the benchmark on core 1 is over */
+        while ( !atomic_load( &sim_done ) ) {
+            mscps_loop( server );
+            if ( blk_process )
+                blk_process();
+            sched_yield();
+        }
+        return sim_result;
+    }
+    return sim_bench();
+}
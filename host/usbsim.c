@@ -0,0 +1,291 @@
+/**
+ * @file host/usbsim.c
+ *
+ * This file implements simulated USB mass storage devices behind the
+ * subset of the TinyUSB host API that driver/usbmsc.c uses, so the USB
+ * unit driver can run unmodified in host builds.
+ *
+ * Up to USBSIM_DEVS devices with the same number of LUNs each can be
+ * plugged in, device n at bus address n + 1. Every LUN holds its medium
+ * in memory and, like a Bulk-Only Transport device, each device executes
+ * one SCSI command at a time for all of its LUNs. Every command takes a
+ * fixed time for the CBW and CSW stages plus a time per data byte, on
+ * the wall clock. Completion callbacks are made from tuh_task(), as in
+ * TinyUSB, and a new command may be started from inside one.
+ *
+ * The default timing is 250 us per command and 1 us per byte, roughly a
+ * flash drive on the full speed root port of the RP2040.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pico/time.h>
+
+#include "tusb.h"
+#include "bsp/board.h"
+#include "host/usbsim.h"
+
+typedef struct usbsim_dev {
+    uint8_t  *image[USBSIM_LUNS];
+
+    int       attached;
+    int       mounted;
+
+    /* Command in progress */
+    int       busy;
+    uint64_t  done_at;
+    msc_cbw_t cbw;
+    msc_csw_t csw;
+    void     *data;
+    tuh_msc_complete_cb_t cb;
+    uintptr_t arg;
+} usbsim_dev_t;
+
+static struct {
+    usbsim_dev_t dev[USBSIM_DEVS];
+    int       ndevs;
+    int       nluns;
+    uint32_t  blkcount;
+    uint32_t  blksize;
+    uint32_t  cmd_us;
+    uint32_t  ns_per_byte;
+
+    usbsim_stats_t stats;
+} us;
+
+/**
+ * Create the simulated devices and their media. They are plugged in by
+ * tuh_init().
+ * @param blkcount Number of blocks on each medium.
+ * @param blksize  Block size in bytes.
+ * @param ndevs    Number of devices, at most USBSIM_DEVS.
+ * @param nluns    LUNs per device, at most USBSIM_LUNS.
+ */
+void usbsim_setup( uint32_t blkcount, uint32_t blksize, int ndevs, int nluns ) {
+    int d, l;
+
+    for ( d = 0; d < USBSIM_DEVS; d++ )
+        for ( l = 0; l < USBSIM_LUNS; l++ )
+            free( us.dev[d].image[l] );
+    memset( &us, 0, sizeof us );
+    us.ndevs    = ndevs;
+    us.nluns    = nluns;
+    us.blkcount = blkcount;
+    us.blksize  = blksize;
+    for ( d = 0; d < ndevs; d++ ) {
+        for ( l = 0; l < nluns; l++ ) {
+            us.dev[d].image[l] = calloc( blkcount, blksize );
+            if ( us.dev[d].image[l] == NULL ) {
+                fprintf( stderr, "usbsim: could not allocate medium\n" );
+                exit( 1 );
+            }
+        }
+    }
+    usbsim_timing( 250, 1000 );
+}
+
+/**
+ * Set the device timing.
+ * @param cmd_us      Fixed time per command, in microseconds.
+ * @param ns_per_byte Transfer time per data byte, in nanoseconds.
+ */
+void usbsim_timing( uint32_t cmd_us, uint32_t ns_per_byte ) {
+    us.cmd_us      = cmd_us;
+    us.ns_per_byte = ns_per_byte;
+}
+
+uint8_t *usbsim_image( int dev, int lun ) {
+    return us.dev[dev].image[lun];
+}
+
+/**
+ * Plug a device in or pull it out. A device that is pulled forgets the
+ * command in progress without completing it, as TinyUSB does.
+ * @param dev The device
+ * @param in  1 to plug it in, 0 to pull it out
+ */
+void usbsim_plug( int dev, int in ) {
+    usbsim_dev_t *d = us.dev + dev;
+
+    if ( in ) {
+        d->attached = 1;
+        return;
+    }
+    d->attached = 0;
+    d->busy     = 0;
+    if ( d->mounted ) {
+        d->mounted = 0;
+        tuh_msc_umount_cb( dev + 1 );
+        tuh_umount_cb( dev + 1 );
+    }
+}
+
+const usbsim_stats_t *usbsim_stats( void ) {
+    return &us.stats;
+}
+
+void board_init( void ) {
+}
+
+bool tuh_init( uint8_t rhport ) {
+    int d;
+
+    (void) rhport;
+    for ( d = 0; d < us.ndevs; d++ )
+        us.dev[d].attached = 1;
+    return true;
+}
+
+static usbsim_dev_t *usbsim_dev( uint8_t dev_addr ) {
+    if ( dev_addr < 1 || dev_addr > us.ndevs || !us.dev[dev_addr - 1].mounted )
+        return NULL;
+    return us.dev + dev_addr - 1;
+}
+
+/**
+ * Start a SCSI command.
+ */
+static bool usbsim_start( uint8_t dev_addr, uint8_t lun, uint8_t op, uint32_t lba,
+                          uint32_t bytes, void *data, tuh_msc_complete_cb_t cb, uintptr_t arg ) {
+    usbsim_dev_t *d = usbsim_dev( dev_addr );
+
+    if ( d == NULL || d->busy || lun >= us.nluns ) {
+        us.stats.refused++;
+        return false;
+    }
+
+    memset( &d->cbw, 0, sizeof d->cbw );
+    d->cbw.signature   = 0x43425355;
+    d->cbw.tag         = us.stats.commands;
+    d->cbw.total_bytes = bytes;
+    d->cbw.lun         = lun;
+    d->cbw.cmd_len     = 10;
+    d->cbw.command[0]  = op;
+    d->cbw.command[2]  = lba >> 24;
+    d->cbw.command[3]  = lba >> 16;
+    d->cbw.command[4]  = lba >> 8;
+    d->cbw.command[5]  = lba;
+    d->cbw.command[7]  = (bytes / us.blksize) >> 8;
+    d->cbw.command[8]  = (bytes / us.blksize);
+
+    d->data    = data;
+    d->cb      = cb;
+    d->arg     = arg;
+    d->busy    = 1;
+    d->done_at = time_us_64() + us.cmd_us + (uint64_t) bytes * us.ns_per_byte / 1000;
+    return true;
+}
+
+/**
+ * Carry out the data stage of the command in progress and fill in the CSW.
+ */
+static void usbsim_execute( usbsim_dev_t *d ) {
+    uint8_t *image = d->image[d->cbw.lun];
+    uint32_t lba, bytes;
+
+    memset( &d->csw, 0, sizeof d->csw );
+    d->csw.signature = 0x53425355;
+    d->csw.tag       = d->cbw.tag;
+    d->csw.status    = MSC_CSW_STATUS_PASSED;
+
+    lba   = ((uint32_t) d->cbw.command[2] << 24) | ((uint32_t) d->cbw.command[3] << 16) |
+            ((uint32_t) d->cbw.command[4] <<  8) | d->cbw.command[5];
+    bytes = d->cbw.total_bytes;
+
+    switch ( d->cbw.command[0] ) {
+        case SCSI_CMD_INQUIRY:
+            memset( d->data, 0, sizeof(scsi_inquiry_resp_t) );
+            memcpy( ((scsi_inquiry_resp_t *) d->data)->vendor_id,   "LESIDRV ", 8 );
+            memcpy( ((scsi_inquiry_resp_t *) d->data)->product_id,  "SIMULATED DISK  ", 16 );
+            memcpy( ((scsi_inquiry_resp_t *) d->data)->product_rev, "1.0 ", 4 );
+            return;
+        case SCSI_CMD_READ_10:
+        case SCSI_CMD_WRITE_10:
+            if ( (uint64_t) lba * us.blksize + bytes > (uint64_t) us.blkcount * us.blksize ) {
+                d->csw.status       = MSC_CSW_STATUS_FAILED;
+                d->csw.data_residue = bytes;
+                return;
+            }
+            if ( d->cbw.command[0] == SCSI_CMD_READ_10 )
+                memcpy( d->data, image + (size_t) lba * us.blksize, bytes );
+            else
+                memcpy( image + (size_t) lba * us.blksize, d->data, bytes );
+            us.stats.bytes += bytes;
+            return;
+    }
+}
+
+/**
+ * Run the simulated host stack: mount a device that was plugged in, one
+ * per call, and complete the commands in progress whose time is up.
+ */
+void tuh_task( void ) {
+    tuh_msc_complete_data_t cb_data;
+    usbsim_dev_t *d;
+    uint64_t now = time_us_64();
+    int i;
+
+    for ( i = 0; i < us.ndevs; i++ ) {
+        d = us.dev + i;
+        if ( d->attached && !d->mounted ) {
+            d->mounted = 1;
+            tuh_mount_cb( i + 1 );
+            tuh_msc_mount_cb( i + 1 );
+            return;
+        }
+    }
+
+    for ( i = 0; i < us.ndevs; i++ ) {
+        d = us.dev + i;
+        if ( !d->busy || now < d->done_at )
+            continue;
+
+        usbsim_execute( d );
+        d->busy = 0;
+        us.stats.commands++;
+
+        cb_data.cbw       = &d->cbw;
+        cb_data.csw       = &d->csw;
+        cb_data.scsi_data = d->data;
+        cb_data.user_arg  = d->arg;
+        if ( d->cb )
+            d->cb( i + 1, &cb_data );
+    }
+}
+
+bool tuh_msc_mounted( uint8_t dev_addr ) {
+    return usbsim_dev( dev_addr ) != NULL;
+}
+
+bool tuh_msc_ready( uint8_t dev_addr ) {
+    return tuh_msc_mounted( dev_addr ) && !us.dev[dev_addr - 1].busy;
+}
+
+uint8_t tuh_msc_get_maxlun( uint8_t dev_addr ) {
+    return tuh_msc_mounted( dev_addr ) ? us.nluns : 0;
+}
+
+uint32_t tuh_msc_get_block_count( uint8_t dev_addr, uint8_t lun ) {
+    return us.blkcount;
+}
+
+uint32_t tuh_msc_get_block_size( uint8_t dev_addr, uint8_t lun ) {
+    return us.blksize;
+}
+
+bool tuh_msc_inquiry( uint8_t dev_addr, uint8_t lun, scsi_inquiry_resp_t *response,
+                      tuh_msc_complete_cb_t complete_cb, uintptr_t arg ) {
+    return usbsim_start( dev_addr, lun, SCSI_CMD_INQUIRY, 0, 0, response, complete_cb, arg );
+}
+
+bool tuh_msc_read10( uint8_t dev_addr, uint8_t lun, void *buffer, uint32_t lba,
+                     uint16_t block_count, tuh_msc_complete_cb_t complete_cb, uintptr_t arg ) {
+    return usbsim_start( dev_addr, lun, SCSI_CMD_READ_10, lba, block_count * us.blksize,
+                         buffer, complete_cb, arg );
+}
+
+bool tuh_msc_write10( uint8_t dev_addr, uint8_t lun, void const *buffer, uint32_t lba,
+                      uint16_t block_count, tuh_msc_complete_cb_t complete_cb, uintptr_t arg ) {
+    return usbsim_start( dev_addr, lun, SCSI_CMD_WRITE_10, lba, block_count * us.blksize,
+                         (void *) buffer, complete_cb, arg );
+}
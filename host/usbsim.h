@@ -0,0 +1,26 @@
+/**
+ * @file host/usbsim.h
+ *
+ * Interface to the simulated USB mass storage device.
+ */
+#ifndef _USBSIM_H_
+#define _USBSIM_H_
+
+#include <stdint.h>
+
+#define USBSIM_DEVS (2)
+#define USBSIM_LUNS (2)
+
+typedef struct usbsim_stats {
+    unsigned long commands;
+    unsigned long bytes;
+    unsigned long refused;
+} usbsim_stats_t;
+
+void     usbsim_setup ( uint32_t blkcount, uint32_t blksize, int ndevs, int nluns );
+void     usbsim_timing( uint32_t cmd_us, uint32_t ns_per_byte );
+uint8_t *usbsim_image ( int dev, int lun );
+void     usbsim_plug  ( int dev, int in );
+const usbsim_stats_t *usbsim_stats( void );
+
+#endif
@@ -18,4 +18,12 @@
 #define LESI_DELAY_WR_STROBE  (3)
 #define LESI_DELAY_WR_SETUP   (3)
 #define LESI_DELAY_PWRGOOD    (10)
-#define LESI_DELAY_AC_CLEAR   (500)
\ No newline at end of file
+#define LESI_DELAY_AC_CLEAR   (500)
+/* T1 is not trusted for this long after a command cycle, unless it was */
+/* seen to fall. Waits for the KLESI time out after LESI_T1_TIMEOUT_US,  */
+/* waits for the host (SA handshake, interrupt grant) do not.            */
+#define LESI_DELAY_T1_SETTLE  (50)
+#define LESI_T1_TIMEOUT_US    (10000)
+
+/* PIO cycle engine clock divider, 4 gives 32 ns per instruction at 125 MHz */
+#define LESI_PIO_CLKDIV       (4.0f)
@@ -3,8 +3,9 @@
  * @author Peter Bosch <public@pbx.sh>
  *
  * This file implements basic actions controlling the KLESI adapter, using
- * the lesi/lowlevel.c routines for basic signalling. As a result this code
- * should be platform independent, provided that lowlevel.c is ported.
+ * the lesi_lowlevel_ routines of the selected transport (see lesi.h) for
+ * basic signalling. As a result this code is platform independent, only
+ * a transport needs to be ported.
  *
  * The functionality provided here includes:
  *    * Writing to and reading from KLESI internal registers.
@@ -17,6 +18,17 @@
 
 #include "lesi/lesi.h"
 
+const lesi_transport_t *lesi_transport;
+
+/**
+ * Select the transport used to reach the KLESI adapter. This must be done
+ * before any of the other routines are used.
+ * @param t The transport, for example lesi_pio_transport.
+ */
+void lesi_set_transport( const lesi_transport_t *t ) {
+    lesi_transport = t;
+}
+
 /**
  * Write to a single register on the KLESI card
  * @param addr Must be one of the LESI_REG_ constants
@@ -174,7 +186,45 @@ int lesi_read_ram_word( int addr, uint16_t *data ) {
 }
 
 /**
- * Set the KLESI host address register
+ * Shadow of the adapter's host address (UA) register. The adapter
+ * advances UA by one word for every word moved by an NPR, so after a
+ * transfer it often already holds the next address we need, or differs
+ * only in one of its halves. The shadow is only trusted while valid is
+ * set, it is cleared whenever the adapter state is unknown.
+ */
+static struct {
+    int      valid;
+    uint32_t ua;
+} lesi_ua;
+
+static lesi_ua_stats_t lesi_ua_stat;
+
+/**
+ * Forget the shadowed host address. Must be called whenever the adapter
+ * may have been reset or a transfer failed.
+ */
+void lesi_ua_invalidate( void ) {
+    lesi_ua.valid = 0;
+}
+
+/**
+ * Account for the host address advance caused by an NPR transfer.
+ * @param count The number of words that were transferred.
+ */
+void lesi_ua_advance( int count ) {
+    lesi_ua.ua += 2 * count;
+}
+
+/**
+ * Returns the host address shadow statistics.
+ */
+const lesi_ua_stats_t *lesi_ua_stats( void ) {
+    return &lesi_ua_stat;
+}
+
+/**
+ * Set the KLESI host address register. Halves of the register that
+ * already hold the right value are not written.
  * @param addr The host bus address to send to the adapter
  * @return one of the ERR_ status codes
  */
@@ -182,12 +232,34 @@ int lesi_set_host_addr( uint32_t addr ) {
     int status;
 
     /* Write the low 16 bit of the address to the UAL register */
-    status = lesi_write_reg( LESI_REG_UAL, addr );
-    if ( status )
-        return status;
+    if ( lesi_ua.valid && (uint16_t) lesi_ua.ua == (uint16_t) addr ) {
+        lesi_ua_stat.elided++;
+        lesi_ua_stat.cycles_saved += 2;
+    } else {
+        lesi_ua_stat.writes++;
+        status = lesi_write_reg( LESI_REG_UAL, addr );
+        if ( status ) {
+            lesi_ua_invalidate();
+            return status;
+        }
+    }
 
     /* Write the high bits of the address to the UAH register */
-    return lesi_write_reg( LESI_REG_UAH, addr >> 16 );
+    if ( lesi_ua.valid && (lesi_ua.ua >> 16) == (addr >> 16) ) {
+        lesi_ua_stat.elided++;
+        lesi_ua_stat.cycles_saved += 2;
+    } else {
+        lesi_ua_stat.writes++;
+        status = lesi_write_reg( LESI_REG_UAH, addr >> 16 );
+        if ( status ) {
+            lesi_ua_invalidate();
+            return status;
+        }
+    }
+
+    lesi_ua.ua    = addr;
+    lesi_ua.valid = 1;
+    return ERR_OK;
 }
 
 /**
@@ -202,6 +274,10 @@ int lesi_handle_status( void ) {
     if ( status )
         return status;
 
+    /* After a failed transfer the host address is no longer known */
+    if ( sr & (LESI_SR_BUS_PE | LESI_SR_LESI_PE | LESI_SR_NXM) )
+        lesi_ua_invalidate();
+
     if ( sr & LESI_SR_BUS_PE )  /* Q/UNIBUS parity error */
         return ERR_HPARITY;
     if ( sr & LESI_SR_LESI_PE ) /* LESI parity error */
@@ -270,6 +346,21 @@ int lesi_send_intr( uint16_t vector ) {
     if ( status )
         return status;
 
+    return ERR_OK;
+}
+
+/**
+ * Wait for the KLESI to deliver an interrupt sent by lesi_send_intr().
+ *
+ * Like the SA handshake this has no timeout: the host grants the interrupt
+ * only once it drops below the device's priority level, which takes as long
+ * as it runs at a raised IPL or sits halted in the console. An INIT from the
+ * host still ends the wait.
+ *
+ * @return one of the ERR_ status codes
+ */
+int lesi_wait_intr( void ) {
+    return lesi_lowlevel_wait_ready();
 }
 
 /**
@@ -48,17 +48,166 @@
 #define LESI_SR_NXM           (0x0080)
 
 
-/* Prototypes for the low level routines in lesi/lowlevel.c */
-void lesi_lowlevel_setup();
-int  lesi_lowlevel_write( uint16_t data, int cmd );
-int  lesi_lowlevel_read( uint16_t *data );
-int  lesi_lowlevel_read_strobe( int waitxfer );
-int  lesi_lowlevel_wait_ready();
-int  lesi_lowlevel_wait_busy();
-void lesi_lowlevel_set_pwrgood( int good );
-void lesi_lowlevel_reset_klesi();
-void lesi_clear_init();
-int  lesi_check_init();
+/* LESI bus parity: bit 0 covers the low byte, bit 1 the high byte */
+static inline uint8_t lesi_pareven8( uint8_t v ) {
+    return (0x6996u >> ((v ^ (v >> 4)) & 0xf)) & 1;
+}
+
+static inline uint8_t lesi_parity( uint16_t v ) {
+    return lesi_pareven8( v ) | (lesi_pareven8( v >> 8 ) << 1);
+}
+
+
+/**
+ * A LESI transport implements the bus cycle primitives and control
+ * signals for one way of reaching a KLESI adapter. The routines in
+ * lesi/klesi.c and lesi/npr.c only use these, via the lesi_lowlevel_
+ * wrappers below.
+ */
+typedef struct lesi_transport {
+    const char *name;
+    /** Configure the interface and register for INIT */
+    void (*setup)      ( void );
+    /** Issue a command or data write cycle */
+    int  (*write)      ( uint16_t data, int cmd );
+    /** Sample C/D and check parity */
+    int  (*read)       ( uint16_t *data );
+    /** Strobe for the next read, optionally holding STROBE until T1 */
+    int  (*read_strobe)( int waitxfer );
+    /** Read consecutive words, strobing in between. Optional, see below */
+    int  (*read_burst) ( uint16_t *data, int count );
+    /** Wait for T1 to be asserted (adapter ready), without a timeout as
+        the host may take any time to answer the SA register */
+    int  (*wait_ready) ( void );
+    /** Wait for T1 to be deasserted (adapter busy), ERR_BARB_TO if it
+        does not start the operation within LESI_T1_TIMEOUT_US */
+    int  (*wait_busy)  ( void );
+    /** Check whether the adapter is ready again since the last command
+        cycle, without waiting. Returns ERR_BUSY until then, or
+        ERR_DATA_TO after LESI_T1_TIMEOUT_US. Optional, see
+        lesi_lowlevel_ready_poll() */
+    int  (*ready_poll) ( void );
+    void (*set_pwrgood)( int good );
+    void (*reset_klesi)( void );
+    /** Handle an INIT request and clear the INIT state */
+    void (*clear_init) ( void );
+    /** Returns non-zero if an INIT was seen */
+    int  (*check_init) ( void );
+} lesi_transport_t;
+
+/* Bit-banged GPIO transport in lesi/lowlevel.c */
+extern const lesi_transport_t lesi_gpio_transport;
+/* PIO cycle engine transport in lesi/pio.c */
+extern const lesi_transport_t lesi_pio_transport;
+/* Simulated KLESI, host builds only */
+extern const lesi_transport_t lesi_sim_transport;
+
+/* Host address register shadow statistics, see lesi_set_host_addr() */
+typedef struct lesi_ua_stats {
+    /** UAL or UAH register writes issued */
+    unsigned long writes;
+    /** UAL or UAH register writes skipped */
+    unsigned long elided;
+    /** LESI cycles saved by the skipped writes */
+    unsigned long cycles_saved;
+} lesi_ua_stats_t;
+
+void lesi_ua_invalidate( void );
+void lesi_ua_advance( int count );
+const lesi_ua_stats_t *lesi_ua_stats( void );
+
+/* The transport in use, see lesi_set_transport() */
+extern const lesi_transport_t *lesi_transport;
+
+void lesi_set_transport( const lesi_transport_t *t );
+
+static inline void lesi_lowlevel_setup( void ) {
+    lesi_transport->setup();
+}
+
+static inline int lesi_lowlevel_write( uint16_t data, int cmd ) {
+    return lesi_transport->write( data, cmd );
+}
+
+static inline int lesi_lowlevel_read( uint16_t *data ) {
+    return lesi_transport->read( data );
+}
+
+static inline int lesi_lowlevel_read_strobe( int waitxfer ) {
+    return lesi_transport->read_strobe( waitxfer );
+}
+
+/**
+ * Read count consecutive words from the selected register, strobing
+ * between them. Transports that queue cycles can keep several reads in
+ * flight, the others fall back to single reads.
+ */
+static inline int lesi_lowlevel_read_burst( uint16_t *data, int count ) {
+    int status;
+
+    if ( lesi_transport->read_burst )
+        return lesi_transport->read_burst( data, count );
+
+    while ( count-- ) {
+        status = lesi_transport->read( data++ );
+        if ( status )
+            return status;
+        if ( count ) {
+            status = lesi_transport->read_strobe( 0 );
+            if ( status )
+                return status;
+        }
+    }
+    return ERR_OK;
+}
+
+static inline int lesi_lowlevel_wait_ready( void ) {
+    return lesi_transport->wait_ready();
+}
+
+/**
+ * Check whether the adapter became ready. Transports that can not check
+ * T1 without blocking wait for it instead.
+ * @return ERR_OK once T1 is asserted, ERR_BUSY before, or an error code
+ */
+static inline int lesi_lowlevel_ready_poll( void ) {
+    if ( lesi_transport->ready_poll )
+        return lesi_transport->ready_poll();
+    return lesi_transport->wait_ready();
+}
+
+static inline int lesi_lowlevel_wait_busy( void ) {
+    return lesi_transport->wait_busy();
+}
+
+static inline void lesi_lowlevel_set_pwrgood( int good ) {
+    lesi_transport->set_pwrgood( good );
+}
+
+static inline void lesi_lowlevel_reset_klesi( void ) {
+    lesi_ua_invalidate();
+    lesi_transport->reset_klesi();
+}
+
+static inline void lesi_clear_init( void ) {
+    lesi_ua_invalidate();
+    lesi_transport->clear_init();
+}
+
+static inline int lesi_check_init( void ) {
+    return lesi_transport->check_init();
+}
+
+/* Control signal routines shared by the GPIO and PIO transports */
+void lesi_ctl_setup( void );
+void lesi_ctl_set_pwrgood( int good );
+void lesi_ctl_reset_klesi( void );
+void lesi_ctl_clear_init( void );
+int  lesi_ctl_check_init( void );
+void lesi_ctl_t1_arm( void );
+int  lesi_ctl_t1_ready( void );
+int  lesi_ctl_t1_busy( void );
+uint32_t lesi_ctl_t1_elapsed( void );
 
 /* Prototypes for the routines in lesi/klesi.c */
 int lesi_write_reg( int addr, uint16_t data );
@@ -71,6 +220,7 @@ int lesi_read_ram_word( int addr, uint16_t *data );
 int lesi_set_host_addr( uint32_t addr );
 int lesi_handle_status( void );
 int lesi_send_intr( uint16_t vector);
+int lesi_wait_intr( void );
 int lesi_sa_intr  ( uint16_t vector, uint16_t status );
 int lesi_sa_write ( uint16_t sa );
 int lesi_sa_read  ( uint16_t *data ); 
@@ -78,9 +228,61 @@ int lesi_sa_end   ( void ) ;
 int lesi_sa_read_response( uint16_t *data );
 int lesi_sa_read_response_intr( uint16_t *data );
 
+/**
+ * One segment of a scatter-gather DMA transfer. For writes the buffer is
+ * only read from.
+ */
+typedef struct lesi_sg {
+    /** Host bus address of the segment */
+    uint32_t  addr;
+    /** Local buffer */
+    void     *buf;
+    /** Length in words */
+    int       count;
+} lesi_sg_t;
+
+/* lesi_dma_t phases */
+/** Between blocks, the bus is free for other operations */
+#define LESI_DMA_IDLE   (0)
+/** An NPR is running, the adapter accepts no cycles until it completes */
+#define LESI_DMA_NPR    (1)
+/** Finished, the result is in status */
+#define LESI_DMA_DONE   (2)
+
+/** lesi_dma_start() address meaning "from the current UA register value" */
+#define LESI_DMA_CURADDR (0xFFFFFFFFu)
+
+/**
+ * A DMA transfer that is moved along by lesi_dma_poll() instead of
+ * waiting for each NPR to complete. The bus is free between blocks, so
+ * a transfer with its own host address may be interleaved with other
+ * LESI operations whenever it is in the LESI_DMA_IDLE phase.
+ */
+typedef struct lesi_dma {
+    /** Host bus address of the next block, or LESI_DMA_CURADDR */
+    uint32_t  addr;
+    /** Local buffer position of the next block, NULL writes zeros */
+    uint16_t *buf;
+    /** Words not yet started */
+    int       remain;
+    /** Words in the block being transferred */
+    int       bcount;
+    /** Set to move data to host memory */
+    int       write;
+    /** One of the LESI_DMA_ phases */
+    int       phase;
+    /** Result of the transfer, valid in the LESI_DMA_DONE phase */
+    int       status;
+} lesi_dma_t;
+
 /* Prototypes for the DMA routines in lesi/npr.c */
+void lesi_dma_start( lesi_dma_t *op, int write, uint32_t addr, void *buf, int count );
+int  lesi_dma_poll ( lesi_dma_t *op );
+int  lesi_dma_wait ( lesi_dma_t *op );
 int lesi_read_dma( uint16_t *buffer, int count );
 int lesi_write_dma( const uint16_t *buffer, int count );
 int lesi_write_dma_zeros( int count );
+int lesi_read_dma_sg ( const lesi_sg_t *sg, int nseg );
+int lesi_write_dma_sg( const lesi_sg_t *sg, int nseg );
 
 #endif
\ No newline at end of file
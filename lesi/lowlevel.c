@@ -10,6 +10,10 @@
  * signalling via GPIO pins into more understandable functions, but does
  * not implement any bus logic beyond basic timing.
  *
+ * The bit-banged cycle primitives here make up lesi_gpio_transport. The
+ * control signal routines (INIT, AC CLEAR, CP OK) are shared with the PIO
+ * cycle engine transport in lesi/pio.c.
+ *
  */
 #include <hardware/watchdog.h>
 #include <pico/stdlib.h>
@@ -46,16 +50,6 @@ void __attribute__((optimize("O0"))) wait_ns(int amount) {
     };
 }
 
-/* Parity helpers */
-static inline uint8_t pareven8(uint8_t v)
-{
-    return (0x6996u >> ((v ^ (v >> 4)) & 0xf)) & 1;
-}
-
-static inline uint8_t parhilo( uint16_t v ) {
-    return (pareven8(v) | (pareven8(v >> 8) << 1));
-} 
-
 /* GPIO helpers */
 
 static int lesi_bus_dir = -1;
@@ -97,7 +91,7 @@ static inline int lesi_bus_read( uint16_t *data ) {
     datin = gpio_get_all() & LESI_DATA_PAR_MASK;
     par   = ((datin >> LESI_PAR_PIN)) & 3u;
     *data  = (~(datin >> LESI_D0_PIN)) & 0xFFFFu;
-    parexp = parhilo( *data );
+    parexp = lesi_parity( *data );
 
     if (parexp != par )
         return ERR_LPARITY;
@@ -110,18 +104,74 @@ static inline int lesi_bus_read( uint16_t *data ) {
 
 volatile int saw_init = 0;
 
+/* T1 edges counted by lesi_ctl_irq(), and the counts and time at the */
+/* last command cycle                                                 */
+static volatile uint32_t lesi_t1_falls, lesi_t1_rises;
+static uint32_t lesi_t1_arm_falls, lesi_t1_arm_rises, lesi_t1_arm_time;
+
 /**
- * ISR for LESI INIT L state change interrupt
+ * ISR for LESI INIT L and T1 state change interrupts
  */
-void lesi_init_irq(uint gpio, uint32_t event_mask) {
+static void lesi_ctl_irq(uint gpio, uint32_t event_mask) {
+    if ( gpio == LESI_T1_PIN ) {
+        if ( event_mask & GPIO_IRQ_EDGE_FALL )
+            lesi_t1_falls++;
+        if ( event_mask & GPIO_IRQ_EDGE_RISE )
+            lesi_t1_rises++;
+        return;
+    }
     printf("Init received!\n");
     saw_init = 1;
 }
 
+/**
+ * Start following T1 for a command cycle that may make the KLESI busy.
+ * Called by the transports right after every command cycle.
+ */
+void lesi_ctl_t1_arm( void ) {
+    lesi_t1_arm_time  = time_us_32();
+    lesi_t1_arm_rises = lesi_t1_rises;
+    /* The fall may not have been counted yet */
+    lesi_t1_arm_falls = lesi_t1_falls - !gpio_get( LESI_T1_PIN );
+}
+
+/**
+ * Check whether the KLESI finished what the last command cycle started.
+ *
+ * That is the case once T1 fell and rose again. If it was not seen to
+ * fall, T1 is trusted after LESI_DELAY_T1_SETTLE, as not every command
+ * makes the KLESI busy.
+ * @return Non-zero if the KLESI is ready
+ */
+int lesi_ctl_t1_ready( void ) {
+    int fell = lesi_t1_falls != lesi_t1_arm_falls;
+
+    if ( fell && lesi_t1_rises != lesi_t1_arm_rises )
+        return 1;
+    if ( !gpio_get( LESI_T1_PIN ) )
+        return 0;
+    return fell || time_us_32() - lesi_t1_arm_time >= LESI_DELAY_T1_SETTLE;
+}
+
+/**
+ * Check whether the KLESI went busy since the last command cycle.
+ * @return Non-zero if T1 fell since
+ */
+int lesi_ctl_t1_busy( void ) {
+    return lesi_t1_falls != lesi_t1_arm_falls || !gpio_get( LESI_T1_PIN );
+}
+
+/**
+ * Returns the time since the last command cycle in microseconds.
+ */
+uint32_t lesi_ctl_t1_elapsed( void ) {
+    return time_us_32() - lesi_t1_arm_time;
+}
+
 /**
  * Handle INIT request and clear INIT flag.
  */
-void lesi_clear_init() {
+void lesi_ctl_clear_init() {
 
     /* Wait for INIT to be deasserted */
     while (gpio_get(LESI_INIT_PIN));
@@ -139,14 +189,14 @@ void lesi_clear_init() {
  * Check whether a LESI INIT was requested
  * @return 0 if no INIT was seen.
  */
-int lesi_check_init() {
+int lesi_ctl_check_init() {
     return saw_init;
 }
 
 /**
  * Configure all needed GPIO pads and register INIT interrupt
  */
-void lesi_lowlevel_setup() {
+void lesi_ctl_setup() {
     int i;
     for ( i = 0; i < 16; i++) {
         gpio_init( LESI_D0_PIN + i );
@@ -177,14 +227,26 @@ void lesi_lowlevel_setup() {
     gpio_put( LESI_STROBE_PIN, 0 );
     gpio_put( LESI_CMD_PIN, 0 );
     gpio_put( LESI_CP_OK_PIN , 0 );
-    lesi_bus_data_dir( LESI_DIR_READ );
 
     /* 
     There is no guaranteed pulse width for the INIT signal,
     as such, we need to use a pin change interrupt to recognize its
     rising edge 
     */
-    gpio_set_irq_enabled_with_callback( LESI_INIT_PIN, GPIO_IRQ_EDGE_RISE, 1, lesi_init_irq );
+    gpio_set_irq_enabled_with_callback( LESI_INIT_PIN, GPIO_IRQ_EDGE_RISE, 1, lesi_ctl_irq );
+
+    /* T1 edges tell when the KLESI went busy and became ready again */
+    gpio_set_irq_enabled( LESI_T1_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, 1 );
+}
+
+static int lesi_gpio_wait_ready();
+
+/**
+ * Configure the GPIO pads and take the C/D bus for bit-banged cycles
+ */
+static void lesi_gpio_setup() {
+    lesi_ctl_setup();
+    lesi_bus_data_dir( LESI_DIR_READ );
 }
 
 /**
@@ -193,11 +255,11 @@ void lesi_lowlevel_setup() {
  * @param cmd  Whether this should be a command cycle.
  * @return Status code.
  */
-int lesi_lowlevel_write( uint16_t data, int cmd ) {
+static int lesi_gpio_write( uint16_t data, int cmd ) {
     uint32_t data_par, par;
 
     /* Parity */
-    par = parhilo( data );
+    par = lesi_parity( data );
 
     /* Pack data and parity */
     data_par  = LESI_DATA_MASK & ~data;
@@ -225,6 +287,7 @@ int lesi_lowlevel_write( uint16_t data, int cmd ) {
         gpio_clr_mask( 1 << LESI_CMD_PIN );
         lesi_bus_data_dir( LESI_DIR_READ );
         wait_ns( LESI_DELAY_CMD_END );
+        lesi_ctl_t1_arm();
     }
 
     if ( saw_init )
@@ -258,7 +321,7 @@ int lesi_lowlevel_write( uint16_t data, int cmd ) {
  * @param data The data read from the bus.
  * @return Status code.
  */
-int lesi_lowlevel_read( uint16_t *data ) {
+static int lesi_gpio_read( uint16_t *data ) {
     int status;
 
     /* Turnaround bus */
@@ -281,7 +344,7 @@ int lesi_lowlevel_read( uint16_t *data ) {
  * @param waitxfer If this is set, the call will block with STROBE asserted until T1 asserts.
  * @return Status code.
  */
-int lesi_lowlevel_read_strobe( int waitxfer ) {
+static int lesi_gpio_read_strobe( int waitxfer ) {
     int status;
     
     if ( saw_init )
@@ -294,7 +357,7 @@ int lesi_lowlevel_read_strobe( int waitxfer ) {
     wait_ns( LESI_DELAY_RD_STROBE );
 
     if ( waitxfer ) {
-        status = lesi_lowlevel_wait_ready();
+        status = lesi_gpio_wait_ready();
         if ( status )
             return status;
     }
@@ -311,13 +374,12 @@ int lesi_lowlevel_read_strobe( int waitxfer ) {
  * Wait for LESI T1 to be asserted (i.e. for the KLESI to become ready).
  * @return Status code.
  */
-int lesi_lowlevel_wait_ready() {
+static int lesi_gpio_wait_ready() {
 #ifdef CFG_DBG_LESI_IO
     printf("LESI WAIT....");
 #endif
-    busy_wait_us(50);
     for ( ;; ) {
-        if ( gpio_get(LESI_T1_PIN) )
+        if ( lesi_ctl_t1_ready() )
             return ERR_OK;
         if ( saw_init )
             return ERR_INIT;
@@ -326,36 +388,50 @@ int lesi_lowlevel_wait_ready() {
 #ifdef CFG_DBG_LESI_IO
     printf("DONE\n");
 #endif
-    //TODO: A better version of this must be possible
+}
+
+/**
+ * Check whether the KLESI finished what the last command started,
+ * without waiting for it.
+ * @return  Status code, ERR_BUSY while the KLESI is busy.
+ */
+static int lesi_gpio_ready_poll() {
+    if ( saw_init )
+        return ERR_INIT;
+    if ( lesi_ctl_t1_ready() )
+        return ERR_OK;
+    if ( lesi_ctl_t1_elapsed() >= LESI_T1_TIMEOUT_US )
+        return ERR_DATA_TO;
+    return ERR_BUSY;
 }
 
 /**
  * Wait for LESI T1 to be deasserted (i.e. for the KLESI to become busy).
  * @return  Status code.
  */
-int lesi_lowlevel_wait_busy() {
+static int lesi_gpio_wait_busy() {
     uint16_t pin;
 #ifdef CFG_DBG_LESI_IO
     printf("LESI WAIT....");
 #endif
-    //busy_wait_us(50);
     for ( ;; ) {
-        if ( !gpio_get(LESI_T1_PIN) )
+        if ( lesi_ctl_t1_busy() )
             return ERR_OK;
         if ( saw_init )
             return ERR_INIT;
+        if ( lesi_ctl_t1_elapsed() >= LESI_T1_TIMEOUT_US )
+            return ERR_BARB_TO;
         app_idle();
     }
 #ifdef CFG_DBG_LESI_IO
     printf("DONE\n");
 #endif
-    //TODO: A better version of this must be possible
 }
 
 /**
  * Sets the controller power good signal.
  */
-void lesi_lowlevel_set_pwrgood( int good ) {
+void lesi_ctl_set_pwrgood( int good ) {
     gpio_put( LESI_CP_OK_PIN, good );
     busy_wait_us_32( LESI_DELAY_PWRGOOD );
 }
@@ -363,9 +439,24 @@ void lesi_lowlevel_set_pwrgood( int good ) {
 /**
  * Sends a reset pulse to the KLESI card
  */
-void lesi_lowlevel_reset_klesi() { 
+void lesi_ctl_reset_klesi() {
     gpio_set_mask( 1 << LESI_AC_CLEAR_PIN );
     busy_wait_us_32( LESI_DELAY_AC_CLEAR );
     gpio_clr_mask( 1 << LESI_AC_CLEAR_PIN );
     busy_wait_us_32( LESI_DELAY_AC_CLEAR );
-}
\ No newline at end of file
+}
+
+const lesi_transport_t lesi_gpio_transport = {
+    .name        = "gpio",
+    .setup       = lesi_gpio_setup,
+    .write       = lesi_gpio_write,
+    .read        = lesi_gpio_read,
+    .read_strobe = lesi_gpio_read_strobe,
+    .wait_ready  = lesi_gpio_wait_ready,
+    .wait_busy   = lesi_gpio_wait_busy,
+    .ready_poll  = lesi_gpio_ready_poll,
+    .set_pwrgood = lesi_ctl_set_pwrgood,
+    .reset_klesi = lesi_ctl_reset_klesi,
+    .clear_init  = lesi_ctl_clear_init,
+    .check_init  = lesi_ctl_check_init,
+};
@@ -4,17 +4,34 @@
  *
  * This file implements DMA reads and writes to the host memory on top
  * of the KLESI driver routines in lesi/klesi.c
+ *
+ * Transfers are split in blocks of up to 16 words, the size of the KLESI
+ * scratchpad. An NPR always ends at the last scratchpad word and the
+ * adapter accepts no LESI cycles until it completes, so blocks cannot
+ * be overlapped with each other. Instead the per-block cycles are kept
+ * to a minimum: scratchpad reads are issued as bursts, consecutive write
+ * blocks are not separated by idle commands, and the status register is
+ * checked once per transfer.
+ *
+ * A transfer is an lesi_dma_t that lesi_dma_poll() moves along one step
+ * at a time, so the caller can do other work while an NPR runs, or run
+ * other LESI operations between blocks. lesi_read_dma() and friends are
+ * the blocking versions.
  */
 
+#include <string.h>
 #include "lesi/lesi.h"
 
+void app_idle();
+
+static const uint16_t zero_buf[16] = {0};
+
 /**
- * Reads a single 0 to 16 word block from host memory.
- * @param buffer The buffer to read the data into
+ * Start the NPR for a 0 to 16 word read block.
  * @param count  The number of words to read from host memory.
  * @return one of the ERR_ status codes
  */
-int lesi_read_dma_block( uint16_t *buffer, int count ) {
+static int lesi_read_dma_issue( int count ) {
     uint16_t cmd;
     int status;
 
@@ -26,80 +43,85 @@ int lesi_read_dma_block( uint16_t *buffer, int count ) {
     } else {
         cmd |= LESI_CMD_WORDCNT( 16 - count );
     }
-    status = lesi_lowlevel_write(  cmd, 1  );
-    if ( status )
-        return status;
+    return lesi_lowlevel_write(  cmd, 1  );
+}
+
+/**
+ * Wait for the NPR started by the last command to complete.
+ * @return one of the ERR_ status codes, ERR_DATA_TO if it never did
+ */
+static int lesi_dma_wait_npr( void ) {
+    int status;
+
+    while ( (status = lesi_lowlevel_ready_poll()) == ERR_BUSY )
+        app_idle();
+    return status;
+}
+
+/**
+ * Read out a block once its NPR completed.
+ * @param buffer The buffer to read the data into
+ * @param count  The number of words in the block.
+ * @return one of the ERR_ status codes
+ */
+static int lesi_read_dma_collect( uint16_t *buffer, int count ) {
+    uint16_t cmd;
+    int status;
+
+    lesi_ua_advance( count >= 16 ? 16 : count );
 
-    /* Wait for the NPR transaction to complete */
-    status = lesi_lowlevel_wait_ready();
-    if ( status )
-        return status;
-    
     /* Stop the NPR from being reissued as we read out the data */
-    cmd &= ~LESI_CMD_DO_NPR;
+    cmd = LESI_CMD_REGSEL(LESI_REG_RAM);
+    if ( count < 16 )
+        cmd |= LESI_CMD_WORDCNT( 16 - count );
     status = lesi_lowlevel_write(  cmd, 1  );
     if ( status )
         return status;
     
-    while ( count-- ) {
-        /* Accept a word of data from the KLESI RAM */
-        status = lesi_lowlevel_read( buffer++ );
-        if ( status )
-            return status;
-        
-        /* Request the next word of data */
-        if ( count ) {
-            status = lesi_lowlevel_read_strobe( 0 );
-            if ( status )
-                return status;
-        }
-    }
-
-    return ERR_OK;
+    /* Accept the data from the KLESI RAM */
+    return lesi_lowlevel_read_burst( buffer, count >= 16 ? 16 : count );
 }
 
 /**
- * Read data from host memory starting at the current host address
- * register value.
- *
- * @param buffer The buffer to read the data into.
+ * Reads a single 0 to 16 word block from host memory.
+ * @param buffer The buffer to read the data into
  * @param count  The number of words to read from host memory.
  * @return one of the ERR_ status codes
  */
-int lesi_read_dma( uint16_t *buffer, int count ) {
-    int bcount = 16, status;
+int lesi_read_dma_block( uint16_t *buffer, int count ) {
+    int status;
 
-    while ( count ) {
-        if ( count < bcount )
-            bcount = count;
-        
-        /* Read the block */
-        status = lesi_read_dma_block( buffer, bcount );
-        if ( status )
-            return status;
+    status = lesi_read_dma_issue( count );
+    if ( status )
+        return status;
 
-        buffer += bcount;
-        count  -= bcount;
-    }
+    /* Wait for the NPR transaction to complete */
+    status = lesi_dma_wait_npr();
+    if ( status )
+        return status;
 
-    /* Present any hardware / bus errors to the calling routine */
-    return lesi_handle_status();
+    return lesi_read_dma_collect( buffer, count );
 }
 
 /**
- * Writes a single 0 to 16 word block of data to host memory.
+ * Fill the scratchpad with a 0 to 16 word block and start the NPR that
+ * writes it to host memory.
  *
- * @param buffer The buffer to read the data into.
+ * The adapter is left with the NPR command selected, the next block's
+ * scratchpad write or lesi_write_dma_finish() replaces it.
+ *
+ * @param buffer The data to write.
  * @param count  The number of words to write.
  * @return one of the ERR_ status codes
  */
-int lesi_write_dma_block( const uint16_t *buffer, int count ) {
+static int lesi_write_dma_issue( const uint16_t *buffer, int count ) {
     uint16_t cmd;
     int status;
 
     /* Send the write RAM command */
     status = lesi_write_ram( 16 - count, buffer, count );
-    //TODO: Why is the status ignored here
+    if ( status )
+        return status;
     
     /* Start the NPR via a WRITE RAM with DO NPR set */
     /* As we don't issue a data cycle, this will not write the scratchpad */
@@ -110,14 +132,41 @@ int lesi_write_dma_block( const uint16_t *buffer, int count ) {
     } else {
         cmd |= LESI_CMD_WORDCNT(16 - count);
     }
-    status = lesi_lowlevel_write(  cmd, 1  );
+    return lesi_lowlevel_write(  cmd, 1  );
+}
+
+/**
+ * Writes a single 0 to 16 word block of data to host memory.
+ *
+ * Errors are collected by lesi_write_dma_finish() once for the whole
+ * transfer.
+ *
+ * @param buffer The buffer to read the data into.
+ * @param count  The number of words to write.
+ * @return one of the ERR_ status codes
+ */
+int lesi_write_dma_block( const uint16_t *buffer, int count ) {
+    int status;
+
+    status = lesi_write_dma_issue( buffer, count );
     if ( status )
         return status;
     
     /* Wait for the NPR transfer to complete */
-    status = lesi_lowlevel_wait_ready();
+    status = lesi_dma_wait_npr();
     if ( status )
         return status;
+    lesi_ua_advance( count >= 16 ? 16 : count );
+
+    return ERR_OK;
+}
+
+/**
+ * Complete a series of lesi_write_dma_block() calls.
+ * @return one of the ERR_ status codes
+ */
+static int lesi_write_dma_finish( void ) {
+    int status;
 
     /* Idle the KLESI */
     status = lesi_lowlevel_write(  0, 1  );
@@ -128,6 +177,140 @@ int lesi_write_dma_block( const uint16_t *buffer, int count ) {
     return lesi_handle_status();
 }
 
+/**
+ * Set up a DMA transfer. Nothing happens on the bus until the first
+ * lesi_dma_poll() call.
+ *
+ * A transfer with its own host address sets the address register before
+ * every block, which costs no cycles unless another operation moved it.
+ * Such transfers may be interleaved with other LESI operations between
+ * blocks. Errors those operations cause on the host bus may be reported
+ * to either of them.
+ *
+ * @param op    The transfer
+ * @param write Set to move data to host memory
+ * @param addr  Host bus address, or LESI_DMA_CURADDR to continue from the
+ *              current host address register value
+ * @param buf   The local buffer, NULL to write zeros
+ * @param count The number of words to move
+ */
+void lesi_dma_start( lesi_dma_t *op, int write, uint32_t addr, void *buf, int count ) {
+    op->addr   = addr;
+    op->buf    = buf;
+    op->remain = count;
+    op->bcount = 0;
+    op->write  = write;
+    op->phase  = LESI_DMA_IDLE;
+    op->status = ERR_OK;
+}
+
+/**
+ * Finish a transfer.
+ * @param op     The transfer
+ * @param status Status of the last block
+ * @return The status of the transfer
+ */
+static int lesi_dma_end( lesi_dma_t *op, int status ) {
+    if ( status ) {
+        /* The adapter may have stopped anywhere in the block */
+        lesi_ua_invalidate();
+    } else if ( op->write ) {
+        status = lesi_write_dma_finish();
+    } else {
+        /* Present any hardware / bus errors to the calling routine */
+        status = lesi_handle_status();
+    }
+    op->phase  = LESI_DMA_DONE;
+    op->status = status;
+    return status;
+}
+
+/**
+ * Move a transfer along without waiting for the adapter: start the next
+ * block, or finish the block whose NPR completed.
+ * @param op The transfer
+ * @return ERR_BUSY while the transfer is not done, otherwise its status.
+ *         op->phase tells whether the bus is free meanwhile.
+ */
+int lesi_dma_poll( lesi_dma_t *op ) {
+    int status;
+
+    if ( op->phase == LESI_DMA_DONE )
+        return op->status;
+
+    if ( op->phase == LESI_DMA_IDLE ) {
+        if ( op->remain == 0 )
+            return lesi_dma_end( op, ERR_OK );
+
+        op->bcount = op->remain < 16 ? op->remain : 16;
+        if ( op->addr != LESI_DMA_CURADDR ) {
+            status = lesi_set_host_addr( op->addr );
+            if ( status )
+                return lesi_dma_end( op, status );
+        }
+        if ( op->write )
+            status = lesi_write_dma_issue( op->buf ? op->buf : zero_buf, op->bcount );
+        else
+            status = lesi_read_dma_issue( op->bcount );
+        if ( status )
+            return lesi_dma_end( op, status );
+        op->remain -= op->bcount;
+        op->phase   = LESI_DMA_NPR;
+    }
+
+    status = lesi_lowlevel_ready_poll();
+    if ( status == ERR_BUSY )
+        return ERR_BUSY;
+    if ( status == ERR_OK ) {
+        if ( op->write )
+            lesi_ua_advance( op->bcount );
+        else
+            status = lesi_read_dma_collect( op->buf, op->bcount );
+    }
+    if ( status )
+        return lesi_dma_end( op, status );
+
+    if ( op->buf )
+        op->buf += op->bcount;
+    if ( op->addr != LESI_DMA_CURADDR )
+        op->addr += 2 * op->bcount;
+    op->phase = LESI_DMA_IDLE;
+
+    if ( op->remain == 0 )
+        return lesi_dma_end( op, ERR_OK );
+    return ERR_BUSY;
+}
+
+/**
+ * Run a transfer to completion, running app_idle() while NPRs are busy.
+ * @param op The transfer, set up by lesi_dma_start()
+ * @return one of the ERR_ status codes
+ */
+int lesi_dma_wait( lesi_dma_t *op ) {
+    int status;
+
+    while ( (status = lesi_dma_poll( op )) == ERR_BUSY ) {
+        if ( op->phase == LESI_DMA_NPR )
+            app_idle();
+    }
+    return status;
+}
+
+/**
+ * Read data from host memory starting at the current host address
+ * register value.
+ *
+ * @param buffer The buffer to read the data into.
+ * @param count  The number of words to read from host memory.
+ * @return one of the ERR_ status codes
+ */
+int lesi_read_dma( uint16_t *buffer, int count ) {
+    lesi_dma_t op;
+
+    lesi_dma_start( &op, 0, LESI_DMA_CURADDR, buffer, count );
+    return lesi_dma_wait( &op );
+}
+
 /**
  * Write data to host memory starting at the current host address
  * register value.
@@ -137,49 +320,179 @@ int lesi_write_dma_block( const uint16_t *buffer, int count ) {
  * @return one of the ERR_ status codes
  */
 int lesi_write_dma( const uint16_t *buffer, int count ) {
-    int bcount = 16, status;
+    lesi_dma_t op;
+
+    lesi_dma_start( &op, 1, LESI_DMA_CURADDR, (uint16_t *) buffer, count );
+    return lesi_dma_wait( &op );
+}
+
+/**
+ * Write zeros to host memory starting at the current host address
+ * register value.
+ *
+ * @param count  The number of words to write.
+ * @return one of the ERR_ status codes
+ */
+int lesi_write_dma_zeros( int count ) {
+    lesi_dma_t op;
+
+    lesi_dma_start( &op, 1, LESI_DMA_CURADDR, NULL, count );
+    return lesi_dma_wait( &op );
+}
+
+/**
+ * Returns the number of segments, starting at sg, that are contiguous in
+ * host memory and the total number of words in them.
+ */
+static int lesi_sg_run( const lesi_sg_t *sg, int nseg, int *words ) {
+    int n;
+
+    *words = sg[0].count;
+    for ( n = 1; n < nseg; n++ ) {
+        if ( sg[n].addr != sg[n - 1].addr + 2 * sg[n - 1].count )
+            break;
+        *words += sg[n].count;
+    }
+    return n;
+}
+
+/**
+ * Copy words between a block buffer and a segment list, advancing the
+ * segment cursor.
+ * @param sg    The segment list.
+ * @param seg   Current segment index, updated.
+ * @param off   Word offset in the current segment, updated.
+ * @param block The block buffer.
+ * @param count The number of words to copy.
+ * @param out   Non-zero to copy from the segments into the block.
+ */
+static void lesi_sg_copy( const lesi_sg_t *sg, int *seg, int *off,
+                          uint16_t *block, int count, int out ) {
+    uint16_t *p;
+    int n;
 
     while ( count ) {
-        if ( count < bcount )
-            bcount = count;
-        
-        /* Read the block */
-        status = lesi_write_dma_block( buffer, bcount );
+        n = sg[*seg].count - *off;
+        if ( n > count )
+            n = count;
+        p = (uint16_t *) sg[*seg].buf + *off;
+        if ( out )
+            memcpy( block, p, 2 * n );
+        else
+            memcpy( p, block, 2 * n );
+        block += n;
+        count -= n;
+        *off  += n;
+        if ( *off == sg[*seg].count ) {
+            (*seg)++;
+            *off = 0;
+        }
+    }
+}
+
+/**
+ * Read a list of segments from host memory. Segments that are contiguous
+ * in host memory share one host address setup and are transferred as
+ * full 16 word blocks, also across segment boundaries.
+ *
+ * @param sg   The segment list.
+ * @param nseg The number of segments.
+ * @return one of the ERR_ status codes
+ */
+int lesi_read_dma_sg( const lesi_sg_t *sg, int nseg ) {
+    uint16_t block[16];
+    int run, words, bcount, seg, off, status;
+
+    while ( nseg ) {
+        run = lesi_sg_run( sg, nseg, &words );
+
+        status = lesi_set_host_addr( sg[0].addr );
         if ( status )
             return status;
 
-        buffer += bcount;
-        count  -= bcount;
+        seg = off = 0;
+        while ( words ) {
+            bcount = words < 16 ? words : 16;
+
+            /* Blocks within one segment need no bounce buffer */
+            if ( sg[seg].count - off >= bcount ) {
+                status = lesi_read_dma_block( (uint16_t *) sg[seg].buf + off, bcount );
+                off += bcount;
+                if ( off == sg[seg].count ) {
+                    seg++;
+                    off = 0;
+                }
+            } else {
+                status = lesi_read_dma_block( block, bcount );
+                if ( !status )
+                    lesi_sg_copy( sg, &seg, &off, block, bcount, 0 );
+            }
+            if ( status ) {
+                /* The adapter may have stopped anywhere in the block */
+                lesi_ua_invalidate();
+                return status;
+            }
+            words -= bcount;
+        }
+
+        sg   += run;
+        nseg -= run;
     }
 
     /* Present any hardware / bus errors to the calling routine */
     return lesi_handle_status();
 }
 
-static const uint16_t zero_buf[16] = {0};
-
 /**
- * Write zeros to host memory starting at the current host address
- * register value.
+ * Write a list of segments to host memory. Segments that are contiguous
+ * in host memory share one host address setup and are transferred as
+ * full 16 word blocks, also across segment boundaries.
  *
- * @param count  The number of words to write.
+ * @param sg   The segment list.
+ * @param nseg The number of segments.
  * @return one of the ERR_ status codes
  */
-int lesi_write_dma_zeros( int count ) {
-    int bcount = 16, status;
+int lesi_write_dma_sg( const lesi_sg_t *sg, int nseg ) {
+    uint16_t block[16];
+    const uint16_t *src;
+    int run, words, bcount, seg, off, status;
 
-    while ( count ) {
-        if ( count < bcount )
-            bcount = count;
-        
-        /* Read the block */
-        status = lesi_write_dma_block( zero_buf, bcount );
+    while ( nseg ) {
+        run = lesi_sg_run( sg, nseg, &words );
+
+        status = lesi_set_host_addr( sg[0].addr );
         if ( status )
             return status;
 
-        count  -= bcount;
+        seg = off = 0;
+        while ( words ) {
+            bcount = words < 16 ? words : 16;
+
+            /* Blocks within one segment need no bounce buffer */
+            if ( sg[seg].count - off >= bcount ) {
+                src = (const uint16_t *) sg[seg].buf + off;
+                off += bcount;
+                if ( off == sg[seg].count ) {
+                    seg++;
+                    off = 0;
+                }
+            } else {
+                lesi_sg_copy( sg, &seg, &off, block, bcount, 1 );
+                src = block;
+            }
+
+            status = lesi_write_dma_block( src, bcount );
+            if ( status ) {
+                /* The adapter may have stopped anywhere in the block */
+                lesi_ua_invalidate();
+                return status;
+            }
+            words -= bcount;
+        }
+
+        sg   += run;
+        nseg -= run;
     }
 
-    /* Present any hardware / bus errors to the calling routine */
-    return lesi_handle_status();
+    return lesi_write_dma_finish();
 }
@@ -0,0 +1,284 @@
+/**
+ * @file lesi/pio.c
+ * @author Peter Bosch <public@pbx.sh>
+ *
+ * This file implements the LESI bus cycle primitives on top of the PIO
+ * cycle engine in lesi/lesi.pio. Instead of toggling COMMAND, STROBE and
+ * the C/D bus from software, every cycle is handed to the state machine
+ * as a descriptor, so cycle timing no longer depends on the CPU clock or
+ * on the code the compiler generates.
+ *
+ * The CPU only packs descriptors and unpacks sampled bus values. Parity
+ * is generated while packing a descriptor and checked while unpacking.
+ *
+ * The control signals are shared with the GPIO transport, together they
+ * make up lesi_pio_transport.
+ *
+ * This file is also built against the host-side model of the program
+ * (host/piomodel.c) so cycle sequences can be verified without a board.
+ */
+#include <pico/stdlib.h>
+
+#include "lesi/hwconfig.h"
+#include "lesi/lesi.h"
+#include "lesi/pio.h"
+
+#ifndef LESI_PIO_MODEL
+#include "lesi.pio.h"
+#endif
+
+void app_idle();
+extern volatile int saw_init;
+
+/**
+ * Pack a data word and its parity into the C/D pin image.
+ */
+static inline uint32_t lesi_pio_pins( uint16_t data ) {
+    return ((uint16_t) ~data) | ((uint32_t) lesi_parity( data ) << 16);
+}
+
+/**
+ * Wait for the state machine to return a word through the RX FIFO.
+ * @param out  Output pointer for the word.
+ * @param idle Whether to run app_idle() while waiting.
+ * @return Status code.
+ */
+static int lesi_pio_collect( uint32_t *out, int idle ) {
+    while ( lesi_pio_rx_empty() ) {
+        if ( saw_init ) {
+            /* The engine may be stuck waiting for T1, start over */
+            lesi_pio_restart();
+            return ERR_INIT;
+        }
+        if ( idle )
+            app_idle();
+    }
+    *out = lesi_pio_get();
+    return ERR_OK;
+}
+
+#ifndef LESI_PIO_MODEL
+
+static uint lesi_pio_offset;
+
+/**
+ * Load the cycle engine program and start its state machine.
+ */
+void lesi_pio_setup( void ) {
+    lesi_pio_offset = pio_add_program( LESI_PIO, &lesi_cycle_program );
+    lesi_cycle_program_init( LESI_PIO, LESI_PIO_SM, lesi_pio_offset, LESI_PIO_CLKDIV );
+}
+
+/**
+ * Abort whatever the cycle engine is doing and return it to the idle
+ * state with STROBE and COMMAND deasserted and the C/D bus released.
+ */
+void lesi_pio_restart( void ) {
+    pio_sm_set_enabled( LESI_PIO, LESI_PIO_SM, false );
+    pio_sm_clear_fifos( LESI_PIO, LESI_PIO_SM );
+    pio_sm_restart( LESI_PIO, LESI_PIO_SM );
+    pio_sm_exec( LESI_PIO, LESI_PIO_SM, pio_encode_nop() | pio_encode_sideset_opt( 2, 0 ) );
+    pio_sm_exec( LESI_PIO, LESI_PIO_SM, pio_encode_mov( pio_osr, pio_null ) );
+    pio_sm_exec( LESI_PIO, LESI_PIO_SM, pio_encode_out( pio_pindirs, 18 ) );
+    pio_sm_exec( LESI_PIO, LESI_PIO_SM, pio_encode_set( pio_pins, 0 ) );
+    pio_sm_exec( LESI_PIO, LESI_PIO_SM,
+        pio_encode_jmp( lesi_pio_offset + lesi_cycle_offset_entry ) );
+    pio_sm_set_enabled( LESI_PIO, LESI_PIO_SM, true );
+}
+
+#endif
+
+static int lesi_pio_wait_ready();
+
+/**
+ * Configure the control signals and start the cycle engine
+ */
+static void lesi_pio_transport_setup() {
+    lesi_ctl_setup();
+    lesi_pio_setup();
+}
+
+/**
+ * Issue a write cycle on the LESI bus.
+ * @param data The data to drive on LESI C/D
+ * @param cmd  Whether this should be a command cycle.
+ * @return Status code.
+ */
+static int lesi_pio_write( uint16_t data, int cmd ) {
+    lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_WRITE, cmd != 0, lesi_pio_pins( data ) ) );
+    if ( cmd )
+        lesi_ctl_t1_arm();
+
+    if ( saw_init )
+        return ERR_INIT;
+
+    return ERR_OK;
+}
+
+/**
+ * Read from the LESI bus.
+ * @param data The data read from the bus.
+ * @return Status code.
+ */
+static int lesi_pio_read( uint16_t *data ) {
+    uint32_t pins;
+    int status;
+
+    lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_READ, 0, 0 ) );
+    status = lesi_pio_collect( &pins, 0 );
+    if ( status )
+        return status;
+
+    *data = LESI_PIO_PINS_DATA( pins );
+
+    if ( saw_init )
+        return ERR_INIT;
+
+    if ( lesi_parity( *data ) != LESI_PIO_PINS_PAR( pins ) )
+        return ERR_LPARITY;
+
+    return ERR_OK;
+}
+
+/**
+ * Read consecutive words from the LESI bus, strobing in between. Up to
+ * a FIFO worth of reads is kept queued so the state machine does not
+ * idle while the CPU unpacks and checks the previous word.
+ * @param data  Buffer for the words read.
+ * @param count Number of words to read.
+ * @return Status code.
+ */
+static int lesi_pio_read_burst( uint16_t *data, int count ) {
+    uint32_t pins;
+    int sent = 0, got, status = ERR_OK;
+
+    for ( got = 0; got < count; got++ ) {
+        while ( sent < count && sent - got < LESI_PIO_FIFO_DEPTH ) {
+            if ( sent )
+                lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_STROBE, 0, 0 ) );
+            lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_READ, 0, 0 ) );
+            sent++;
+        }
+
+        /* A failed collect restarts the engine, nothing is left queued */
+        if ( lesi_pio_collect( &pins, 0 ) )
+            return ERR_INIT;
+
+        data[got] = LESI_PIO_PINS_DATA( pins );
+
+        /* Keep draining the queued reads after a parity error */
+        if ( lesi_parity( data[got] ) != LESI_PIO_PINS_PAR( pins ) )
+            status = ERR_LPARITY;
+    }
+
+    if ( saw_init )
+        return ERR_INIT;
+
+    return status;
+}
+
+/**
+ * Strobe the LESI bus for a read
+ * @param waitxfer If this is set, the call will block with STROBE asserted until T1 asserts.
+ * @return Status code.
+ */
+static int lesi_pio_read_strobe( int waitxfer ) {
+    int status;
+
+    if ( saw_init )
+        return ERR_INIT;
+
+    if ( waitxfer ) {
+        /* Leave STROBE asserted while the engine waits for T1 */
+        lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_STROBE, 1, 0 ) );
+        status = lesi_pio_wait_ready();
+        if ( status )
+            return status;
+    }
+
+    lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_STROBE, 0, 0 ) );
+
+    if ( saw_init )
+        return ERR_INIT;
+
+    return ERR_OK;
+}
+
+/**
+ * Wait for LESI T1 to be asserted (i.e. for the KLESI to become ready).
+ * @return Status code.
+ */
+static int lesi_pio_wait_ready() {
+    uint32_t ack;
+
+    /* The engine waits for T1 itself, but may only start once T1 is
+       valid for the last command */
+    while ( !lesi_ctl_t1_ready() ) {
+        if ( saw_init )
+            return ERR_INIT;
+        app_idle();
+    }
+    lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_WAIT, 1, 0 ) );
+    return lesi_pio_collect( &ack, 1 );
+}
+
+static int lesi_pio_wait_queued;
+
+/**
+ * Check whether the KLESI finished what the last command started,
+ * without waiting for it. Once T1 says so, the engine is made to wait
+ * for it too, so that the cycles queued before have completed.
+ * @return  Status code, ERR_BUSY while the KLESI is busy.
+ */
+static int lesi_pio_ready_poll() {
+    uint32_t ack;
+
+    if ( !lesi_pio_wait_queued ) {
+        if ( saw_init )
+            return ERR_INIT;
+        if ( !lesi_ctl_t1_ready() ) {
+            if ( lesi_ctl_t1_elapsed() >= LESI_T1_TIMEOUT_US )
+                return ERR_DATA_TO;
+            return ERR_BUSY;
+        }
+        lesi_pio_put( LESI_PIO_DESC( LESI_PIO_OP_WAIT, 1, 0 ) );
+        lesi_pio_wait_queued = 1;
+    }
+
+    if ( lesi_pio_rx_empty() && !saw_init )
+        return ERR_BUSY;
+
+    lesi_pio_wait_queued = 0;
+    return lesi_pio_collect( &ack, 0 );
+}
+
+/**
+ * Wait for LESI T1 to be deasserted (i.e. for the KLESI to become busy).
+ * @return  Status code.
+ */
+static int lesi_pio_wait_busy() {
+    while ( !lesi_ctl_t1_busy() ) {
+        if ( saw_init )
+            return ERR_INIT;
+        if ( lesi_ctl_t1_elapsed() >= LESI_T1_TIMEOUT_US )
+            return ERR_BARB_TO;
+        app_idle();
+    }
+    return ERR_OK;
+}
+
+const lesi_transport_t lesi_pio_transport = {
+    .name        = "pio",
+    .setup       = lesi_pio_transport_setup,
+    .write       = lesi_pio_write,
+    .read        = lesi_pio_read,
+    .read_strobe = lesi_pio_read_strobe,
+    .read_burst  = lesi_pio_read_burst,
+    .wait_ready  = lesi_pio_wait_ready,
+    .wait_busy   = lesi_pio_wait_busy,
+    .ready_poll  = lesi_pio_ready_poll,
+    .set_pwrgood = lesi_ctl_set_pwrgood,
+    .reset_klesi = lesi_ctl_reset_klesi,
+    .clear_init  = lesi_ctl_clear_init,
+    .check_init  = lesi_ctl_check_init,
+};
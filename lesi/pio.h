@@ -0,0 +1,79 @@
+/**
+ * @file lesi/pio.h
+ * @author Peter Bosch <public@pbx.sh>
+ *
+ * Definitions shared between the PIO LESI cycle engine (lesi/lesi.pio),
+ * the CPU side of the PIO backend (lesi/pio.c) and the host-side model
+ * of the PIO program used for off-target verification.
+ *
+ * Every LESI bus cycle is described by a single 32-bit descriptor that
+ * is pushed into the state machine TX FIFO. Descriptors are shifted out
+ * LSB first:
+ *
+ *    [0]     Flag bit, meaning depends on the opcode
+ *    [2:1]   Opcode, the PIO program dispatches on this with OUT PC
+ *    [20:3]  Pin image for C/D 0..15 and parity 0..1 (write cycles only)
+ *
+ * Read cycles and T1 waits return one word through the RX FIFO: the
+ * sampled pin image for reads, or an acknowledge for waits.
+ */
+#ifndef _LESIPIOH_
+#define _LESIPIOH_
+#include <stdint.h>
+
+/** Command or data write cycle, flag set for command cycles */
+#define LESI_PIO_OP_WRITE     (0)
+/** Turn the bus around if needed, sample C/D and push the pin image */
+#define LESI_PIO_OP_READ      (1)
+/** Read strobe, flag set to leave STROBE asserted */
+#define LESI_PIO_OP_STROBE    (2)
+/** Wait for T1 to reach the level in the flag bit and push an acknowledge */
+#define LESI_PIO_OP_WAIT      (3)
+
+#define LESI_PIO_DESC(op, flag, pins) \
+    ( ((flag) & 1) | (((op) & 3) << 1) | (((pins) & 0x3FFFF) << 3) )
+#define LESI_PIO_DESC_FLAG(d) ( (d) & 1 )
+#define LESI_PIO_DESC_OP(d)   ( ((d) >> 1) & 3 )
+#define LESI_PIO_DESC_PINS(d) ( ((d) >> 3) & 0x3FFFF )
+
+/** Pin image: C/D is active low, parity bits follow the data bits */
+#define LESI_PIO_PINS_DATA(p) ( (uint16_t) ~(p) )
+#define LESI_PIO_PINS_PAR(p)  ( ((p) >> 16) & 3 )
+
+/** Depth of the joined-free PIO FIFOs */
+#define LESI_PIO_FIFO_DEPTH   (4)
+
+#ifdef LESI_PIO_MODEL
+
+/* The host-side model provides the FIFO interface */
+void     lesi_pio_put( uint32_t desc );
+uint32_t lesi_pio_get( void );
+int      lesi_pio_rx_empty( void );
+void     lesi_pio_restart( void );
+void     lesi_pio_setup( void );
+
+#else
+
+#include <hardware/pio.h>
+
+#define LESI_PIO              (pio0)
+#define LESI_PIO_SM           (0)
+
+void lesi_pio_setup( void );
+void lesi_pio_restart( void );
+
+static inline void lesi_pio_put( uint32_t desc ) {
+    pio_sm_put_blocking( LESI_PIO, LESI_PIO_SM, desc );
+}
+
+static inline uint32_t lesi_pio_get( void ) {
+    return pio_sm_get_blocking( LESI_PIO, LESI_PIO_SM );
+}
+
+static inline int lesi_pio_rx_empty( void ) {
+    return pio_sm_is_rx_fifo_empty( LESI_PIO, LESI_PIO_SM );
+}
+
+#endif
+
+#endif
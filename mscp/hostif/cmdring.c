@@ -5,25 +5,121 @@
 #include <string.h>
 #include "projconfig.h"
 #include "mscp/packet.h"
+#include "mscp/pool.h"
 
 int dbg_cmdring = 0;
 
 int hostif_ringxfer_err( mscpa_t *a, int status, int fcode ) {
     int err = ERR_STATUS( status );
-    if ( err == ERR_NXM )
-        a->fatal_code = FATAL_BUSMASTER_ERR;
     if ( err == ERR_INIT || err == 0 )
         return status;
+    if ( err == ERR_NXM )
+        a->fatal_code = FATAL_BUSMASTER_ERR;
+    else if ( err == ERR_DATA_TO )
+        a->fatal_code = FATAL_HOST_TIMEOUT;
     else
         a->fatal_code = fcode;
     return status | ERR_FATAL;
 }
 
+/**
+ * Read a window of command ring descriptors, starting at the current
+ * slot and ending at the last slot of the ring, into the descriptor cache.
+ *
+ * The window grows while the host keeps the ring filled and drops back
+ * to a single descriptor once the ring runs empty, so that polling an
+ * idle ring stays as cheap as a single descriptor read.
+ *
+ * A ring full check that was deferred by CS_SENDIRQ is answered from the
+ * same read, which then starts two slots earlier.
+ *
+ * @param a The MSCP adapter context
+ * @return one of the ERR_ status codes
+ */
+static int hostif_cring_prefetch( mscpa_t *a ) {
+    hostif_desc_t desc[HOSTIF_DESC_PER_NPR];
+    int status, count, owned, back, i;
+
+    back  = a->cring_irqchk ? 2 : 0;
+    count = a->csize - a->cring_idx;
+    if ( count > a->cring_window )
+        count = a->cring_window;
+    if ( count + back > HOSTIF_DESC_PER_NPR )
+        count = HOSTIF_DESC_PER_NPR - back;
+
+    a->cring_cpos   = 0;
+    a->cring_ccount = 0;
+
+    status = lesi_set_host_addr( a->cring_base + (a->cring_idx - back) * sizeof(hostif_desc_t) );
+    propagateTagged( status, WHEN_KLESI_CMD );
+
+    status = lesi_read_dma( (uint16_t *) desc, (count + back) * sizeof(hostif_desc_t) / 2 );
+    status = hostif_ringxfer_err( a, status, FATAL_RING_READ );
+    propagateTagged( status, WHEN_CTRL_READ );
+
+    for ( i = 0; i < count + back; i++ )
+        hostif_shadow_update( a->cring_shadow, a->cring_idx - back + i, desc[i] );
+    memcpy( a->cring_cache, desc + back, count * sizeof(hostif_desc_t) );
+    a->cring_ccount = count;
+    a->cring_prefetches++;
+
+    for ( owned = 0; owned < count; owned++ )
+        if ( ~a->cring_cache[owned] & MSCP_DESC_OWNER )
+            break;
+    a->cring_window = owned ? 2 * owned : 1;
+    if ( a->cring_window > MSCP_CRING_PREFETCH )
+        a->cring_window = MSCP_CRING_PREFETCH;
+    if ( dbg_cmdring )
+        printf("MSCP C: prefetched %i descriptors at slot %i\n", count, a->cring_idx);
+
+    if ( a->cring_irqchk ) {
+        a->cring_irqchk = 0;
+        a->own_reads_avoided++;
+        if ( hostif_shadow_owned( a->cring_shadow, a->cring_idx - 2 ) ) {
+            status = hostif_send_ring_irq( a, 1, 0 );
+            propagate( status );
+        }
+    }
+    return ERR_OK;
+}
+
+/**
+ * Check whether the command ring was full before the port handed back
+ * the descriptor in slot idx, by reading the descriptor before it.
+ * @param a   The MSCP adapter context
+ * @param idx The slot that was handed back
+ * @return one of the ERR_ status codes
+ */
+static int hostif_cring_check_full( mscpa_t *a, int idx ) {
+    hostif_desc_t desc;
+    uint32_t descptr;
+    int status, slot;
+
+    slot    = (idx - 1) & (a->csize - 1);
+    descptr = a->cring_base + slot * sizeof(hostif_desc_t);
+
+    status = lesi_set_host_addr( descptr );
+    propagateTagged( status, WHEN_KLESI_CMD );
+
+    status = lesi_read_dma( (uint16_t *) &desc, sizeof(hostif_desc_t) / 2 );
+    status = hostif_ringxfer_err( a, status, FATAL_RING_READ );
+    propagateTagged( status, WHEN_CTRL_READ );
+
+    a->own_reads++;
+    hostif_shadow_update( a->cring_shadow, slot, desc );
+    if ( desc & MSCP_DESC_OWNER ) {
+        status = hostif_send_ring_irq( a, 1, 0 );
+        propagate( status );
+    }
+    return ERR_OK;
+}
+
 int hostif_cring_fetch( mscpa_t *a ) {
-    int status, idx, want_irq;
+    int status, idx;
     mscpc_t *pkt;
     uint32_t descptr;
     uint32_t envptr;
+    lesi_sg_t sg[2];
 
     idx = a->cring_idx;
     descptr = a->cring_base + idx * sizeof(hostif_desc_t);
@@ -34,13 +130,15 @@ int hostif_cring_fetch( mscpa_t *a ) {
             if ( dbg_cmdring )
                 printf("MSCP C: polling slot %i\n", idx);
             
-            status = lesi_set_host_addr( descptr );
-            propagateTagged( status, WHEN_KLESI_CMD );
+            /* Descriptors we own cannot change under us, but any other */
+            /* cached descriptor may have been handed over since */
+            if ( a->cring_ccount == 0 ||
+                 (~a->cring_cache[a->cring_cpos] & MSCP_DESC_OWNER) ) {
+                status = hostif_cring_prefetch( a );
+                propagate( status );
+            }
 
-            status = lesi_read_dma( (uint16_t *) &a->cring_desc, sizeof(hostif_desc_t) / 2 );
-            status = hostif_ringxfer_err( a, status, FATAL_RING_READ );
-            propagateTagged( status, WHEN_CTRL_READ );
-            
+            a->cring_desc = a->cring_cache[a->cring_cpos];
 
             if ( ~a->cring_desc & MSCP_DESC_OWNER ) {
                 /* We don't own this descriptor. That means for now no */
@@ -52,14 +150,31 @@ int hostif_cring_fetch( mscpa_t *a ) {
                 return ERR_OK;
             }
 
-            /* Allocate and zero packet */
-            pkt = a->cring_pkt = malloc( sizeof(mscpc_t) );
-            if ( a->cring_pkt == NULL ) {
-                printf("MSCP: Could not malloc command queue entry\n");
-                return ERR_OK; //TODO: Do we want this to be an error?
+            /* Only take the command when we can hold it, otherwise */
+            /* leave it in the ring until packets are freed. Some are */
+            /* kept back for the replies to immediate commands. */
+            if ( mscp_pool_avail( &mscp_pkt_pool ) <= MSCP_POOL_RESERVE ||
+                 mscp_pool_avail( &mscp_msg_pool ) <= MSCP_POOL_RESERVE ) {
+                a->cring_stalls++;
+                return ERR_OK;
             }
 
-            memset( pkt, 0, sizeof(mscpc_t) );
+            /* Allocate zeroed packet and message slot. The server on the */
+            /* other core allocates from the same pools, so the check   */
+            /* above does not guarantee them                             */
+            pkt = mscp_pkt_alloc();
+            if ( pkt != NULL )
+                pkt->data = mscp_msg_alloc();
+            if ( pkt == NULL || pkt->data == NULL ) {
+                mscp_pkt_free( pkt );
+                a->cring_stalls++;
+                return ERR_OK;
+            }
+            a->cring_pkt = pkt;
+
+            /* Consume the cached descriptor */
+            a->cring_cpos++;
+            a->cring_ccount--;
 
 
             /* Checkpoint */ 
@@ -72,16 +187,22 @@ int hostif_cring_fetch( mscpa_t *a ) {
             a->c_fir = a->cring_desc & MSCP_DESC_FLAG;
 
     case CS_XFER_ENV:
-            /* --------------- Transfer command envelope ----------------- */
+            /* ----------- Transfer command envelope and payload ------------ */
+            /* Every command buffer holds at least 60 bytes, so the envelope */
+            /* and the first 60 bytes are read in one go */
             envptr = (a->cring_desc & a->addrmask) - sizeof(hostif_envhdr_t);
-            status = lesi_set_host_addr( envptr );
-            propagateTagged( status, WHEN_KLESI_CMD );
+            sg[0].addr  = envptr;
+            sg[0].buf   = &a->cring_hdr;
+            sg[0].count = sizeof(hostif_envhdr_t) / 2;
+            sg[1].addr  = a->cring_desc & a->addrmask;
+            sg[1].buf   = pkt->data;
+            sg[1].count = 30;
 
-            status = lesi_read_dma( (uint16_t *) &a->cring_hdr, sizeof(hostif_envhdr_t) / 2 );
+            //TODO: Honor burst limit
+            status = lesi_read_dma_sg( sg, 2 );
             status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_READ );
             propagateTagged( status, WHEN_CTRL_READ );
 
-            a->cring_state      = CS_XFER_PAYL;
             pkt->msg_type = (a->cring_hdr.type_credits >> 4) & 0xF;
             pkt->credit   = (a->cring_hdr.type_credits     ) & 0xF;
             pkt->data_len = ((a->cring_hdr.msg_len + 1) / 2);
@@ -92,31 +213,25 @@ int hostif_cring_fetch( mscpa_t *a ) {
                 pkt->data_len = 30;
             pkt->data_len *= 2;
 
+            /* No MSCP command is larger than a message slot, ignore */
+            /* anything beyond it */
+            if ( pkt->data_len > MSCP_MSG_SLOT_SZ )
+                pkt->data_len = MSCP_MSG_SLOT_SZ;
+
             if ( dbg_cmdring )
                 printf("MSCP C: Accepted command envelope [%3i] Conn ID: %i Type: %i, Credits: %i, Length: %i\n",
                     idx, a->cring_hdr.conn_id, pkt->msg_type, pkt->credit, a->cring_hdr.msg_len );
-    case CS_XFER_PAYL:
-            /* --------------- Transfer command payload ----------------- */
-            pkt->data = malloc( pkt->data_len );
-            if ( pkt->data == NULL ) {
-                printf("MSCP C: Could not malloc command payload\n");
-                return ERR_OK; //TODO: Do we want this to be an error?
-            }
 
-            /* Resumed */
-            status = lesi_set_host_addr( a->cring_desc & a->addrmask );
-            if ( status ) {
-                free( pkt->data );
+
+            a->cring_state = CS_XFER_PAYL;
+    case CS_XFER_PAYL:
+            /* --------------- Transfer rest of command payload ----------------- */
+            if ( pkt->data_len > 60 ) {
+                status = lesi_set_host_addr( (a->cring_desc & a->addrmask) + 60 );
                 propagateTagged( status, WHEN_KLESI_CMD );
-            }
-            
-            //TODO: Combine with header read as size is always >= 64
-            //TODO: Honor burst limit
 
-            status = lesi_read_dma( pkt->data, pkt->data_len  / 2);
-            status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_READ );
-            if ( status ) {
-                free( pkt->data );
+                status = lesi_read_dma( (uint16_t *) pkt->data + 30, (pkt->data_len - 60) / 2 );
+                status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_READ );
                 propagateTagged( status, WHEN_CTRL_READ );
             }
             
@@ -136,6 +251,7 @@ int hostif_cring_fetch( mscpa_t *a ) {
             status = lesi_write_dma( (uint16_t *) &a->cring_desc, sizeof(hostif_desc_t) / 2 );
             status = hostif_ringxfer_err( a, status, FATAL_RING_WRITE );
             propagateTagged( status, WHEN_CTRL_WRITE );
+            hostif_shadow_update( a->cring_shadow, idx, a->cring_desc );
 
             if ( ~a->c_fir & MSCP_DESC_FLAG ) {
                 break; /* done */
@@ -145,25 +261,24 @@ int hostif_cring_fetch( mscpa_t *a ) {
 
     case CS_SENDIRQ:
 
+            /* The ring was full if the slot before this one was */
+            /* owned by the port */
             if ( a->csize == 1 ) {
-                want_irq = 1;
-            } else {
-                /* Read previous descriptor to see if the ring is full */
-                descptr = a->cring_base + ((idx - 1) & (a->csize - 1)) * sizeof(hostif_desc_t);
-
-                status = lesi_set_host_addr( descptr );
-                propagateTagged( status, WHEN_KLESI_CMD );
-
-                status = lesi_read_dma( (uint16_t *) &a->cring_desc, sizeof(hostif_desc_t) / 2 );
-                status = hostif_ringxfer_err( a, status, FATAL_RING_READ );
-                propagateTagged( status, WHEN_CTRL_READ );
-
-                want_irq = a->cring_desc & MSCP_DESC_OWNER;
-            }
-
-            if ( want_irq ) {
                 status = hostif_send_ring_irq( a, 1, 0 );
                 propagate( status );
+            } else if ( hostif_shadow_owned( a->cring_shadow, (idx - 1) & (a->csize - 1) ) ) {
+                /* Still ours, only we can hand it back */
+                a->own_reads_avoided++;
+                status = hostif_send_ring_irq( a, 1, 0 );
+                propagate( status );
+            } else if ( a->cring_ccount == 0 && idx > 0 && idx + 1 < a->csize &&
+                        HOSTIF_DESC_PER_NPR > 2 ) {
+                /* The next poll reads the descriptors following this */
+                /* slot, let it read the one before it as well */
+                a->cring_irqchk = 1;
+            } else {
+                status = hostif_cring_check_full( a, idx );
+                propagate( status );
             }
             
             if ( dbg_cmdring )
@@ -220,17 +335,26 @@ int hostif_cring_poll( mscpa_t *a ) {
         a->cring_state = CS_UNUSED;
     }
 
+    /* The ring ran empty before the deferred ring full check was done */
+    if ( a->cring_irqchk ) {
+        a->cring_irqchk = 0;
+        status = hostif_cring_check_full( a, (a->cring_idx - 1) & (a->csize - 1) );
+        propagate( status );
+    }
+
     return ERR_OK;
  
 }
 
 void hostif_cring_reset( mscpa_t *a ) {
-    if ( a->cring_pkt ) {
-        if ( a->cring_pkt->data )
-            free( a->cring_pkt->data );
-        free( a->cring_pkt );
-    }
+    mscp_pkt_free( a->cring_pkt );
+    a->cring_pkt = NULL;
     a->cring_idx = 0;
     a->cring_state = CS_UNUSED;
+    a->cring_cpos = 0;
+    a->cring_ccount = 0;
+    a->cring_window = 1;
+    a->cring_irqchk = 0;
+    memset( a->cring_shadow, 0, sizeof(hostif_shadow_t) );
 
 }
\ No newline at end of file
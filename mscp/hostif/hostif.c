@@ -1,8 +1,10 @@
 #include "mscp/hostif/hostif.h"
+#include "mscp/xcore.h"
 #include "lesi/lesi.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "pico/time.h"
 #include "projconfig.h"
 
 void hostif_startup( mscpa_t *a ) {
@@ -54,38 +56,116 @@ err:
 }
 
 /**
- * Notify the host of a ring transition.
+ * Update the interrupt words in the communication area and interrupt the
+ * host for all pending ring transitions.
  * @param a The MSCP adapter context
- * @param c Whether the command ringbuffer transitioned
- * @param r Whether the response ringbuffer transitioned
  * @return one of the ERR_ status codes
  */
-int hostif_send_ring_irq( mscpa_t *a, int c, int r ) {
-    uint16_t v= 1;
+static int hostif_deliver_ring_irq( mscpa_t *a ) {
+    uint16_t v[2] = { 1, 1 };
+    uint32_t delay;
     int status;
     //printf("HostIF: Sending ring transition IRQ\n");
-    if ( c ) {
+    /* cmd_int and rsp_int are adjacent, write them in one go */
+    if ( a->irq_c ) {
         status = lesi_set_host_addr( a->cahdr_base + 4 );
         propagateTagged( status, WHEN_INTR_REQ );
 
-        status = lesi_write_dma( &v, 1 );
+        status = lesi_write_dma( v, a->irq_r ? 2 : 1 );
         propagateTagged( status, WHEN_INTR_REQ );
-    }
-    if ( r ) {
+    } else if ( a->irq_r ) {
         status = lesi_set_host_addr( a->cahdr_base + 6 );
         propagateTagged( status, WHEN_INTR_REQ );
 
-        status = lesi_write_dma( &v, 1 );
+        status = lesi_write_dma( v, 1 );
         propagateTagged( status, WHEN_INTR_REQ );
     }
     if ( a->vector ) {
-        lesi_send_intr( a->vector );
-        lesi_lowlevel_wait_ready();
+        status = lesi_send_intr( a->vector );
+        if ( status == ERR_OK )
+            status = lesi_wait_intr();
+        if ( status )
+            return hostif_ringxfer_err( a, status, FATAL_INT_MASTER ) | WHEN_INTR_REQ;
     }
+
+    delay = time_us_64() - a->irq_since;
+    if ( delay > a->irq_stats.max_delay_us )
+        a->irq_stats.max_delay_us = delay;
+    a->irq_stats.interrupts++;
+    a->irq_c = 0;
+    a->irq_r = 0;
+    a->irq_pending = 0;
     return ERR_OK;
 
 }
 
+/**
+ * Notify the host of a ring transition. The transition is merged with
+ * any other pending ones and delivered by hostif_irq_poll(), unless it
+ * brings the number of pending transitions to MSCP_IRQ_MAX_PENDING.
+ * @param a The MSCP adapter context
+ * @param c Whether the command ringbuffer transitioned
+ * @param r Whether the response ringbuffer transitioned
+ * @return one of the ERR_ status codes
+ */
+int hostif_send_ring_irq( mscpa_t *a, int c, int r ) {
+    if ( a->irq_pending == 0 )
+        a->irq_since = time_us_64();
+    a->irq_c |= c;
+    a->irq_r |= r;
+    a->irq_pending++;
+    a->irq_stats.transitions++;
+
+    if ( a->irq_pending < MSCP_IRQ_MAX_PENDING )
+        return ERR_OK;
+
+    a->irq_stats.by_count++;
+    return hostif_deliver_ring_irq( a );
+}
+
+/**
+ * Deliver pending ring transitions once they have been held back for
+ * MSCP_IRQ_MAX_DELAY_US, or as soon as the port has no more work that
+ * could produce another transition to merge them with.
+ * @param a The MSCP adapter context
+ * @return one of the ERR_ status codes
+ */
+int hostif_irq_poll( mscpa_t *a ) {
+    if ( a->irq_pending == 0 )
+        return ERR_OK;
+
+    if ( a->rring_pcount == 0 && mscps_pending( a->server ) == 0 ) {
+        a->irq_stats.by_idle++;
+    } else if ( time_us_64() - a->irq_since >= MSCP_IRQ_MAX_DELAY_US ) {
+        a->irq_stats.by_timer++;
+    } else
+        return ERR_OK;
+
+    return hostif_deliver_ring_irq( a );
+}
+
+/**
+ * Drop any pending ring transitions, used when the port is reinitialized.
+ * @param a The MSCP adapter context
+ */
+void hostif_irq_reset( mscpa_t *a ) {
+    a->irq_c = 0;
+    a->irq_r = 0;
+    a->irq_pending = 0;
+}
+
+/**
+ * Return the interrupt counters for the current interval and start a
+ * new one.
+ * @param a     The MSCP adapter context
+ * @param stats Receives the counters, may be NULL
+ */
+void hostif_irq_interval( mscpa_t *a, hostif_irq_stats_t *stats ) {
+    if ( stats )
+        *stats = a->irq_stats;
+    memset( &a->irq_stats, 0, sizeof(hostif_irq_stats_t) );
+}
+
 /**
  * Process incoming and outgoing ring buffers
  * @param a The MSCP adapter context
@@ -100,6 +180,9 @@ int hostif_process( mscpa_t *a ) {
     status = hostif_rring_do( a );
     propagate( status );
 
+    status = hostif_irq_poll( a );
+    propagate( status );
+
     return ERR_OK;
 }
 
@@ -147,6 +230,11 @@ void hostif_fatal( mscpa_t *a, int fatal_code ) {
  */
 void hostif_loop(  mscpa_t *a ) {
     uint16_t sr;
+
+    /* The bus belongs to a server transfer until its NPR completes */
+    if ( mscpx_port_poll( a ) )
+        return;
+
     switch( a->step ) {
         case STEP_TRYSTART:  hostif_startup ( a ); break;
         case 1            :  hostif_istep1  ( a ); break;
@@ -172,6 +260,7 @@ void hostif_loop(  mscpa_t *a ) {
             lesi_lowlevel_reset_klesi();
             hostif_cring_reset( a );
             hostif_rring_reset( a );
+            hostif_irq_reset( a );
             a->step = STEP_TRYSTART;
             break;
         case STEP_FATAL:
@@ -210,25 +299,36 @@ void hostif_set_server( mscpa_t *hostif, mscps_t *server ) {
     hostif->server = server;
 }
 
-int hostif_read_buf ( mscpa_t *hostif, void *target, const void *bufdesc, int offset, int count ) {
-    int status;
+/**
+ * Set up a transfer between a local buffer and a host buffer, to be run
+ * with lesi_dma_poll() or lesi_dma_wait(). The transfer keeps its own
+ * host address, so ring work may be done between its blocks.
+ * @param hostif  The MSCP adapter context
+ * @param op      The transfer
+ * @param to_host Set to write the host buffer, clear to read it
+ * @param local   The local buffer
+ * @param bufdesc The MSCP buffer descriptor
+ * @param offset  Offset into the host buffer
+ * @param count   Number of bytes to move
+ */
+void hostif_buf_start( mscpa_t *hostif, lesi_dma_t *op, int to_host, void *local,
+                       const void *bufdesc, int offset, int count ) {
     const uint32_t *bufd = bufdesc;
     //TODO: Verify that no byte transfers are attempted
     //TODO: Support UBA channels & purge
-    status = lesi_set_host_addr( (*bufd + offset) & 0xFFFFFF );
-    propagate(status);
+    lesi_dma_start( op, to_host, (*bufd + offset) & 0xFFFFFF, local, count / 2 );
+}
+
+int hostif_read_buf ( mscpa_t *hostif, void *target, const void *bufdesc, int offset, int count ) {
+    lesi_dma_t op;
 
-    return lesi_read_dma( target, count / 2 );
+    hostif_buf_start( hostif, &op, 0, target, bufdesc, offset, count );
+    return lesi_dma_wait( &op );
 }
 
 int hostif_write_buf( mscpa_t *hostif, const void *target, const void *bufdesc, int offset, int count ) {
-    int status;
-    const uint32_t *bufd = bufdesc;
-    //TODO: Verify that no byte transfers are attempted
-    //TODO: Support UBA channels & purge
-    status = lesi_set_host_addr( (*bufd + offset) & 0xFFFFFF );
-    propagate(status);
-    
-    return lesi_write_dma( target, count / 2 );
+    lesi_dma_t op;
 
+    hostif_buf_start( hostif, &op, 1, (void *) target, bufdesc, offset, count );
+    return lesi_dma_wait( &op );
 }
\ No newline at end of file
@@ -11,6 +11,8 @@
 #include "mscp/mscp.h"
 #include "mscp/hostif/sareg.h"
 #include "mscp/hostif/commarea.h"
+#include "lesi/lesi.h"
+#include "projconfig.h"
 
 #define FATAL_ENV_PKT_READ  (1)
 #define FATAL_ENV_PKT_WRITE (2)
@@ -48,6 +50,48 @@
 #define WHEN_SA_OP      (0x700)
 #define WHEN_INTR_REQ   (0x300)
 
+/* Largest ring the SA init words can describe */
+#define HOSTIF_RING_MAX     (128)
+
+/* Ring descriptors that fit in a single NPR */
+#define HOSTIF_DESC_PER_NPR (8)
+
+/**
+ * Ring ownership shadow: a set bit means the descriptor was seen owned
+ * by the port and has not been handed back to the host since. Only the
+ * host can hand descriptors to the port, so a clear bit means nothing.
+ */
+typedef uint32_t hostif_shadow_t[HOSTIF_RING_MAX / 32];
+
+static inline int hostif_shadow_owned( const uint32_t *sh, int slot ) {
+    return (sh[slot >> 5] >> (slot & 31)) & 1;
+}
+
+static inline void hostif_shadow_update( uint32_t *sh, int slot, hostif_desc_t desc ) {
+    if ( desc & MSCP_DESC_OWNER )
+        sh[slot >> 5] |=  (1u << (slot & 31));
+    else
+        sh[slot >> 5] &= ~(1u << (slot & 31));
+}
+
+/**
+ * Ring transition interrupt counters, collected per interval.
+ */
+typedef struct hostif_irq_stats {
+    /** Ring transitions requested by the ring code */
+    unsigned long transitions;
+    /** Interrupts delivered to the host */
+    unsigned long interrupts;
+    /** Deliveries caused by reaching MSCP_IRQ_MAX_PENDING */
+    unsigned long by_count;
+    /** Deliveries caused by MSCP_IRQ_MAX_DELAY_US expiring */
+    unsigned long by_timer;
+    /** Deliveries caused by the port going idle */
+    unsigned long by_idle;
+    /** Longest time a transition was held back, in microseconds */
+    uint32_t      max_delay_us;
+} hostif_irq_stats_t;
+
 struct mscpa {
     mscps_t      *server;
 
@@ -97,16 +141,57 @@ struct mscpa {
     hostif_envhdr_t cring_hdr;
     mscpc_t      *cring_pkt;
 
+    /**
+     * Descriptor cache, holds the descriptors for the cring_ccount
+     * slots starting at cring_idx, the first one at cring_cpos.
+     */
+    hostif_desc_t cring_cache[MSCP_CRING_PREFETCH];
+    int           cring_cpos;
+    int           cring_ccount;
+    int           cring_window;
+    unsigned long cring_prefetches;
+
+    /**
+     * Set when the ring full check for the slot before cring_idx - 1 was
+     * left to the next descriptor prefetch.
+     */
+    int             cring_irqchk;
+    hostif_shadow_t cring_shadow;
+
+    /** Polls that left a command in the ring for lack of packets */
+    unsigned long cring_stalls;
+
     int             rring_idx;
     int             rring_state;
-    int             rring_bufsz;
-    hostif_desc_t   rring_desc;
-    hostif_envhdr_t rring_hdr;
-    mscpc_t        *rring_pkt;
+
+    /**
+     * Response batch, holds the rring_pcount responses queued by the
+     * server and the descriptors and envelopes of the rring_bcount slots
+     * starting at rring_idx that were claimed for the first of them.
+     */
+    mscpc_t        *rring_pend[MSCP_RRING_BATCH];
+    int             rring_pcount;
+    int             rring_bcount;
+    hostif_desc_t   rring_desc[MSCP_RRING_BATCH];
+    hostif_envhdr_t rring_hdr[MSCP_RRING_BATCH];
+    unsigned long   rring_batches;
+    hostif_shadow_t rring_shadow;
+
+    /** Ring transition checks answered without a descriptor read */
+    unsigned long own_reads_avoided;
+    /** Ring transition checks that had to read the descriptor */
+    unsigned long own_reads;
 
     int        r_fir;
     int        c_poll;
     int        c_fir;
+
+    /* Pending ring transition interrupt */
+    int        irq_c;
+    int        irq_r;
+    int        irq_pending;
+    uint64_t   irq_since;
+    hostif_irq_stats_t irq_stats;
 };
 
 void hostif_istep1  ( mscpa_t *a );
@@ -120,12 +205,17 @@ int  hostif_cring_poll(  mscpa_t *a );
 void hostif_cring_reset( mscpa_t *a );
 
 int hostif_send_ring_irq( mscpa_t *a, int c, int r );
+int hostif_irq_poll( mscpa_t *a );
+void hostif_irq_reset( mscpa_t *a );
+void hostif_irq_interval( mscpa_t *a, hostif_irq_stats_t *stats );
 
 int hostif_rring_do( mscpa_t *a );
 void hostif_rring_reset( mscpa_t *a );
 void hostif_loop(  mscpa_t *a );
 int hostif_ringxfer_err( mscpa_t *a, int status, int fcode );
 void hostif_fatal( mscpa_t *a, int fatal_code );
+void hostif_buf_start( mscpa_t *hostif, lesi_dma_t *op, int to_host, void *local,
+                       const void *bufdesc, int offset, int count );
 int hostif_read_buf ( mscpa_t *hostif, void *target, const void *bufdesc, int offset, int count );
 int hostif_write_buf( mscpa_t *hostif, const void *target, const void *bufdesc, int offset, int count );
 
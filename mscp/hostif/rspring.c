@@ -1,5 +1,6 @@
 #include "mscp/hostif/hostif.h"
 #include "lesi/lesi.h"
+#include "mscp/pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,32 +9,54 @@
 int dbg_respring = 0;
 
 int hostif_rring_do( mscpa_t *a ) {
-    int status, idx, want_irq;
+    int status, idx, prev_idx, want_irq, i, n, back;
     uint32_t descptr;
+    hostif_desc_t desc[HOSTIF_DESC_PER_NPR];
     uint32_t envptr;
+    lesi_sg_t sg[2 * MSCP_RRING_BATCH];
+    hostif_desc_t prev;
     mscpc_t *pkt;
 
     idx     = a->rring_idx;
     descptr = a->rring_base + idx * sizeof(hostif_desc_t);
-    pkt     = a->rring_pkt;
 
     switch ( a->rring_state ) {
         case CS_UNUSED:
-            return ERR_OK;
+            if ( a->rring_pcount == 0 )
+                return ERR_OK;
+            a->rring_state = CS_WAITFULL;
+
         case CS_WAITFULL:
-            assert( pkt != NULL );
+            /* Read the descriptors for as many queued responses as there */
+            /* are slots left before the end of the ring. The slot before */
+            /* them is read along to refresh its ownership shadow. */
+            back = idx > 0 ? 1 : 0;
+            n = a->rsize - idx;
+            if ( n > a->rring_pcount )
+                n = a->rring_pcount;
+            if ( n + back > HOSTIF_DESC_PER_NPR )
+                n = HOSTIF_DESC_PER_NPR - back;
 
             if ( dbg_respring )
-                printf("MSCP R: polling slot %i\n", idx);
+                printf("MSCP R: polling slots %i-%i\n", idx, idx + n - 1);
             
-            status = lesi_set_host_addr( descptr );
+            status = lesi_set_host_addr( descptr - back * sizeof(hostif_desc_t) );
             propagateTagged( status, WHEN_KLESI_CMD );
 
-            status = lesi_read_dma( (uint16_t *) &a->rring_desc, sizeof(hostif_desc_t) / 2 );
+            status = lesi_read_dma( (uint16_t *) desc, (n + back) * sizeof(hostif_desc_t) / 2 );
             status = hostif_ringxfer_err( a, status, FATAL_RING_READ );
             propagateTagged( status, WHEN_CTRL_READ );
 
-            if ( ~a->rring_desc & MSCP_DESC_OWNER ) {
+            for ( i = 0; i < n + back; i++ )
+                hostif_shadow_update( a->rring_shadow, idx - back + i, desc[i] );
+            memcpy( a->rring_desc, desc + back, n * sizeof(hostif_desc_t) );
+
+            /* Claim the slots up to the first one we don't own */
+            for ( i = 0; i < n; i++ )
+                if ( ~a->rring_desc[i] & MSCP_DESC_OWNER )
+                    break;
+
+            if ( i == 0 ) {
                 /* We don't own this descriptor. That means for now no */
                 /* more descriptors are available. */
                 if ( dbg_respring )
@@ -42,92 +65,90 @@ int hostif_rring_do( mscpa_t *a ) {
             }
 
             /* Checkpoint */ 
+            a->rring_bcount = i;
             a->rring_state = CS_XFERSZ;
             if ( dbg_respring )
-                printf("MSCP R: Accepted response descriptor [%3i] Addr: %09o F: %i\n",
-                idx, a->rring_desc & a->addrmask,
-                (a->rring_desc & MSCP_DESC_FLAG) != 0 );
+                for ( i = 0; i < a->rring_bcount; i++ )
+                    printf("MSCP R: Accepted response descriptor [%3i] Addr: %09o F: %i\n",
+                    idx + i, a->rring_desc[i] & a->addrmask,
+                    (a->rring_desc[i] & MSCP_DESC_FLAG) != 0 );
             
-            a->r_fir = a->rring_desc & MSCP_DESC_FLAG;
+            /* Only the first slot can be a transition from an empty ring */
+            a->r_fir = a->rring_desc[0] & MSCP_DESC_FLAG;
 
         case CS_XFERSZ:
-            /* --------------- Transfer response envelope in ----------------- */
-            envptr = (a->rring_desc & a->addrmask) - sizeof(hostif_envhdr_t);
-            if ( pkt->msg_len > 60 ) {
-                status = lesi_set_host_addr( envptr );
-                propagateTagged( status, WHEN_KLESI_CMD );
-
-                status = lesi_read_dma( (uint16_t *) &a->rring_hdr, sizeof(hostif_envhdr_t) / 2 );
-                status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_READ );
-                propagateTagged( status, WHEN_CTRL_READ );
-
-                //TODO: checkpoint here?
-                a->rring_bufsz = a->rring_hdr.msg_len;
-            } else
-                a->rring_bufsz = pkt->msg_len;
-
-            //TODO: Figure out how to deal with fragmentation
-            a->rring_hdr.conn_id = pkt->conn_id;
-            a->rring_hdr.msg_len = pkt->msg_len;
-            a->rring_hdr.type_credits = (pkt->msg_type << 4)  | pkt->credit;
-            
-            if ( pkt->msg_len > a->rring_bufsz ) {
-                a->rring_hdr.msg_len = a->rring_bufsz;
+            /* --------------- Transfer response envelopes in --------------- */
+            for ( i = 0; i < a->rring_bcount; i++ ) {
+                pkt    = a->rring_pend[i];
+                envptr = (a->rring_desc[i] & a->addrmask) - sizeof(hostif_envhdr_t);
+                if ( pkt->msg_len > 60 ) {
+                    status = lesi_set_host_addr( envptr );
+                    propagateTagged( status, WHEN_KLESI_CMD );
+
+                    status = lesi_read_dma( (uint16_t *) &a->rring_hdr[i], sizeof(hostif_envhdr_t) / 2 );
+                    status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_READ );
+                    propagateTagged( status, WHEN_CTRL_READ );
+
+                    n = a->rring_hdr[i].msg_len;
+                } else
+                    n = pkt->msg_len;
+
+                //TODO: Figure out how to deal with fragmentation
+                a->rring_hdr[i].conn_id = pkt->conn_id;
+                a->rring_hdr[i].msg_len = pkt->msg_len;
+                a->rring_hdr[i].type_credits = (pkt->msg_type << 4)  | pkt->credit;
                 
+                if ( pkt->msg_len > n ) {
+                    a->rring_hdr[i].msg_len = n;
+                    
+                }
             }
 
             a->rring_state = CS_XFER_PAYL;
 
         case CS_XFER_PAYL:
-            /* --------------- Transfer response payload ----------------- */
+            /* ---------- Transfer response envelopes and payloads ----------- */
+            for ( i = 0; i < a->rring_bcount; i++ ) {
+                envptr = (a->rring_desc[i] & a->addrmask) - sizeof(hostif_envhdr_t);
+                sg[2 * i].addr      = envptr;
+                sg[2 * i].buf       = &a->rring_hdr[i];
+                sg[2 * i].count     = sizeof(hostif_envhdr_t) / 2;
+                sg[2 * i + 1].addr  = a->rring_desc[i] & a->addrmask;
+                sg[2 * i + 1].buf   = a->rring_pend[i]->data;
+                sg[2 * i + 1].count = a->rring_hdr[i].msg_len / 2;
+            }
 
-            /* Resumed */
-            status = lesi_set_host_addr( a->rring_desc & a->addrmask );
-            propagateTagged( status, WHEN_KLESI_CMD );
-            
-            //TODO: Combine with header read as size is always >= 64
             //TODO: Honor burst limit
-
-            status = lesi_write_dma( pkt->data, pkt->msg_len / 2);
+            status = lesi_write_dma_sg( sg, 2 * a->rring_bcount );
             status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_WRITE );
             propagateTagged( status, WHEN_CTRL_WRITE );
             
             if ( dbg_respring )
-                printf("MSCP R: Transfered response payload [%3i]\n", idx);
-
-            a->rring_state = CS_XFER_ENV;
-
-        case CS_XFER_ENV:
-
-            /* --------------- Transfer response envelope ----------------- */
-            envptr = (a->rring_desc & a->addrmask) - sizeof(hostif_envhdr_t);
-
-            status = lesi_set_host_addr( envptr );
-            propagateTagged( status, WHEN_KLESI_CMD );
-
-            status = lesi_write_dma( (uint16_t *) &a->rring_hdr, sizeof(hostif_envhdr_t) / 2 );
-            status = hostif_ringxfer_err( a, status, FATAL_ENV_PKT_WRITE );
-            propagateTagged( status, WHEN_CTRL_WRITE );
-
-            if ( dbg_respring )
-                printf("MSCP R: Sent response envelope [%3i] Conn ID: %i Type: %i, Credits: %i, Length: %i\n",
-                    idx, a->rring_hdr.conn_id, pkt->msg_type, pkt->credit, a->rring_hdr.msg_len );
+                for ( i = 0; i < a->rring_bcount; i++ )
+                    printf("MSCP R: Sent response [%3i] Conn ID: %i Type: %i, Credits: %i, Length: %i\n",
+                        idx + i, a->rring_hdr[i].conn_id, a->rring_pend[i]->msg_type,
+                        a->rring_pend[i]->credit, a->rring_hdr[i].msg_len );
 
             a->rring_state = CS_XFER_OWN;
 
         case CS_XFER_OWN:
-            /* --------------- Transfer command ownership ----------------- */
-
-            a->rring_desc |=  MSCP_DESC_FLAG;
-            a->rring_desc &= ~MSCP_DESC_OWNER;
+            /* --------------- Transfer response ownership ----------------- */
+            /* The payloads are all in place, hand the slots over at once */
+            for ( i = 0; i < a->rring_bcount; i++ ) {
+                a->rring_desc[i] |=  MSCP_DESC_FLAG;
+                a->rring_desc[i] &= ~MSCP_DESC_OWNER;
+            }
 
             status = lesi_set_host_addr( descptr );
             propagateTagged( status, WHEN_KLESI_CMD );
 
-            status = lesi_write_dma( (uint16_t *) &a->rring_desc, sizeof(hostif_desc_t) / 2 );
+            status = lesi_write_dma( (uint16_t *) a->rring_desc, a->rring_bcount * sizeof(hostif_desc_t) / 2 );
             status = hostif_ringxfer_err( a, status, FATAL_RING_WRITE );
             propagateTagged( status, WHEN_CTRL_WRITE );
 
+            for ( i = 0; i < a->rring_bcount; i++ )
+                hostif_shadow_update( a->rring_shadow, idx + i, a->rring_desc[i] );
+
             if ( ~a->r_fir & MSCP_DESC_FLAG ) {
                 break; /* done */
             }
@@ -136,20 +157,28 @@ int hostif_rring_do( mscpa_t *a ) {
 
         case CS_SENDIRQ:
 
+            prev_idx = (idx - 1) & (a->rsize - 1);
             if ( a->rsize == 1 ) {
                 want_irq = 1;
+            } else if ( hostif_shadow_owned( a->rring_shadow, prev_idx ) ) {
+                /* The host gave it back to us, so it still is ours */
+                a->own_reads_avoided++;
+                want_irq = 1;
             } else {
-                /* Read previous descriptor to see if the ring was empty */
-                descptr = a->rring_base + ((idx - 1) & (a->rsize - 1)) * sizeof(hostif_desc_t);
+                /* Read the descriptor before the batch to see if the ring */
+                /* was empty */
+                descptr = a->rring_base + prev_idx * sizeof(hostif_desc_t);
 
                 status = lesi_set_host_addr( descptr );
                 propagateTagged( status, WHEN_KLESI_CMD );
 
-                status = lesi_read_dma( (uint16_t *) &a->rring_desc, sizeof(hostif_desc_t) / 2 );
+                status = lesi_read_dma( (uint16_t *) &prev, sizeof(hostif_desc_t) / 2 );
                 status = hostif_ringxfer_err( a, status, FATAL_RING_READ );
                 propagateTagged( status, WHEN_CTRL_READ );
 
-                want_irq = a->rring_desc & MSCP_DESC_OWNER;
+                a->own_reads++;
+                hostif_shadow_update( a->rring_shadow, prev_idx, prev );
+                want_irq = prev & MSCP_DESC_OWNER;
             }
 
             if ( want_irq ) {
@@ -159,39 +188,52 @@ int hostif_rring_do( mscpa_t *a ) {
 
             
             if ( dbg_respring )
-                printf("MSCP R: Transfered response ownership [%3i]\n", idx);
+                printf("MSCP R: Transfered response ownership [%3i-%3i]\n", 
+                    idx, idx + a->rring_bcount - 1);
             
             break; /* done */
     }
 
-    a->rring_idx = (idx + 1) & (a->rsize - 1);
-    free( a->rring_pkt->data );
-    free( a->rring_pkt );
-    a->rring_pkt = NULL;
+    /* Release the sent responses and move the rest up */
+    n = a->rring_bcount;
+    for ( i = 0; i < n; i++ )
+        mscp_pkt_free( a->rring_pend[i] );
+    a->rring_pcount -= n;
+    memmove( a->rring_pend, a->rring_pend + n, a->rring_pcount * sizeof(mscpc_t *) );
+
+    a->rring_idx = (idx + n) & (a->rsize - 1);
+    a->rring_bcount = 0;
+    a->rring_batches++;
     a->rring_state = CS_UNUSED;
     return ERR_OK;
 
 }
 
+/**
+ * Queue a response for transmission on the response ring.
+ * @param a    The MSCP adapter context
+ * @param resp The response packet, owned by the host interface on success
+ * @return ERR_OK, or ERR_BUSY if the response batch is full
+ */
 int hostif_send_response(  mscpa_t *a, mscpc_t *resp ) {
-    int status;
 
-    if ( a->rring_state != CS_UNUSED )
+    if ( a->rring_pcount == MSCP_RRING_BATCH )
         return ERR_BUSY;
     
-    a->rring_state = CS_WAITFULL;
-    a->rring_pkt   = resp;
+    a->rring_pend[a->rring_pcount++] = resp;
  
     return ERR_OK;
 }
 
 void hostif_rring_reset( mscpa_t *a ) {
-    if ( a->rring_pkt ) {
-        if ( a->rring_pkt->data )
-            free( a->rring_pkt->data );
-        free( a->rring_pkt );
-    }
+    int i;
+
+    for ( i = 0; i < a->rring_pcount; i++ )
+        mscp_pkt_free( a->rring_pend[i] );
     a->rring_idx = 0;
+    a->rring_pcount = 0;
+    a->rring_bcount = 0;
     a->rring_state = CS_UNUSED;
+    memset( a->rring_shadow, 0, sizeof(hostif_shadow_t) );
 
 }
\ No newline at end of file
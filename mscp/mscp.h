@@ -21,6 +21,7 @@
 #define CMD_DELETE   (4)
 #define CMD_REPLY    (5)
 #define CMD_ABORTING (6)
+#define CMD_MERGED   (7) /* Carried out as part of an earlier command */
 
 typedef struct mscpa mscpa_t;
 typedef struct mscps mscps_t;
@@ -47,6 +48,12 @@ struct mscpc {
         mscp_errlog_t *errl;
     };
     void              *dctx;
+    /* Commands merged into this one, in LBA order */
+    mscpc_t           *merge_next;
+    /* Time the command was queued to its unit, and how many commands that
+       arrived later were issued before it */
+    uint64_t           t_queued;
+    int                bypassed;
 };
 
 void hostif_set_server( mscpa_t *hostif, mscps_t *server );
@@ -57,6 +64,8 @@ void mscps_enqueue_cmd( mscps_t *server, mscpc_t *cmd );
 void mscps_attach( mscps_t *server ,mscpa_t *hostif );
 mscps_t *mscps_setup( );
 void mscps_loop( mscps_t *server ) ;
+int mscps_pending( mscps_t *server );
+int mscps_split( mscps_t *server );
 
 void hostif_loop(  mscpa_t *a );
 
@@ -51,25 +51,25 @@ struct __attribute__((packed)) mscp_pkt {
 	u_short	m_modifier;		/* modifiers */
 	union {// 12
 	struct {
-		long	Ms_bytecnt;	/* byte count */
-		long  	Ms_buf; 	/* buffer descriptor hi  word */
-		long	Ms_xx2[2];	/* unused */
-		long    Ms_lba;	    /* logical bhock number hi  word */
-		long	Ms_xx4;		/* unused */
-		long	*Ms_dscptr;	/* pointer to descriptor (software) */
-		long	Ms_sftwds[4];	/* software words, padding */
+		int32_t	Ms_bytecnt;	/* byte count */
+		int32_t  	Ms_buf; 	/* buffer descriptor hi  word */
+		int32_t	Ms_xx2[2];	/* unused */
+		int32_t    Ms_lba;	    /* logical bhock number hi  word */
+		int32_t	Ms_xx4;		/* unused */
+		uint32_t Ms_dscptr;	/* pointer to descriptor (software) */
+		int32_t	Ms_sftwds[4];	/* software words, padding */
 	} m_generic;
 	struct {
 		u_short	Ms_version;	/* MSCP version */
 		u_short	Ms_cntflgs;	/* controller flags */
 		u_short	Ms_hsttmo;	/* host timeout */
 		u_short	Ms_usefrac;	/* use fraction */
-		long	Ms_time;	/* time and date */
+		int32_t	Ms_time;	/* time and date */
 	} m_setcntchar;
 	struct {
 		u_short	Ms_rsvd;	/* MSCP version */
 		u_short	Ms_unitflgs;/* unit flags */
-		 long  Ms_rsvd2[3];
+		 int32_t  Ms_rsvd2[3];
 		uint32_t Ms_ddp;
 	} m_online;
 	struct {
@@ -78,9 +78,9 @@ struct __attribute__((packed)) mscp_pkt {
 	struct {
 		u_short	Ms_multunt;	/* multi-unit code */
 		u_short	Ms_unitflgs;	/* unit flags */
-		long	Ms_hostid;	/* host identifier */
+		int32_t	Ms_hostid;	/* host identifier */
 		quad	Ms_unitid;	/* unit identifier */
-		long	Ms_mediaid;	/* media type identifier */
+		int32_t	Ms_mediaid;	/* media type identifier */
 		u_short	Ms_shdwunt;	/* shadow unit */
 		u_short	Ms_shdwsts;	/* shadow status */
 		u_short Ms_track;	/* track size */
@@ -104,7 +104,7 @@ typedef struct mscp_pkt mscp_pkt_t;
 struct __attribute__((packed)) mscp_resp {
 	uint32_t m_cmdref;		/* command reference number */
 
-	u_short m_rsvd;
+	u_short m_unit;			/* unit number */
 	u_short	m_seqn;			/* plus error log reference number */	
 
 	u_char	m_endcode;		/* opcode    */
@@ -131,11 +131,11 @@ struct __attribute__((packed)) mscp_resp {
 		uint32_t Ms_vsn;      /* Volume serial number */
 	} m_online;
 	struct {
-		long	Ms_bytecnt;	/* byte count */
-		long  	Ms_buf; 	/* buffer descriptor hi  word */
-		long	Ms_xx2[2];	/* unused */
-		long    Ms_lba;	    /* Bad block LBA */
-		long	Ms_xx4;		/* unused */
+		int32_t	Ms_bytecnt;	/* byte count */
+		int32_t  	Ms_buf; 	/* buffer descriptor hi  word */
+		int32_t	Ms_xx2[2];	/* unused */
+		int32_t    Ms_lba;	    /* Bad block LBA */
+		int32_t	Ms_xx4;		/* unused */
 	} m_generic;
 	struct {
 		uint32_t Ms_orn;
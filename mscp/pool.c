@@ -0,0 +1,160 @@
+#include "mscp/pool.h"
+#include <stdio.h>
+#include <string.h>
+#include "projconfig.h"
+
+mscp_pool_t mscp_pkt_pool;
+mscp_pool_t mscp_msg_pool;
+
+MSCP_POOL_STORAGE( mscp_pkt_storage, sizeof(mscpc_t),  MSCP_POOL_PKTS );
+MSCP_POOL_STORAGE( mscp_msg_storage, sizeof(mscp_msg_t), MSCP_POOL_MSGS );
+
+/**
+ * Set up a pool and put all of its objects on the free list.
+ * @param pool    The pool to set up
+ * @param name    Name used in reports
+ * @param storage Backing storage for count objects, see MSCP_POOL_STORAGE
+ * @param objsize Size of an object in bytes
+ * @param count   The number of objects
+ */
+void mscp_pool_init( mscp_pool_t *pool, const char *name, void *storage, size_t objsize, int count ) {
+    uint8_t *obj = storage;
+    int i;
+
+    /* Keep every object aligned for any pointer sized member */
+    objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    memset( pool, 0, sizeof(mscp_pool_t) );
+    pool->name    = name;
+    pool->objsize = objsize;
+    pool->count   = count;
+    for ( i = count - 1; i >= 0; i-- ) {
+        *(void **) (obj + i * objsize) = pool->free;
+        pool->free = obj + i * objsize;
+    }
+}
+
+/**
+ * Take an object from a pool.
+ * @param pool The pool to allocate from
+ * @return The object, or NULL if the pool is exhausted
+ */
+void *mscp_pool_alloc( mscp_pool_t *pool ) {
+    uint32_t save = 0;
+    void *obj;
+
+    if ( pool->lock )
+        save = spin_lock_blocking( pool->lock );
+    obj = pool->free;
+    if ( obj == NULL ) {
+        if ( !pool->empty )
+            pool->exhausted++;
+        pool->empty = 1;
+    } else {
+        pool->free = *(void **) obj;
+        __atomic_store_n( &pool->used, pool->used + 1, __ATOMIC_RELAXED );
+        if ( pool->used > pool->high_water )
+            pool->high_water = pool->used;
+    }
+    if ( pool->lock )
+        spin_unlock( pool->lock, save );
+    return obj;
+}
+
+/**
+ * Return an object to the pool it was taken from.
+ * @param pool The pool the object belongs to
+ * @param obj  The object, may be NULL
+ */
+void mscp_pool_free( mscp_pool_t *pool, void *obj ) {
+    uint32_t save = 0;
+
+    if ( obj == NULL )
+        return;
+    if ( pool->lock )
+        save = spin_lock_blocking( pool->lock );
+    *(void **) obj = pool->free;
+    pool->free = obj;
+    pool->empty = 0;
+    __atomic_store_n( &pool->used, pool->used - 1, __ATOMIC_RELAXED );
+    if ( pool->lock )
+        spin_unlock( pool->lock, save );
+}
+
+/**
+ * Guard a pool with a spin lock, so that both cores can allocate from
+ * and free to it.
+ */
+void mscp_pool_share( mscp_pool_t *pool ) {
+    if ( pool->lock == NULL )
+        pool->lock = spin_lock_init( spin_lock_claim_unused( true ) );
+}
+
+/**
+ * Print the usage counters of a pool.
+ */
+void mscp_pool_dump( const mscp_pool_t *pool ) {
+    printf("Pool %-8s %4i x %4i bytes: %4i in use, high water %4i, ran out %lu times\n",
+        pool->name, pool->count, (int) pool->objsize, pool->used, pool->high_water, pool->exhausted );
+}
+
+/**
+ * Set up the packet header and message slot pools.
+ */
+void mscp_pools_init( void ) {
+    mscp_pool_init( &mscp_pkt_pool, "packet", mscp_pkt_storage, sizeof(mscpc_t),    MSCP_POOL_PKTS );
+    mscp_pool_init( &mscp_msg_pool, "message", mscp_msg_storage, sizeof(mscp_msg_t), MSCP_POOL_MSGS );
+}
+
+/**
+ * Guard the packet header and message slot pools, which the port and
+ * the server use from different cores.
+ */
+void mscp_pools_share( void ) {
+    mscp_pool_share( &mscp_pkt_pool );
+    mscp_pool_share( &mscp_msg_pool );
+}
+
+void mscp_pools_dump( void ) {
+    mscp_pool_dump( &mscp_pkt_pool );
+    mscp_pool_dump( &mscp_msg_pool );
+}
+
+/**
+ * Allocate a zeroed packet header.
+ * @return The header, or NULL if the pool is exhausted
+ */
+mscpc_t *mscp_pkt_alloc( void ) {
+    mscpc_t *pkt = mscp_pool_alloc( &mscp_pkt_pool );
+
+    if ( pkt )
+        memset( pkt, 0, sizeof(mscpc_t) );
+    return pkt;
+}
+
+/**
+ * Free a packet header along with its message slot.
+ * @param pkt The packet, may be NULL
+ */
+void mscp_pkt_free( mscpc_t *pkt ) {
+    if ( pkt == NULL )
+        return;
+    mscp_msg_free( pkt->data );
+    mscp_pool_free( &mscp_pkt_pool, pkt );
+}
+
+/**
+ * Allocate a zeroed message slot of MSCP_MSG_SLOT_SZ bytes.
+ * @return The slot, or NULL if the pool is exhausted
+ */
+void *mscp_msg_alloc( void ) {
+    void *msg = mscp_pool_alloc( &mscp_msg_pool );
+
+    if ( msg )
+        memset( msg, 0, sizeof(mscp_msg_t) );
+    return msg;
+}
+
+void mscp_msg_free( void *msg ) {
+    mscp_pool_free( &mscp_msg_pool, msg );
+}
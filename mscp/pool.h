@@ -0,0 +1,90 @@
+/**
+ * Fixed size object pools for the MSCP packet path.
+ *
+ * Packet headers, message slots and unit driver contexts are allocated
+ * and freed for every command. Taking them from statically sized pools
+ * instead of the heap keeps allocation O(1) and avoids fragmenting the
+ * heap. When a pool runs out, its alloc function returns NULL. The
+ * caller then leaves the work where it is, e.g. the descriptor in the
+ * command ring, and retries until an object is freed. Only the first
+ * refused allocation of such a wait is counted.
+ *
+ * Pools shared by the port and the server running on different cores
+ * are guarded by a hardware spin lock, see mscp_pool_share().
+ */
+#ifndef __mscp_pool__
+#define __mscp_pool__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mscp/mscp.h"
+#include "hardware/sync.h"
+
+typedef struct mscp_pool {
+    const char   *name;
+    size_t        objsize;
+    int           count;
+
+    /** Head of the free list, threaded through the free objects */
+    void         *free;
+
+    /** Objects currently allocated */
+    int           used;
+    /** Most objects ever allocated at the same time */
+    int           high_water;
+    /** Times the pool ran out, counted once until an object is freed
+        however often allocation is retried meanwhile */
+    unsigned long exhausted;
+    /** Set by a refused allocation, cleared when an object is freed */
+    int           empty;
+
+    /** Held while the free list is changed, NULL if only one core uses
+        the pool */
+    spin_lock_t  *lock;
+} mscp_pool_t;
+
+/**
+ * Message slot, large enough for any MSCP command or response message.
+ */
+typedef union mscp_msg {
+    mscp_pkt_t    pkt;
+    mscp_resp_t   resp;
+    mscp_errlog_t errl;
+    uint8_t       raw[64];
+} mscp_msg_t;
+
+#define MSCP_MSG_SLOT_SZ (sizeof(mscp_msg_t))
+
+/**
+ * Define the storage for a pool of count objects of size bytes.
+ */
+#define MSCP_POOL_STORAGE(name, size, count) \
+    static void *name[((size) + sizeof(void *) - 1) / sizeof(void *) * (count)]
+
+void  mscp_pool_init ( mscp_pool_t *pool, const char *name, void *storage, size_t objsize, int count );
+void *mscp_pool_alloc( mscp_pool_t *pool );
+void  mscp_pool_free ( mscp_pool_t *pool, void *obj );
+void  mscp_pool_dump ( const mscp_pool_t *pool );
+void  mscp_pool_share( mscp_pool_t *pool );
+
+/**
+ * Returns the number of free objects. On a shared pool, the other core
+ * may change this at any time.
+ */
+static inline int mscp_pool_avail( const mscp_pool_t *pool ) {
+    return pool->count - __atomic_load_n( &pool->used, __ATOMIC_RELAXED );
+}
+
+/* Packet header and message slot pools */
+extern mscp_pool_t mscp_pkt_pool;
+extern mscp_pool_t mscp_msg_pool;
+
+void     mscp_pools_init( void );
+void     mscp_pools_dump( void );
+void     mscp_pools_share( void );
+mscpc_t *mscp_pkt_alloc ( void );
+void     mscp_pkt_free  ( mscpc_t *pkt );
+void    *mscp_msg_alloc ( void );
+void     mscp_msg_free  ( void *msg );
+
+#endif
@@ -0,0 +1,344 @@
+#include "mscp/server/bcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Set up an empty cache.
+ * @param c       The cache
+ * @param nblocks Number of blocks to hold
+ * @return The number of blocks allocated, 0 if out of memory. An empty
+ *         cache misses every lookup.
+ */
+int mscp_bcache_init( mscp_bcache_t *c, int nblocks ) {
+    int hsize = 1;
+    int i;
+
+    memset( c, 0, sizeof(mscp_bcache_t) );
+    if ( nblocks > INT16_MAX )
+        nblocks = INT16_MAX;
+    if ( nblocks <= 0 )
+        return 0;
+    while ( hsize < nblocks )
+        hsize <<= 1;
+
+    c->hash = malloc( hsize * sizeof(int16_t) );
+    c->ent  = malloc( nblocks * sizeof(mscp_bcache_ent_t) );
+    c->data = malloc( nblocks * MSCP_BCACHE_BLKSZ );
+    if ( c->hash == NULL || c->ent == NULL || c->data == NULL ) {
+        free( c->hash );
+        free( c->ent );
+        free( c->data );
+        memset( c, 0, sizeof(mscp_bcache_t) );
+        return 0;
+    }
+
+    c->nblocks = nblocks;
+    c->hmask   = hsize - 1;
+    for ( i = 0; i < hsize; i++ )
+        c->hash[i] = -1;
+    memset( c->ent, 0, nblocks * sizeof(mscp_bcache_ent_t) );
+    return nblocks;
+}
+
+/**
+ * Drop every block, dirty ones included. Used when the device behind the
+ * cache went away and its data can no longer be written back.
+ */
+void mscp_bcache_clear( mscp_bcache_t *c ) {
+    int i;
+
+    if ( c->nblocks == 0 )
+        return;
+    for ( i = 0; i <= c->hmask; i++ )
+        c->hash[i] = -1;
+    memset( c->ent, 0, c->nblocks * sizeof(mscp_bcache_ent_t) );
+    c->hand   = 0;
+    c->ndirty = 0;
+}
+
+static int mscp_bcache_find( mscp_bcache_t *c, uint32_t lba ) {
+    int i;
+
+    if ( c->nblocks == 0 )
+        return -1;
+    for ( i = c->hash[lba & c->hmask]; i >= 0; i = c->ent[i].hnext )
+        if ( c->ent[i].lba == lba )
+            return i;
+    return -1;
+}
+
+static void mscp_bcache_unlink( mscp_bcache_t *c, int idx ) {
+    int16_t *p;
+
+    for ( p = c->hash + (c->ent[idx].lba & c->hmask); *p >= 0; p = &c->ent[*p].hnext ) {
+        if ( *p == idx ) {
+            *p = c->ent[idx].hnext;
+            break;
+        }
+    }
+    if ( c->ent[idx].flags & MSCP_BC_DIRTY )
+        c->ndirty--;
+    c->ent[idx].flags = 0;
+}
+
+/**
+ * Find an entry to reuse. The clock hand skips, and clears, the blocks
+ * that were referenced since it last passed them. Dirty blocks are
+ * skipped until they have been destaged.
+ * @return The entry, or -1 if every block is dirty
+ */
+static int mscp_bcache_victim( mscp_bcache_t *c ) {
+    mscp_bcache_ent_t *e;
+    int idx, i;
+
+    for ( i = 0; i < 2 * c->nblocks; i++ ) {
+        idx = c->hand;
+        e   = c->ent + idx;
+        if ( ++c->hand == c->nblocks )
+            c->hand = 0;
+        if ( !(e->flags & MSCP_BC_VALID) )
+            return idx;
+        if ( e->flags & MSCP_BC_DIRTY )
+            continue;
+        if ( e->flags & MSCP_BC_REF ) {
+            e->flags &= ~MSCP_BC_REF;
+            continue;
+        }
+        c->stats.evictions++;
+        if ( e->flags & MSCP_BC_RA )
+            c->stats.ra_wasted++;
+        mscp_bcache_unlink( c, idx );
+        return idx;
+    }
+    return -1;
+}
+
+/**
+ * Copy the cached blocks at the start of a range.
+ * @param c     The cache
+ * @param lba   First block of the range
+ * @param count Blocks in the range
+ * @param dst   Buffer for count blocks
+ * @return The number of blocks copied, the run stops at the first block
+ *         that is not cached.
+ */
+int mscp_bcache_read( mscp_bcache_t *c, uint32_t lba, int count, uint8_t *dst ) {
+    mscp_bcache_ent_t *e;
+    int n, idx;
+
+    for ( n = 0; n < count; n++ ) {
+        idx = mscp_bcache_find( c, lba + n );
+        if ( idx < 0 )
+            break;
+        e = c->ent + idx;
+        if ( e->flags & MSCP_BC_RA )
+            c->stats.ra_hits++;
+        e->flags = (e->flags & ~MSCP_BC_RA) | MSCP_BC_REF;
+        memcpy( dst + n * MSCP_BCACHE_BLKSZ, c->data + idx * MSCP_BCACHE_BLKSZ, MSCP_BCACHE_BLKSZ );
+    }
+    c->stats.hits += n;
+    return n;
+}
+
+/**
+ * Count the blocks at the start of a range that are not cached, these
+ * are read from the device.
+ * @return The number of blocks up to the first cached one
+ */
+int mscp_bcache_misses( mscp_bcache_t *c, uint32_t lba, int count ) {
+    int n;
+
+    for ( n = 0; n < count; n++ )
+        if ( mscp_bcache_find( c, lba + n ) >= 0 )
+            break;
+    c->stats.misses += n;
+    return n;
+}
+
+int mscp_bcache_contains( mscp_bcache_t *c, uint32_t lba ) {
+    return mscp_bcache_find( c, lba ) >= 0;
+}
+
+/**
+ * Store blocks read from the device, or written by the host in write-back
+ * operation. Blocks read from the device never replace dirty ones.
+ * @param c     The cache
+ * @param lba   First block
+ * @param count Number of blocks
+ * @param src   The block data
+ * @param flags MSCP_BC_RA if the blocks were read ahead, MSCP_BC_DIRTY
+ *              if they still have to be written to the device, else 0
+ * @return The number of blocks stored, less than count if the cache ran
+ *         out of clean blocks to replace
+ */
+int mscp_bcache_fill( mscp_bcache_t *c, uint32_t lba, int count, const uint8_t *src, int flags ) {
+    mscp_bcache_ent_t *e;
+    int n, idx, h;
+
+    if ( c->nblocks == 0 )
+        return 0;
+    for ( n = 0; n < count; n++ ) {
+        idx = mscp_bcache_find( c, lba + n );
+        if ( idx < 0 ) {
+            idx = mscp_bcache_victim( c );
+            if ( idx < 0 )
+                break;
+            e = c->ent + idx;
+            h = (lba + n) & c->hmask;
+            e->lba   = lba + n;
+            e->flags = MSCP_BC_VALID | (flags & MSCP_BC_RA);
+            e->hnext = c->hash[h];
+            c->hash[h] = idx;
+            if ( flags & MSCP_BC_RA )
+                c->stats.ra_blocks++;
+        }
+        e = c->ent + idx;
+        if ( flags & MSCP_BC_DIRTY ) {
+            c->stats.wb_blocks++;
+            if ( e->flags & MSCP_BC_DIRTY )
+                c->stats.wb_merged++;
+            else
+                c->ndirty++;
+            e->flags |= MSCP_BC_DIRTY;
+            e->epoch  = c->epoch;
+        } else if ( e->flags & MSCP_BC_DIRTY )
+            continue;
+        memcpy( c->data + idx * MSCP_BCACHE_BLKSZ, src + n * MSCP_BCACHE_BLKSZ, MSCP_BCACHE_BLKSZ );
+    }
+    return n;
+}
+
+/**
+ * Update the cached copies of blocks the host writes.
+ */
+void mscp_bcache_write( mscp_bcache_t *c, uint32_t lba, int count, const uint8_t *src ) {
+    int n, idx;
+
+    for ( n = 0; n < count; n++ ) {
+        idx = mscp_bcache_find( c, lba + n );
+        if ( idx >= 0 )
+            memcpy( c->data + idx * MSCP_BCACHE_BLKSZ, src + n * MSCP_BCACHE_BLKSZ, MSCP_BCACHE_BLKSZ );
+    }
+}
+
+/**
+ * Drop blocks from the cache.
+ */
+void mscp_bcache_inval( mscp_bcache_t *c, uint32_t lba, int count ) {
+    int n, idx;
+
+    for ( n = 0; n < count; n++ ) {
+        idx = mscp_bcache_find( c, lba + n );
+        if ( idx >= 0 )
+            mscp_bcache_unlink( c, idx );
+    }
+}
+
+/**
+ * Take the next run of dirty blocks to write to the device. Runs are
+ * taken in ascending LBA order, like an elevator sweep starting at from.
+ * The blocks are marked clean, a later write makes them dirty again.
+ * @param c     The cache
+ * @param from  Where the sweep continues, the first dirty block at or
+ *              after it is taken, or the lowest one if there is none
+ * @param lba   Receives the first block of the run
+ * @param max   Most blocks to take
+ * @param dst   Buffer for max blocks
+ * @return The number of blocks in the run, 0 if nothing is dirty
+ */
+int mscp_bcache_destage( mscp_bcache_t *c, uint32_t from, uint32_t *lba, int max, uint8_t *dst ) {
+    mscp_bcache_ent_t *e;
+    uint32_t best = 0, low = 0;
+    int have_best = 0, have_low = 0;
+    int i, n, idx;
+
+    if ( c->ndirty == 0 )
+        return 0;
+    for ( i = 0; i < c->nblocks; i++ ) {
+        e = c->ent + i;
+        if ( !(e->flags & MSCP_BC_DIRTY) )
+            continue;
+        if ( e->lba >= from && (!have_best || e->lba < best) ) {
+            best = e->lba;
+            have_best = 1;
+        }
+        if ( !have_low || e->lba < low ) {
+            low = e->lba;
+            have_low = 1;
+        }
+    }
+    *lba = have_best ? best : low;
+
+    for ( n = 0; n < max; n++ ) {
+        idx = mscp_bcache_find( c, *lba + n );
+        if ( idx < 0 || !(c->ent[idx].flags & MSCP_BC_DIRTY) )
+            break;
+        c->ent[idx].flags &= ~MSCP_BC_DIRTY;
+        c->ndirty--;
+        memcpy( dst + n * MSCP_BCACHE_BLKSZ, c->data + idx * MSCP_BCACHE_BLKSZ, MSCP_BCACHE_BLKSZ );
+    }
+    c->stats.destaged += n;
+    c->stats.destage_ops++;
+    return n;
+}
+
+/**
+ * Find the dirty blocks in a range, which a transfer that bypasses the
+ * cache would miss.
+ * @param c     The cache
+ * @param lba   First block of the range
+ * @param count Blocks in the range
+ * @param first Receives the first dirty block, if there is one
+ * @return The number of dirty blocks in the range
+ */
+int mscp_bcache_dirty_in( mscp_bcache_t *c, uint32_t lba, uint32_t count, uint32_t *first ) {
+    uint32_t n;
+    int idx, dirty = 0;
+
+    if ( c->ndirty == 0 )
+        return 0;
+    for ( n = 0; n < count; n++ ) {
+        idx = mscp_bcache_find( c, lba + n );
+        if ( idx < 0 || !(c->ent[idx].flags & MSCP_BC_DIRTY) )
+            continue;
+        if ( dirty++ == 0 )
+            *first = lba + n;
+    }
+    return dirty;
+}
+
+/**
+ * Count the dirty blocks written in or before an epoch.
+ */
+int mscp_bcache_dirty_before( mscp_bcache_t *c, uint16_t epoch ) {
+    int i, n = 0;
+
+    if ( c->ndirty == 0 )
+        return 0;
+    for ( i = 0; i < c->nblocks; i++ )
+        if ( (c->ent[i].flags & MSCP_BC_DIRTY) && (int16_t) (c->ent[i].epoch - epoch) <= 0 )
+            n++;
+    return n;
+}
+
+/**
+ * Start a new write epoch.
+ * @return The epoch that just ended, blocks dirtied from now on are newer
+ */
+uint16_t mscp_bcache_new_epoch( mscp_bcache_t *c ) {
+    return c->epoch++;
+}
+
+void mscp_bcache_dump( const mscp_bcache_t *c ) {
+    const mscp_bcache_stats_t *s = &c->stats;
+    unsigned long total = s->hits + s->misses;
+
+    printf("Cache %5i blocks: %lu hits, %lu misses (%.1f%% hit), %lu evictions, "
+           "read-ahead %lu blocks, %lu used, %lu wasted\n",
+        c->nblocks, s->hits, s->misses, total ? 100.0 * s->hits / total : 0.0,
+        s->evictions, s->ra_blocks, s->ra_hits, s->ra_wasted );
+    if ( s->wb_blocks || s->destaged || c->ndirty )
+        printf("      write-back %lu blocks, %lu merged, %lu destaged in %lu writes, %i dirty\n",
+            s->wb_blocks, s->wb_merged, s->destaged, s->destage_ops, c->ndirty );
+}
@@ -0,0 +1,87 @@
+/**
+ * Unit block cache.
+ *
+ * Holds recently read 512 byte blocks of a unit in controller RAM, so
+ * that blocks the host reads again and again (directories, index files)
+ * are served without going to the backing device. Entries are found by
+ * LBA through a hash table and replaced with the CLOCK algorithm. Blocks
+ * brought in by read-ahead are tagged, so the statistics show how many
+ * of them were used before being replaced.
+ *
+ * In write-through operation WRITE updates blocks that are cached and
+ * does not allocate new ones. In write-back operation the written blocks
+ * are stored dirty; they cannot be replaced until they are destaged to
+ * the device. Every dirty block is tagged with the epoch in which it was
+ * written, so a flush can wait for just the data that was dirty when it
+ * started.
+ */
+#ifndef __mscp_bcache__
+#define __mscp_bcache__
+
+#include <stdint.h>
+
+#define MSCP_BCACHE_BLKSZ (512)
+
+/* Entry flags */
+#define MSCP_BC_VALID (1)
+#define MSCP_BC_REF   (2) /* Referenced since the clock hand last passed */
+#define MSCP_BC_RA    (4) /* Read ahead and not used yet */
+#define MSCP_BC_DIRTY (8) /* Newer than the device */
+
+typedef struct mscp_bcache_ent {
+    uint32_t lba;
+    int16_t  hnext;
+    uint8_t  flags;
+    uint16_t epoch;
+} mscp_bcache_ent_t;
+
+typedef struct mscp_bcache_stats {
+    /** Blocks served from the cache */
+    unsigned long hits;
+    /** Blocks read from the device */
+    unsigned long misses;
+    /** Blocks replaced to make room */
+    unsigned long evictions;
+    /** Blocks brought in by read-ahead */
+    unsigned long ra_blocks;
+    /** Read-ahead blocks the host read afterwards */
+    unsigned long ra_hits;
+    /** Read-ahead blocks replaced without being read */
+    unsigned long ra_wasted;
+    /** Blocks written into the cache in write-back operation */
+    unsigned long wb_blocks;
+    /** Of those, blocks that were still dirty and merged */
+    unsigned long wb_merged;
+    /** Dirty blocks written to the device */
+    unsigned long destaged;
+    /** Device writes used for that */
+    unsigned long destage_ops;
+} mscp_bcache_stats_t;
+
+typedef struct mscp_bcache {
+    int                nblocks;
+    int                hmask;
+    int                hand;
+    int                ndirty;
+    uint16_t           epoch;
+    int16_t           *hash;
+    mscp_bcache_ent_t *ent;
+    uint8_t           *data;
+    mscp_bcache_stats_t stats;
+} mscp_bcache_t;
+
+int  mscp_bcache_init   ( mscp_bcache_t *c, int nblocks );
+void mscp_bcache_clear  ( mscp_bcache_t *c );
+int  mscp_bcache_read   ( mscp_bcache_t *c, uint32_t lba, int count, uint8_t *dst );
+int  mscp_bcache_misses ( mscp_bcache_t *c, uint32_t lba, int count );
+int  mscp_bcache_contains( mscp_bcache_t *c, uint32_t lba );
+int  mscp_bcache_fill   ( mscp_bcache_t *c, uint32_t lba, int count, const uint8_t *src, int flags );
+void mscp_bcache_write  ( mscp_bcache_t *c, uint32_t lba, int count, const uint8_t *src );
+void mscp_bcache_inval  ( mscp_bcache_t *c, uint32_t lba, int count );
+int  mscp_bcache_destage( mscp_bcache_t *c, uint32_t from, uint32_t *lba, int max, uint8_t *dst );
+int  mscp_bcache_dirty_in( mscp_bcache_t *c, uint32_t lba, uint32_t count, uint32_t *first );
+int  mscp_bcache_dirty_before( mscp_bcache_t *c, uint16_t epoch );
+uint16_t mscp_bcache_new_epoch( mscp_bcache_t *c );
+void mscp_bcache_dump   ( const mscp_bcache_t *c );
+
+#endif
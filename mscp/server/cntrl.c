@@ -8,7 +8,7 @@ int mscp_cntrl_scc( mscps_t *srv, mscp_pkt_t *pkt,  mscp_resp_t *end, int *sz )
     printf("MSCP:    MSCP Version     = %i\n"         , pkt->m_un.m_setcntchar.Ms_version );
     printf("MSCP:    Controller flags = %04X\n"       , pkt->m_un.m_setcntchar.Ms_cntflgs );
     printf("MSCP:    Host timeout     = %i s\n"       , pkt->m_un.m_setcntchar.Ms_hsttmo );
-    printf("MSCP:    Wallclock time   = %lli clunks\n", pkt->m_un.m_setcntchar.Ms_time );
+    printf("MSCP:    Wallclock time   = %lli clunks\n", (long long) pkt->m_un.m_setcntchar.Ms_time );
     srv->c_flags = pkt->m_un.m_setcntchar.Ms_cntflgs & srv->c_flagmask;
 
     end->m_status = M_ST_SUCC;
@@ -2,8 +2,10 @@
 #include "error.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include "mscp/pool.h"
+#include "mscp/xcore.h"
 
-void mscps_enqueue_cmd( mscps_t *server, mscpc_t *cmd ) {
+static void mscps_cq_append( mscps_t *server, mscpc_t *cmd ) {
     if ( server->cq_tail ) {
         server->cq_tail->next = cmd;
     } else {
@@ -14,22 +16,78 @@ void mscps_enqueue_cmd( mscps_t *server, mscpc_t *cmd ) {
     server->cq_count++;
 }
 
-void mscps_send_response( mscps_t *server, void *end, int conn, int sz, int type ) {
-    mscpc_t *endw = malloc(sizeof(mscpc_t));
+/**
+ * Hand a command to the server. Called by the port.
+ */
+void mscps_enqueue_cmd( mscps_t *server, mscpc_t *cmd ) {
+    /* Never full, every packet the port can take fits */
+    if ( server->link )
+        mscp_spsc_put( &server->link->cmdq, cmd );
+    else
+        mscps_cq_append( server, cmd );
+}
+
+/**
+ * Take the commands the port passed from the other core.
+ */
+void mscps_link_poll( mscps_t *server ) {
+    mscpc_t *cmd;
+
+    while ( (cmd = mscp_spsc_get( &server->link->cmdq )) != NULL )
+        mscps_cq_append( server, cmd );
+}
+
+static void mscps_rq_append( mscps_t *server, mscpc_t *pkt ) {
+    //TODO: ordering
+    if ( server->rq_tail ) {
+        server->rq_tail->next = pkt;
+    } else {
+        server->rq_head = pkt;
+    }
+    pkt->next = NULL;
+    server->rq_tail = pkt;
+    server->rq_count++;
+}
+
+/**
+ * Queue the response to an immediate command.
+ * @param server The MSCP server
+ * @param endw   Packet header for it, allocated along with the message
+ *               so the response cannot be lost, taken over by the server
+ * @param end    The message, taken over by the server
+ * @param conn   Connection of the command
+ * @param sz     Length of the message
+ * @param type   Message type
+ */
+void mscps_send_response( mscps_t *server, mscpc_t *endw, void *end, int conn, int sz, int type ) {
     endw->data = end;
     endw->data_len = endw->msg_len = sz;
     endw->conn_id  = conn;
     endw->credit   = 3; // ?
     endw->msg_type = type;
-    //TODO: ordering
-    if ( server->rq_tail ) {
-        server->rq_tail->next = endw;
-    } else {
-        server->rq_head = endw;
+    mscps_rq_append( server, endw );
+}
+
+/**
+ * Send an attention message, which carries no credits and is not the
+ * answer to any command.
+ * @param server The MSCP server
+ * @param msg    The message, taken over by the server
+ * @param sz     Length of the message
+ */
+void mscps_send_attn( mscps_t *server, void *msg, int sz ) {
+    mscpc_t *attn = mscp_pkt_alloc();
+    if ( attn == NULL ) {
+        printf("MSCP: No packet free for attention message, dropped\n");
+        mscp_msg_free( msg );
+        return;
     }
-    endw->next = NULL;
-    server->rq_tail = endw;
-    server->rq_count++;
+    attn->data = msg;
+    attn->data_len = attn->msg_len = sz;
+    attn->conn_id  = 0;
+    attn->credit   = 0;
+    attn->msg_type = 0;
+    mscps_rq_append( server, attn );
 }
 
 void mscps_send_end( mscps_t *server, mscpc_t *pkt ) {
@@ -37,15 +95,7 @@ void mscps_send_end( mscps_t *server, mscpc_t *pkt ) {
     pkt->resp->m_endcode |= M_OP_END;
     if ( pkt->msg_len == 0 )
         pkt->msg_len = 60;
-    //TODO: ordering
-    if ( server->rq_tail ) {
-        server->rq_tail->next = pkt;
-    } else {
-        server->rq_head = pkt;
-    }
-    pkt->next = NULL;
-    server->rq_tail = pkt;
-    server->rq_count++;
+    mscps_rq_append( server, pkt );
 }
 
 int mscps_send_rq( mscps_t *server ) {
@@ -56,14 +106,21 @@ int mscps_send_rq( mscps_t *server ) {
 
     while ( resp != NULL ) {
         next = resp->next;
-        status = hostif_send_response( server->hostif, resp );
 
+        /* The port may free the response as soon as it has it */
+        resp->next = NULL;
+        if ( server->link )
+            status = mscp_spsc_put( &server->link->rspq, resp ) ? ERR_OK : ERR_BUSY;
+        else
+            status = hostif_send_response( server->hostif, resp );
+
+        if ( status != ERR_OK )
+            resp->next = next;
         if ( status == ERR_BUSY )
             return ERR_OK;
         else if ( status != ERR_OK )
             return status;
         server->rq_count--;
-        resp->next = NULL;
         server->rq_head = next;
 
         if ( resp == server->rq_tail )
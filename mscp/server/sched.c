@@ -0,0 +1,181 @@
+#include "mscp/server/server.h"
+#include "pico/time.h"
+#include "projconfig.h"
+
+/*
+ * Unit command scheduler.
+ *
+ * MSCP lets a controller execute the commands queued to a unit in any
+ * order, as long as the result is the same as executing them in order.
+ * mscpu_process asks the scheduler which queued command to hand to the
+ * unit driver next. The policy is chosen per unit, MSCP_SCHED by
+ * default:
+ *
+ *  MSCP_SCHED_FIFO      Arrival order.
+ *  MSCP_SCHED_ELEVATOR  Ascending LBA from where the last command ended,
+ *                       wrapping around to the lowest queued LBA (C-LOOK).
+ *  MSCP_SCHED_DEADLINE  As the elevator, but commands that have been
+ *                       queued for MSCP_SCHED_DEADLINE_US go first.
+ *
+ * With every policy, express requests (M_MD_EXPRS) go ahead of the
+ * other commands, and a command that was passed over by
+ * MSCP_SCHED_MAX_BYPASS later arrivals goes ahead of everything.
+ *
+ * A command never passes an earlier one that touches the same blocks
+ * when either of them writes, nor a command that does not transfer
+ * blocks, such as FLUSH. Nor is it issued while such an earlier command
+ * is still being carried out: the unit driver moves a command in several
+ * segments, and a READ issued next to an overlapping WRITE could see the
+ * blocks it has not written yet.
+ */
+
+static int mscpu_sched_sortable( mscpc_t *cmd ) {
+    switch ( cmd->pkt->m_opcode ) {
+        case M_OP_ACCES:
+        case M_OP_COMP :
+        case M_OP_READ :
+        case M_OP_WRITE:
+        case M_OP_ERASE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int mscpu_sched_writes( mscpc_t *cmd ) {
+    return cmd->pkt->m_opcode == M_OP_WRITE || cmd->pkt->m_opcode == M_OP_ERASE;
+}
+
+/**
+ * Returns the block following the last one touched by a command and the
+ * commands merged into it.
+ */
+static uint32_t mscpu_sched_end( mscpu_t *unit, mscpc_t *cmd ) {
+    return cmd->pkt->m_un.m_generic.Ms_lba +
+        (mscpu_xfer_len( cmd ) + unit->u_blksize - 1) / unit->u_blksize;
+}
+
+/**
+ * Checks whether a command may be issued now, ahead of the queued commands
+ * that arrived before it and next to the ones still being carried out.
+ * @param unit The unit
+ * @param cmd  A queued command that can be sorted
+ * @return 1 if none of the earlier commands that have not been answered
+ *         conflict with it
+ */
+static int mscpu_sched_may_pass( mscpu_t *unit, mscpc_t *cmd ) {
+    mscpc_t *e;
+    uint32_t lba = cmd->pkt->m_un.m_generic.Ms_lba;
+    uint32_t end = mscpu_sched_end( unit, cmd );
+
+    for ( e = unit->cq_head; e != cmd; e = e->next ) {
+        if ( e->state == CMD_REPLY || e->state == CMD_DELETE || e->state == CMD_COMPLETE )
+            continue;
+        /* Commands that move no blocks have none to conflict over, and
+           queued ones end the part of the queue that is picked from */
+        if ( !mscpu_sched_sortable( e ) )
+            continue;
+        if ( !mscpu_sched_writes( e ) && !mscpu_sched_writes( cmd ) )
+            continue;
+        if ( e->pkt->m_un.m_generic.Ms_lba < end && lba < mscpu_sched_end( unit, e ) )
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Checks whether a command has waited long enough that it must go next.
+ */
+static int mscpu_sched_late( mscpu_t *unit, mscpc_t *cmd, uint64_t now ) {
+    if ( cmd->bypassed >= MSCP_SCHED_MAX_BYPASS )
+        return 1;
+    return unit->u_sched == MSCP_SCHED_DEADLINE &&
+           now - cmd->t_queued >= MSCP_SCHED_DEADLINE_US;
+}
+
+/**
+ * Select the queued command to hand to the unit driver next.
+ * @param unit The unit
+ * @return The command, or NULL if no command is queued or every one of
+ *         them must wait for an earlier command to finish
+ */
+mscpc_t *mscpu_sched_pick( mscpu_t *unit ) {
+    mscpc_t *cmd, *first = NULL, *exprs = NULL, *late = NULL, *up = NULL, *low = NULL;
+    uint64_t now = time_us_64();
+    uint32_t lba;
+    int first_ok = 0;
+
+    for ( cmd = unit->cq_head; cmd != NULL; cmd = cmd->next ) {
+        if ( cmd->state != CMD_QUEUED )
+            continue;
+
+        /* Commands that can not be sorted end the part of the queue that
+           can be reordered */
+        if ( !mscpu_sched_sortable( cmd ) ) {
+            if ( first == NULL )
+                return cmd;
+            break;
+        }
+
+        if ( first == NULL ) {
+            first = cmd;
+            first_ok = mscpu_sched_may_pass( unit, cmd );
+            /* Nothing passes a late command, even while it waits */
+            if ( mscpu_sched_late( unit, cmd, now ) )
+                return first_ok ? cmd : NULL;
+            if ( first_ok && (cmd->pkt->m_modifier & M_MD_EXPRS) )
+                exprs = cmd;
+        } else if ( late == NULL && mscpu_sched_late( unit, cmd, now ) ) {
+            if ( mscpu_sched_may_pass( unit, cmd ) )
+                late = cmd;
+        } else if ( exprs == NULL && (cmd->pkt->m_modifier & M_MD_EXPRS) ) {
+            if ( mscpu_sched_may_pass( unit, cmd ) )
+                exprs = cmd;
+        }
+        if ( unit->u_sched == MSCP_SCHED_FIFO )
+            continue;
+
+        lba = cmd->pkt->m_un.m_generic.Ms_lba;
+        if ( lba >= unit->u_sched_pos && (up == NULL || lba < up->pkt->m_un.m_generic.Ms_lba) ) {
+            if ( cmd == first ? first_ok : mscpu_sched_may_pass( unit, cmd ) )
+                up = cmd;
+        } else if ( up == NULL && (low == NULL || lba < low->pkt->m_un.m_generic.Ms_lba) ) {
+            if ( cmd == first ? first_ok : mscpu_sched_may_pass( unit, cmd ) )
+                low = cmd;
+        }
+    }
+    if ( late )
+        return late;
+    if ( exprs )
+        return exprs;
+    if ( up )
+        return up;
+    if ( low )
+        return low;
+    return first_ok ? first : NULL;
+}
+
+/**
+ * Account for a command the unit driver accepted.
+ * @param unit The unit
+ * @param cmd  The command returned by mscpu_sched_pick, no longer queued
+ */
+void mscpu_sched_issued( mscpu_t *unit, mscpc_t *cmd ) {
+    mscpc_t *e;
+    int passed = 0;
+
+    if ( mscpu_sched_late( unit, cmd, time_us_64() ) )
+        unit->u_starved++;
+
+    /* Every command that arrived earlier and is still queued was passed */
+    for ( e = unit->cq_head; e != cmd && e != NULL; e = e->next ) {
+        if ( e->state == CMD_QUEUED ) {
+            e->bypassed++;
+            passed = 1;
+        }
+    }
+    unit->u_reordered += passed;
+
+    if ( mscpu_sched_sortable( cmd ) )
+        unit->u_sched_pos = mscpu_sched_end( unit, cmd );
+}
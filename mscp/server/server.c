@@ -1,6 +1,8 @@
 #include "mscp/server/server.h"
 #include "mscp/hostif/hostif.h"
 #include "projconfig.h"
+#include "mscp/pool.h"
+#include "mscp/xcore.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -17,15 +19,34 @@ void hexdump( void *a ,int count ) {
     printf("\n");
 }
 
+/**
+ * Run a command, or queue it to its unit.
+ * @param server The MSCP server
+ * @param cmd    The command packet
+ * @return 1 if the command was taken, 0 if there are no packets free for
+ *         the reply and the command has to wait.
+ */
 int mscp_run_command( mscps_t *server, mscpc_t *cmd ) {
     int typ = cmd->msg_type;
     int sz = 32;
     int status;
-    mscp_resp_t *end = malloc(sizeof(mscp_resp_t));
-    memset( end, 0, sizeof(mscp_resp_t));
+    mscp_resp_t *end;
+    mscpc_t *endw;
     mscp_pkt_t *pkt = (void *)cmd->data;
     mscpu_t *unit = NULL;
+
+    /* The reply needs a message slot and a packet header. The port on the
+       other core allocates from the same pools, so take both before
+       relying on them */
+    endw = mscp_pkt_alloc();
+    end  = mscp_msg_alloc();
+    if ( endw == NULL || end == NULL ) {
+        mscp_pkt_free( endw );
+        mscp_msg_free( end );
+        return 0;
+    }
     end->m_cmdref = pkt->m_cmdref;
+    end->m_unit   = pkt->m_unit;
     end->m_seqn   = 0; // ?
     end->m_endcode = pkt->m_opcode | M_OP_END;
     end->m_status  = M_ST_ICMD;
@@ -39,14 +60,17 @@ int mscp_run_command( mscps_t *server, mscpc_t *cmd ) {
     //printf("Got packet: opcode = %i\n", pkt->m_opcode );
     switch( pkt->m_opcode ) {
         case M_OP_STCON: status = mscp_cntrl_scc   ( server, pkt, end, &sz ); break;
+        case M_OP_ABORT: status = mscpu_abort      ( unit  , pkt, end, &sz ); break;
         case M_OP_ONLIN: status = mscpu_online     ( unit  , pkt, end, &sz ); break;
         case M_OP_STUNT: status = mscpu_setchar    ( unit  , pkt, end, &sz ); break;
         case M_OP_ACCES:
         case M_OP_WRITE:
         case M_OP_COMP :
         case M_OP_ERASE:
+        case M_OP_FLUSH:
         case M_OP_READ : 
-            free( end );
+            mscp_pkt_free( endw );
+            mscp_msg_free( end );
             status = mscpu_enqueue( unit, cmd ); return 1;
         default:
             printf("Got unknown packet: opcode = %i\n", pkt->m_opcode );
@@ -54,14 +78,13 @@ int mscp_run_command( mscps_t *server, mscpc_t *cmd ) {
             break;
     }
 reply:
-    mscps_send_response(server, end, cmd->conn_id, sz, typ);
+    mscps_send_response(server, endw, end, cmd->conn_id, sz, typ);
     mscps_cmd_free( cmd );
     return 1;
 }
 
 void mscps_cmd_free( mscpc_t *cmd ) {
-    free( cmd->data );
-    free( cmd );
+    mscp_pkt_free( cmd );
 }
 
 void mscps_cmd_handle( mscps_t *server ) {
@@ -71,28 +94,87 @@ void mscps_cmd_handle( mscps_t *server ) {
 
     while ( cmd != NULL ) {
         next = cmd->next;
+        if ( !mscp_run_command( server, cmd ) )
+            break; /* retried once replies have been sent */
         server->cq_head = next;
         if ( cmd == server->cq_tail )
             server->cq_tail = NULL;
-        mscp_run_command( server, cmd );
+        server->cq_count--;
         cmd = next;
     }
 }
 
-void mscps_reinit( mscps_t *server ) {
+static void mscps_do_reinit( mscps_t *server ) {
     int i;
     //TODO: Server reinit
     for ( i = 0; i < server->c_numunits; i++ )
         mscpu_reinit( server->c_unit + i ); //TODO: Handle errors
 }
 
+static int mscps_count_pending( mscps_t *server ) {
+    int i, n;
+
+    n = server->cq_count + server->rq_count;
+    for ( i = 0; i < server->c_numunits; i++ )
+        n += server->c_unit[i].cq_count;
+    return n;
+}
+
+/**
+ * Reinitialize the server, called by the port when the host
+ * reinitialized it. With the server on the other core, this only asks
+ * the server loop to do so.
+ */
+void mscps_reinit( mscps_t *server ) {
+    if ( server->link )
+        atomic_store( &server->link->reinit, 1 );
+    else
+        mscps_do_reinit( server );
+}
+
 void mscps_loop( mscps_t *server ) {
     int i;
+    if ( server->link ) {
+        if ( atomic_exchange( &server->link->reinit, 0 ) )
+            mscps_do_reinit( server );
+        mscps_link_poll( server );
+    }
     mscps_cmd_handle( server );
     mscps_send_rq( server );
     for ( i = 0; i < server->c_numunits; i++ )
         mscpu_process( server->c_unit + i ); //TODO: Handle errors
+    if ( server->link )
+        atomic_store( &server->link->pending, mscps_count_pending( server ) );
+}
+
+/**
+ * Returns the number of commands the server is still working on or has
+ * responses queued for. Called by the port.
+ */
+int mscps_pending( mscps_t *server ) {
+    mscpx_link_t *l = server->link;
 
+    if ( l == NULL )
+        return mscps_count_pending( server );
+    return atomic_load( &l->pending ) + mscp_spsc_count( &l->cmdq ) + mscp_spsc_count( &l->rspq );
+}
+
+/**
+ * Prepare the server to run on a different core than the port. From here
+ * on, commands, responses and host buffer transfers pass through the
+ * queues of a mscpx_link_t, and the packet pools are locked.
+ * @return 1 on success, 0 if the link could not be allocated
+ */
+int mscps_split( mscps_t *server ) {
+    mscpx_link_t *l;
+
+    l = malloc( sizeof(mscpx_link_t) );
+    if ( l == NULL )
+        return 0;
+    mscpx_init( l );
+    mscp_pools_share();
+    server->link = l;
+    return 1;
 }
 
 void mscps_attach( mscps_t *server ,mscpa_t *hostif ) {
@@ -104,6 +186,8 @@ mscps_t *mscps_setup( void ) {
     mscps_t *server;
     int i;
 
+    mscp_pools_init();
+
     server = malloc( sizeof(mscps_t) );
     if ( server == NULL )
         return NULL;
@@ -137,8 +221,12 @@ mscps_t *mscps_setup( void ) {
 }
 
 int mscps_read_buf ( mscps_t *server, void *target, const void *bufdesc, int offset, int count ) {
+    if ( server->link )
+        return mscpx_xfer( server->link, 0, target, bufdesc, offset, count );
     return hostif_read_buf( server->hostif, target, bufdesc, offset, count );
 }
 int mscps_write_buf( mscps_t *server, const void *target, const void *bufdesc, int offset, int count ) {
+    if ( server->link )
+        return mscpx_xfer( server->link, 1, (void *) target, bufdesc, offset, count );
     return hostif_write_buf( server->hostif, target, bufdesc, offset, count );
 }
\ No newline at end of file
@@ -7,6 +7,11 @@
 #define MUS_AVAIL   (1) /* Unit-Available */
 #define MUS_ONLINE  (2) /* Unit-Online    */
 
+/* Unit command scheduling policies, see sched.c */
+#define MSCP_SCHED_FIFO     (0) /* Arrival order                         */
+#define MSCP_SCHED_ELEVATOR (1) /* Ascending LBA, bounded bypassing      */
+#define MSCP_SCHED_DEADLINE (2) /* Ascending LBA, bounded queueing time  */
+
 typedef int (*mscpu_proc_cmd_t)( mscpu_t *unit, mscpc_t *cmd );
 
 struct mscps {
@@ -38,6 +43,9 @@ struct mscps {
 
     int       c_numunits;
     mscpu_t  *c_unit;
+
+    /** Queues to the port on the other core, NULL if both run on one */
+    struct mscpx_link *link;
 };
 
 struct mscpu {
@@ -65,12 +73,30 @@ struct mscpu {
 
     void     *u_drvctx;
 
+    /** Largest transfer queued WRITEs and ERASEs are merged into, 0 if
+        the unit driver does not handle merged commands */
+    int       u_merge_max;
+    /** WRITE and ERASE commands queued, and how many of them were merged */
+    unsigned long u_writes;
+    unsigned long u_merged;
+
+    /** Scheduling policy, one of MSCP_SCHED_* */
+    int       u_sched;
+    /** Block following the last command issued, where the elevator goes on */
+    uint32_t  u_sched_pos;
+    /** Commands issued ahead of an earlier one, and commands issued because
+        they waited too long */
+    unsigned long u_reordered;
+    unsigned long u_starved;
+
 };
 
 
 int mscps_send_rq( mscps_t *server );
-void mscps_send_response( mscps_t *server, void *end, int conn, int sz, int type );
+void mscps_link_poll( mscps_t *server );
+void mscps_send_response( mscps_t *server, mscpc_t *endw, void *end, int conn, int sz, int type );
 void mscps_send_end     ( mscps_t *server, mscpc_t *pkt );
+void mscps_send_attn    ( mscps_t *server, void *msg, int sz );
 
 /* Controller packets */
 int mscp_cntrl_scc( mscps_t *srv, mscp_pkt_t *pkt,  mscp_resp_t *end, int *sz );
@@ -84,8 +110,15 @@ void mscpu_abort_cmd( mscpu_t *unit, mscpc_t *cmd );
 void mscps_cmd_free  ( mscpc_t *cmd );
 
 void mscpu_init( mscps_t *server, int idx );
+void mscpu_set_avail( mscps_t *server, int idx, mscpu_proc_cmd_t drvproc );
+void mscpu_set_offline( mscps_t *server, int idx );
+int mscpu_verify_access( mscpu_t *unit, mscpc_t *cmd );
 int mscpu_process( mscpu_t *unit );
+int mscpu_xfer_len( mscpc_t *cmd );
+int mscpu_read_data( mscpu_t *unit, mscpc_t *cmd, void *target, int offset, int count );
 int mscpu_reinit( mscpu_t *unit );
+mscpc_t *mscpu_sched_pick  ( mscpu_t *unit );
+void     mscpu_sched_issued( mscpu_t *unit, mscpc_t *cmd );
 int mscps_read_buf ( mscps_t *server, void *target, const void *bufdesc, int offset, int count );
 int mscps_write_buf( mscps_t *server, const void *target, const void *bufdesc, int offset, int count );
 
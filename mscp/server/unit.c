@@ -3,6 +3,9 @@
 #include <string.h>
 #include <stdio.h>
 #include "error.h"
+#include "mscp/pool.h"
+#include "pico/time.h"
+#include "projconfig.h"
 
 void mscpu_init( mscps_t *server, int idx ) {
     mscpu_t *unit;
@@ -22,6 +25,32 @@ void mscpu_init( mscps_t *server, int idx ) {
     /* Set unit offline as there isn't yet a back end */
     unit->u_state = MUS_OFFLINE;
 
+    unit->u_sched = MSCP_SCHED;
+}
+
+/**
+ * Tell the host that a unit became available, if it enabled attention
+ * messages.
+ */
+static void mscpu_avail_attn( mscps_t *server, mscpu_t *unit ) {
+    mscp_resp_t *msg;
+
+    if ( !(server->c_flags & M_CF_ATTN) )
+        return;
+    msg = mscp_msg_alloc();
+    if ( msg == NULL ) {
+        printf("MSCP: No message free for attention on unit %i\n", unit->u_idx );
+        return;
+    }
+    memset( msg, 0, 32 );
+    msg->m_unit    = unit->u_idx;
+    msg->m_endcode = M_OP_AVATN;
+    msg->m_status  = M_ST_SUCC;
+    msg->m_un.m_online.Ms_unitflgs = unit->u_flags;
+    msg->m_un.m_online.Ms_unitid   = unit->u_id;
+    msg->m_un.m_online.Ms_media    = unit->u_mediaid;
+    printf("MSCP: Unit %i is available, sending attention\n", unit->u_idx );
+    mscps_send_attn( server, msg, 32 );
 }
 
 void mscpu_set_avail( mscps_t *server, int idx, mscpu_proc_cmd_t drvproc ) {
@@ -33,11 +62,23 @@ void mscpu_set_avail( mscps_t *server, int idx, mscpu_proc_cmd_t drvproc ) {
     if ( drvproc )
         unit->u_proccb = drvproc;
     
-    if ( unit->u_state == MUS_OFFLINE )
+    if ( unit->u_state == MUS_OFFLINE ) {
         unit->u_state = MUS_AVAIL;
-    
-    //TODO: send attention message
+        mscpu_avail_attn( server, unit );
+    }
+}
+
+/**
+ * Take a unit offline when its back end went away. Commands still queued
+ * are answered "Unit-Offline" by the unit driver; the host has to bring
+ * the unit online again once it is available.
+ */
+void mscpu_set_offline( mscps_t *server, int idx ) {
+    mscpu_t *unit = server->c_unit + idx;
 
+    if ( unit->u_state != MUS_OFFLINE )
+        printf("MSCP: Unit %i transitioned to \"Unit-Offline\"\n", idx );
+    unit->u_state = MUS_OFFLINE;
 }
 
 static void mscpu_offline_err( mscpu_t *unit, mscp_resp_t *end ) {
@@ -58,8 +99,147 @@ int mscpu_enqueue( mscpu_t *unit, mscpc_t *cmd ) {
     }
     cmd->next  = NULL;
     cmd->state = CMD_QUEUED;
+    cmd->t_queued = time_us_64();
+    cmd->bypassed = 0;
     unit->cq_tail = cmd;
     unit->cq_count++;
+    if ( cmd->pkt->m_opcode == M_OP_WRITE || cmd->pkt->m_opcode == M_OP_ERASE )
+        unit->u_writes++;
+    return ERR_OK;
+}
+
+static uint32_t mscpu_cmd_end( mscpu_t *unit, mscpc_t *cmd ) {
+    return cmd->pkt->m_un.m_generic.Ms_lba +
+        (cmd->pkt->m_un.m_generic.Ms_bytecnt + unit->u_blksize - 1) / unit->u_blksize;
+}
+
+/**
+ * Checks whether a command, together with the commands merged into it,
+ * touches any of the blocks of another one. A merged command moves with
+ * its lead, so all of the chain from it on goes where it goes.
+ */
+static int mscpu_overlaps( mscpu_t *unit, mscpc_t *a, mscpc_t *b ) {
+    uint32_t a_end = a->pkt->m_un.m_generic.Ms_lba +
+        (mscpu_xfer_len( a ) + unit->u_blksize - 1) / unit->u_blksize;
+
+    return a->pkt->m_un.m_generic.Ms_lba < mscpu_cmd_end( unit, b ) &&
+           b->pkt->m_un.m_generic.Ms_lba < a_end;
+}
+
+/**
+ * Check whether a WRITE or ERASE can take others merged into it: it has
+ * to move data, and mscpu_verify_access() must let it through, or the
+ * merged commands would be answered with its status without their data
+ * ever reaching the unit.
+ */
+static int mscpu_may_lead( mscpu_t *unit, mscpc_t *cmd ) {
+    return unit->u_state == MUS_ONLINE &&
+           !(unit->u_flags & (M_UF_WRTPH | M_UF_WRTPS)) &&
+           cmd->pkt->m_un.m_generic.Ms_bytecnt != 0 &&
+           mscpu_cmd_end( unit, cmd ) <= unit->u_blkcount;
+}
+
+/**
+ * Merge queued WRITE and ERASE commands that continue each other into
+ * the first one, so the unit driver moves their data in one transfer.
+ * A command is only moved ahead of the commands between it and the one
+ * it is merged into if none of them touch its blocks, counting those
+ * already merged into them as well. Merged commands
+ * stay in the queue in the CMD_MERGED state and are answered together
+ * with the command they were merged into, each with its own END packet.
+ */
+static void mscpu_coalesce( mscpu_t *unit ) {
+    mscpc_t *lead, *cmd, *tail, *mid;
+    int len, op;
+
+    for ( lead = unit->cq_head; lead != NULL; lead = lead->next ) {
+        op = lead->pkt->m_opcode;
+        if ( lead->state != CMD_QUEUED || (op != M_OP_WRITE && op != M_OP_ERASE) ||
+             !mscpu_may_lead( unit, lead ) )
+            continue;
+        len  = mscpu_xfer_len( lead );
+        for ( tail = lead; tail->merge_next != NULL; tail = tail->merge_next )
+            ;
+        for ( cmd = lead->next; cmd != NULL; cmd = cmd->next ) {
+            if ( cmd->state != CMD_QUEUED || cmd->merge_next != NULL ||
+                 cmd->pkt->m_opcode != op ||
+                 cmd->pkt->m_modifier != lead->pkt->m_modifier )
+                continue;
+            if ( tail->pkt->m_un.m_generic.Ms_bytecnt % unit->u_blksize != 0 ||
+                 cmd->pkt->m_un.m_generic.Ms_lba != mscpu_cmd_end( unit, tail ) ||
+                 cmd->pkt->m_un.m_generic.Ms_bytecnt == 0 ||
+                 mscpu_cmd_end( unit, cmd ) > unit->u_blkcount ||
+                 len + cmd->pkt->m_un.m_generic.Ms_bytecnt > unit->u_merge_max )
+                continue;
+            for ( mid = lead->next; mid != cmd; mid = mid->next )
+                if ( mscpu_overlaps( unit, mid, cmd ) )
+                    break;
+            if ( mid != cmd )
+                continue;
+            tail->merge_next = cmd;
+            tail = cmd;
+            cmd->state = CMD_MERGED;
+            len += cmd->pkt->m_un.m_generic.Ms_bytecnt;
+            unit->u_merged++;
+        }
+    }
+}
+
+/**
+ * Returns the number of bytes moved by a command and those merged into it.
+ */
+int mscpu_xfer_len( mscpc_t *cmd ) {
+    int len = 0;
+
+    for ( ; cmd != NULL; cmd = cmd->merge_next )
+        len += cmd->pkt->m_un.m_generic.Ms_bytecnt;
+    return len;
+}
+
+/**
+ * Read host data of a command and those merged into it, as if they were
+ * one transfer.
+ * @param unit   The unit
+ * @param cmd    The first command
+ * @param target Buffer for the data
+ * @param offset Offset into the combined transfer
+ * @param count  Number of bytes to read
+ */
+int mscpu_read_data( mscpu_t *unit, mscpc_t *cmd, void *target, int offset, int count ) {
+    uint8_t *p = target;
+    int len, n, status;
+
+    for ( ; cmd != NULL && count > 0; cmd = cmd->merge_next ) {
+        len = cmd->pkt->m_un.m_generic.Ms_bytecnt;
+        if ( offset >= len ) {
+            offset -= len;
+            continue;
+        }
+        n = len - offset < count ? len - offset : count;
+        status = mscps_read_buf( unit->u_server, p, &cmd->pkt->m_un.m_generic.Ms_buf, offset, n );
+        propagate( status );
+        p      += n;
+        count  -= n;
+        offset  = 0;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Answer the commands merged into one that is being answered or deleted.
+ * They get its status: a lead is never aborted once commands are merged
+ * into it (see mscpu_abort_cmd()), and mscpu_may_lead() only leaves it
+ * errors that hold for the merged commands as much, so its status is
+ * that of the whole transfer.
+ */
+static void mscpu_merge_done( mscpc_t *cmd ) {
+    mscpc_t *m;
+
+    for ( m = cmd->merge_next; m != NULL; m = m->merge_next ) {
+        if ( cmd->state == CMD_REPLY )
+            m->resp->m_status = cmd->resp->m_status;
+        m->state = cmd->state;
+    }
 }
 
 int mscpu_reinit( mscpu_t *unit ) {
@@ -68,13 +248,31 @@ int mscpu_reinit( mscpu_t *unit ) {
 }
 
 int mscpu_process( mscpu_t *unit ) {
-    mscpc_t *cmd, **prev;
+    mscpc_t *cmd, *next, *last = NULL, **prev;
     int status;
-    for ( cmd = unit->cq_head, prev = &unit->cq_head; cmd != NULL; cmd = cmd->next ) {
-        if ( unit->u_proccb ) {
+    if ( unit->u_merge_max )
+        mscpu_coalesce( unit );
+
+    /* Hand queued commands to the unit driver in the order the scheduler
+       picks them, until the driver has no room for another */
+    while ( unit->u_proccb && (cmd = mscpu_sched_pick( unit )) != NULL ) {
+        status = unit->u_proccb( unit, cmd );
+        if ( status )
+            return status;
+        if ( cmd->state == CMD_QUEUED )
+            break;
+        mscpu_sched_issued( unit, cmd );
+    }
+
+    for ( cmd = unit->cq_head, prev = &unit->cq_head; cmd != NULL; cmd = next ) {
+        /* Completing a command relinks it into the response queue */
+        next = cmd->next;
+        if ( unit->u_proccb && cmd->state != CMD_MERGED && cmd->state != CMD_QUEUED ) {
             status = unit->u_proccb( unit, cmd );
             if ( status )
                 return status;
+            if ( cmd->state == CMD_DELETE || cmd->state == CMD_REPLY )
+                mscpu_merge_done( cmd );
         }
         if ( cmd->state == CMD_DELETE || cmd->state == CMD_REPLY ) {
             /* These states are requests to remove the command from unit
@@ -82,8 +280,11 @@ int mscpu_process( mscpu_t *unit ) {
              */
             *prev = cmd->next;
             if ( cmd == unit->cq_tail )
-                unit->cq_tail = NULL;
+                unit->cq_tail = last;
             unit->cq_count--;
+        } else {
+            last = cmd;
+            prev = &cmd->next;
         }
         if ( cmd->state == CMD_REPLY ) {
             mscps_send_end( unit->u_server, cmd );
@@ -123,8 +324,56 @@ error:
     return ERR_OK;
 }
 
+/**
+ * Take the commands merged into one back out of it, so they run on their
+ * own again.
+ */
+static void mscpu_unmerge( mscpu_t *unit, mscpc_t *cmd ) {
+    mscpc_t *m, *next;
+
+    for ( m = cmd->merge_next, cmd->merge_next = NULL; m != NULL; m = next ) {
+        next = m->merge_next;
+        m->merge_next = NULL;
+        m->state      = CMD_QUEUED;
+        unit->u_merged--;
+    }
+}
+
+/**
+ * Abort a command. Merging is invisible to the host, so an ABORT only
+ * ever ends the command it names:
+ *  - A command that was not issued yet is taken out of the chain it was
+ *    merged into, and the commands merged into it go back to the queue
+ *    to run on their own.
+ *  - Once a chain is under way its data moves as one transfer that
+ *    cannot be cut short for one command, so the ABORT has no effect and
+ *    every command of the chain ends with its real status. MSCP allows
+ *    this for a command that is too far along to be aborted.
+ */
 void mscpu_abort_cmd( mscpu_t *unit, mscpc_t *cmd ) {
+    mscpc_t *lead, *prev = NULL;
+
+    if ( cmd->state == CMD_MERGED ) {
+        for ( lead = unit->cq_head; lead != NULL; lead = lead->next ) {
+            if ( lead->state == CMD_MERGED )
+                continue;
+            for ( prev = lead; prev->merge_next != NULL && prev->merge_next != cmd; )
+                prev = prev->merge_next;
+            if ( prev->merge_next == cmd )
+                break;
+        }
+        if ( lead == NULL || lead->state != CMD_QUEUED )
+            return;
+        prev->merge_next = NULL;
+        cmd->state = CMD_QUEUED;
+        unit->u_merged--;
+    } else if ( cmd->state == CMD_ACTIVE && cmd->merge_next != NULL )
+        return;
+    if ( cmd->state != CMD_QUEUED && cmd->state != CMD_ACTIVE )
+        return;
+
     //TODO: Actually cancel any outstanding transactions on the command
+    mscpu_unmerge( unit, cmd );
     cmd->resp->m_status = M_ST_ABRTD; //TODO: Sub code
     cmd->state          = CMD_ABORTED;
 }
@@ -143,11 +392,9 @@ int mscpu_abort( mscpu_t *unit, mscp_pkt_t *pkt,  mscp_resp_t *end, int *sz ) {
     mscpc_t *cmd;
     printf("MSCP: Received ABORT\n");
     printf("MSCP:    ORN              = %i\n"       , pkt->m_un.m_abort.Ms_orn );
-    for ( cmd = unit->cq_head; cmd != NULL; cmd = cmd->next ) {
-        if ( cmd->pkt->m_cmdref != pkt->m_un.m_abort.Ms_orn )
-            continue;
-        mscpu_abort_cmd( unit, cmd );
-    }
+    for ( cmd = unit->cq_head; cmd != NULL; cmd = cmd->next )
+        if ( cmd->pkt->m_cmdref == pkt->m_un.m_abort.Ms_orn )
+            mscpu_abort_cmd( unit, cmd );
     end->m_status = M_ST_SUCC;
     end->m_un.m_abort.Ms_orn = pkt->m_un.m_abort.Ms_orn;
     *sz = 16;
@@ -173,6 +420,8 @@ int mscpu_verify_access( mscpu_t *unit, mscpc_t *cmd ) {
             return 0;
         }
     }
+    if ( cmd->pkt->m_opcode == M_OP_FLUSH )
+        return 1;
     if ( cmd->pkt->m_un.m_generic.Ms_lba > unit->u_blkcount ) {
         cmd->resp->m_status = M_ST_ICMD;
         cmd->resp->m_status |= 28 << M_ST_SBBIT;
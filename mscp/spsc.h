@@ -0,0 +1,101 @@
+/**
+ * Lock-free single producer, single consumer queue of pointers.
+ *
+ * Used to pass packets between the port and the server when they run on
+ * different cores. Only the producer writes the tail and only the
+ * consumer writes the head. The producer stores the tail with release
+ * ordering after filling the slot, and the consumer stores the head after
+ * reading it, so neither side needs a lock. The indices run freely and
+ * are masked on use, so the size must be a power of two.
+ *
+ * Only atomic loads and stores of aligned words are used. Those need no
+ * library support on the Cortex-M0+, and the same code runs under
+ * pthreads on the host.
+ */
+#ifndef __mscp_spsc__
+#define __mscp_spsc__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct mscp_spsc {
+    void       **slot;
+    unsigned     mask;
+
+    /** Next slot to get, written by the consumer */
+    atomic_uint  head;
+    /** Next slot to put, written by the producer */
+    atomic_uint  tail;
+} mscp_spsc_t;
+
+/**
+ * Set up an empty queue.
+ * @param q       The queue
+ * @param storage Array of size slots
+ * @param size    Number of slots, a power of two
+ */
+static inline void mscp_spsc_init( mscp_spsc_t *q, void **storage, unsigned size ) {
+    q->slot = storage;
+    q->mask = size - 1;
+    atomic_init( &q->head, 0 );
+    atomic_init( &q->tail, 0 );
+}
+
+/**
+ * Put an object at the tail of the queue. Producer side only.
+ * @return 1 on success, 0 if the queue is full
+ */
+static inline int mscp_spsc_put( mscp_spsc_t *q, void *obj ) {
+    unsigned tail = atomic_load_explicit( &q->tail, memory_order_relaxed );
+
+    if ( tail - atomic_load_explicit( &q->head, memory_order_acquire ) > q->mask )
+        return 0;
+    q->slot[tail & q->mask] = obj;
+    atomic_store_explicit( &q->tail, tail + 1, memory_order_release );
+    return 1;
+}
+
+/**
+ * Returns the object at the head of the queue without removing it, or
+ * NULL if the queue is empty. Consumer side only.
+ */
+static inline void *mscp_spsc_peek( mscp_spsc_t *q ) {
+    unsigned head = atomic_load_explicit( &q->head, memory_order_relaxed );
+
+    if ( head == atomic_load_explicit( &q->tail, memory_order_acquire ) )
+        return NULL;
+    return q->slot[head & q->mask];
+}
+
+/**
+ * Remove the object at the head of the queue, which must not be empty.
+ * Consumer side only.
+ */
+static inline void mscp_spsc_pop( mscp_spsc_t *q ) {
+    unsigned head = atomic_load_explicit( &q->head, memory_order_relaxed );
+
+    atomic_store_explicit( &q->head, head + 1, memory_order_release );
+}
+
+/**
+ * Take the object at the head of the queue. Consumer side only.
+ * @return The object, or NULL if the queue is empty
+ */
+static inline void *mscp_spsc_get( mscp_spsc_t *q ) {
+    void *obj = mscp_spsc_peek( q );
+
+    if ( obj != NULL )
+        mscp_spsc_pop( q );
+    return obj;
+}
+
+/**
+ * Returns the number of objects in the queue. Exact on either side for
+ * the objects that side put or took, an estimate for the other ones.
+ */
+static inline unsigned mscp_spsc_count( mscp_spsc_t *q ) {
+    return atomic_load_explicit( &q->tail, memory_order_acquire ) -
+           atomic_load_explicit( &q->head, memory_order_acquire );
+}
+
+#endif
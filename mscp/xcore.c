@@ -0,0 +1,113 @@
+#include "mscp/xcore.h"
+#include "mscp/server/server.h"
+#include "mscp/hostif/hostif.h"
+#include "error.h"
+
+void app_idle();
+
+void mscpx_init( mscpx_link_t *l ) {
+    mscp_spsc_init( &l->cmdq,  l->cmd_slot,  MSCP_XCORE_QSIZE );
+    mscp_spsc_init( &l->rspq,  l->rsp_slot,  MSCP_XCORE_QSIZE );
+    mscp_spsc_init( &l->xferq, l->xfer_slot, MSCP_XCORE_QSIZE );
+    atomic_init( &l->pending, 0 );
+    atomic_init( &l->reinit,  0 );
+    l->cur = NULL;
+}
+
+/**
+ * Move the server's host buffer transfers along. Returns to let the port
+ * serve the rings while an NPR runs, or once MSCP_XCORE_SLICE words were
+ * moved.
+ * @param a The MSCP adapter context
+ * @param l The link
+ * @return Non-zero while an NPR is running and the bus must be left alone
+ */
+static int mscpx_xfer_poll( mscpa_t *a, mscpx_link_t *l ) {
+    mscpx_xfer_t *x;
+    int words = 0, status;
+
+    for ( ;; ) {
+        if ( l->cur == NULL ) {
+            x = mscp_spsc_get( &l->xferq );
+            if ( x == NULL )
+                return 0;
+            l->cur = x;
+            hostif_buf_start( a, &l->dma, x->to_host, x->local, x->bufdesc,
+                              x->offset, x->count );
+        }
+
+        status = lesi_dma_poll( &l->dma );
+        if ( status == ERR_BUSY ) {
+            if ( l->dma.phase == LESI_DMA_NPR )
+                return 1;
+            words += l->dma.bcount;
+            if ( words >= MSCP_XCORE_SLICE )
+                return 0;
+            continue;
+        }
+
+        l->cur->status = status;
+        atomic_store_explicit( &l->cur->done, 1, memory_order_release );
+        l->cur = NULL;
+        words += l->dma.bcount;
+        if ( words >= MSCP_XCORE_SLICE )
+            return 0;
+    }
+}
+
+/**
+ * Serve the server from the port side: move the host buffer transfers it
+ * asked for along and move its responses into the response batch. Called
+ * from hostif_loop on the core that owns the LESI bus.
+ * @param a The MSCP adapter context
+ * @return Non-zero while a transfer has an NPR running
+ */
+int mscpx_port_poll( mscpa_t *a ) {
+    mscpx_link_t *l = a->server ? a->server->link : NULL;
+    mscpc_t *resp;
+
+    if ( l == NULL )
+        return 0;
+
+    if ( mscpx_xfer_poll( a, l ) )
+        return 1;
+
+    /* Responses stay queued while the response batch is full */
+    while ( (resp = mscp_spsc_peek( &l->rspq )) != NULL ) {
+        if ( hostif_send_response( a, resp ) != ERR_OK )
+            break;
+        mscp_spsc_pop( &l->rspq );
+    }
+    return 0;
+}
+
+/**
+ * Have the port move data between host memory and a local buffer, and
+ * wait for it to finish. Called by the server core, which keeps running
+ * app_idle() meanwhile.
+ * @param l       The link
+ * @param to_host Set to write host memory, clear to read it
+ * @param local   The local buffer
+ * @param bufdesc The MSCP buffer descriptor
+ * @param offset  Offset into the host buffer
+ * @param count   Number of bytes to move
+ * @return The status of the transfer
+ */
+int mscpx_xfer( mscpx_link_t *l, int to_host, void *local, const void *bufdesc,
+                int offset, int count ) {
+    mscpx_xfer_t x;
+
+    x.to_host = to_host;
+    x.local   = local;
+    x.bufdesc = bufdesc;
+    x.offset  = offset;
+    x.count   = count;
+    x.status  = ERR_OK;
+    atomic_init( &x.done, 0 );
+
+    while ( !mscp_spsc_put( &l->xferq, &x ) )
+        app_idle();
+    while ( !atomic_load_explicit( &x.done, memory_order_acquire ) )
+        app_idle();
+    return x.status;
+}
@@ -0,0 +1,71 @@
+/**
+ * Link between the port and the server when they run on different cores.
+ *
+ * With MSCP_DUAL_CORE, core 1 owns the LESI bus and runs the host
+ * interface, and core 0 runs the MSCP server and the unit drivers. They
+ * share nothing but the packet pools and three queues:
+ *
+ *  cmdq   Commands taken from the command ring, port to server.
+ *  rspq   Responses for the response ring, server to port.
+ *  xferq  Host buffer transfers for the unit drivers, server to port.
+ *         The server waits for the port to finish each transfer. The
+ *         port runs them without waiting for the NPRs, and keeps
+ *         serving the rings between blocks.
+ *
+ * Each queue has one producer and one consumer, see spsc.h. Every packet
+ * comes from mscp_pkt_pool, so cmdq and rspq never fill up as long as
+ * they have at least MSCP_POOL_PKTS slots.
+ */
+#ifndef __mscp_xcore__
+#define __mscp_xcore__
+
+#include <stdatomic.h>
+#include "mscp/mscp.h"
+#include "mscp/spsc.h"
+#include "lesi/lesi.h"
+#include "projconfig.h"
+
+#if MSCP_XCORE_QSIZE < MSCP_POOL_PKTS || (MSCP_XCORE_QSIZE & (MSCP_XCORE_QSIZE - 1))
+#error "MSCP_XCORE_QSIZE must be a power of two of at least MSCP_POOL_PKTS"
+#endif
+
+/**
+ * A host buffer transfer run by the port on behalf of the server.
+ */
+typedef struct mscpx_xfer {
+    /** Set to move data to host memory, clear to move it from there */
+    int          to_host;
+    void        *local;
+    const void  *bufdesc;
+    int          offset;
+    int          count;
+    /** Result of the transfer, valid once done is set */
+    int          status;
+    atomic_int   done;
+} mscpx_xfer_t;
+
+typedef struct mscpx_link {
+    mscp_spsc_t  cmdq;
+    mscp_spsc_t  rspq;
+    mscp_spsc_t  xferq;
+    void        *cmd_slot [MSCP_XCORE_QSIZE];
+    void        *rsp_slot [MSCP_XCORE_QSIZE];
+    void        *xfer_slot[MSCP_XCORE_QSIZE];
+
+    /** Commands the server is working on or has replies queued for, as
+        last published by the server */
+    atomic_int   pending;
+    /** Set by the port when the host reinitialized it */
+    atomic_int   reinit;
+
+    /** Transfer the port is running, and its DMA state. Port side only */
+    mscpx_xfer_t *cur;
+    lesi_dma_t    dma;
+} mscpx_link_t;
+
+void mscpx_init     ( mscpx_link_t *l );
+int  mscpx_port_poll( mscpa_t *a );
+int  mscpx_xfer     ( mscpx_link_t *l, int to_host, void *local, const void *bufdesc,
+                      int offset, int count );
+
+#endif
@@ -8,6 +8,109 @@
 #define MSCP_BASE_FEATURES (FEAT_VEC | FEAT_ENH_DIAG ) /* ZRCFA requires ENH DIAG */
 #define MSCP_DEF_BURSTSZ   (8)
 
+/* Max. command ring descriptors read per poll, at most 8 fit in one NPR */
+#define MSCP_CRING_PREFETCH (8)
+
+/* Max. responses sent per response ring pass, at most 8 fit in one NPR */
+#define MSCP_RRING_BATCH    (8)
+
+/* Ring transition interrupt moderation: deliver pending transitions once */
+/* this many have been merged, or after this long, or when the port goes  */
+/* idle. A pending count of 1 interrupts on every transition.             */
+#define MSCP_IRQ_MAX_PENDING  (4)
+#define MSCP_IRQ_MAX_DELAY_US (200)
+
+/* Packet header and message slot pools, shared by the commands in flight */
+/* and the queued responses. Commands are left in the command ring while  */
+/* no more than MSCP_POOL_RESERVE of either are free, these are kept for  */
+/* the replies to immediate commands.                                     */
+#define MSCP_POOL_PKTS    (32)
+#define MSCP_POOL_MSGS    (32)
+#define MSCP_POOL_RESERVE (2)
+
+/* Run the LESI bus and the host interface on core 1, and the MSCP server */
+/* and USB on core 0. MSCP_XCORE_QSIZE is the size of the queues between  */
+/* them, a power of two of at least MSCP_POOL_PKTS.                       */
+/* The port moves host buffer data for the server without waiting for the */
+/* NPRs, and checks the rings after every MSCP_XCORE_SLICE words.         */
+#define MSCP_DUAL_CORE    (1)
+#define MSCP_XCORE_QSIZE  (32)
+#define MSCP_XCORE_SLICE  (256)
+
+/* Block unit driver command contexts, each runs up to BLKDRV_SEGS        */
+/* transfer segments. With two or more, the device transfer of one        */
+/* segment overlaps the LESI DMA of the previous one.                     */
+#define BLKDRV_CMD_POOL   (4)
+#define BLKDRV_SEGS       (2)
+
+/* Segment data buffers shared by all block units, and the default bytes  */
+/* moved per device transfer. COMPARE uses half a buffer for host data.   */
+#define BLKDRV_BUF_POOL   (4)
+#define BLKDRV_SEG_MAX    (16384)
+#define BLKDRV_SEG_READ   (BLKDRV_SEG_MAX)
+#define BLKDRV_SEG_WRITE  (BLKDRV_SEG_MAX)
+#define BLKDRV_SEG_COMP   (BLKDRV_SEG_MAX / 2)
+
+/* USB mass storage LUNs served at once, over all devices. Each LUN gets  */
+/* the free units it needs; a device that is plugged in later brings its  */
+/* units available with an attention message.                             */
+#define USBMSC_LUNS       (MSCP_CUNITS)
+
+/* Disk images on a FAT32 USB stick: files in the root directory with     */
+/* the FATVOL_EXT extension become units, one per free unit. A stick      */
+/* without any is served whole as one unit. All images of the stick share */
+/* FATVOL_QDEPTH transfer contexts.                                       */
+#define FATVOL_ENA        (1)
+#define FATVOL_EXT        "DSK"
+#define FATVOL_IMAGES     (MSCP_CUNITS)
+#define FATVOL_QDEPTH     (4)
+
+/* Mirror two USB sticks: their first LUNs hold the same data and make    */
+/* one unit. Writes go to both, reads to the less busy one. Regions       */
+/* written while a stick was away, tracked in MIRROR_REGIONS bits, are    */
+/* copied to it in chunks of MIRROR_SYNC_BLOCKS when it comes back.       */
+#define USBMSC_MIRROR     (0)
+#define MIRROR_QDEPTH     (4)
+#define MIRROR_REGIONS    (8192)
+#define MIRROR_SYNC_BLOCKS (16)
+
+/* Striped block devices: a request is split in pieces of one stripe of   */
+/* STRIPE_BLOCKS blocks, at most STRIPE_PIECES of them in flight per      */
+/* request and STRIPE_QDEPTH requests per stripe set.                     */
+#define STRIPE_BLOCKS     (16)
+#define STRIPE_PIECES     (8)
+#define STRIPE_QDEPTH     (4)
+
+/* Block cache of each block unit, in 512 byte blocks. After this many    */
+/* READs in a row that continue the previous one, the blocks following    */
+/* the stream are read ahead, up to MSCP_BCACHE_RA_BLOCKS past its end.   */
+#define MSCP_BCACHE_BLOCKS    (128)
+#define MSCP_BCACHE_SEQ_MIN   (2)
+#define MSCP_BCACHE_RA_BLOCKS (32)
+
+/* Write-back caching, used when the host sets M_UF_WBKNV on the unit.    */
+/* Dirty blocks are destaged once there are MSCP_BCACHE_DIRTY_HIGH of     */
+/* them or the oldest has waited MSCP_BCACHE_WB_DEADLINE_US. Beyond       */
+/* MSCP_BCACHE_DIRTY_MAX, which must not exceed MSCP_BCACHE_BLOCKS, WRITE */
+/* goes through to the device.                                            */
+#define MSCP_BCACHE_WBACK          (1)
+#define MSCP_BCACHE_DIRTY_HIGH     (32)
+#define MSCP_BCACHE_DIRTY_MAX      (96)
+#define MSCP_BCACHE_WB_DEADLINE_US (500000)
+
+/* Largest transfer queued WRITEs and ERASEs to contiguous blocks are     */
+/* merged into, on units whose driver supports it                         */
+#define MSCP_MERGE_MAX             (65536)
+
+/* Order in which queued commands are issued to a unit driver, one of the  */
+/* MSCP_SCHED_* policies in mscp/server/server.h. A command is passed over */
+/* by at most MSCP_SCHED_MAX_BYPASS later ones, the deadline policy also   */
+/* issues it first once it has been queued for MSCP_SCHED_DEADLINE_US.     */
+/* Sorting pays off on devices where the access cost depends on position. */
+#define MSCP_SCHED                 MSCP_SCHED_FIFO
+#define MSCP_SCHED_MAX_BYPASS      (16)
+#define MSCP_SCHED_DEADLINE_US     (50000)
+
 /* Controller identity */
 
 #define MSCP_CID_CLASS     (M_CC_MASS)
@@ -16,8 +119,11 @@
 #define MSCP_CID_UIDL      (0x13371337)
 
 #define MSCP_CFLAGS        (0)
-#define MSCP_CFLAGMASK     (0)
+#define MSCP_CFLAGMASK     (M_CF_ATTN)
 
 #define MSCP_CUNITS        (2)
 
+/* Use the PIO cycle engine transport instead of bit-banged GPIO for LESI cycles */
+#define LESI_PIO_ENA
+
 #undef USBMSC_ENA
\ No newline at end of file